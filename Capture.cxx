@@ -0,0 +1,210 @@
+/*
+ * Capture.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <Logger.hxx>
+#include <Capture.hxx>
+
+#define CAPTURE_MAGIC   "MMCAP"
+#define CAPTURE_VERSION 1
+
+struct CaptureHeader {
+    char magic[5];
+    uint8_t version;
+    uint8_t reserved[2];
+};
+
+struct CaptureRecord {
+    uint32_t length;
+    uint16_t type;
+    uint16_t reserved;
+    uint64_t us;
+};
+
+CaptureWriter::CaptureWriter()
+    : _fp(NULL),
+      _records(0)
+{
+
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+bool CaptureWriter::open(const string &path)
+{
+    CaptureHeader header;
+    lock_guard<mutex> lock(_mutex);
+
+    _fp = fopen(path.c_str(), "wbe");
+    if (_fp == NULL) {
+        LOGE(MAIN, "%s: %s!", path.c_str(), strerror(errno));
+        return false;
+    }
+    setvbuf(_fp, NULL, _IOFBF, 64 * 1024);
+
+    memset(&header, 0x0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, _fp) != 1) {
+        fclose(_fp);
+        _fp = NULL;
+        return false;
+    }
+
+    _start = chrono::steady_clock::now();
+    _flushed = _start;
+
+    return true;
+}
+
+void CaptureWriter::close(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_fp != NULL) {
+        fclose(_fp);
+        _fp = NULL;
+    }
+}
+
+bool CaptureWriter::writeRecord(CaptureType type, const pb_msgdesc_t *fields,
+                                const void *src)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    CaptureRecord record;
+    pb_ostream_t stream;
+    lock_guard<mutex> lock(_mutex);
+
+    if (_fp == NULL) {
+        return false;
+    }
+
+    stream = pb_ostream_from_buffer(_buf, sizeof(_buf));
+    if (!pb_encode(&stream, fields, src)) {
+        LOGE(MAIN, "pb_encode failed: %s", PB_GET_ERROR(&stream));
+        return false;
+    }
+
+    record.length = stream.bytes_written;
+    record.type = type;
+    record.reserved = 0;
+    record.us = chrono::duration_cast<chrono::microseconds>(
+        now - _start).count();
+    if ((fwrite(&record, sizeof(record), 1, _fp) != 1) ||
+        (fwrite(_buf, record.length, 1, _fp) != 1)) {
+        LOGE(MAIN, "capture: %s!", strerror(errno));
+        return false;
+    }
+
+    // Bound what a crash can lose without a write(2) per packet
+    if ((now - _flushed) >= chrono::seconds(1)) {
+        fflush(_fp);
+        _flushed = now;
+    }
+
+    _records++;
+
+    return true;
+}
+
+bool CaptureWriter::write(const meshtastic_MeshPacket &packet)
+{
+    return writeRecord(CAPTURE_MESH_PACKET, meshtastic_MeshPacket_fields,
+                       &packet);
+}
+
+bool CaptureWriter::write(const meshtastic_MqttClientProxyMessage &m)
+{
+    return writeRecord(CAPTURE_MQTT_PROXY,
+                       meshtastic_MqttClientProxyMessage_fields, &m);
+}
+
+bool CaptureWriter::write(const meshtastic_ModuleConfig_MQTTConfig &c)
+{
+    return writeRecord(CAPTURE_MQTT_CONFIG,
+                       meshtastic_ModuleConfig_MQTTConfig_fields, &c);
+}
+
+CaptureReader::CaptureReader()
+    : _fp(NULL)
+{
+
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const string &path)
+{
+    CaptureHeader header;
+
+    _fp = fopen(path.c_str(), "rbe");
+    if (_fp == NULL) {
+        LOGE(MAIN, "%s: %s!", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if ((fread(&header, sizeof(header), 1, _fp) != 1) ||
+        (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.version != CAPTURE_VERSION)) {
+        LOGE(MAIN, "%s: not a capture file!", path.c_str());
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void CaptureReader::close(void)
+{
+    if (_fp != NULL) {
+        fclose(_fp);
+        _fp = NULL;
+    }
+}
+
+bool CaptureReader::next(CaptureType &type, uint64_t &us,
+                         vector<uint8_t> &payload)
+{
+    CaptureRecord record;
+
+    if ((_fp == NULL) || (fread(&record, sizeof(record), 1, _fp) != 1)) {
+        return false;
+    }
+
+    if (record.length > 65536) {
+        LOGE(MAIN, "capture: bad record length %u!", record.length);
+        return false;
+    }
+
+    // A truncated tail (capture cut short by a crash) ends the replay
+    payload.resize(record.length);
+    if ((record.length > 0) &&
+        (fread(payload.data(), record.length, 1, _fp) != 1)) {
+        return false;
+    }
+
+    type = (CaptureType) record.type;
+    us = record.us;
+
+    return true;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
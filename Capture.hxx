@@ -0,0 +1,102 @@
+/*
+ * Capture.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef CAPTURE_HXX
+#define CAPTURE_HXX
+
+#include <stdint.h>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Compact binary capture of what a radio hands to MeshMon, for replaying
+ * real traffic without the radio.
+ *
+ * The file starts with an 8-byte header ("MMCAP", version, 2 reserved
+ * bytes) followed by records of
+ *   u32 length, u16 type, u16 reserved, u64 microseconds since start
+ * and the pb-encoded message of that length, all little-endian as
+ * written by the host.
+ */
+enum CaptureType {
+    CAPTURE_MESH_PACKET = 1,
+    CAPTURE_MQTT_PROXY = 2,
+    CAPTURE_MQTT_CONFIG = 3,
+};
+
+class CaptureWriter {
+
+public:
+
+    CaptureWriter();
+    ~CaptureWriter();
+
+    bool open(const string &path);
+    void close(void);
+
+    bool write(const meshtastic_MeshPacket &packet);
+    bool write(const meshtastic_MqttClientProxyMessage &m);
+    bool write(const meshtastic_ModuleConfig_MQTTConfig &c);
+
+    inline unsigned long records(void) const {
+        return _records;
+    }
+
+private:
+
+    bool writeRecord(CaptureType type, const pb_msgdesc_t *fields,
+                     const void *src);
+
+private:
+
+    mutex _mutex;
+    FILE *_fp;
+    chrono::steady_clock::time_point _start;
+    chrono::steady_clock::time_point _flushed;
+    unsigned long _records;
+    uint8_t _buf[meshtastic_MqttClientProxyMessage_size >
+                 meshtastic_MeshPacket_size ?
+                 meshtastic_MqttClientProxyMessage_size :
+                 meshtastic_MeshPacket_size];
+
+};
+
+class CaptureReader {
+
+public:
+
+    CaptureReader();
+    ~CaptureReader();
+
+    bool open(const string &path);
+    void close(void);
+
+    // Raw payload of the next record; false at the end or on a bad file
+    bool next(CaptureType &type, uint64_t &us, vector<uint8_t> &payload);
+
+private:
+
+    FILE *_fp;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,363 @@
+/*
+ * CpuTemp.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Logger.hxx>
+#include <CpuTemp.hxx>
+
+#define GET_GENCMD_RESULT 0x00030080
+
+CpuTempSource::~CpuTempSource()
+{
+
+}
+
+VcioCpuTempSource::VcioCpuTempSource()
+    : _fd(-1)
+{
+
+}
+
+VcioCpuTempSource::~VcioCpuTempSource()
+{
+    close();
+}
+
+const char *VcioCpuTempSource::name(void) const
+{
+    return "vcio";
+}
+
+bool VcioCpuTempSource::open(void)
+{
+    if (_fd == -1) {
+        _fd = ::open("/dev/vcio", 0);
+    }
+
+    return _fd != -1;
+}
+
+void VcioCpuTempSource::close(void)
+{
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool VcioCpuTempSource::read(float &tempC)
+{
+    static const char *command = "measure_temp";
+    const size_t maxString = sizeof(_buf) - (7 * sizeof(_buf[0]));
+    unsigned int *p = _buf;
+    unsigned int i = 0;
+    const char *s;
+    char str[16];
+    size_t n = 0;
+    int ret;
+
+    if (_fd == -1) {
+        return false;
+    }
+
+    p[i++] = 0; // size
+    p[i++] = 0x00000000; // process request
+    p[i++] = GET_GENCMD_RESULT; // (the tag id)
+    p[i++] = maxString; // buffer_len
+    p[i++] = 0; // request_len (set to response length)
+    p[i++] = 0; // error repsonse
+    memcpy(p + i, command, strlen(command) + 1);
+    i += maxString >> 2;
+    p[i++] = 0x00000000; // end tag
+    p[0] = i * sizeof(*p); // actual size
+
+    ret = ioctl(_fd, _IOWR(100, 0, char *), p);
+    if (ret == -1) {
+        LOGE(MAIN, "ioctl: %s!", strerror(errno));
+        return false;
+    }
+
+    // Response is "temp=48.3'C"
+    s = (const char *) (p + 6);
+    for (size_t j = 0; (j < maxString) && (s[j] != '\0'); j++) {
+        if (s[j] == '\'') {
+            break;
+        }
+        if ((isdigit(s[j]) || (s[j] == '.')) && (n < (sizeof(str) - 1))) {
+            str[n++] = s[j];
+        }
+    }
+    str[n] = '\0';
+
+    if (n == 0) {
+        return false;
+    }
+
+    tempC = strtof(str, NULL);
+
+    return true;
+}
+
+ThermalCpuTempSource::ThermalCpuTempSource(const string &path)
+    : _path(path),
+      _fd(-1)
+{
+
+}
+
+ThermalCpuTempSource::~ThermalCpuTempSource()
+{
+    close();
+}
+
+const char *ThermalCpuTempSource::name(void) const
+{
+    return "thermal";
+}
+
+bool ThermalCpuTempSource::open(void)
+{
+    if (_fd == -1) {
+        _fd = ::open(_path.c_str(), O_RDONLY);
+    }
+
+    return _fd != -1;
+}
+
+void ThermalCpuTempSource::close(void)
+{
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool ThermalCpuTempSource::read(float &tempC)
+{
+    char buf[32];
+    ssize_t len;
+
+    if (_fd == -1) {
+        return false;
+    }
+
+    // sysfs attributes are regenerated on every read from offset 0
+    len = pread(_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return false;
+    }
+    buf[len] = '\0';
+
+    tempC = strtol(buf, NULL, 10) / 1000.0;
+
+    return true;
+}
+
+FakeCpuTempSource::FakeCpuTempSource(float tempC)
+    : _tempC(tempC)
+{
+
+}
+
+FakeCpuTempSource::~FakeCpuTempSource()
+{
+
+}
+
+const char *FakeCpuTempSource::name(void) const
+{
+    return "fake";
+}
+
+bool FakeCpuTempSource::open(void)
+{
+    return true;
+}
+
+void FakeCpuTempSource::close(void)
+{
+
+}
+
+bool FakeCpuTempSource::read(float &tempC)
+{
+    tempC = _tempC;
+
+    return true;
+}
+
+void FakeCpuTempSource::set(float tempC)
+{
+    _tempC = tempC;
+}
+
+CpuTemp::CpuTemp(shared_ptr<CpuTempSource> source, unsigned int intervalMs)
+    : _source(source),
+      _intervalMs(intervalMs > 0 ? intervalMs : 1),
+      _sample(0),
+      _isRunning(false)
+{
+
+}
+
+CpuTemp::~CpuTemp()
+{
+    stop();
+    join();
+    if (_source) {
+        _source->close();
+    }
+}
+
+shared_ptr<CpuTempSource> CpuTemp::createSource(const string &type)
+{
+    shared_ptr<CpuTempSource> source;
+
+    if ((type == "auto") || (type == "vcio")) {
+        source = make_shared<VcioCpuTempSource>();
+        if (source->open() || (type == "vcio")) {
+            return source;
+        }
+    }
+
+    if ((type == "auto") || (type == "thermal")) {
+        source = make_shared<ThermalCpuTempSource>();
+        if (source->open() || (type == "thermal")) {
+            return source;
+        }
+    }
+
+    if (type == "fake") {
+        return make_shared<FakeCpuTempSource>();
+    }
+
+    return NULL;
+}
+
+const char *CpuTemp::sourceName(void) const
+{
+    return _source ? _source->name() : "none";
+}
+
+unsigned int CpuTemp::intervalMs(void) const
+{
+    return _intervalMs;
+}
+
+bool CpuTemp::sample(float &tempC, time_t &sampledAt) const
+{
+    uint64_t sample = _sample.load();
+    uint32_t bits = sample >> 32;
+
+    if (sample == 0) {
+        return false;
+    }
+
+    memcpy(&tempC, &bits, sizeof(tempC));
+    sampledAt = (time_t) (sample & 0xffffffff);
+
+    return true;
+}
+
+float CpuTemp::tempC(void) const
+{
+    float tempC = 0.0;
+    time_t sampledAt;
+
+    sample(tempC, sampledAt);
+
+    return tempC;
+}
+
+time_t CpuTemp::sampledAt(void) const
+{
+    float tempC;
+    time_t sampledAt = 0;
+
+    sample(tempC, sampledAt);
+
+    return sampledAt;
+}
+
+void CpuTemp::refresh(void)
+{
+    float tempC;
+    uint32_t bits;
+
+    if (!_source || !_source->open() || !_source->read(tempC)) {
+        return;
+    }
+
+    memcpy(&bits, &tempC, sizeof(bits));
+    _sample = (((uint64_t) bits) << 32) | (uint32_t) time(NULL);
+}
+
+void CpuTemp::start(void)
+{
+    if (!_isRunning && (_thread == NULL)) {
+        // Have a reading available before the first interval elapses
+        refresh();
+        _isRunning = true;
+        _thread = make_shared<thread>(thread_function, this);
+    }
+}
+
+void CpuTemp::stop(void)
+{
+    if (_isRunning) {
+        _mutex.lock();
+        _isRunning = false;
+        _mutex.unlock();
+        _cv.notify_one();
+    }
+}
+
+void CpuTemp::join(void)
+{
+    if (_thread != NULL) {
+        if (_thread->joinable()) {
+            _thread->join();
+        }
+    }
+}
+
+void CpuTemp::thread_function(CpuTemp *cpuTemp)
+{
+    cpuTemp->run();
+}
+
+void CpuTemp::run(void)
+{
+    unique_lock<mutex> lock(_mutex);
+
+    while (_isRunning) {
+        _cv.wait_for(lock, chrono::milliseconds(_intervalMs));
+        if (!_isRunning) {
+            break;
+        }
+
+        lock.unlock();
+        refresh();
+        lock.lock();
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
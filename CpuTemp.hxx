@@ -0,0 +1,153 @@
+/*
+ * CpuTemp.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef CPUTEMP_HXX
+#define CPUTEMP_HXX
+
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+class CpuTempSource {
+
+public:
+
+    virtual ~CpuTempSource();
+
+    virtual const char *name(void) const = 0;
+    virtual bool open(void) = 0;
+    virtual void close(void) = 0;
+    virtual bool read(float &tempC) = 0;
+
+};
+
+// Raspberry Pi VideoCore mailbox ("vcgencmd measure_temp")
+class VcioCpuTempSource : public CpuTempSource {
+
+public:
+
+    VcioCpuTempSource();
+    ~VcioCpuTempSource();
+
+    virtual const char *name(void) const;
+    virtual bool open(void);
+    virtual void close(void);
+    virtual bool read(float &tempC);
+
+private:
+
+    int _fd;
+    unsigned int _buf[(1024 >> 2) + 7];
+
+};
+
+// Generic Linux thermal zone, in millidegrees C
+class ThermalCpuTempSource : public CpuTempSource {
+
+public:
+
+    ThermalCpuTempSource(const string &path =
+                         "/sys/class/thermal/thermal_zone0/temp");
+    ~ThermalCpuTempSource();
+
+    virtual const char *name(void) const;
+    virtual bool open(void);
+    virtual void close(void);
+    virtual bool read(float &tempC);
+
+private:
+
+    string _path;
+    int _fd;
+
+};
+
+// Reports whatever was last set; for boxes without a sensor and testing
+class FakeCpuTempSource : public CpuTempSource {
+
+public:
+
+    FakeCpuTempSource(float tempC = 0.0);
+    ~FakeCpuTempSource();
+
+    virtual const char *name(void) const;
+    virtual bool open(void);
+    virtual void close(void);
+    virtual bool read(float &tempC);
+
+    void set(float tempC);
+
+private:
+
+    atomic<float> _tempC;
+
+};
+
+/*
+ * Samples a CpuTempSource on a background thread at a fixed interval and
+ * publishes the latest reading atomically, so that readers never touch
+ * the device.
+ */
+class CpuTemp {
+
+public:
+
+    CpuTemp(shared_ptr<CpuTempSource> source, unsigned int intervalMs = 5000);
+    ~CpuTemp();
+
+    // "auto" picks vcio, then the thermal zone, and is NULL if neither is
+    // there; the fake source has to be asked for by name
+    static shared_ptr<CpuTempSource> createSource(const string &type);
+
+    const char *sourceName(void) const;
+    unsigned int intervalMs(void) const;
+
+    float tempC(void) const;
+    time_t sampledAt(void) const;
+    bool sample(float &tempC, time_t &sampledAt) const;
+
+    void start(void);
+    void stop(void);
+    void join(void);
+
+private:
+
+    static void thread_function(CpuTemp *cpuTemp);
+    void run(void);
+    void refresh(void);
+
+private:
+
+    shared_ptr<CpuTempSource> _source;
+    unsigned int _intervalMs;
+
+    // Reading (float bits) in the upper half, time(NULL) in the lower
+    atomic<uint64_t> _sample;
+
+    mutex _mutex;
+    condition_variable _cv;
+    shared_ptr<thread> _thread;
+    bool _isRunning;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
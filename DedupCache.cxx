@@ -0,0 +1,93 @@
+/*
+ * DedupCache.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cstring>
+#include <DedupCache.hxx>
+
+DedupCache::DedupCache(size_t slots, unsigned int ttlSec)
+    : _slots(slots >= PROBE_LIMIT ? slots : PROBE_LIMIT),
+      _ttlMs(ttlSec * 1000),
+      _table(new Slot[_slots]),
+      _epoch(chrono::steady_clock::now()),
+      _hits(0),
+      _misses(0),
+      _evictions(0)
+{
+    memset(_table, 0x0, sizeof(Slot) * _slots);
+}
+
+DedupCache::~DedupCache()
+{
+    delete [] _table;
+}
+
+uint32_t DedupCache::nowMs(void) const
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - _epoch).count();
+}
+
+bool DedupCache::check(uint32_t from, uint32_t id)
+{
+    uint64_t key = (((uint64_t) from) << 32) | id;
+    uint64_t hash;
+    uint32_t now;
+    Slot *victim = NULL;
+    bool victimLive = false;
+    lock_guard<mutex> lock(_mutex);
+
+    // Under the lock, so that no slot is stamped later than now
+    now = nowMs();
+
+    if (key == 0) {
+        key = 1;
+    }
+
+    // Fibonacci hashing spreads sequential packet ids across the table
+    hash = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    for (unsigned int i = 0; i < PROBE_LIMIT; i++) {
+        Slot &slot = _table[(hash + i) % _slots];
+        bool live = (slot.key != 0) && ((now - slot.seenMs) < _ttlMs);
+
+        if (live && (slot.key == key)) {
+            _hits++;
+            return true;
+        }
+
+        // Prefer a free slot; otherwise the oldest one in the window
+        if (!live) {
+            if ((victim == NULL) || victimLive) {
+                victim = &slot;
+                victimLive = false;
+            }
+        } else if ((victim == NULL) ||
+                   (victimLive &&
+                    ((now - slot.seenMs) > (now - victim->seenMs)))) {
+            victim = &slot;
+            victimLive = true;
+        }
+    }
+
+    if (victimLive) {
+        _evictions++;
+    }
+    victim->key = key;
+    victim->seenMs = now;
+    _misses++;
+
+    return false;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,91 @@
+/*
+ * DedupCache.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef DEDUPCACHE_HXX
+#define DEDUPCACHE_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+using namespace std;
+
+/*
+ * Remembers (from, packet id) pairs for a time window so that a packet
+ * heard by several radios is forwarded only once.
+ *
+ * Fixed-size open-addressing table: a key may live in any of the
+ * PROBE_LIMIT slots following its hash. Inserting reuses an empty or
+ * expired slot in that window, or else evicts the oldest entry in it, so
+ * memory never grows.
+ */
+class DedupCache {
+
+public:
+
+    DedupCache(size_t slots = 4096, unsigned int ttlSec = 600);
+    ~DedupCache();
+
+    // True if seen within the TTL; otherwise remembers it and returns false
+    bool check(uint32_t from, uint32_t id);
+
+    inline size_t slots(void) const {
+        return _slots;
+    }
+
+    inline unsigned int ttlSec(void) const {
+        return _ttlMs / 1000;
+    }
+
+    inline unsigned long hits(void) const {
+        return _hits;
+    }
+
+    inline unsigned long misses(void) const {
+        return _misses;
+    }
+
+    inline unsigned long evictions(void) const {
+        return _evictions;
+    }
+
+private:
+
+    static const unsigned int PROBE_LIMIT = 8;
+
+    struct Slot {
+        uint64_t key;       // 0 if empty
+        uint32_t seenMs;
+    };
+
+    uint32_t nowMs(void) const;
+
+private:
+
+    size_t _slots;
+    uint32_t _ttlMs;
+    Slot *_table;
+    chrono::steady_clock::time_point _epoch;
+
+    mutex _mutex;
+    atomic<unsigned long> _hits;
+    atomic<unsigned long> _misses;
+    atomic<unsigned long> _evictions;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,702 @@
+/*
+ * EventBus.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <Json.hxx>
+#include <Logger.hxx>
+#include <RadioName.hxx>
+#include <EventBus.hxx>
+
+#define MAX_LINE 1024
+// Rendered events collected before sending
+#define BATCH_BYTES (64 * 1024)
+
+EventBus::EventBus(shared_ptr<Reactor> reactor)
+    : _reactor(reactor),
+      _ownReactor(false),
+      _isRunning(false),
+      _listenfd(-1),
+      _wakefd(-1),
+      _maxSubscribers(16),
+      _queue(256),
+      _dropSlow(false),
+      _active(0),
+      _pending(false),
+      _published(0),
+      _lost(0),
+      _disconnected(0)
+{
+    if (_reactor == NULL) {
+        _reactor = make_shared<Reactor>(1);
+        _ownReactor = true;
+    }
+}
+
+EventBus::~EventBus()
+{
+    stop();
+
+    if (_listenfd != -1) {
+        close(_listenfd);
+        unlink(_path.c_str());
+    }
+    if (_wakefd != -1) {
+        close(_wakefd);
+    }
+}
+
+unsigned int EventBus::addSource(const string &name)
+{
+    _sources.push_back(RadioName::shorten(name));
+
+    return _sources.size() - 1;
+}
+
+void EventBus::setLimits(unsigned int maxSubscribers, size_t queue,
+                         bool dropSlow)
+{
+    if (maxSubscribers > 0) {
+        _maxSubscribers = maxSubscribers;
+    }
+    if (queue > 0) {
+        _queue = queue;
+    }
+    _dropSlow = dropSlow;
+}
+
+bool EventBus::bind(const string &path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || (path.size() >= sizeof(addr.sun_path))) {
+        LOGE(MAIN, "events: bad socket path '%s'", path.c_str());
+        return false;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    _listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
+    if (_listenfd == -1) {
+        LOGE(MAIN, "events: socket: %s!", strerror(errno));
+        return false;
+    }
+
+    // Left behind by an earlier run
+    unlink(path.c_str());
+    if ((::bind(_listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) ||
+        (listen(_listenfd, 16) == -1)) {
+        LOGE(MAIN, "events: %s: %s!", path.c_str(), strerror(errno));
+        close(_listenfd);
+        _listenfd = -1;
+        return false;
+    }
+    _path = path;
+
+    return true;
+}
+
+bool EventBus::start(void)
+{
+    if (_isRunning || (_listenfd == -1)) {
+        return false;
+    }
+
+    _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wakefd == -1) {
+        LOGE(MAIN, "events: eventfd: %s!", strerror(errno));
+        return false;
+    }
+
+    for (unsigned int i = 0; i < _maxSubscribers; i++) {
+        unique_ptr<Subscriber> sub(new Subscriber());
+
+        for (unsigned int j = 0; j < _sources.size(); j++) {
+            sub->rings.push_back(unique_ptr<MessageRing<Event> >(
+                                     new MessageRing<Event>(_queue)));
+        }
+        _subscribers.push_back(move(sub));
+    }
+
+    if (_ownReactor) {
+        _reactor->start();
+    }
+    if (!_reactor->add(_wakefd, EPOLLIN,
+                       [this](uint32_t events) {
+                           (void)(events);
+                           onWake();
+                       }) ||
+        !_reactor->add(_listenfd, EPOLLIN,
+                       [this](uint32_t events) {
+                           (void)(events);
+                           onAccept();
+                       })) {
+        _reactor->remove(_wakefd);
+        return false;
+    }
+    _isRunning = true;
+
+    return true;
+}
+
+void EventBus::stop(void)
+{
+    if (!_isRunning.exchange(false)) {
+        return;
+    }
+
+    _reactor->remove(_listenfd);
+    _reactor->remove(_wakefd);
+    for (vector<unique_ptr<Subscriber> >::iterator it = _subscribers.begin();
+         it != _subscribers.end(); it++) {
+        Subscriber *sub = it->get();
+        int fd;
+
+        {
+            lock_guard<mutex> lock(sub->lock);
+            fd = sub->fd;
+        }
+        if (fd == -1) {
+            continue;
+        }
+
+        // Let a running handler finish before the slot goes away
+        _reactor->remove(fd);
+        {
+            lock_guard<mutex> lock(sub->lock);
+            if (sub->fd != fd) {
+                continue;
+            }
+            shutdown(fd, SHUT_RDWR);
+        }
+        closeSubscriber(sub);
+    }
+
+    if (_ownReactor) {
+        _reactor->stop();
+        _reactor->join();
+    }
+}
+
+unsigned int EventBus::subscribers(void) const
+{
+    return _active;
+}
+
+bool EventBus::parseFilter(const string &line, Filter &filter,
+                           string &error) const
+{
+    istringstream iss(line);
+    string word;
+    bool portnums = false;
+
+    filter.source = RoutingTable::ANY;
+    filter.channel = RoutingTable::ANY;
+    filter.nodes.clear();
+    filter.portnums.set();
+    filter.encrypted = true;
+
+    while (iss >> word) {
+        size_t eq = word.find('=');
+        string name = word.substr(0, eq);
+        string values = eq == string::npos ? "" : word.substr(eq + 1);
+        istringstream vss(values);
+        string value;
+
+        if (values.empty()) {
+            error = "expected name=value in '" + word + "'";
+            return false;
+        }
+
+        if ((name == "portnum") && !portnums) {
+            // Only what was asked for, in all portnum= words; encrypted
+            // packets have none
+            filter.portnums.reset();
+            filter.encrypted = false;
+            portnums = true;
+        }
+
+        while (getline(vss, value, ',')) {
+            int64_t node;
+            int portnum;
+            char *end = NULL;
+            long channel;
+            int source;
+
+            if (name == "node") {
+                if (!RoutingTable::parseNode(value, node)) {
+                    goto bad;
+                }
+                filter.nodes.push_back(node);
+            } else if (name == "portnum") {
+                if (!RoutingTable::parsePortnum(value, portnum)) {
+                    goto bad;
+                }
+                filter.portnums.set(portnum);
+            } else if (name == "channel") {
+                channel = strtol(value.c_str(), &end, 10);
+                if (value.empty() || (*end != '\0') || (channel < 0) ||
+                    (channel >= (long) RoutingTable::NUM_CHANNELS)) {
+                    goto bad;
+                }
+                filter.channel = channel;
+            } else if (name == "radio") {
+                source = RadioName::find(_sources, value);
+                if (source < 0) {
+                    goto bad;
+                }
+                filter.source = source;
+            } else {
+                error = "unknown filter '" + name + "'";
+                return false;
+            }
+            continue;
+
+        bad:
+
+            error = "bad " + name + " '" + value + "'";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EventBus::matches(const Filter &filter, unsigned int source,
+                       const meshtastic_MeshPacket &packet)
+{
+    if ((filter.source != RoutingTable::ANY) &&
+        ((unsigned int) filter.source != source)) {
+        return false;
+    }
+    if ((filter.channel != RoutingTable::ANY) &&
+        (filter.channel != packet.channel)) {
+        return false;
+    }
+    if (!filter.nodes.empty() &&
+        (find(filter.nodes.begin(), filter.nodes.end(), packet.from) ==
+         filter.nodes.end()) &&
+        (find(filter.nodes.begin(), filter.nodes.end(), packet.to) ==
+         filter.nodes.end())) {
+        return false;
+    }
+
+    if (packet.which_payload_variant != meshtastic_MeshPacket_decoded_tag) {
+        return filter.encrypted;
+    }
+
+    return (packet.decoded.portnum < RoutingTable::NUM_PORTNUMS) &&
+        filter.portnums.test(packet.decoded.portnum);
+}
+
+void EventBus::fill(Event &event, const meshtastic_MeshPacket &packet)
+{
+    event.t = packet.rx_time != 0 ? (time_t) packet.rx_time : time(NULL);
+    event.id = packet.id;
+    event.from = packet.from;
+    event.to = packet.to;
+    event.channel = packet.channel;
+    event.encrypted =
+        packet.which_payload_variant != meshtastic_MeshPacket_decoded_tag;
+    event.portnum = event.encrypted ? 0 : packet.decoded.portnum;
+    event.rssi = packet.rx_rssi;
+    event.snr = packet.rx_snr;
+    event.hopLimit = packet.hop_limit;
+    event.hopStart = packet.hop_start;
+    event.viaMqtt = packet.via_mqtt;
+    event.textLength = 0;
+    if (!event.encrypted &&
+        (packet.decoded.portnum == meshtastic_PortNum_TEXT_MESSAGE_APP)) {
+        event.textLength = min((size_t) TEXT_BYTES,
+                               (size_t) packet.decoded.payload.size);
+        memcpy(event.text, packet.decoded.payload.bytes, event.textLength);
+    }
+}
+
+void EventBus::render(const Event &event, unsigned int source,
+                      string &out) const
+{
+    out += '{';
+    Json::key(out, "t", true);
+    Json::appendInt(out, event.t);
+    Json::key(out, "radio");
+    Json::appendString(out, _sources[source]);
+    Json::key(out, "id");
+    Json::appendUnsigned(out, event.id);
+    Json::key(out, "from");
+    Json::appendNodeId(out, event.from);
+    Json::key(out, "to");
+    Json::appendNodeId(out, event.to);
+    Json::key(out, "channel");
+    Json::appendUnsigned(out, event.channel);
+    if (event.encrypted) {
+        Json::key(out, "encrypted");
+        Json::appendBool(out, true);
+    } else {
+        Json::key(out, "portnum");
+        Json::appendUnsigned(out, event.portnum);
+    }
+    Json::key(out, "rssi");
+    Json::appendInt(out, event.rssi);
+    Json::key(out, "snr");
+    Json::appendFloat(out, event.snr, 2);
+    Json::key(out, "hopLimit");
+    Json::appendUnsigned(out, event.hopLimit);
+    Json::key(out, "hopStart");
+    Json::appendUnsigned(out, event.hopStart);
+    Json::key(out, "viaMqtt");
+    Json::appendBool(out, event.viaMqtt);
+    if (event.textLength > 0) {
+        Json::key(out, "text");
+        Json::appendString(out, event.text, event.textLength);
+    }
+    out += "}\n";
+}
+
+void EventBus::publish(unsigned int source,
+                       const meshtastic_MeshPacket &packet)
+{
+    bool wake = false;
+    uint64_t one = 1;
+
+    if (!_isRunning || (source >= _sources.size())) {
+        return;
+    }
+    _published++;
+    if (_active == 0) {
+        return;
+    }
+
+    for (vector<unique_ptr<Subscriber> >::iterator it = _subscribers.begin();
+         it != _subscribers.end(); it++) {
+        Subscriber *sub = it->get();
+        Event *event;
+        bool live;
+
+        if (sub->state.load(memory_order_acquire) != ACTIVE) {
+            continue;
+        }
+
+        // closeSubscriber() waits for users to drop to zero before it
+        // recycles the slot
+        sub->users++;
+        if ((sub->state == ACTIVE) && matches(sub->filter, source, packet)) {
+            MessageRing<Event> &ring = *sub->rings[source];
+
+            event = ring.alloc();
+            if (event == NULL) {
+                if (_dropSlow) {
+                    sub->lagging = true;
+                } else {
+                    // The oldest goes, or this one if the reader holds it
+                    if (ring.dropOldest(live)) {
+                        event = ring.alloc();
+                    }
+                    sub->lost++;
+                    _lost++;
+                }
+            }
+            if (event != NULL) {
+                fill(*event, packet);
+                ring.push();
+            }
+            wake = true;
+        }
+        sub->users--;
+    }
+
+    if (wake && !_pending.exchange(true)) {
+        if (write(_wakefd, &one, sizeof(one)) < 0) {
+            // Already readable
+        }
+    }
+}
+
+void EventBus::onAccept(void)
+{
+    Subscriber *sub;
+    int fd;
+
+    for (;;) {
+        fd = accept4(_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR)) {
+                LOGW(MAIN, "events: accept: %s", strerror(errno));
+            }
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+
+        sub = NULL;
+        for (vector<unique_ptr<Subscriber> >::iterator it =
+                 _subscribers.begin(); it != _subscribers.end(); it++) {
+            int expected = FREE;
+
+            if ((*it)->state.compare_exchange_strong(expected, PENDING)) {
+                sub = it->get();
+                break;
+            }
+        }
+        if (sub == NULL) {
+            static const char busy[] =
+                "{\"error\":\"too many subscribers\"}\n";
+
+            if (send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL) < 0) {
+                // Closing anyway
+            }
+            close(fd);
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(sub->lock);
+            sub->fd = fd;
+        }
+        if (!_reactor->add(fd, EPOLLIN,
+                           [this, sub](uint32_t events) {
+                               onSubscriber(sub, events);
+                           })) {
+            lock_guard<mutex> lock(sub->lock);
+            sub->fd = -1;
+            close(fd);
+            sub->state = FREE;
+        }
+    }
+}
+
+void EventBus::onWake(void)
+{
+    uint64_t count;
+
+    if (read(_wakefd, &count, sizeof(count)) < 0) {
+        // Spurious
+    }
+    // Before draining, so that anything published from here on wakes us
+    // again
+    _pending = false;
+
+    for (vector<unique_ptr<Subscriber> >::iterator it = _subscribers.begin();
+         it != _subscribers.end(); it++) {
+        Subscriber *sub = it->get();
+
+        if (sub->state != ACTIVE) {
+            continue;
+        }
+
+        lock_guard<mutex> lock(sub->lock);
+        if (sub->state != ACTIVE) {
+            continue;
+        }
+        if (sub->lagging || !drain(sub)) {
+            // The subscriber's own handler closes it on the hangup
+            shutdown(sub->fd, SHUT_RDWR);
+        } else if (!sub->output.empty()) {
+            _reactor->modify(sub->fd, EPOLLIN | EPOLLOUT);
+        }
+    }
+}
+
+void EventBus::onSubscriber(Subscriber *sub, uint32_t events)
+{
+    char buf[512];
+    ssize_t n;
+    size_t nl;
+    string error;
+    bool closing = false;
+
+    {
+        lock_guard<mutex> lock(sub->lock);
+
+        if (events & EPOLLIN) {
+            for (;;) {
+                n = recv(sub->fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n > 0) {
+                    // Only the filter line is of interest
+                    if (sub->state == PENDING) {
+                        sub->input.append(buf, n);
+                    }
+                    continue;
+                }
+                if ((n == 0) ||
+                    ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                     (errno != EINTR))) {
+                    closing = true;
+                }
+                if ((n == 0) || (errno != EINTR)) {
+                    break;
+                }
+            }
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            closing = true;
+        }
+
+        if (!closing && (sub->state == PENDING)) {
+            nl = sub->input.find('\n');
+            if (nl != string::npos) {
+                if (parseFilter(sub->input.substr(0, nl), sub->filter,
+                                error)) {
+                    sub->output += "{\"subscribed\":true}\n";
+                    sub->state = ACTIVE;
+                    _active++;
+                } else {
+                    sub->output += "{\"error\":";
+                    Json::appendString(sub->output, error);
+                    sub->output += "}\n";
+                    flush(sub);
+                    closing = true;
+                }
+                sub->input.clear();
+            } else if (sub->input.size() > MAX_LINE) {
+                closing = true;
+            }
+        }
+
+        if (!closing && (sub->state == ACTIVE)) {
+            if (sub->lagging) {
+                closing = true;
+            } else if (!drain(sub)) {
+                closing = true;
+            }
+        } else if (!closing && !flush(sub)) {
+            closing = true;
+        }
+
+        if (!closing) {
+            _reactor->modify(sub->fd, sub->output.empty() ?
+                             EPOLLIN : EPOLLIN | EPOLLOUT);
+        }
+    }
+
+    if (closing) {
+        closeSubscriber(sub);
+    }
+}
+
+bool EventBus::drain(Subscriber *sub)
+{
+    unsigned long lost;
+    bool more = true;
+
+    // Stops taking events while the socket is backed up, so that the
+    // rings fill up and the producers see the lag
+    while (more) {
+        if (sub->output.size() >= BATCH_BYTES) {
+            if (!flush(sub)) {
+                return false;
+            }
+            if (sub->output.size() >= BATCH_BYTES) {
+                return true;
+            }
+        }
+
+        lost = sub->lost;
+        if (lost != sub->reported) {
+            sub->output += "{\"lagged\":";
+            Json::appendUnsigned(sub->output, lost - sub->reported);
+            sub->output += "}\n";
+            sub->reported = lost;
+        }
+
+        more = false;
+        for (unsigned int i = 0; i < sub->rings.size(); i++) {
+            Event *event = sub->rings[i]->front();
+
+            if (event != NULL) {
+                render(*event, i, sub->output);
+                sub->rings[i]->pop();
+                more = true;
+            }
+        }
+    }
+
+    return flush(sub);
+}
+
+bool EventBus::flush(Subscriber *sub)
+{
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < sub->output.size()) {
+        n = send(sub->fd, sub->output.data() + sent,
+                 sub->output.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    sub->output.erase(0, sent);
+
+    return true;
+}
+
+void EventBus::closeSubscriber(Subscriber *sub)
+{
+    int fd;
+
+    {
+        lock_guard<mutex> lock(sub->lock);
+        if (sub->state == ACTIVE) {
+            _active--;
+        }
+        if (sub->lagging) {
+            _disconnected++;
+        }
+        sub->state = CLOSING;
+        fd = sub->fd;
+    }
+
+    // A producer that saw the subscriber active may still be pushing
+    while (sub->users != 0) {
+        this_thread::yield();
+    }
+
+    _reactor->remove(fd);
+    close(fd);
+
+    lock_guard<mutex> lock(sub->lock);
+    for (unsigned int i = 0; i < sub->rings.size(); i++) {
+        while (sub->rings[i]->front() != NULL) {
+            sub->rings[i]->pop();
+        }
+    }
+    sub->lost = 0;
+    sub->reported = 0;
+    sub->lagging = false;
+    sub->input.clear();
+    sub->output.clear();
+    sub->fd = -1;
+    sub->state = FREE;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
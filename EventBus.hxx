@@ -0,0 +1,181 @@
+/*
+ * EventBus.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef EVENTBUS_HXX
+#define EVENTBUS_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <bitset>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <LibMeshtastic.hxx>
+#include <MessageRing.hxx>
+#include <Reactor.hxx>
+#include <RoutingTable.hxx>
+
+using namespace std;
+
+/*
+ * Live stream of the packets heard by every radio, for local consumers on
+ * a Unix domain socket.
+ *
+ * A subscriber connects and sends one line of filters, e.g.
+ *
+ *   node=!a1b2c3d4,!0badcafe portnum=TEXT_MESSAGE_APP,POSITION_APP
+ *   channel=0 radio=ttyACM0
+ *
+ * (an empty line takes everything), and from then on reads one JSON
+ * object per packet that matches. Each subscriber has a preallocated ring
+ * per radio with the radio's thread as its only producer: publish()
+ * filters and copies the packet into the ring without taking a lock or
+ * allocating. A subscriber that falls behind loses its oldest events and
+ * is told how many with a {"lagged":n} line, or is disconnected if the
+ * bus is set to drop slow subscribers.
+ */
+class EventBus {
+
+public:
+
+    // Shares the reactor if given one, otherwise runs its own
+    EventBus(shared_ptr<Reactor> reactor = NULL);
+    ~EventBus();
+
+    // Before start(); returns what the radio passes to publish()
+    unsigned int addSource(const string &name);
+
+    // queue: events per subscriber per radio
+    void setLimits(unsigned int maxSubscribers, size_t queue,
+                   bool dropSlow);
+
+    bool bind(const string &path);
+    bool start(void);
+    void stop(void);
+
+    // From the radio's thread
+    void publish(unsigned int source, const meshtastic_MeshPacket &packet);
+
+    unsigned int subscribers(void) const;
+
+    inline unsigned long published(void) const {
+        return _published;
+    }
+
+    inline unsigned long lost(void) const {
+        return _lost;
+    }
+
+    inline unsigned long disconnected(void) const {
+        return _disconnected;
+    }
+
+private:
+
+    static const unsigned int TEXT_BYTES = 240;
+
+    struct Event {
+        time_t t;
+        uint32_t id;
+        uint32_t from;
+        uint32_t to;
+        uint8_t channel;
+        bool encrypted;
+        uint16_t portnum;
+        int32_t rssi;
+        float snr;
+        uint8_t hopLimit;
+        uint8_t hopStart;
+        bool viaMqtt;
+        uint16_t textLength;
+        char text[TEXT_BYTES];
+    };
+
+    struct Filter {
+        int source;                 // or RoutingTable::ANY
+        int channel;                // or RoutingTable::ANY
+        vector<uint32_t> nodes;     // from or to; empty: any
+        bitset<RoutingTable::NUM_PORTNUMS> portnums;
+        bool encrypted;             // pass packets we could not decode
+    };
+
+    enum State {
+        FREE,
+        PENDING,        // connected, waiting for the filter line
+        ACTIVE,
+        CLOSING,
+    };
+
+    struct Subscriber {
+        Subscriber()
+            : state(FREE), users(0), lost(0), lagging(false), fd(-1),
+              reported(0) {}
+
+        // Shared with the producers
+        atomic<int> state;
+        atomic<unsigned int> users;
+        atomic<unsigned long> lost;
+        atomic<bool> lagging;
+        Filter filter;
+        vector<unique_ptr<MessageRing<Event> > > rings;
+
+        // Reactor side
+        mutex lock;
+        int fd;
+        string input;
+        string output;
+        unsigned long reported;
+    };
+
+    bool parseFilter(const string &line, Filter &filter,
+                     string &error) const;
+    static bool matches(const Filter &filter, unsigned int source,
+                        const meshtastic_MeshPacket &packet);
+    static void fill(Event &event, const meshtastic_MeshPacket &packet);
+    void render(const Event &event, unsigned int source, string &out) const;
+
+    void onAccept(void);
+    void onWake(void);
+    void onSubscriber(Subscriber *sub, uint32_t events);
+    bool drain(Subscriber *sub);
+    static bool flush(Subscriber *sub);
+    void closeSubscriber(Subscriber *sub);
+
+private:
+
+    shared_ptr<Reactor> _reactor;
+    bool _ownReactor;
+    atomic<bool> _isRunning;
+    int _listenfd;
+    int _wakefd;
+    string _path;
+    vector<string> _sources;
+    unsigned int _maxSubscribers;
+    size_t _queue;
+    bool _dropSlow;
+
+    // Allocated by start(), never resized
+    vector<unique_ptr<Subscriber> > _subscribers;
+    atomic<unsigned int> _active;
+    atomic<bool> _pending;
+    atomic<unsigned long> _published;
+    atomic<unsigned long> _lost;
+    atomic<unsigned long> _disconnected;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
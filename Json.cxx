@@ -0,0 +1,158 @@
+/*
+ * Json.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cmath>
+#include <Json.hxx>
+
+static const char hexDigits[] = "0123456789abcdef";
+
+// Length of the well-formed UTF-8 sequence at str, 0 if it is not one
+static size_t utf8Length(const unsigned char *str, size_t len)
+{
+    unsigned int code;
+    size_t n;
+
+    if ((str[0] >= 0xc2) && (str[0] <= 0xdf)) {
+        n = 2;
+        code = str[0] & 0x1f;
+    } else if ((str[0] >= 0xe0) && (str[0] <= 0xef)) {
+        n = 3;
+        code = str[0] & 0x0f;
+    } else if ((str[0] >= 0xf0) && (str[0] <= 0xf4)) {
+        n = 4;
+        code = str[0] & 0x07;
+    } else {
+        return 0;
+    }
+
+    if (n > len) {
+        return 0;
+    }
+    for (size_t i = 1; i < n; i++) {
+        if ((str[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        code = (code << 6) | (str[i] & 0x3f);
+    }
+
+    // No overlong forms, surrogates or code points past U+10FFFF
+    if (((n == 3) && (code < 0x800)) || ((n == 4) && (code < 0x10000)) ||
+        ((code >= 0xd800) && (code < 0xe000)) || (code > 0x10ffff)) {
+        return 0;
+    }
+
+    return n;
+}
+
+void Json::appendUnsigned(string &s, uint64_t v)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+
+    do {
+        *--p = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+    s.append(p, buf + sizeof(buf) - p);
+}
+
+void Json::appendInt(string &s, int64_t v)
+{
+    if (v < 0) {
+        s += '-';
+        appendUnsigned(s, -(uint64_t) v);
+    } else {
+        appendUnsigned(s, v);
+    }
+}
+
+void Json::appendFixed(string &s, int64_t v, unsigned int decimals)
+{
+    uint64_t scale = 1;
+    uint64_t u;
+
+    for (unsigned int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+    if (v < 0) {
+        s += '-';
+        u = -(uint64_t) v;
+    } else {
+        u = v;
+    }
+
+    appendUnsigned(s, u / scale);
+    if (decimals > 0) {
+        s += '.';
+        for (uint64_t d = scale / 10; d > 0; d /= 10) {
+            s += '0' + ((u % scale) / d) % 10;
+        }
+    }
+}
+
+void Json::appendFloat(string &s, float f, unsigned int decimals)
+{
+    double scale = 1.0;
+
+    if (!isfinite(f)) {
+        s += "null";
+        return;
+    }
+
+    for (unsigned int i = 0; i < decimals; i++) {
+        scale *= 10.0;
+    }
+    appendFixed(s, llround(f * scale), decimals);
+}
+
+void Json::appendString(string &s, const char *str, size_t len)
+{
+    s += '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if ((c == '"') || (c == '\\')) {
+            s += '\\';
+            s += c;
+        } else if (c < 0x20) {
+            s += "\\u00";
+            s += hexDigits[c >> 4];
+            s += hexDigits[c & 0xf];
+        } else if (c < 0x80) {
+            s += c;
+        } else {
+            // Names off the mesh are not always valid UTF-8
+            size_t n = utf8Length((const unsigned char *) str + i, len - i);
+
+            if (n == 0) {
+                s += "\\ufffd";
+            } else {
+                s.append(str + i, n);
+                i += n - 1;
+            }
+        }
+    }
+    s += '"';
+}
+
+void Json::appendNodeId(string &s, uint32_t num)
+{
+    s += "\"!";
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        s += hexDigits[(num >> shift) & 0xf];
+    }
+    s += '"';
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,62 @@
+/*
+ * Json.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef JSON_HXX
+#define JSON_HXX
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+/*
+ * Appends JSON values to a string in place, without printf; shared by the
+ * query API and the event stream.
+ */
+class Json {
+
+public:
+
+    static void appendUnsigned(string &s, uint64_t v);
+    static void appendInt(string &s, int64_t v);
+    // v / 10^decimals
+    static void appendFixed(string &s, int64_t v, unsigned int decimals);
+    // null if not finite
+    static void appendFloat(string &s, float f, unsigned int decimals);
+    static void appendString(string &s, const char *str, size_t len);
+    static void appendNodeId(string &s, uint32_t num);
+
+    static inline void appendString(string &s, const string &str) {
+        appendString(s, str.data(), str.size());
+    }
+
+    static inline void appendBool(string &s, bool b) {
+        s += b ? "true" : "false";
+    }
+
+    // Starts a member: ,"name":
+    static inline void key(string &s, const char *name, bool first = false) {
+        if (!first) {
+            s += ',';
+        }
+        s += '"';
+        s += name;
+        s += "\":";
+    }
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,133 @@
+/*
+ * LatencyHistogram.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <LatencyHistogram.hxx>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+LatencyHistogram::~LatencyHistogram()
+{
+
+}
+
+unsigned int LatencyHistogram::bucketOf(uint64_t us)
+{
+    unsigned int msb;
+    unsigned int shift;
+
+    // Values below 2 * SUB_BUCKETS get a bucket each
+    if (us < (2 * SUB_BUCKETS)) {
+        return us;
+    }
+
+    if (us >= (((uint64_t) 1) << MAX_BITS)) {
+        return NUM_BUCKETS - 1;
+    }
+
+    msb = 63 - __builtin_clzll(us);
+    shift = msb - SUB_BUCKET_BITS;
+
+    return ((shift + 1) * SUB_BUCKETS) + ((us >> shift) - SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < (2 * SUB_BUCKETS)) {
+        return bucket;
+    }
+
+    shift = (bucket / SUB_BUCKETS) - 1;
+
+    return ((((uint64_t) SUB_BUCKETS + (bucket % SUB_BUCKETS)) + 1)
+            << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+    uint64_t max = _max.load(memory_order_relaxed);
+
+    _buckets[bucketOf(us)].fetch_add(1, memory_order_relaxed);
+    _count.fetch_add(1, memory_order_relaxed);
+    while ((us > max) &&
+           !_max.compare_exchange_weak(max, us, memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::record(chrono::steady_clock::time_point start,
+                              chrono::steady_clock::time_point end)
+{
+    if (end < start) {
+        end = start;
+    }
+
+    record(chrono::duration_cast<chrono::microseconds>(end - start).count());
+}
+
+void LatencyHistogram::reset(void)
+{
+    for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+        _buckets[i].store(0, memory_order_relaxed);
+    }
+    _count = 0;
+    _max = 0;
+}
+
+uint64_t LatencyHistogram::count(void) const
+{
+    return _count;
+}
+
+uint64_t LatencyHistogram::max(void) const
+{
+    return _max;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t total = 0;
+    uint64_t target;
+    uint64_t seen = 0;
+
+    // Sum the buckets rather than trusting _count, which may be a few
+    // records ahead of them
+    for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+        total += _buckets[i].load(memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    target = (uint64_t) ((p / 100.0) * total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+        seen += _buckets[i].load(memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t bound = bucketUpperBound(i);
+            uint64_t max = _max.load(memory_order_relaxed);
+            return bound < max ? bound : max;
+        }
+    }
+
+    return _max;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
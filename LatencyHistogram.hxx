@@ -0,0 +1,70 @@
+/*
+ * LatencyHistogram.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef LATENCYHISTOGRAM_HXX
+#define LATENCYHISTOGRAM_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+/*
+ * Lock-free latency histogram with HDR-style log-linear buckets.
+ *
+ * Each power of two is split into SUB_BUCKETS linear buckets, so any
+ * recorded value is reported within ~6% of its true value while the whole
+ * range from 1us to ~12 days fits in a fixed array. record() is a couple
+ * of relaxed atomic adds and can be called from any thread.
+ */
+class LatencyHistogram {
+
+public:
+
+    LatencyHistogram();
+    ~LatencyHistogram();
+
+    void record(uint64_t us);
+    void record(chrono::steady_clock::time_point start,
+                chrono::steady_clock::time_point end);
+    void reset(void);
+
+    uint64_t count(void) const;
+    uint64_t max(void) const;
+    // Upper bound of the bucket holding the given percentile (0-100)
+    uint64_t percentile(double p) const;
+
+private:
+
+    static const unsigned int SUB_BUCKET_BITS = 4;
+    static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_BITS = 40;
+    static const unsigned int NUM_BUCKETS =
+        (MAX_BITS - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    static unsigned int bucketOf(uint64_t us);
+    static uint64_t bucketUpperBound(unsigned int bucket);
+
+private:
+
+    atomic<uint64_t> _buckets[NUM_BUCKETS];
+    atomic<uint64_t> _count;
+    atomic<uint64_t> _max;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
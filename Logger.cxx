@@ -0,0 +1,427 @@
+/*
+ * Logger.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <Logger.hxx>
+
+static const char *levelNames[] = {
+    "error",
+    "warn",
+    "info",
+    "debug",
+};
+
+static const char levelLetters[] = { 'E', 'W', 'I', 'D', };
+
+static const char *subsystemNames[Logger::NUM_SUBSYSTEMS] = {
+    "main",
+    "mesh",
+    "mqtt",
+    "spool",
+    "reactor",
+    "metrics",
+    "store",
+};
+
+atomic<int> Logger::_levels[NUM_SUBSYSTEMS] = {
+    { LEVEL_INFO, }, { LEVEL_INFO, }, { LEVEL_INFO, }, { LEVEL_INFO, },
+    { LEVEL_INFO, }, { LEVEL_INFO, }, { LEVEL_INFO, },
+};
+// Zero-initialized: slot seq is 2 * turn when free for that turn of the
+// ring and 2 * turn + 1 once written
+Logger::Slot Logger::_slots[SLOTS];
+atomic<uint64_t> Logger::_head(0);
+uint64_t Logger::_tail = 0;
+atomic<unsigned long> Logger::_dropped(0);
+atomic<bool> Logger::_isRunning(false);
+atomic<bool> Logger::_idle(false);
+shared_ptr<thread> Logger::_thread;
+mutex Logger::_mutex;
+condition_variable Logger::_cv;
+string Logger::_path;
+FILE *Logger::_fp = NULL;
+size_t Logger::_size = 0;
+size_t Logger::_maxBytes = 0;
+unsigned int Logger::_keep = 0;
+
+const char *Logger::levelString(Level level)
+{
+    return (level >= LEVEL_ERROR) && (level <= LEVEL_DEBUG) ?
+        levelNames[level] : "off";
+}
+
+bool Logger::parseLevel(const string &s, Level &level)
+{
+    if (s == "off") {
+        level = LEVEL_OFF;
+        return true;
+    }
+
+    for (int i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++) {
+        if (s == levelNames[i]) {
+            level = (Level) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *Logger::subsystemString(Subsystem subsys)
+{
+    return subsys < NUM_SUBSYSTEMS ? subsystemNames[subsys] : "unknown";
+}
+
+bool Logger::parseSubsystem(const string &s, Subsystem &subsys)
+{
+    for (unsigned int i = 0; i < NUM_SUBSYSTEMS; i++) {
+        if (s == subsystemNames[i]) {
+            subsys = (Subsystem) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Logger::setLevel(Subsystem subsys, Level level)
+{
+    if (subsys < NUM_SUBSYSTEMS) {
+        _levels[subsys] = level;
+    }
+}
+
+void Logger::setLevel(Level level)
+{
+    for (unsigned int i = 0; i < NUM_SUBSYSTEMS; i++) {
+        _levels[i] = level;
+    }
+}
+
+Logger::Level Logger::level(Subsystem subsys)
+{
+    return subsys < NUM_SUBSYSTEMS ? (Level) _levels[subsys].load() :
+        LEVEL_OFF;
+}
+
+bool Logger::setFile(const string &path, size_t maxBytes, unsigned int keep)
+{
+    lock_guard<mutex> lock(_mutex);
+    FILE *fp = NULL;
+    struct stat st;
+
+    if (!path.empty()) {
+        fp = fopen(path.c_str(), "ae");
+        if (fp == NULL) {
+            fprintf(stderr, "%s: %s!\n", path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if ((_fp != NULL) && (_fp != stdout)) {
+        fclose(_fp);
+    }
+    _fp = fp;
+    _path = path;
+    _size = 0;
+    if ((fp != NULL) && (fstat(fileno(fp), &st) == 0)) {
+        _size = st.st_size;
+    }
+    _maxBytes = maxBytes;
+    _keep = keep;
+
+    return true;
+}
+
+void Logger::start(void)
+{
+    if (_isRunning.exchange(true)) {
+        return;
+    }
+
+    _thread = make_shared<thread>(thread_function);
+}
+
+void Logger::stop(void)
+{
+    if (!_isRunning.exchange(false)) {
+        return;
+    }
+
+    _cv.notify_one();
+    if (_thread != NULL) {
+        _thread->join();
+        _thread = NULL;
+    }
+}
+
+Logger::Slot *Logger::claim(void)
+{
+    uint64_t pos = _head.load(memory_order_relaxed);
+
+    for (;;) {
+        Slot *slot = &_slots[pos % SLOTS];
+        uint64_t turn = 2 * (pos / SLOTS);
+        uint64_t seq = slot->seq.load(memory_order_acquire);
+
+        if (seq == turn) {
+            if (_head.compare_exchange_weak(pos, pos + 1,
+                                            memory_order_relaxed)) {
+                return slot;
+            }
+        } else if (seq < turn) {
+            // Still holds a message from the previous turn: full
+            _dropped++;
+            return NULL;
+        } else {
+            pos = _head.load(memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::publish(Slot *slot)
+{
+    slot->seq.fetch_add(1, memory_order_release);
+    if (_idle.load(memory_order_relaxed)) {
+        _cv.notify_one();
+    }
+}
+
+void Logger::log(Subsystem subsys, Level level, const char *format, ...)
+{
+    Slot local;
+    Slot *slot;
+    va_list ap;
+    int n;
+
+    slot = _isRunning ? claim() : &local;
+    if (slot == NULL) {
+        return;
+    }
+
+    slot->us = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    slot->level = level;
+    slot->subsys = subsys;
+    slot->raw = false;
+    va_start(ap, format);
+    n = vsnprintf(slot->text, sizeof(slot->text), format, ap);
+    va_end(ap);
+    slot->length = n < 0 ? 0 :
+        n >= (int) sizeof(slot->text) ? sizeof(slot->text) - 1 : n;
+
+    if (slot == &local) {
+        lock_guard<mutex> lock(_mutex);
+        output(local);
+        if (_fp != NULL) {
+            fflush(_fp);
+        }
+    } else {
+        publish(slot);
+    }
+}
+
+void Logger::write(Subsystem subsys, Level level, const string &text)
+{
+    for (size_t offset = 0; offset < text.size(); offset += TEXT_BYTES) {
+        Slot local;
+        Slot *slot = _isRunning ? claim() : &local;
+
+        if (slot == NULL) {
+            return;
+        }
+
+        slot->us = 0;
+        slot->level = level;
+        slot->subsys = subsys;
+        slot->raw = true;
+        slot->length = min((size_t) TEXT_BYTES, text.size() - offset);
+        memcpy(slot->text, text.data() + offset, slot->length);
+
+        if (slot == &local) {
+            lock_guard<mutex> lock(_mutex);
+            output(local);
+            if (_fp != NULL) {
+                fflush(_fp);
+            }
+        } else {
+            publish(slot);
+        }
+    }
+}
+
+int Logger::vwrite(Subsystem subsys, Level level, const char *format,
+                   va_list ap)
+{
+    char buf[1024];
+    va_list aq;
+    int n;
+
+    va_copy(aq, ap);
+    n = vsnprintf(buf, sizeof(buf), format, aq);
+    va_end(aq);
+    if (n < 0) {
+        return n;
+    }
+
+    if (n < (int) sizeof(buf)) {
+        write(subsys, level, string(buf, n));
+    } else {
+        string text(n + 1, '\0');
+
+        vsnprintf(&text[0], text.size(), format, ap);
+        text.resize(n);
+        write(subsys, level, text);
+    }
+
+    return n;
+}
+
+void Logger::output(const Slot &slot)
+{
+    FILE *fp = _fp != NULL ? _fp : stdout;
+    int n = 0;
+
+    if (slot.raw) {
+        n = fwrite(slot.text, 1, slot.length, fp);
+    } else {
+        time_t t = slot.us / 1000000;
+        struct tm tm;
+        char timestr[32];
+
+        localtime_r(&t, &tm);
+        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+        n = fprintf(fp, "%s.%03u %c %s: %.*s%s", timestr,
+                    (unsigned int) ((slot.us / 1000) % 1000),
+                    levelLetters[slot.level], subsystemNames[slot.subsys],
+                    (int) slot.length, slot.text,
+                    (slot.length > 0) && (slot.text[slot.length - 1] == '\n') ?
+                    "" : "\n");
+    }
+
+    if (n > 0) {
+        _size += n;
+    }
+    if ((_fp != NULL) && (_maxBytes > 0) && (_size >= _maxBytes)) {
+        rotate();
+    }
+}
+
+void Logger::rotate(void)
+{
+    fclose(_fp);
+    _fp = NULL;
+    _size = 0;
+
+    for (unsigned int i = _keep; i > 1; i--) {
+        rename((_path + "." + to_string(i - 1)).c_str(),
+               (_path + "." + to_string(i)).c_str());
+    }
+    if (_keep > 0) {
+        rename(_path.c_str(), (_path + ".1").c_str());
+    } else {
+        unlink(_path.c_str());
+    }
+
+    _fp = fopen(_path.c_str(), "ae");
+    if (_fp == NULL) {
+        fprintf(stderr, "%s: %s!\n", _path.c_str(), strerror(errno));
+    }
+}
+
+bool Logger::drain(void)
+{
+    bool drained = false;
+
+    for (;;) {
+        Slot *slot = &_slots[_tail % SLOTS];
+        uint64_t turn = 2 * (_tail / SLOTS);
+
+        if (slot->seq.load(memory_order_acquire) != turn + 1) {
+            break;
+        }
+
+        {
+            lock_guard<mutex> lock(_mutex);
+            output(*slot);
+        }
+        slot->seq.store(turn + 2, memory_order_release);
+        _tail++;
+        drained = true;
+    }
+
+    return drained;
+}
+
+void Logger::thread_function(void)
+{
+    unsigned long reported = 0;
+
+    for (;;) {
+        bool drained = drain();
+
+        if (_dropped != reported) {
+            Slot note;
+
+            note.raw = false;
+            note.us = chrono::duration_cast<chrono::microseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+            note.level = LEVEL_WARN;
+            note.subsys = SUBSYS_MAIN;
+            note.length = snprintf(note.text, sizeof(note.text),
+                                   "%lu log messages dropped",
+                                   _dropped - reported);
+            reported = _dropped;
+
+            lock_guard<mutex> lock(_mutex);
+            output(note);
+        }
+
+        if (drained) {
+            continue;
+        }
+
+        {
+            unique_lock<mutex> lock(_mutex);
+
+            if (_fp != NULL) {
+                fflush(_fp);
+            } else {
+                fflush(stdout);
+            }
+            if (!_isRunning) {
+                break;
+            }
+
+            // Producers only notify while we are idle; the timeout covers
+            // a notification that races with going idle
+            _idle = true;
+            _cv.wait_for(lock, chrono::milliseconds(100));
+            _idle = false;
+        }
+    }
+
+    // Whatever was claimed before stop()
+    drain();
+    lock_guard<mutex> lock(_mutex);
+    fflush(_fp != NULL ? _fp : stdout);
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
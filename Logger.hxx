@@ -0,0 +1,155 @@
+/*
+ * Logger.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef LOGGER_HXX
+#define LOGGER_HXX
+
+#include <stdint.h>
+#include <cstdarg>
+#include <cstdio>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/*
+ * Process-wide log with levels and per-subsystem filters.
+ *
+ * Callers format into a slot of a bounded lock-free multi-producer ring
+ * (a sequence number per slot, as in Vyukov's queue) and return; one
+ * writer thread drains it to stdout or a size-rotated file. A full ring
+ * drops the message and counts it rather than blocking the caller. The
+ * LOG macros test the level before evaluating anything, so a disabled
+ * message costs one relaxed load. Until start() messages are written
+ * synchronously.
+ */
+class Logger {
+
+public:
+
+    enum Level {
+        LEVEL_OFF = -1,
+        LEVEL_ERROR,
+        LEVEL_WARN,
+        LEVEL_INFO,
+        LEVEL_DEBUG,
+    };
+
+    enum Subsystem {
+        SUBSYS_MAIN,
+        SUBSYS_MESH,
+        SUBSYS_MQTT,
+        SUBSYS_SPOOL,
+        SUBSYS_REACTOR,
+        SUBSYS_METRICS,
+        SUBSYS_STORE,
+        NUM_SUBSYSTEMS,
+    };
+
+    static const unsigned int SLOTS = 2048;
+    static const unsigned int TEXT_BYTES = 232;
+
+    static const char *levelString(Level level);
+    static bool parseLevel(const string &s, Level &level);
+    static const char *subsystemString(Subsystem subsys);
+    static bool parseSubsystem(const string &s, Subsystem &subsys);
+
+    static inline bool enabled(Subsystem subsys, Level level) {
+        return level <= _levels[subsys].load(memory_order_relaxed);
+    }
+
+    static void setLevel(Subsystem subsys, Level level);
+    static void setLevel(Level level);
+    static Level level(Subsystem subsys);
+
+    // Rotates path -> path.1 -> ... -> path.keep past maxBytes; empty
+    // path: stdout
+    static bool setFile(const string &path, size_t maxBytes,
+                        unsigned int keep);
+
+    static void start(void);
+    static void stop(void);
+
+    // One line, prefixed with time, level and subsystem
+    static void log(Subsystem subsys, Level level, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+    // Text as is, split across slots if long; for console output
+    static int vwrite(Subsystem subsys, Level level, const char *format,
+                      va_list ap);
+    static void write(Subsystem subsys, Level level, const string &text);
+
+    static inline unsigned long dropped(void) {
+        return _dropped;
+    }
+
+private:
+
+    struct Slot {
+        atomic<uint64_t> seq;
+        uint64_t us;
+        int8_t level;
+        uint8_t subsys;
+        bool raw;
+        uint16_t length;
+        char text[TEXT_BYTES];
+    };
+
+    static Slot *claim(void);
+    static void publish(Slot *slot);
+    static void output(const Slot &slot);
+    static void rotate(void);
+    static bool drain(void);
+    static void thread_function(void);
+
+private:
+
+    static atomic<int> _levels[NUM_SUBSYSTEMS];
+    static Slot _slots[SLOTS];
+    static atomic<uint64_t> _head;
+    static uint64_t _tail;
+    static atomic<unsigned long> _dropped;
+
+    static atomic<bool> _isRunning;
+    static atomic<bool> _idle;
+    static shared_ptr<thread> _thread;
+    static mutex _mutex;
+    static condition_variable _cv;
+
+    static string _path;
+    static FILE *_fp;
+    static size_t _size;
+    static size_t _maxBytes;
+    static unsigned int _keep;
+
+};
+
+#define LOG_AT(subsys, level, ...)                                      \
+    do {                                                                \
+        if (Logger::enabled(Logger::SUBSYS_##subsys, level)) {          \
+            Logger::log(Logger::SUBSYS_##subsys, level, __VA_ARGS__);   \
+        }                                                               \
+    } while (0)
+
+#define LOGE(subsys, ...) LOG_AT(subsys, Logger::LEVEL_ERROR, __VA_ARGS__)
+#define LOGW(subsys, ...) LOG_AT(subsys, Logger::LEVEL_WARN, __VA_ARGS__)
+#define LOGI(subsys, ...) LOG_AT(subsys, Logger::LEVEL_INFO, __VA_ARGS__)
+#define LOGD(subsys, ...) LOG_AT(subsys, Logger::LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -4,24 +4,51 @@
  * Copyright (C) 2025, Charles Chiou
  */
 
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
+#include <cstring>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <thread>
+#include <Logger.hxx>
 #include <MqttClient.hxx>
+#include <ServiceEnvelope.hxx>
 #include <MeshMon.hxx>
 
 MeshMon::MeshMon()
     : MeshClient()
 {
-
+    _proxyQueueConfig = MqttClient::defaultQueueConfig;
+    _packetQueueConfig = MqttClient::defaultQueueConfig;
+    _connectConfig = MqttClient::defaultConnectConfig;
+    _downlinkConfig = MqttClient::defaultDownlinkConfig;
+    _batchConfig = MqttClient::defaultBatchConfig;
+    _qosConfig = MqttClient::defaultQosConfig;
+    _mqttShared = false;
+    _routes = make_shared<RoutingTable>();
+    _eventSource = 0;
 }
 
 MeshMon::~MeshMon()
 {
+    stopMqtt();
+}
+
+void MeshMon::join(void)
+{
+    MeshClient::join();
+    stopMqtt();
+}
+
+void MeshMon::stopMqtt(void)
+{
+    if (_mqttShared) {
+        // Owned by main() and still in use by the other radios
+        _meshtasticMqtt = NULL;
+        _myownMqtt = NULL;
+        return;
+    }
+
     if (_meshtasticMqtt != NULL) {
         _meshtasticMqtt->stop();
         _meshtasticMqtt->join();
@@ -35,172 +62,426 @@ MeshMon::~MeshMon()
     }
 }
 
-void MeshMon::join(void)
+void MeshMon::shareMqtt(shared_ptr<Reactor> reactor,
+                        shared_ptr<MqttClient> meshtasticMqtt,
+                        shared_ptr<MqttClient> myownMqtt)
 {
-    MeshClient::join();
+    _reactor = reactor;
+    _upstreamMqtt = meshtasticMqtt;
+    _myownMqtt = myownMqtt;
+    _mqttShared = true;
+}
+
+void MeshMon::useMqtt(shared_ptr<MqttClient> meshtasticMqtt,
+                      shared_ptr<MqttClient> myownMqtt)
+{
+    stopMqtt();
+    _meshtasticMqtt = meshtasticMqtt;
+    _myownMqtt = myownMqtt;
+    _mqttShared = true;
+}
+
+void MeshMon::setNodeDb(shared_ptr<NodeDb> nodeDb)
+{
+    _nodeDb = nodeDb;
+}
+
+void MeshMon::setMqttQueueConfig(const MqttClient::QueueConfig &proxy,
+                                 const MqttClient::QueueConfig &packet)
+{
+    _proxyQueueConfig = proxy;
+    _packetQueueConfig = packet;
+
+    if (_mqttShared) {
+        return;
+    }
 
     if (_meshtasticMqtt != NULL) {
-        _meshtasticMqtt->stop();
-        _meshtasticMqtt->join();
-        _meshtasticMqtt = NULL;
+        _meshtasticMqtt->setProxyQueueConfig(proxy);
+        _meshtasticMqtt->setPacketQueueConfig(packet);
+    }
+
+    if (_myownMqtt != NULL) {
+        _myownMqtt->setProxyQueueConfig(proxy);
+        _myownMqtt->setPacketQueueConfig(packet);
+    }
+}
+
+void MeshMon::setMqttConnectConfig(const MqttClient::ConnectConfig &connect)
+{
+    // Takes effect for clients started from here on
+    _connectConfig = connect;
+}
+
+void MeshMon::setMqttDownlinkConfig(const MqttClient::DownlinkConfig &downlink)
+{
+    _downlinkConfig = downlink;
+}
+
+void MeshMon::setMqttSpoolConfig(const MqttClient::SpoolConfig &spool)
+{
+    _spoolConfig = spool;
+}
+
+void MeshMon::setMqttBatchConfig(const MqttClient::BatchConfig &batch)
+{
+    _batchConfig = batch;
+}
+
+void MeshMon::setMqttQosConfig(const MqttClient::QosConfig &qos)
+{
+    _qosConfig = qos;
+}
+
+void MeshMon::openSpool(shared_ptr<MqttClient> mqtt, const char *name)
+{
+    MqttClient::SpoolConfig config = _spoolConfig;
+
+    if (config.dir.empty()) {
+        return;
+    }
+
+    config.dir += "/";
+    config.dir += name;
+    if (!mqtt->openSpool(config)) {
+        LOGE(SPOOL, "Unable to open MQTT spool %s", config.dir.c_str());
     }
+}
+
+void MeshMon::setDownlink(shared_ptr<MqttClient> mqtt)
+{
+    weak_ptr<MeshMon> self = shared_from_this();
+
+    // The client may outlive us if it is shared
+    mqtt->setDownlink(
+        [self](const meshtastic_MqttClientProxyMessage &m) {
+            shared_ptr<MeshMon> mon = self.lock();
+
+            return (mon != NULL) && mon->downlink(m);
+        }, _dedup);
+}
+
+bool MeshMon::downlink(const meshtastic_MqttClientProxyMessage &m)
+{
+    meshtastic_ToRadio toRadio;
+
+    memset(&toRadio, 0x0, sizeof(toRadio));
+    toRadio.which_payload_variant =
+        meshtastic_ToRadio_mqttClientProxyMessage_tag;
+    toRadio.mqttClientProxyMessage = m;
+
+    return sendToRadio(toRadio);
+}
 
+void MeshMon::startMyownMqtt(const string &server, uint16_t port,
+                             const string &user, const string &password,
+                             const string &topic)
+{
     if (_myownMqtt != NULL) {
         _myownMqtt->stop();
         _myownMqtt->join();
         _myownMqtt = NULL;
     }
+
+    _myownMqtt = make_shared<MqttClient>(server, port, user, password, topic);
+    _myownMqtt->setProxyQueueConfig(_proxyQueueConfig);
+    _myownMqtt->setPacketQueueConfig(_packetQueueConfig);
+    _myownMqtt->setConnectConfig(_connectConfig);
+    _myownMqtt->setBatchConfig(_batchConfig);
+    _myownMqtt->setQosConfig(_qosConfig);
+    openSpool(_myownMqtt, "myown");
+    _myownMqtt->start();
 }
 
 float MeshMon::getCpuTempC(void)
 {
-#define MAX_STRING        1024
-#define GET_GENCMD_RESULT 0x00030080
-    float tempC = 0.0;
-    int fd = -1;
-    int ret;
-    static const char *command = "measure_temp";
-    unsigned p[(MAX_STRING >> 2) + 7];
-    unsigned int i = 0;
-    const char *s;
-    string str;
-
-    fd = open("/dev/vcio", 0);
-    if (fd == -1) {
-        fprintf(stderr, "open: %s!\n", strerror(errno));
-        goto done;
-    }
-
-    i = 0;
-    p[i++] = 0; // size
-    p[i++] = 0x00000000; // process request
-    p[i++] = GET_GENCMD_RESULT; // (the tag id)
-    p[i++] = MAX_STRING;// buffer_len
-    p[i++] = 0; // request_len (set to response length)
-    p[i++] = 0; // error repsonse
-    memcpy(p + i, command, strlen(command) + 1);
-    i += MAX_STRING >> 2;
-    p[i++] = 0x00000000; // end tag
-    p[0] = i * sizeof(*p); // actual size
-
-    ret = ioctl(fd, _IOWR(100, 0, char *), p);
-    if (ret == -1) {
-        fprintf(stderr, "ioctl: %s!\n", strerror(errno));
-        goto done;
-    }
-
-    s = (const char *) (p + 6);
-    for (unsigned int i = 0; i < (sizeof(p) - 6); i++) {
-        if (s[i] == '\'') {
+    if (_cpuTemp == NULL) {
+        return 0.0;
+    }
+
+    return _cpuTemp->tempC();
+}
+
+time_t MeshMon::receivedAt(const meshtastic_MeshPacket &packet)
+{
+    return packet.rx_time != 0 ? (time_t) packet.rx_time : time(NULL);
+}
+
+void MeshMon::received(const meshtastic_MeshPacket &packet)
+{
+    uint8_t sinks = _routes->lookup(packet);
+
+    if (_capture != NULL) {
+        _capture->write(packet);
+    }
+
+    if (_nodeDb != NULL) {
+        _nodeDb->heard(packet, receivedAt(packet));
+    }
+
+    if (sinks & RoutingTable::SINK_METRICS) {
+        _packetStats.record(packet);
+    }
+
+    if ((sinks & RoutingTable::SINK_EVENTS) && (_events != NULL)) {
+        _events->publish(_eventSource, packet);
+    }
+
+    if ((sinks & RoutingTable::SINK_MYOWN) && (_myownMqtt != NULL)) {
+        _myownMqtt->publish(packet);
+    }
+
+    if ((sinks & RoutingTable::SINK_LOG) && (packet.from != whoami()) &&
+        Logger::enabled(Logger::SUBSYS_MESH, Logger::LEVEL_INFO)) {
+        Logger::log(Logger::SUBSYS_MESH, Logger::LEVEL_INFO,
+                    "%s sent portnum %u [rssi:%d] [hops:%u]",
+                    getDisplayName(packet.from).c_str(),
+                    (unsigned int) packet.decoded.portnum,
+                    (int) packet.rx_rssi, (unsigned int) hopsAway(packet));
+    }
+}
+
+template <typename T> static bool decodePayload(
+    const meshtastic_MeshPacket &packet, const pb_msgdesc_t *fields, T &dst)
+{
+    pb_istream_t stream;
+
+    memset(&dst, 0x0, sizeof(dst));
+    stream = pb_istream_from_buffer(packet.decoded.payload.bytes,
+                                    packet.decoded.payload.size);
+
+    return pb_decode(&stream, fields, &dst);
+}
+
+void MeshMon::replayPacket(const meshtastic_MeshPacket &packet)
+{
+    meshtastic_Position position;
+    meshtastic_User user;
+    meshtastic_Routing routing;
+    meshtastic_AdminMessage adminMessage;
+    meshtastic_Telemetry telemetry;
+    meshtastic_RouteDiscovery routeDiscovery;
+
+    if (packet.which_payload_variant != meshtastic_MeshPacket_decoded_tag) {
+        return;
+    }
+
+    // Same dispatch as MeshClient does for packets off the radio
+    switch (packet.decoded.portnum) {
+    case meshtastic_PortNum_TEXT_MESSAGE_APP:
+        gotTextMessage(packet,
+                       string((const char *) packet.decoded.payload.bytes,
+                              packet.decoded.payload.size));
+        break;
+    case meshtastic_PortNum_POSITION_APP:
+        if (decodePayload(packet, meshtastic_Position_fields, position)) {
+            gotPosition(packet, position);
+        }
+        break;
+    case meshtastic_PortNum_NODEINFO_APP:
+        if (decodePayload(packet, meshtastic_User_fields, user)) {
+            gotUser(packet, user);
+        }
+        break;
+    case meshtastic_PortNum_ROUTING_APP:
+        if (decodePayload(packet, meshtastic_Routing_fields, routing)) {
+            gotRouting(packet, routing);
+        }
+        break;
+    case meshtastic_PortNum_ADMIN_APP:
+        if (decodePayload(packet, meshtastic_AdminMessage_fields,
+                          adminMessage)) {
+            gotAdminMessage(packet, adminMessage);
+        }
+        break;
+    case meshtastic_PortNum_TRACEROUTE_APP:
+        if (decodePayload(packet, meshtastic_RouteDiscovery_fields,
+                          routeDiscovery)) {
+            gotTraceRoute(packet, routeDiscovery);
+        }
+        break;
+    case meshtastic_PortNum_TELEMETRY_APP:
+        if (!decodePayload(packet, meshtastic_Telemetry_fields, telemetry)) {
             break;
         }
-        if (isdigit(s[i]) || (s[i] == '.')) {
-            str += s[i];
+        switch (telemetry.which_variant) {
+        case meshtastic_Telemetry_device_metrics_tag:
+            gotDeviceMetrics(packet, telemetry.variant.device_metrics);
+            break;
+        case meshtastic_Telemetry_environment_metrics_tag:
+            gotEnvironmentMetrics(packet,
+                                  telemetry.variant.environment_metrics);
+            break;
+        case meshtastic_Telemetry_air_quality_metrics_tag:
+            gotAirQualityMetrics(packet,
+                                 telemetry.variant.air_quality_metrics);
+            break;
+        case meshtastic_Telemetry_power_metrics_tag:
+            gotPowerMetrics(packet, telemetry.variant.power_metrics);
+            break;
+        case meshtastic_Telemetry_local_stats_tag:
+            gotLocalStats(packet, telemetry.variant.local_stats);
+            break;
+        case meshtastic_Telemetry_health_metrics_tag:
+            gotHealthMetrics(packet, telemetry.variant.health_metrics);
+            break;
+        case meshtastic_Telemetry_host_metrics_tag:
+            gotHostMetrics(packet, telemetry.variant.host_metrics);
+            break;
+        default:
+            break;
         }
+        break;
+    default:
+        break;
     }
+}
 
-    try {
-        tempC = stof(str);
-    } catch (const invalid_argument& e) {
-    } catch (const out_of_range &e) {
-    }
-
-done:
+unsigned long MeshMon::replay(const string &path, double speed,
+                              const atomic<bool> &stop)
+{
+    CaptureReader reader;
+    CaptureType type;
+    uint64_t us;
+    vector<uint8_t> payload;
+    pb_istream_t stream;
+    meshtastic_MeshPacket packet;
+    meshtastic_MqttClientProxyMessage proxy;
+    meshtastic_ModuleConfig_MQTTConfig mqttConfig;
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point due;
+    unsigned long count = 0;
+
+    if (!reader.open(path)) {
+        return 0;
+    }
+
+    start = chrono::steady_clock::now();
+    while (!stop && reader.next(type, us, payload)) {
+        if (speed > 0.0) {
+            due = start + chrono::microseconds((uint64_t) (us / speed));
+            // Short naps so that stop is noticed during long gaps
+            while (!stop && (chrono::steady_clock::now() < due)) {
+                this_thread::sleep_until(
+                    min(due, chrono::steady_clock::now() +
+                        chrono::milliseconds(100)));
+            }
+        }
 
-    if (fd != -1) {
-        close(fd);
+        stream = pb_istream_from_buffer(payload.data(), payload.size());
+        switch (type) {
+        case CAPTURE_MESH_PACKET:
+            memset(&packet, 0x0, sizeof(packet));
+            if (pb_decode(&stream, meshtastic_MeshPacket_fields, &packet)) {
+                replayPacket(packet);
+            }
+            break;
+        case CAPTURE_MQTT_PROXY:
+            memset(&proxy, 0x0, sizeof(proxy));
+            if (pb_decode(&stream, meshtastic_MqttClientProxyMessage_fields,
+                          &proxy)) {
+                gotMqttClientProxyMessage(proxy);
+            }
+            break;
+        case CAPTURE_MQTT_CONFIG:
+            memset(&mqttConfig, 0x0, sizeof(mqttConfig));
+            if (pb_decode(&stream, meshtastic_ModuleConfig_MQTTConfig_fields,
+                          &mqttConfig)) {
+                gotModuleConfigMQTT(mqttConfig);
+            }
+            break;
+        default:
+            break;
+        }
+        count++;
     }
 
-    return tempC;
+    LOGI(MAIN, "replayed %lu records from %s in %.3fs", count, path.c_str(),
+         chrono::duration<double>(chrono::steady_clock::now() -
+                                  start).count());
+
+    return count;
 }
 
 void MeshMon::gotModuleConfigMQTT(const meshtastic_ModuleConfig_MQTTConfig &c)
 {
-    if (c.proxy_to_client_enabled && (_meshtasticMqtt == NULL)) {
+    if (_capture != NULL) {
+        _capture->write(c);
+    }
+
+    if (c.proxy_to_client_enabled && (_meshtasticMqtt == NULL) &&
+        _mqttShared) {
+        // The first radio with the proxy enabled brings up the shared
+        // upstream connection
+        static mutex attachMutex;
+        lock_guard<mutex> lock(attachMutex);
+
+        if (!_upstreamMqtt->isRunning()) {
+            // and gets what comes down from the broker
+            setDownlink(_upstreamMqtt);
+        }
+        _upstreamMqtt->ignoreGateway(whoami());
+        if (_upstreamMqtt->isRunning() || _upstreamMqtt->attach(_reactor)) {
+            _meshtasticMqtt = _upstreamMqtt;
+        }
+    } else if (c.proxy_to_client_enabled && (_meshtasticMqtt == NULL)) {
         // Turn on MQTT client proxy
         _meshtasticMqtt = make_shared<MqttClient>();
+        _meshtasticMqtt->setProxyQueueConfig(_proxyQueueConfig);
+        _meshtasticMqtt->setPacketQueueConfig(_packetQueueConfig);
+        _meshtasticMqtt->setConnectConfig(_connectConfig);
+        _meshtasticMqtt->setDownlinkConfig(_downlinkConfig);
+        _meshtasticMqtt->setQosConfig(_qosConfig);
+        setDownlink(_meshtasticMqtt);
+        _meshtasticMqtt->ignoreGateway(whoami());
+        openSpool(_meshtasticMqtt, "meshtastic");
         _meshtasticMqtt->start();
     }
 }
 
 void MeshMon::gotMqttClientProxyMessage(const meshtastic_MqttClientProxyMessage &m)
 {
-    MeshClient::gotMqttClientProxyMessage(m);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
-    meshtastic_MeshPacket packet;
-    bool found = false;
-
-#if 0
-    // Can't get this to work!
-    char channel_id[32];
-    char gateway_id[32];
-    meshtastic_ServiceEnvelope q = {
-        .packet = &packet,
-        .channel_id = channel_id,
-        .gateway_id = gateway_id,
-    };
-    pb_istream_t stream;
+    if (_capture != NULL) {
+        _capture->write(m);
+    }
 
-    stream = pb_istream_from_buffer(m.payload_variant.data.bytes,
-                                    m.payload_variant.data.size);
-    found = pb_decode(&stream, meshtastic_ServiceEnvelope_fields, &q);
-#else
-    // This is a hack... until we can directly decode ServiceEnvelope above
-    const uint8_t *bytes = m.payload_variant.data.bytes;
-    size_t size = m.payload_variant.data.size;
-    pb_istream_t stream;
+    MeshClient::gotMqttClientProxyMessage(m);
 
-    while (isprint(bytes[size - 1])) {
-        size--;
-    }
+    ServiceEnvelope envelope;
+    const meshtastic_MeshPacket &packet = envelope.packet();
 
-    for (size_t i = 7; i < 10 && !found; i++) {
-        for (size_t l = size; l > i; l--) {
-            stream = pb_istream_from_buffer(bytes + i, l);
-            found = pb_decode(&stream, meshtastic_MeshPacket_fields,
-                              &packet);
-            if (found) {
-                break;
-            }
-        }
+    if (m.which_payload_variant !=
+        meshtastic_MqttClientProxyMessage_data_tag) {
+        return;
     }
-#endif
 
-    if (!found) {
-        cerr << "pb_decode failed!" << endl;
-        goto done;
+    if (!envelope.decode(m.payload_variant.data.bytes,
+                         m.payload_variant.data.size)) {
+        LOGW(MESH, "pb_decode failed!");
+        return;
     }
 
     if (packet.which_payload_variant != meshtastic_MeshPacket_decoded_tag) {
-        goto done;
+        return;
     }
 
-    switch (packet.decoded.portnum) {
-    case meshtastic_PortNum_POSITION_APP:
-    case meshtastic_PortNum_NODEINFO_APP:
-    case meshtastic_PortNum_TELEMETRY_APP:
-        // The list above are sanctioned for upload for the benefit of
-        // meshmap.net
-        if (_meshtasticMqtt != NULL) {
-            _meshtasticMqtt->publish(m);
-#if 0
-            cout << "mqtt-proxy: " << packet.decoded.portnum << " "
-                 << "published="
-                 << _meshtasticMqtt->publishConfirmed() << "/"
-                 << _meshtasticMqtt->published()
-                 << endl;
-#endif
-        }
-        break;
-    default:
-        // Don't allow any other app to upload to MQTT
+    if ((_meshtasticMqtt == NULL) ||
+        ((_routes->lookup(packet) & RoutingTable::SINK_MESHTASTIC) == 0)) {
         // We don't want to upload conversations to the MQTT server!
-        break;
+        return;
     }
 
-done:
+    if ((_dedup != NULL) && (packet.id != 0) &&
+        _dedup->check(packet.from, packet.id)) {
+        // Already uplinked as heard by another radio
+        return;
+    }
 
-    return;
+    _meshtasticMqtt->publish(
+        m, MqttClient::coalesceKey(packet.from, packet.decoded.portnum));
+    _handlerLatency.record(start, chrono::steady_clock::now());
 }
 
 void MeshMon::gotTextMessage(const meshtastic_MeshPacket &packet,
@@ -209,6 +490,7 @@ void MeshMon::gotTextMessage(const meshtastic_MeshPacket &packet,
     bool result = false;
 
     MeshClient::gotTextMessage(packet, message);
+    received(packet);
     result = handleTextMessage(packet, message);
     if (result) {
         return;
@@ -219,21 +501,9 @@ void MeshMon::gotPosition(const meshtastic_MeshPacket &packet,
                           const meshtastic_Position &position)
 {
     MeshClient::gotPosition(packet, position);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent position"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_nodeDb != NULL) {
+        _nodeDb->updatePosition(packet.from, position);
     }
 }
 
@@ -241,44 +511,43 @@ void MeshMon::gotUser(const meshtastic_MeshPacket &packet,
                       const meshtastic_User &user)
 {
     MeshClient::gotUser(packet, user);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent nodeInfo.user"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
+    received(packet);
+    if (_nodeDb != NULL) {
+        _nodeDb->updateUser(packet.from, user);
     }
-#endif
 }
 
 void MeshMon::gotRouting(const meshtastic_MeshPacket &packet,
                          const meshtastic_Routing &routing)
 {
     MeshClient::gotRouting(packet, routing);
-
-#if 0
-    if ((routing.which_variant == meshtastic_Routing_error_reason_tag) &&
-        (routing.error_reason == meshtastic_Routing_Error_NONE) &&
-        (packet.from != packet.to)) {
-        cout << "traceroute from " << getDisplayName(packet.from) << " -> ";
-        cout << getDisplayName(packet.to)
-             << "[" << packet.rx_snr << "dB]" << endl;
+    received(packet);
+    if (_topology != NULL) {
+        if (routing.which_variant == meshtastic_Routing_route_request_tag) {
+            _topology->traceroute(packet, routing.route_request,
+                                  receivedAt(packet));
+        } else if (routing.which_variant ==
+                   meshtastic_Routing_route_reply_tag) {
+            _topology->traceroute(packet, routing.route_reply,
+                                  receivedAt(packet));
+        }
     }
-#endif
 }
 
 void MeshMon::gotAdminMessage(const meshtastic_MeshPacket &packet,
                               const meshtastic_AdminMessage &adminMessage)
 {
     MeshClient::gotAdminMessage(packet, adminMessage);
-    if (!verbose()) {
-        cout << adminMessage;
-        cout << "---" << endl;
-        cout << packet;
+    received(packet);
+    if (!verbose() &&
+        Logger::enabled(Logger::SUBSYS_MESH, Logger::LEVEL_INFO)) {
+        // Only render the dump when someone will see it
+        stringstream ss;
+
+        ss << adminMessage;
+        ss << "---" << endl;
+        ss << packet;
+        Logger::write(Logger::SUBSYS_MESH, Logger::LEVEL_INFO, ss.str());
     }
 }
 
@@ -286,21 +555,12 @@ void MeshMon::gotDeviceMetrics(const meshtastic_MeshPacket &packet,
                                const meshtastic_DeviceMetrics &metrics)
 {
     MeshClient::gotDeviceMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent device metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
+    received(packet);
+    if (_nodeDb != NULL) {
+        _nodeDb->updateDeviceMetrics(packet.from, metrics);
     }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -308,21 +568,9 @@ void MeshMon::gotEnvironmentMetrics(const meshtastic_MeshPacket &packet,
                                     const meshtastic_EnvironmentMetrics &metrics)
 {
     MeshClient::gotEnvironmentMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent environment metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -330,21 +578,9 @@ void MeshMon::gotAirQualityMetrics(const meshtastic_MeshPacket &packet,
                                    const meshtastic_AirQualityMetrics &metrics)
 {
     MeshClient::gotAirQualityMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent air quality metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -352,21 +588,9 @@ void MeshMon::gotPowerMetrics(const meshtastic_MeshPacket &packet,
                               const meshtastic_PowerMetrics &metrics)
 {
     MeshClient::gotPowerMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent power metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -374,39 +598,16 @@ void MeshMon::gotLocalStats(const meshtastic_MeshPacket &packet,
                             const meshtastic_LocalStats &stats)
 {
     MeshClient::gotLocalStats(packet, stats);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent local stats"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
+    received(packet);
 }
 
 void MeshMon::gotHealthMetrics(const meshtastic_MeshPacket &packet,
                                const meshtastic_HealthMetrics &metrics)
 {
     MeshClient::gotHealthMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << " sent health metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -414,21 +615,9 @@ void MeshMon::gotHostMetrics(const meshtastic_MeshPacket &packet,
                              const meshtastic_HostMetrics &metrics)
 {
     MeshClient::gotHostMetrics(packet, metrics);
-
-#if 0
-    if (!verbose()) {
-        if (packet.from != whoami()) {
-            cout << getDisplayName(packet.from)
-                 << "sent host metrics"
-                 << " [rssi:" << packet.rx_rssi << "]"
-                 << " [hops:" << hopsAway(packet) << "]"
-                 << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_telemetry != NULL) {
+        _telemetry->record(packet.from, receivedAt(packet), metrics);
     }
 }
 
@@ -436,59 +625,83 @@ void MeshMon::gotTraceRoute(const meshtastic_MeshPacket &packet,
                             const meshtastic_RouteDiscovery &routeDiscovery)
 {
     MeshClient::gotTraceRoute(packet, routeDiscovery);
-#if 0
-    if (!verbose()) {
-        if ((routeDiscovery.route_count > 0) &&
-            (routeDiscovery.route_back_count == 0)) {
-            float rx_snr;
-            cout << "traceroute from " << getDisplayName(packet.from)
-                 << " -> ";
-            for (unsigned int i = 0; i < routeDiscovery.route_count; i++) {
-                if (i > 0) {
-                    cout << " -> ";
-                }
-                cout << getDisplayName(routeDiscovery.route[i]);
-                if (routeDiscovery.snr_towards[i] != INT8_MIN) {
-                    rx_snr = routeDiscovery.snr_towards[i];
-                    rx_snr /= 4.0;
-                    cout << "[" << rx_snr << "dB]";
-                } else {
-                    cout << "[???dB]";
-                }
-            }
-            rx_snr = packet.rx_snr;
-            cout << " -> " << getDisplayName(packet.to)
-                 << "[" << rx_snr << "dB]" << endl;
-        }
-    }
-#endif
-
-    if (_myownMqtt != NULL) {
-        _myownMqtt->publish(packet);
+    received(packet);
+    if (_topology != NULL) {
+        _topology->traceroute(packet, routeDiscovery, receivedAt(packet));
     }
 }
 
 bool MeshMon::loadNvm(void)
 {
+    NodeDb::NodeRecord record;
     bool result;
 
-    result = MeshNvm::loadNvm();
+    if ((_nodeDb == NULL) || (_nodeDb->count() == 0)) {
+        // Until the table has nodes, they come from MeshNvm
+        result = MeshNvm::loadNvm();
+        return result;
+    }
 
-    return result;
+    for (unsigned int i = 0; i < _nodeDb->capacity(); i++) {
+        if (_nodeDb->slot(i, record)) {
+            restoreNode(record);
+        }
+    }
+
+    return true;
 }
 
 bool MeshMon::saveNvm(void)
 {
     bool result;
 
+    if (_nodeDb != NULL) {
+        // Node updates went to the table as they came in
+        _nodeDb->sync();
+        return true;
+    }
+
     result = MeshNvm::saveNvm();
 
     return result;
 }
 
+// Hands a node back to MeshClient as if it had just been heard, bypassing
+// our own overrides so that nothing is logged or forwarded
+void MeshMon::restoreNode(const NodeDb::NodeRecord &record)
+{
+    meshtastic_MeshPacket packet;
+    meshtastic_User user;
+    meshtastic_Position position;
+    meshtastic_DeviceMetrics metrics;
+
+    memset(&packet, 0x0, sizeof(packet));
+    packet.from = record.num;
+    packet.to = 0xffffffff;
+    packet.rx_time = record.lastHeard;
+    packet.rx_snr = record.snr;
+    packet.rx_rssi = record.rssi;
+    packet.which_payload_variant = meshtastic_MeshPacket_decoded_tag;
+
+    if (NodeDb::toUser(record, user)) {
+        packet.decoded.portnum = meshtastic_PortNum_NODEINFO_APP;
+        MeshClient::gotUser(packet, user);
+    }
+    if (NodeDb::toPosition(record, position)) {
+        packet.decoded.portnum = meshtastic_PortNum_POSITION_APP;
+        MeshClient::gotPosition(packet, position);
+    }
+    if (NodeDb::toDeviceMetrics(record, metrics)) {
+        packet.decoded.portnum = meshtastic_PortNum_TELEMETRY_APP;
+        MeshClient::gotDeviceMetrics(packet, metrics);
+    }
+}
+
 string MeshMon::handleEnv(uint32_t node_num, string &message)
 {
     stringstream ss;
+    float tempC;
+    time_t sampledAt;
 
     ss << HomeChat::handleEnv(node_num, message);
     if (!ss.str().empty()) {
@@ -496,19 +709,62 @@ string MeshMon::handleEnv(uint32_t node_num, string &message)
     }
 
     ss << "cpu temperature: ";
-    ss <<  setprecision(3) << getCpuTempC();
+    if ((_cpuTemp != NULL) && _cpuTemp->sample(tempC, sampledAt)) {
+        ss <<  setprecision(3) << tempC;
+    } else {
+        ss << "n/a";
+    }
+
+    if ((_telemetry != NULL) &&
+        (message.find("history") != string::npos)) {
+        envHistory(ss, node_num, message);
+    }
 
     return ss.str();
 }
 
-static inline int stdio_vprintf(const char *format, va_list ap)
+// "env history [!node]": the last day of a node's environment metrics,
+// the asking node's own by default
+void MeshMon::envHistory(ostream &os, uint32_t node_num,
+                         const string &message)
 {
-    return vprintf(format, ap);
+    static const TelemetryStore::Metric metrics[] = {
+        TelemetryStore::TEMPERATURE,
+        TelemetryStore::RELATIVE_HUMIDITY,
+        TelemetryStore::BAROMETRIC_PRESSURE,
+    };
+    stringstream words(message);
+    string word;
+    uint32_t node = node_num;
+    time_t now = time(NULL);
+    TelemetryStore::Point point;
+
+    while (words >> word) {
+        if ((word.size() == 9) && (word[0] == '!')) {
+            node = strtoul(word.c_str() + 1, NULL, 16);
+        }
+    }
+
+    os << endl << getDisplayName(node) << " last 24h:";
+    for (unsigned int i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+        if (_telemetry->summary(node, metrics[i], now - 86400, now,
+                                point)) {
+            os << endl << TelemetryStore::metricName(metrics[i]) << " "
+               << setprecision(3) << point.min << "/" << point.mean << "/"
+               << point.max;
+        }
+    }
 }
 
 int MeshMon::vprintf(const char *format, va_list ap) const
 {
-    return stdio_vprintf(format, ap);
+    // Console output of libmeshtastic and HomeChat, written as is
+    if (!Logger::enabled(Logger::SUBSYS_MESH, Logger::LEVEL_INFO)) {
+        return 0;
+    }
+
+    return Logger::vwrite(Logger::SUBSYS_MESH, Logger::LEVEL_INFO, format,
+                          ap);
 }
 
 /*
@@ -10,11 +10,19 @@
 #include <LibMeshtastic.hxx>
 #include <HomeChat.hxx>
 #include <MeshNvm.hxx>
+#include <MqttClient.hxx>
+#include <CpuTemp.hxx>
+#include <DedupCache.hxx>
+#include <PacketStats.hxx>
+#include <Capture.hxx>
+#include <RoutingTable.hxx>
+#include <TelemetryStore.hxx>
+#include <NodeDb.hxx>
+#include <Topology.hxx>
+#include <EventBus.hxx>
 
 using namespace std;
 
-class MqttClient;
-
 class MeshMon : public MeshClient, public MeshNvm, public HomeChat,
                 public enable_shared_from_this<MeshMon> {
 
@@ -27,6 +35,101 @@ public:
 
     float getCpuTempC(void);
 
+    inline void setCpuTemp(shared_ptr<CpuTemp> cpuTemp) {
+        _cpuTemp = cpuTemp;
+    }
+
+    inline const shared_ptr<CpuTemp> cpuTemp(void) const {
+        return _cpuTemp;
+    }
+
+    // Shared by all radios; consulted before uplinking a proxied packet
+    inline void setDedupCache(shared_ptr<DedupCache> dedup) {
+        _dedup = dedup;
+    }
+
+    inline const shared_ptr<DedupCache> dedupCache(void) const {
+        return _dedup;
+    }
+
+    // Shared by all radios; history of every node's telemetry
+    inline void setTelemetryStore(shared_ptr<TelemetryStore> telemetry) {
+        _telemetry = telemetry;
+    }
+
+    inline const shared_ptr<TelemetryStore> telemetryStore(void) const {
+        return _telemetry;
+    }
+
+    // Shared by all radios; links learned from traceroutes
+    inline void setTopology(shared_ptr<Topology> topology) {
+        _topology = topology;
+    }
+
+    inline const shared_ptr<Topology> topology(void) const {
+        return _topology;
+    }
+
+    // Shared by all radios; source is this radio's, from addSource()
+    inline void setEventBus(shared_ptr<EventBus> events,
+                            unsigned int source) {
+        _events = events;
+        _eventSource = source;
+    }
+
+    // Shared by all radios; persists node updates as they arrive and
+    // stands in for MeshNvm's node list. Set before setNvm().
+    void setNodeDb(shared_ptr<NodeDb> nodeDb);
+
+    inline const shared_ptr<NodeDb> nodeDb(void) const {
+        return _nodeDb;
+    }
+
+    // Where packets heard on the mesh are forwarded; built-in policy
+    // unless set
+    inline void setRoutingTable(shared_ptr<const RoutingTable> routes) {
+        _routes = routes;
+    }
+
+    inline const shared_ptr<const RoutingTable> routingTable(void) const {
+        return _routes;
+    }
+
+    // Record everything the radio hands us
+    inline void setCapture(shared_ptr<CaptureWriter> capture) {
+        _capture = capture;
+    }
+
+    // Drive the handlers from a capture instead of a radio: at the
+    // recorded pace times speed, or as fast as possible if speed is 0.
+    // Returns the number of records replayed.
+    unsigned long replay(const string &path, double speed,
+                         const atomic<bool> &stop);
+    void replayPacket(const meshtastic_MeshPacket &packet);
+
+    void setMqttQueueConfig(const MqttClient::QueueConfig &proxy,
+                            const MqttClient::QueueConfig &packet);
+    void setMqttConnectConfig(const MqttClient::ConnectConfig &connect);
+    // Broker -> radio; for a shared connection, set it on the client
+    void setMqttDownlinkConfig(const MqttClient::DownlinkConfig &downlink);
+    // Spool directory for this radio; each of its clients gets a
+    // subdirectory
+    void setMqttSpoolConfig(const MqttClient::SpoolConfig &spool);
+    // Private broker only
+    void setMqttBatchConfig(const MqttClient::BatchConfig &batch);
+    void setMqttQosConfig(const MqttClient::QosConfig &qos);
+    void startMyownMqtt(const string &server, uint16_t port,
+                        const string &user, const string &password,
+                        const string &topic);
+    // Use clients owned and started by the caller, e.g. a benchmark
+    void useMqtt(shared_ptr<MqttClient> meshtasticMqtt,
+                 shared_ptr<MqttClient> myownMqtt);
+    // Reactor mode: use connections shared by all radios instead of
+    // starting our own
+    void shareMqtt(shared_ptr<Reactor> reactor,
+                   shared_ptr<MqttClient> meshtasticMqtt,
+                   shared_ptr<MqttClient> myownMqtt);
+
 protected:
 
     // Extend MeshClient
@@ -89,10 +192,51 @@ public:
         return _myownMqtt;
     }
 
+    inline const PacketStats &packetStats(void) const {
+        return _packetStats;
+    }
+
+    // gotMqttClientProxyMessage() -> enqueued, in microseconds
+    inline LatencyHistogram &handlerLatency(void) {
+        return _handlerLatency;
+    }
+
+private:
+
+    void stopMqtt(void);
+    void received(const meshtastic_MeshPacket &packet);
+    static time_t receivedAt(const meshtastic_MeshPacket &packet);
+    void envHistory(ostream &os, uint32_t node_num, const string &message);
+    void restoreNode(const NodeDb::NodeRecord &record);
+    void openSpool(shared_ptr<MqttClient> mqtt, const char *name);
+    void setDownlink(shared_ptr<MqttClient> mqtt);
+    bool downlink(const meshtastic_MqttClientProxyMessage &m);
+
 private:
 
     shared_ptr<MqttClient> _meshtasticMqtt;
     shared_ptr<MqttClient> _myownMqtt;
+    shared_ptr<Reactor> _reactor;
+    shared_ptr<MqttClient> _upstreamMqtt;
+    bool _mqttShared;
+    shared_ptr<CpuTemp> _cpuTemp;
+    shared_ptr<DedupCache> _dedup;
+    shared_ptr<TelemetryStore> _telemetry;
+    shared_ptr<NodeDb> _nodeDb;
+    shared_ptr<Topology> _topology;
+    shared_ptr<EventBus> _events;
+    unsigned int _eventSource;
+    MqttClient::QueueConfig _proxyQueueConfig;
+    MqttClient::QueueConfig _packetQueueConfig;
+    MqttClient::ConnectConfig _connectConfig;
+    MqttClient::SpoolConfig _spoolConfig;
+    MqttClient::DownlinkConfig _downlinkConfig;
+    MqttClient::BatchConfig _batchConfig;
+    MqttClient::QosConfig _qosConfig;
+    LatencyHistogram _handlerLatency;
+    PacketStats _packetStats;
+    shared_ptr<CaptureWriter> _capture;
+    shared_ptr<const RoutingTable> _routes;
 
 };
 
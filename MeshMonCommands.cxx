@@ -0,0 +1,429 @@
+/*
+ * MeshMonCommands.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <MqttClient.hxx>
+#include <MeshMonCommands.hxx>
+
+typedef MeshMonCommands::Output Output;
+
+void MeshMonCommands::Output::printf(const char *format, ...)
+{
+    char buf[1024];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+
+    if (n < (int) sizeof(buf)) {
+        write(buf, n);
+    } else {
+        string text(n + 1, '\0');
+
+        va_start(ap, format);
+        vsnprintf(&text[0], text.size(), format, ap);
+        va_end(ap);
+        write(text.data(), n);
+    }
+}
+
+static void printQueue(Output &out, const char *label,
+                       const char *name,
+                       const MqttClient::QueueConfig &config,
+                       const MqttClient::QueueCounters &counters)
+{
+    out.printf("%s %s queue: capacity %zu %s, "
+               "enq %lu deq %lu drop %lu coalesced %lu\n",
+               label, name, config.capacity,
+               MqttClient::overflowPolicyString(config.policy),
+               counters.enqueued.load(), counters.dequeued.load(),
+               counters.dropped.load(), counters.coalesced.load());
+}
+
+static void printDrain(Output &out, const char *label,
+                       const shared_ptr<MqttClient> &mqtt)
+{
+    out.printf("%s state: %s, %u reconnects\n", label,
+               MqttClient::connStateString(mqtt->connState()),
+               mqtt->reconnects());
+    out.printf("%s time in state: connecting %lus, connected %lus, "
+               "subscribed %lus, backoff %lus\n", label,
+               mqtt->timeInStateMs(MqttClient::CONNECTING) / 1000,
+               mqtt->timeInStateMs(MqttClient::CONNECTED) / 1000,
+               mqtt->timeInStateMs(MqttClient::SUBSCRIBED) / 1000,
+               mqtt->timeInStateMs(MqttClient::BACKOFF) / 1000);
+    out.printf("%s published: %u/%u\n", label,
+               mqtt->publishConfirmed(), mqtt->published());
+    out.printf("%s queue depth: %zu proxy, %zu packet\n", label,
+               mqtt->proxyQueueDepth(), mqtt->packetQueueDepth());
+    out.printf("%s in flight: %u/%u, ack rtt %lums, %lu stalls\n", label,
+               mqtt->inflight(), mqtt->inflightWindow(),
+               mqtt->ackRttUs() / 1000, mqtt->windowStalls());
+    out.printf("%s drain: batch %u, latency %ums (max %ums)\n", label,
+               mqtt->lastBatchSize(), mqtt->lastDrainLatencyMs(),
+               mqtt->maxDrainLatencyMs());
+    if (mqtt->batchConfig().windowMs > 0) {
+        out.printf("%s batching: %lu packets in %lu publishes, "
+                   "%lu saved\n", label, mqtt->batchedPackets(),
+                   mqtt->batches(),
+                   mqtt->batchedPackets() - mqtt->batches());
+    }
+    if (mqtt->spool()) {
+        const shared_ptr<MqttSpool> spool = mqtt->spool();
+
+        out.printf("%s spool: %zu bytes, appended %lu replayed %lu "
+                   "dropped %lu (%s)\n", label, spool->bytes(),
+                   spool->appended(), spool->replayed(),
+                   spool->dropped(), spool->dir().c_str());
+    }
+}
+
+static void printLatency(Output &out, const char *stage,
+                         const LatencyHistogram &h)
+{
+    out.printf("  %-10s %10llu %9llu %9llu %9llu %9llu %9llu\n", stage,
+               (unsigned long long) h.count(),
+               (unsigned long long) h.percentile(50.0),
+               (unsigned long long) h.percentile(90.0),
+               (unsigned long long) h.percentile(99.0),
+               (unsigned long long) h.percentile(99.9),
+               (unsigned long long) h.max());
+}
+
+static void printStats(Output &out, const char *label,
+                       const shared_ptr<MqttClient> &mqtt,
+                       LatencyHistogram *handler, bool reset)
+{
+    out.printf("%s latency (us):    count       p50       p90"
+               "       p99     p99.9       max\n", label);
+    if (handler != NULL) {
+        printLatency(out, "handler", *handler);
+    }
+    printLatency(out, "queue", mqtt->queueLatency());
+    printLatency(out, "publish", mqtt->publishLatency());
+    printLatency(out, "ack", mqtt->ackLatency());
+
+    if (reset) {
+        if (handler != NULL) {
+            handler->reset();
+        }
+        mqtt->queueLatency().reset();
+        mqtt->publishLatency().reset();
+        mqtt->ackLatency().reset();
+    }
+}
+
+int MeshMonCommands::stats(shared_ptr<MeshMon> meshmon, Output &out,
+                           int argc, char **argv)
+{
+    const shared_ptr<MqttClient> meshtasticMqtt =
+        meshmon->meshtasticMqtt();
+    const shared_ptr<MqttClient> myownMqtt = meshmon->myownMqtt();
+    bool reset = false;
+
+    if ((argc == 2) && (strcmp(argv[1], "reset") == 0)) {
+        reset = true;
+    } else if (argc != 1) {
+        out.printf("Usage: %s [reset]\n", argv[0]);
+        return -1;
+    }
+
+    if (meshtasticMqtt) {
+        printStats(out, "MQTT", meshtasticMqtt, &meshmon->handlerLatency(),
+                   reset);
+    }
+    if (myownMqtt) {
+        printStats(out, "Private MQTT", myownMqtt, NULL, reset);
+    }
+    if (!meshtasticMqtt && !myownMqtt) {
+        out.printf("No MQTT clients\n");
+    }
+
+    return 0;
+}
+
+int MeshMonCommands::routes(shared_ptr<MeshMon> meshmon, Output &out,
+                            int argc, char **argv)
+{
+    const shared_ptr<const RoutingTable> routes = meshmon->routingTable();
+
+    (void)(argc);
+    (void)(argv);
+
+    // Built-in policy first, then ~/.meshmon; later rules win
+    for (vector<RoutingTable::Rule>::const_iterator it =
+             routes->rules().begin(); it != routes->rules().end(); it++) {
+        char portnum[16] = "*";
+        char channel[16] = "*";
+        char node[16] = "*";
+
+        if (it->portnum != RoutingTable::ANY) {
+            snprintf(portnum, sizeof(portnum), "%d", it->portnum);
+        }
+        if (it->channel != RoutingTable::ANY) {
+            snprintf(channel, sizeof(channel), "%d", it->channel);
+        }
+        if (it->node != RoutingTable::ANY) {
+            snprintf(node, sizeof(node), "!%08x", (uint32_t) it->node);
+        }
+        out.printf("portnum %-4s channel %-2s node %-10s -> %s\n",
+                   portnum, channel, node,
+                   RoutingTable::sinksString(it->sinks).c_str());
+    }
+
+    return 0;
+}
+
+int MeshMonCommands::telemetry(shared_ptr<MeshMon> meshmon, Output &out,
+                               int argc, char **argv)
+{
+    const shared_ptr<TelemetryStore> store = meshmon->telemetryStore();
+    int64_t node = 0;
+    TelemetryStore::Metric metric;
+    vector<TelemetryStore::Metric> metrics;
+    vector<TelemetryStore::Point> points;
+    TelemetryStore::Point point;
+    time_t now = time(NULL);
+    long hours = 24;
+    char *end = NULL;
+
+    if (store == NULL) {
+        out.printf("No telemetry store\n");
+        return -1;
+    }
+
+    if (argc == 1) {
+        out.printf("%zu/%zu series, %zu KB, %lu recycled\n",
+                   store->series(), store->maxSeries(),
+                   store->memoryBytes() / 1024, store->recycled());
+        return 0;
+    }
+
+    if ((argc > 4) || !RoutingTable::parseNode(argv[1], node)) {
+        out.printf("Usage: %s [!node [metric [hours]]]\n", argv[0]);
+        return -1;
+    }
+
+    if (argc == 2) {
+        // Latest value and the last day at a glance
+        store->metrics(node, metrics);
+        for (vector<TelemetryStore::Metric>::const_iterator it =
+                 metrics.begin(); it != metrics.end(); it++) {
+            float value = 0.0;
+            time_t t = 0;
+
+            if (!store->latest(node, *it, value, t) ||
+                !store->summary(node, *it, now - 86400, now, point)) {
+                continue;
+            }
+            out.printf("%-20s %10.2f (%lds ago)  24h min %.2f "
+                       "mean %.2f max %.2f\n",
+                       TelemetryStore::metricName(*it), value,
+                       (long) (now - t), point.min, point.mean,
+                       point.max);
+        }
+        return 0;
+    }
+
+    if (!TelemetryStore::parseMetric(argv[2], metric)) {
+        out.printf("Unknown metric %s\n", argv[2]);
+        return -1;
+    }
+    if (argc == 4) {
+        hours = strtol(argv[3], &end, 10);
+        if ((*end != '\0') || (hours <= 0)) {
+            out.printf("Invalid hours %s\n", argv[3]);
+            return -1;
+        }
+    }
+    // The hourly rollups go back a week; there is nothing before that
+    hours = min(hours, 168L);
+
+    store->history(node, metric, now - ((time_t) hours * 3600), now, points);
+    for (vector<TelemetryStore::Point>::const_iterator it = points.begin();
+         it != points.end(); it++) {
+        struct tm tm;
+        char timestr[32];
+
+        localtime_r(&it->time, &tm);
+        strftime(timestr, sizeof(timestr), "%m-%d %H:%M", &tm);
+        out.printf("%s  min %.2f mean %.2f max %.2f (%u)\n", timestr,
+                   it->min, it->mean, it->max, it->count);
+    }
+
+    return 0;
+}
+
+static void printLink(Output &out, const Topology::Link &link,
+                      time_t now)
+{
+    out.printf("!%08x -> !%08x  %6.2f dB  (%u samples, %lds ago)\n",
+               link.from, link.to, link.snr, link.samples,
+               (long) (now - link.lastSeen));
+}
+
+int MeshMonCommands::topology(shared_ptr<MeshMon> meshmon, Output &out,
+                              int argc, char **argv)
+{
+    const shared_ptr<Topology> topology = meshmon->topology();
+    vector<Topology::Link> links;
+    int64_t from = 0;
+    int64_t to = 0;
+    time_t now = time(NULL);
+
+    if (topology == NULL) {
+        out.printf("No topology\n");
+        return -1;
+    }
+
+    if (argc == 1) {
+        topology->links(now, links);
+        out.printf("%zu nodes, %zu links seen in the last %us, "
+                   "%lu traceroutes\n", topology->nodes(), links.size(),
+                   topology->maxAgeSec(), topology->traceroutes());
+        return 0;
+    }
+
+    if ((strcmp(argv[1], "neighbors") == 0) && (argc == 3) &&
+        RoutingTable::parseNode(argv[2], from)) {
+        topology->neighbors(from, now, links);
+    } else if ((strcmp(argv[1], "path") == 0) && (argc == 4) &&
+               RoutingTable::parseNode(argv[2], from) &&
+               RoutingTable::parseNode(argv[3], to)) {
+        if (!topology->bestPath(from, to, now, links)) {
+            out.printf("No path\n");
+            return -1;
+        }
+    } else if ((strcmp(argv[1], "weak") == 0) && (argc <= 3)) {
+        topology->weakLinks(argc == 3 ? atof(argv[2]) : -7.0, now, links);
+    } else if (((strcmp(argv[1], "dot") == 0) ||
+                (strcmp(argv[1], "json") == 0)) && (argc == 2)) {
+        stringstream ss;
+        string text;
+
+        if (strcmp(argv[1], "dot") == 0) {
+            topology->writeDot(ss, now);
+        } else {
+            topology->writeJson(ss, now);
+        }
+        text = ss.str();
+        out.write(text.data(), text.size());
+        return 0;
+    } else {
+        out.printf("Usage: %s [neighbors !node | path !from !to | "
+                   "weak [dB] | dot | json]\n", argv[0]);
+        return -1;
+    }
+
+    for (vector<Topology::Link>::const_iterator it = links.begin();
+         it != links.end(); it++) {
+        printLink(out, *it, now);
+    }
+
+    return 0;
+}
+
+int MeshMonCommands::status(shared_ptr<MeshMon> meshmon, Output &out,
+                            int argc, char **argv)
+{
+    const shared_ptr<MqttClient> meshtasticMqtt =
+        meshmon->meshtasticMqtt();
+    const shared_ptr<MqttClient> myownMqtt = meshmon->myownMqtt();
+
+    (void)(argc);
+    (void)(argv);
+
+    if (meshmon->cpuTemp()) {
+        const shared_ptr<CpuTemp> cpuTemp = meshmon->cpuTemp();
+        float tempC = 0.0;
+        time_t sampledAt = 0;
+
+        if (cpuTemp->sample(tempC, sampledAt)) {
+            out.printf("CPU temp: %.1fC (%s, %lds ago)\n", tempC,
+                       cpuTemp->sourceName(),
+                       (long) (time(NULL) - sampledAt));
+        } else {
+            out.printf("CPU temp: n/a (%s)\n", cpuTemp->sourceName());
+        }
+    }
+    if (meshtasticMqtt) {
+        printDrain(out, "MQTT", meshtasticMqtt);
+        printQueue(out, "MQTT", "proxy", meshtasticMqtt->proxyQueueConfig(),
+                   meshtasticMqtt->proxyQueueCounters());
+        if (!meshtasticMqtt->downlinkConfig().channels.empty()) {
+            printQueue(out, "MQTT", "downlink",
+                       meshtasticMqtt->downlinkConfig().queue,
+                       meshtasticMqtt->downlinkQueueCounters());
+            out.printf("MQTT downlink: %zu queued, %lu filtered, "
+                       "duty cycle %.0f%%\n",
+                       meshtasticMqtt->downlinkQueueDepth(),
+                       meshtasticMqtt->downlinkFiltered(),
+                       meshtasticMqtt->downlinkConfig().dutyCycle * 100.0);
+        }
+    }
+    if (meshmon->dedupCache()) {
+        const shared_ptr<DedupCache> dedup = meshmon->dedupCache();
+
+        out.printf("MQTT dedup: %lu hits, %lu misses, %lu evictions "
+                   "(%zu slots, ttl %us)\n",
+                   dedup->hits(), dedup->misses(), dedup->evictions(),
+                   dedup->slots(), dedup->ttlSec());
+    }
+    if (meshmon->nodeDb()) {
+        const shared_ptr<NodeDb> nodeDb = meshmon->nodeDb();
+
+        out.printf("Node DB: %u/%u nodes, log %zu bytes, %lu compactions, "
+                   "%lu dropped (%s)\n", nodeDb->count(),
+                   nodeDb->capacity(), nodeDb->walBytes(),
+                   nodeDb->compactions(), nodeDb->dropped(),
+                   nodeDb->path().c_str());
+    }
+    if (myownMqtt) {
+        printDrain(out, "Private MQTT", myownMqtt);
+        printQueue(out, "Private MQTT", "packet",
+                   myownMqtt->packetQueueConfig(),
+                   myownMqtt->packetQueueCounters());
+    }
+
+    return 0;
+}
+
+bool MeshMonCommands::run(shared_ptr<MeshMon> meshmon, Output &out,
+                          int argc, char **argv, int &ret)
+{
+    if (strcmp(argv[0], "stats") == 0) {
+        ret = stats(meshmon, out, argc, argv);
+    } else if (strcmp(argv[0], "routes") == 0) {
+        ret = routes(meshmon, out, argc, argv);
+    } else if (strcmp(argv[0], "telemetry") == 0) {
+        ret = telemetry(meshmon, out, argc, argv);
+    } else if (strcmp(argv[0], "topology") == 0) {
+        ret = topology(meshmon, out, argc, argv);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
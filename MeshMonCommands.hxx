@@ -0,0 +1,63 @@
+/*
+ * MeshMonCommands.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef MESHMONCOMMANDS_HXX
+#define MESHMONCOMMANDS_HXX
+
+#include <MeshMon.hxx>
+
+using namespace std;
+
+/*
+ * The meshmon-specific shell commands, written against an abstract
+ * output so that both MeshMonShell and the ShellServer sessions can run
+ * them.
+ */
+class MeshMonCommands {
+
+public:
+
+    class Output {
+
+    public:
+
+        virtual ~Output() {}
+
+        virtual void write(const char *text, size_t len) = 0;
+        void printf(const char *format, ...)
+            __attribute__((format(printf, 2, 3)));
+
+    };
+
+    // False if argv[0] is not one of ours; ret is the command's result
+    static bool run(shared_ptr<MeshMon> meshmon, Output &out,
+                    int argc, char **argv, int &ret);
+
+    static int stats(shared_ptr<MeshMon> meshmon, Output &out,
+                     int argc, char **argv);
+    static int routes(shared_ptr<MeshMon> meshmon, Output &out,
+                      int argc, char **argv);
+    static int telemetry(shared_ptr<MeshMon> meshmon, Output &out,
+                         int argc, char **argv);
+    static int topology(shared_ptr<MeshMon> meshmon, Output &out,
+                        int argc, char **argv);
+    // What meshmon adds to the "system" command
+    static int status(shared_ptr<MeshMon> meshmon, Output &out,
+                      int argc, char **argv);
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
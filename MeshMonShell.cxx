@@ -4,10 +4,35 @@
  * Copyright (C) 2025, Charles Chiou
  */
 
+#include <algorithm>
 #include <MeshMon.hxx>
-#include <MqttClient.hxx>
+#include <MeshMonCommands.hxx>
 #include <MeshMonShell.hxx>
 
+// Command output goes to the shell's own printf()
+class ShellOutput : public MeshMonCommands::Output {
+
+public:
+
+    ShellOutput(MeshMonShell *shell)
+        : _shell(shell) {
+
+    }
+
+    virtual void write(const char *text, size_t len) {
+        // In pieces; the shell formats into a bounded buffer
+        for (size_t offset = 0; offset < len; offset += 512) {
+            _shell->printf("%.*s", (int) min(len - offset, (size_t) 512),
+                           text + offset);
+        }
+    }
+
+private:
+
+    MeshMonShell *_shell;
+
+};
+
 MeshMonShell::MeshMonShell(shared_ptr<MeshClient> client)
     : MeshShell(client)
 {
@@ -24,21 +49,27 @@ shared_ptr<MeshShell> MeshMonShell::newInstance(void)
     return make_shared<MeshMonShell>();
 }
 
+int MeshMonShell::unknown_command(int argc, char **argv)
+{
+    shared_ptr<MeshMon> meshmon = dynamic_pointer_cast<MeshMon>(_client);
+    ShellOutput out(this);
+    int ret = 0;
+
+    if (MeshMonCommands::run(meshmon, out, argc, argv, ret)) {
+        return ret;
+    }
+
+    return MeshShell::unknown_command(argc, argv);
+}
+
 int MeshMonShell::system(int argc, char **argv)
 {
     shared_ptr<MeshMon> meshmon = dynamic_pointer_cast<MeshMon>(_client);
-    const shared_ptr<MqttClient> meshtasticMqtt =
-        meshmon->meshtasticMqtt();
+    ShellOutput out(this);
 
     MeshShell::system(argc, argv);
-    this->printf("CPU temp: %.1fC\n", meshmon->getCpuTempC());
-    if (meshtasticMqtt) {
-        this->printf("MQTT published: %u/%u\n",
-                     meshtasticMqtt->publishConfirmed(),
-                     meshtasticMqtt->published());
-    }
 
-    return 0;
+    return MeshMonCommands::status(meshmon, out, argc, argv);
 }
 
 /*
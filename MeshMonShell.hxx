@@ -22,6 +22,7 @@ protected:
 
     virtual shared_ptr<MeshShell> newInstance(void);
     virtual int system(int argc, char **argv);
+    virtual int unknown_command(int argc, char **argv);
 
 };
 
@@ -0,0 +1,209 @@
+/*
+ * MessageRing.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef MESSAGERING_HXX
+#define MESSAGERING_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+using namespace std;
+
+/*
+ * Fixed-capacity ring of preallocated message slots.
+ *
+ * One producer fills a slot in place (alloc() + push()) and one consumer
+ * reads it in place (front() + pop()). Slots are never copied and nothing
+ * is allocated after construction. Each slot carries a sequence number in
+ * the style of Vyukov's bounded queue, so that the producer can also take
+ * the oldest slot away from the consumer (dropOldest()) without a lock.
+ *
+ * A queued slot can be cancelled by key (cancel()); the consumer skips
+ * cancelled slots. This is how a newer message supersedes an older one
+ * without touching a slot that the consumer may be reading.
+ */
+template <typename T> class MessageRing {
+
+public:
+
+    MessageRing(size_t capacity)
+        : _capacity(capacity > 0 ? capacity : 1),
+          _cells(new Cell[_capacity]),
+          _head(0),
+          _tail(0),
+          _claimed(false),
+          _claimedPos(0)
+    {
+        for (size_t i = 0; i < _capacity; i++) {
+            _cells[i].seq.store(i, memory_order_relaxed);
+            _cells[i].cancelled.store(SIZE_MAX, memory_order_relaxed);
+            _cells[i].key = 0;
+        }
+    }
+
+    ~MessageRing() {
+        delete [] _cells;
+    }
+
+    inline size_t capacity(void) const {
+        return _capacity;
+    }
+
+    inline size_t size(void) const {
+        size_t head = _head.load();
+        size_t tail = _tail.load();
+
+        return tail - head;
+    }
+
+    inline bool empty(void) const {
+        return size() == 0;
+    }
+
+    // Producer: next free slot to fill in place, or NULL if full
+    T *alloc(void) {
+        size_t pos = _tail.load(memory_order_relaxed);
+        Cell &cell = _cells[pos % _capacity];
+
+        if (cell.seq.load(memory_order_acquire) != pos) {
+            return NULL;
+        }
+
+        return &cell.data;
+    }
+
+    // Producer: hand the slot returned by alloc() to the consumer
+    void push(uint64_t key = 0) {
+        size_t pos = _tail.load(memory_order_relaxed);
+        Cell &cell = _cells[pos % _capacity];
+
+        cell.key = key;
+        cell.cancelled.store(SIZE_MAX, memory_order_relaxed);
+        cell.seq.store(pos + 1, memory_order_release);
+        _tail.store(pos + 1, memory_order_seq_cst);
+    }
+
+    // Producer: mark the queued slot with the given key as superseded
+    bool cancel(uint64_t key) {
+        size_t tail = _tail.load(memory_order_relaxed);
+
+        for (size_t pos = _head.load(memory_order_acquire); pos < tail;
+             pos++) {
+            Cell &cell = _cells[pos % _capacity];
+            if ((cell.seq.load(memory_order_acquire) == (pos + 1)) &&
+                (cell.key == key) &&
+                (cell.cancelled.load(memory_order_relaxed) != pos)) {
+                cell.cancelled.store(pos, memory_order_release);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Producer: free the oldest queued slot; live is false if that slot
+    // had already been cancelled
+    bool dropOldest(bool &live) {
+        size_t pos;
+
+        if (!claim(pos)) {
+            return false;
+        }
+
+        Cell &cell = _cells[pos % _capacity];
+        live = cell.cancelled.load(memory_order_acquire) != pos;
+        release(pos);
+
+        return true;
+    }
+
+    // Consumer: oldest live slot, read in place until pop()
+    T *front(void) {
+        size_t pos;
+
+        if (_claimed) {
+            return &_cells[_claimedPos % _capacity].data;
+        }
+
+        while (claim(pos)) {
+            Cell &cell = _cells[pos % _capacity];
+            if (cell.cancelled.load(memory_order_acquire) == pos) {
+                release(pos);
+                continue;
+            }
+            _claimed = true;
+            _claimedPos = pos;
+            return &cell.data;
+        }
+
+        return NULL;
+    }
+
+    // Consumer: return the slot from front() to the producer
+    void pop(void) {
+        if (_claimed) {
+            release(_claimedPos);
+            _claimed = false;
+        }
+    }
+
+private:
+
+    struct Cell {
+        atomic<size_t> seq;
+        atomic<size_t> cancelled;
+        uint64_t key;
+        T data;
+    };
+
+    bool claim(size_t &pos) {
+        pos = _head.load(memory_order_relaxed);
+        for (;;) {
+            Cell &cell = _cells[pos % _capacity];
+            size_t seq = cell.seq.load(memory_order_acquire);
+            if (seq == (pos + 1)) {
+                if (_head.compare_exchange_weak(pos, pos + 1,
+                                                memory_order_acq_rel)) {
+                    return true;
+                }
+            } else if (seq < (pos + 1)) {
+                return false;
+            } else {
+                pos = _head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    inline void release(size_t pos) {
+        _cells[pos % _capacity].seq.store(pos + _capacity,
+                                          memory_order_release);
+    }
+
+private:
+
+    const size_t _capacity;
+    Cell *_cells;
+    atomic<size_t> _head;
+    atomic<size_t> _tail;
+
+    // Consumer only
+    bool _claimed;
+    size_t _claimedPos;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,431 @@
+/*
+ * MetricsServer.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <Logger.hxx>
+#include <RadioName.hxx>
+#include <MetricsServer.hxx>
+
+#define CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define EOF_MARKER "# EOF\n"
+
+MetricsServer::MetricsServer(size_t bufferBytes)
+    : _listenfd(-1),
+      _isRunning(false),
+      _bufSize(bufferBytes > 4096 ? bufferBytes : 4096),
+      _len(0),
+      _truncated(false),
+      _scrapes(0)
+{
+    _buf = new char[_bufSize];
+    _stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+MetricsServer::~MetricsServer()
+{
+    stop();
+    join();
+
+    if (_listenfd != -1) {
+        close(_listenfd);
+    }
+    if (_stopfd != -1) {
+        close(_stopfd);
+    }
+    delete [] _buf;
+}
+
+void MetricsServer::addDevice(const string &name, shared_ptr<MeshMon> mon)
+{
+    Device device;
+
+    // Label with ttyACM0 rather than /dev/ttyACM0
+    device.name = RadioName::shorten(name);
+    device.mon = mon;
+    _devices.push_back(device);
+}
+
+bool MetricsServer::bind(const string &address, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        LOGE(METRICS, "bad address '%s'", address.c_str());
+        return false;
+    }
+
+    _listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listenfd == -1) {
+        LOGE(METRICS, "socket: %s!", strerror(errno));
+        return false;
+    }
+
+    setsockopt(_listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((::bind(_listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) ||
+        (listen(_listenfd, 4) == -1)) {
+        LOGE(METRICS, "%s:%u: %s!", address.c_str(), port,
+             strerror(errno));
+        close(_listenfd);
+        _listenfd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void MetricsServer::start(void)
+{
+    if (!_isRunning && (_thread == NULL) && (_listenfd != -1)) {
+        _isRunning = true;
+        _thread = make_shared<thread>(thread_function, this);
+    }
+}
+
+void MetricsServer::stop(void)
+{
+    uint64_t one = 1;
+
+    if (_isRunning) {
+        _isRunning = false;
+        if (write(_stopfd, &one, sizeof(one)) != sizeof(one)) {
+            LOGE(METRICS, "eventfd write: %s!", strerror(errno));
+        }
+    }
+}
+
+void MetricsServer::join(void)
+{
+    if (_thread != NULL) {
+        if (_thread->joinable()) {
+            _thread->join();
+        }
+    }
+}
+
+void MetricsServer::append(const char *format, ...)
+{
+    va_list ap;
+    size_t room;
+    int n;
+
+    if (_truncated) {
+        return;
+    }
+
+    // Keep room for the terminating "# EOF"
+    room = _bufSize - _len - sizeof(EOF_MARKER);
+    va_start(ap, format);
+    n = vsnprintf(_buf + _len, room, format, ap);
+    va_end(ap);
+
+    if ((n < 0) || ((size_t) n >= room)) {
+        // Drop the partial line along with everything after it
+        _truncated = true;
+        return;
+    }
+
+    _len += n;
+}
+
+void MetricsServer::family(const char *name, const char *type,
+                           const char *help)
+{
+    append("# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+void MetricsServer::collectClients(vector<Client> &clients) const
+{
+    // A client shared by all radios in reactor mode is listed once
+    for (vector<Device>::const_iterator it = _devices.begin();
+         it != _devices.end(); it++) {
+        shared_ptr<MqttClient> mqtts[2] = {
+            it->mon->meshtasticMqtt(), it->mon->myownMqtt(),
+        };
+        const char *names[2] = { "meshtastic", "myown", };
+
+        for (unsigned int i = 0; i < 2; i++) {
+            bool seen = false;
+
+            if (mqtts[i] == NULL) {
+                continue;
+            }
+            for (vector<Client>::iterator c = clients.begin();
+                 c != clients.end(); c++) {
+                if (c->mqtt == mqtts[i]) {
+                    c->device = "shared";
+                    seen = true;
+                }
+            }
+            if (!seen) {
+                Client client;
+                client.device = it->name;
+                client.name = names[i];
+                client.mqtt = mqtts[i];
+                clients.push_back(client);
+            }
+        }
+    }
+}
+
+size_t MetricsServer::render(void)
+{
+    vector<Client> clients;
+    PacketStats::Node node;
+    float tempC;
+    time_t sampledAt;
+
+    _len = 0;
+    _truncated = false;
+    collectClients(clients);
+
+    family("meshmon_packets", "counter", "Packets received by portnum");
+    for (vector<Device>::const_iterator it = _devices.begin();
+         it != _devices.end(); it++) {
+        const PacketStats &stats = it->mon->packetStats();
+        for (unsigned int i = 0; i < PacketStats::NUM_PORTNUMS; i++) {
+            if (stats.portnum(i) != 0) {
+                append("meshmon_packets_total{device=\"%s\",portnum=\"%u\"} "
+                       "%lu\n", it->name.c_str(), i, stats.portnum(i));
+            }
+        }
+    }
+
+#define CLIENT_METRIC(metric, type, help, format, value)                \
+    family(metric, type, help);                                         \
+    for (vector<Client>::const_iterator c = clients.begin();            \
+         c != clients.end(); c++) {                                     \
+        append("%s%s{device=\"%s\",client=\"%s\"} " format "\n", metric, \
+               strcmp(type, "counter") == 0 ? "_total" : "",            \
+               c->device.c_str(), c->name, value);                      \
+    }
+
+    CLIENT_METRIC("meshmon_mqtt_connected", "gauge",
+                  "Subscribed to the broker", "%d",
+                  c->mqtt->isConnected() ? 1 : 0);
+    CLIENT_METRIC("meshmon_mqtt_reconnects", "counter",
+                  "Reconnect attempts", "%u", c->mqtt->reconnects());
+    CLIENT_METRIC("meshmon_mqtt_published", "counter",
+                  "Messages handed to the broker", "%u",
+                  c->mqtt->published());
+    CLIENT_METRIC("meshmon_mqtt_confirmed", "counter",
+                  "Messages acknowledged by the broker", "%u",
+                  c->mqtt->publishConfirmed());
+    CLIENT_METRIC("meshmon_mqtt_queue_depth", "gauge",
+                  "Messages waiting to be published", "%zu",
+                  c->mqtt->proxyQueueDepth() + c->mqtt->packetQueueDepth());
+    CLIENT_METRIC("meshmon_mqtt_queue_dropped", "counter",
+                  "Messages dropped on queue overflow", "%lu",
+                  c->mqtt->proxyQueueCounters().dropped.load() +
+                  c->mqtt->packetQueueCounters().dropped.load());
+    CLIENT_METRIC("meshmon_mqtt_queue_coalesced", "counter",
+                  "Messages superseded while queued", "%lu",
+                  c->mqtt->proxyQueueCounters().coalesced.load() +
+                  c->mqtt->packetQueueCounters().coalesced.load());
+    CLIENT_METRIC("meshmon_mqtt_inflight", "gauge",
+                  "QoS 1/2 messages waiting for an ack", "%u",
+                  c->mqtt->inflight());
+    CLIENT_METRIC("meshmon_mqtt_inflight_window", "gauge",
+                  "Messages allowed in flight", "%u",
+                  c->mqtt->inflightWindow());
+    CLIENT_METRIC("meshmon_mqtt_ack_rtt_microseconds", "gauge",
+                  "Smoothed ack round trip", "%lu", c->mqtt->ackRttUs());
+    CLIENT_METRIC("meshmon_mqtt_window_stalls", "counter",
+                  "Drain passes held back by a full window", "%lu",
+                  c->mqtt->windowStalls());
+    CLIENT_METRIC("meshmon_mqtt_batches", "counter",
+                  "Publishes carrying a batch of packets", "%lu",
+                  c->mqtt->batches());
+    CLIENT_METRIC("meshmon_mqtt_batched_packets", "counter",
+                  "Packets published in batches", "%lu",
+                  c->mqtt->batchedPackets());
+    CLIENT_METRIC("meshmon_mqtt_spool_bytes", "gauge",
+                  "Bytes waiting in the on-disk spool", "%zu",
+                  c->mqtt->spool() ? c->mqtt->spool()->bytes() : 0);
+
+#undef CLIENT_METRIC
+
+    if (_dedup) {
+        family("meshmon_dedup_hits", "counter",
+               "Packets not uplinked as already heard by another radio");
+        append("meshmon_dedup_hits_total %lu\n", _dedup->hits());
+        family("meshmon_dedup_misses", "counter", "First sightings");
+        append("meshmon_dedup_misses_total %lu\n", _dedup->misses());
+        family("meshmon_dedup_evictions", "counter",
+               "Live entries evicted from the dedup table");
+        append("meshmon_dedup_evictions_total %lu\n", _dedup->evictions());
+    }
+
+    if (_cpuTemp && _cpuTemp->sample(tempC, sampledAt)) {
+        family("meshmon_cpu_temperature_celsius", "gauge",
+               "CPU temperature");
+        append("meshmon_cpu_temperature_celsius %.1f\n", tempC);
+    }
+
+    family("meshmon_node_table_overflow", "counter",
+           "Packets from nodes that did not fit in the last-heard table");
+    for (vector<Device>::const_iterator it = _devices.begin();
+         it != _devices.end(); it++) {
+        append("meshmon_node_table_overflow_total{device=\"%s\"} %lu\n",
+               it->name.c_str(), it->mon->packetStats().nodesDropped());
+    }
+
+#define NODE_METRIC(metric, type, help, format, value)                  \
+    family(metric, type, help);                                         \
+    for (vector<Device>::const_iterator it = _devices.begin();          \
+         it != _devices.end(); it++) {                                  \
+        const PacketStats &stats = it->mon->packetStats();              \
+        for (unsigned int i = 0; i < PacketStats::NODE_SLOTS; i++) {    \
+            if (stats.node(i, node)) {                                  \
+                append("%s%s{device=\"%s\",node=\"!%08x\"} " format     \
+                       "\n", metric,                                    \
+                       strcmp(type, "counter") == 0 ? "_total" : "",    \
+                       it->name.c_str(), node.num, value);              \
+            }                                                           \
+        }                                                               \
+    }
+
+    NODE_METRIC("meshmon_node_last_heard_seconds", "gauge",
+                "When the node was last heard, as a Unix timestamp", "%ld",
+                (long) node.lastHeard);
+    NODE_METRIC("meshmon_node_rssi_dbm", "gauge",
+                "RSSI of the last packet heard from the node", "%d",
+                node.rssi);
+    NODE_METRIC("meshmon_node_snr_db", "gauge",
+                "SNR of the last packet heard from the node", "%.2f",
+                node.snr);
+    NODE_METRIC("meshmon_node_packets", "counter",
+                "Packets heard from the node", "%lu", node.packets);
+
+#undef NODE_METRIC
+
+    memcpy(_buf + _len, EOF_MARKER, sizeof(EOF_MARKER) - 1);
+    _len += sizeof(EOF_MARKER) - 1;
+
+    return _len;
+}
+
+static bool sendAll(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if ((n == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+void MetricsServer::serve(int fd)
+{
+    struct timeval tv = { 2, 0, };
+    char request[1024];
+    char header[256];
+    ssize_t n;
+    size_t len;
+
+    // Don't let a stuck client hold up the next scrape forever
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) {
+        return;
+    }
+    request[n] = '\0';
+
+    if ((strncmp(request, "GET /metrics", 12) != 0) ||
+        ((request[12] != ' ') && (request[12] != '?'))) {
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 404 Not Found\r\n"
+                 "Content-Length: 0\r\n"
+                 "Connection: close\r\n\r\n");
+        sendAll(fd, header, strlen(header));
+        return;
+    }
+
+    len = render();
+    _scrapes++;
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: " CONTENT_TYPE "\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", len);
+    if (sendAll(fd, header, strlen(header))) {
+        sendAll(fd, _buf, len);
+    }
+}
+
+void MetricsServer::thread_function(MetricsServer *server)
+{
+    server->run();
+}
+
+void MetricsServer::run(void)
+{
+    struct pollfd fds[2];
+    int fd;
+
+    fds[0].fd = _listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _stopfd;
+    fds[1].events = POLLIN;
+
+    while (_isRunning) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE(METRICS, "poll: %s!", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(_listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd == -1) {
+                continue;
+            }
+            serve(fd);
+            close(fd);
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,112 @@
+/*
+ * MetricsServer.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef METRICSSERVER_HXX
+#define METRICSSERVER_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <MeshMon.hxx>
+
+using namespace std;
+
+/*
+ * Minimal HTTP listener serving GET /metrics in OpenMetrics text format.
+ *
+ * Scrapes are served one at a time on the server's own thread. The page
+ * is rendered into a buffer allocated once up front, from atomics and
+ * lock-free tables only, so a scrape never stalls the radio receive
+ * path. Output that does not fit in the buffer is cut at a whole line.
+ */
+class MetricsServer {
+
+public:
+
+    MetricsServer(size_t bufferBytes = 256 * 1024);
+    ~MetricsServer();
+
+    void addDevice(const string &name, shared_ptr<MeshMon> mon);
+
+    inline void setCpuTemp(shared_ptr<CpuTemp> cpuTemp) {
+        _cpuTemp = cpuTemp;
+    }
+
+    inline void setDedupCache(shared_ptr<DedupCache> dedup) {
+        _dedup = dedup;
+    }
+
+    bool bind(const string &address, uint16_t port);
+    void start(void);
+    void stop(void);
+    void join(void);
+
+    // Renders the page into the internal buffer; returns its length
+    size_t render(void);
+
+    inline const char *buffer(void) const {
+        return _buf;
+    }
+
+    inline unsigned long scrapes(void) const {
+        return _scrapes;
+    }
+
+private:
+
+    struct Device {
+        string name;
+        shared_ptr<MeshMon> mon;
+    };
+
+    struct Client {
+        string device;
+        const char *name;
+        shared_ptr<MqttClient> mqtt;
+    };
+
+    void append(const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+    void family(const char *name, const char *type, const char *help);
+    void collectClients(vector<Client> &clients) const;
+    void serve(int fd);
+
+    static void thread_function(MetricsServer *server);
+    void run(void);
+
+private:
+
+    vector<Device> _devices;
+    shared_ptr<CpuTemp> _cpuTemp;
+    shared_ptr<DedupCache> _dedup;
+
+    int _listenfd;
+    int _stopfd;
+    shared_ptr<thread> _thread;
+    bool _isRunning;
+
+    char *_buf;
+    size_t _bufSize;
+    size_t _len;
+    bool _truncated;
+    atomic<unsigned long> _scrapes;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
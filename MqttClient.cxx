@@ -4,10 +4,103 @@
  * Copyright (C) 2025, Charles Chiou
  */
 
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cstring>
+#include <algorithm>
 #include <mosquitto.h>
-#include <iostream>
+#include <Logger.hxx>
+#include <ServiceEnvelope.hxx>
 #include <MqttClient.hxx>
 
+const MqttClient::QueueConfig MqttClient::defaultQueueConfig = {
+    64, MqttClient::DROP_OLDEST,
+};
+
+const MqttClient::ConnectConfig MqttClient::defaultConnectConfig = {
+    60, 1000, 300000,
+};
+
+// LongFast: about 1 kbit/s; 10% of the airtime, up to 5 seconds at once
+const MqttClient::DownlinkConfig MqttClient::defaultDownlinkConfig = {
+    vector<string>(), "", 1067, 0.1, 5000, { 16, MqttClient::DROP_OLDEST, },
+};
+
+const MqttClient::BatchConfig MqttClient::defaultBatchConfig = {
+    0, 32, 8192,
+};
+
+const MqttClient::QosConfig MqttClient::defaultQosConfig = {
+    -1, -1, 4, 64,
+};
+
+const char *MqttClient::connStateString(ConnState state)
+{
+    switch (state) {
+    case STOPPED:
+        return "stopped";
+    case CONNECTING:
+        return "connecting";
+    case CONNECTED:
+        return "connected";
+    case SUBSCRIBED:
+        return "subscribed";
+    case BACKOFF:
+        return "backoff";
+    case NUM_CONN_STATES:
+        break;
+    }
+
+    return "unknown";
+}
+
+bool MqttClient::parseOverflowPolicy(const string &s, OverflowPolicy &policy)
+{
+    if (s == "drop-oldest") {
+        policy = DROP_OLDEST;
+    } else if (s == "drop-newest") {
+        policy = DROP_NEWEST;
+    } else if (s == "coalesce") {
+        policy = COALESCE;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+const char *MqttClient::overflowPolicyString(OverflowPolicy policy)
+{
+    switch (policy) {
+    case DROP_OLDEST:
+        return "drop-oldest";
+    case DROP_NEWEST:
+        return "drop-newest";
+    case COALESCE:
+        return "coalesce";
+    }
+
+    return "unknown";
+}
+
+uint64_t MqttClient::coalesceKey(uint32_t node, unsigned int portnum)
+{
+    // Zero is reserved for 'never coalesce'
+    return (((uint64_t) node) << 32) | (((uint64_t) portnum) + 1);
+}
+
+unsigned int MqttClient::airtimeMs(size_t bytes, unsigned int bitrate)
+{
+    // Payload plus the 16-byte packet header, rounded up; preamble and
+    // coding overhead are folded into the preset's effective bitrate
+    if (bitrate == 0) {
+        return 0;
+    }
+
+    return (((bytes + 16) * 8 * 1000) + bitrate - 1) / bitrate;
+}
+
 MqttClient::MqttClient()
     : MqttClient("mqtt.meshtastic.org", 1883, "meshdev", "large4cats",
                  "mesh/TW")
@@ -24,10 +117,82 @@ MqttClient::MqttClient(const string &server, uint16_t port,
     _user = user;
     _password = password;
     _topic = topic;
+    _isRunning = false;
+    _mosq = NULL;
+    _grantedQos = 0;
+    _connectConfig = defaultConnectConfig;
+    _state = STOPPED;
+    _stateSince = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < NUM_CONN_STATES; i++) {
+        _stateTimeMs[i] = 0;
+    }
+    _backoffAttempts = 0;
+    _rng.seed(_stateSince.time_since_epoch().count() ^ (uintptr_t) this);
+    _reconnects = 0;
+    _kick = false;
+    _published = 0;
+    _publishConfirmed = 0;
+    _messaged = 0;
+    _lastBatchSize = 0;
+    _lastDrainLatencyMs = 0;
+    _maxDrainLatencyMs = 0;
+    _proxyQueueConfig = defaultQueueConfig;
+    _packetQueueConfig = defaultQueueConfig;
+    _proxyQueue.reset(
+        new MessageRing<ProxyEntry>(_proxyQueueConfig.capacity));
+    _packetQueue.reset(
+        new MessageRing<PacketEntry>(_packetQueueConfig.capacity));
+    _waiting = false;
+    _multiProducer = false;
+    _sockfd = -1;
+    _wakefd = -1;
+    _timerfd = -1;
+    _wakePending = false;
+    _replayRate = 0;
+    _replayTokens = 0.0;
+    for (unsigned int i = 0; i < ACK_SLOTS; i++) {
+        _ackSlots[i].mid = -1;
+        _ackSlots[i].acked = false;
+        _ackSlots[i].qos = 0;
+    }
+    _qosConfig = defaultQosConfig;
+    _inflight = 0;
+    _window = _qosConfig.windowMin;
+    _windowAcks = 0;
+    _srttUs = 0;
+    _minRttUs = 0;
+    _windowStalls = 0;
+    _proxyQueueCounters.enqueued = 0;
+    _proxyQueueCounters.dequeued = 0;
+    _proxyQueueCounters.dropped = 0;
+    _proxyQueueCounters.coalesced = 0;
+    _packetQueueCounters.enqueued = 0;
+    _packetQueueCounters.dequeued = 0;
+    _packetQueueCounters.dropped = 0;
+    _packetQueueCounters.coalesced = 0;
+    _downlinkConfig = defaultDownlinkConfig;
+    _downlinkQueue.reset(
+        new MessageRing<DownlinkEntry>(_downlinkConfig.queue.capacity));
+    _downlinkQueueCounters.enqueued = 0;
+    _downlinkQueueCounters.dequeued = 0;
+    _downlinkQueueCounters.dropped = 0;
+    _downlinkQueueCounters.coalesced = 0;
+    _downlinkFiltered = 0;
+    _airtimeTokens = 0.0;
+    _airtimeRefill = chrono::steady_clock::now();
+    _downlinkAt = _airtimeRefill;
+    _batchConfig = defaultBatchConfig;
+    _batchAt = chrono::steady_clock::time_point::max();
+    _replayBatches = 0;
+    _replayFailed = false;
+    _batchesPublished = 0;
+    _batchedPackets = 0;
 }
 
 MqttClient::~MqttClient()
 {
+    detach();
+
     if (_mosq) {
         mosquitto_destroy(_mosq);
         _mosq = NULL;
@@ -44,218 +209,1668 @@ unsigned int MqttClient::publishConfirmed(void) const
     return _publishConfirmed;
 }
 
-bool MqttClient::isConnected(void) const
+size_t MqttClient::proxyQueueDepth(void) const
 {
-    return (_mosq != NULL) && (_grantedQos != 0);
+    return _proxyQueue->size();
 }
 
-bool MqttClient::isRunning(void) const
+size_t MqttClient::packetQueueDepth(void) const
 {
-    return _isRunning;
+    return _packetQueue->size();
 }
 
-void MqttClient::start(void)
+unsigned int MqttClient::lastBatchSize(void) const
 {
-    if (!_isRunning) {
-        if (_thread == NULL) {
-            _isRunning = true;
-            _thread = make_shared<thread>(thread_function, this);
-        }
-    }
+    return _lastBatchSize;
 }
 
-void MqttClient::stop(void)
+unsigned int MqttClient::lastDrainLatencyMs(void) const
 {
-    if (_isRunning) {
-        _isRunning = false;
-        _cv.notify_one();
+    return _lastDrainLatencyMs;
+}
+
+unsigned int MqttClient::maxDrainLatencyMs(void) const
+{
+    return _maxDrainLatencyMs;
+}
+
+void MqttClient::setProxyQueueConfig(const QueueConfig &config)
+{
+    // The slots are preallocated; capacity is fixed once running
+    _proxyQueueConfig.policy = config.policy;
+    if (!_isRunning && (config.capacity != _proxyQueue->capacity())) {
+        _proxyQueue.reset(new MessageRing<ProxyEntry>(config.capacity));
     }
+    _proxyQueueConfig.capacity = _proxyQueue->capacity();
 }
 
-void MqttClient::join(void)
+void MqttClient::setPacketQueueConfig(const QueueConfig &config)
 {
-    if (_thread != NULL) {
-        if (_thread->joinable()) {
-            _thread->join();
-        }
+    _packetQueueConfig.policy = config.policy;
+    if (!_isRunning && (config.capacity != _packetQueue->capacity())) {
+        _packetQueue.reset(new MessageRing<PacketEntry>(config.capacity));
     }
+    _packetQueueConfig.capacity = _packetQueue->capacity();
 }
 
-void MqttClient::reset(void)
+const MqttClient::QueueConfig &MqttClient::proxyQueueConfig(void) const
+{
+    return _proxyQueueConfig;
+}
+
+const MqttClient::QueueConfig &MqttClient::packetQueueConfig(void) const
+{
+    return _packetQueueConfig;
+}
+
+const MqttClient::QueueCounters &MqttClient::proxyQueueCounters(void) const
+{
+    return _proxyQueueCounters;
+}
+
+const MqttClient::QueueCounters &MqttClient::packetQueueCounters(void) const
+{
+    return _packetQueueCounters;
+}
+
+void MqttClient::setConnectConfig(const ConnectConfig &config)
 {
-    _mutex.lock();
-    while (_proxyQueue.empty() == false) {
-        _proxyQueue.pop();
+    _connectConfig = config;
+    if (_connectConfig.backoffMinMs == 0) {
+        _connectConfig.backoffMinMs = 1;
     }
-    while (_packetQueue.empty() == false) {
-        _packetQueue.pop();
+    if (_connectConfig.backoffMaxMs < _connectConfig.backoffMinMs) {
+        _connectConfig.backoffMaxMs = _connectConfig.backoffMinMs;
     }
-    _mutex.unlock();
 }
 
-bool MqttClient::publish(const meshtastic_MqttClientProxyMessage &m)
+const MqttClient::ConnectConfig &MqttClient::connectConfig(void) const
 {
-    if (!isRunning() && _proxyQueue.size() > 64) {
-        return false;
-    }
+    return _connectConfig;
+}
 
-    if (m.which_payload_variant !=
-        meshtastic_MqttClientProxyMessage_data_tag) {
-        return false;
+MqttClient::ConnState MqttClient::connState(void) const
+{
+    return _state;
+}
+
+unsigned long MqttClient::timeInStateMs(ConnState state) const
+{
+    lock_guard<mutex> lock(_stateMutex);
+    unsigned long ms = _stateTimeMs[state];
+
+    if (_state == state) {
+        ms += chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - _stateSince).count();
     }
 
-    _mutex.lock();
-    _proxyQueue.push(m);
-    _mutex.unlock();
-    _cv.notify_one();
+    return ms;
+}
 
-    return true;
+unsigned int MqttClient::reconnects(void) const
+{
+    return _reconnects;
 }
 
-bool MqttClient::publish(const meshtastic_MeshPacket &p)
+void MqttClient::setState(ConnState state)
 {
-    if (!isRunning() && _packetQueue.size() > 64) {
-        return false;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+    {
+        lock_guard<mutex> lock(_stateMutex);
+
+        _stateTimeMs[_state] += chrono::duration_cast<chrono::milliseconds>(
+            now - _stateSince).count();
+        _stateSince = now;
+        _state = state;
+        if (state == SUBSCRIBED) {
+            _backoffAttempts = 0;
+        }
     }
 
-    _mutex.lock();
-    _packetQueue.push(p);
-    _mutex.unlock();
-    _cv.notify_one();
+    // Let run() or the reactor re-evaluate: a link that just came up
+    // has a queue to drain
+    if (_wakefd != -1) {
+        wake();
+    } else {
+        lock_guard<mutex> lock(_mutex);
+        _kick = true;
+        _cv.notify_one();
+    }
+}
 
-    return true;
+void MqttClient::scheduleBackoff(void)
+{
+    unsigned long delayMs;
+
+    {
+        lock_guard<mutex> lock(_stateMutex);
+
+        // Exponential with "equal jitter": half the delay is fixed and
+        // half is random, so radios that lost the broker together do not
+        // come back in lockstep
+        delayMs = _connectConfig.backoffMinMs;
+        for (unsigned int i = 0; (i < _backoffAttempts) &&
+                 (delayMs < _connectConfig.backoffMaxMs); i++) {
+            delayMs *= 2;
+        }
+        if (delayMs > _connectConfig.backoffMaxMs) {
+            delayMs = _connectConfig.backoffMaxMs;
+        }
+        delayMs = (delayMs / 2) +
+            uniform_int_distribution<unsigned long>(0, delayMs / 2)(_rng);
+        _backoffAttempts++;
+        _retryAt = chrono::steady_clock::now() +
+            chrono::milliseconds(delayMs);
+    }
+
+    setState(BACKOFF);
 }
 
-void MqttClient::onConnect(struct mosquitto *mosq, void *obj, int rc)
+bool MqttClient::backoffExpired(void) const
 {
-    MqttClient *mqtt = (MqttClient *) obj;
+    lock_guard<mutex> lock(_stateMutex);
 
-    if (rc != MOSQ_ERR_SUCCESS) {
-        cerr << "mosquitto: " << mosquitto_connack_string(rc) << endl;
-        mosquitto_disconnect(mosq);
+    return (_state == BACKOFF) && (chrono::steady_clock::now() >= _retryAt);
+}
+
+bool MqttClient::linkUp(void) const
+{
+    ConnState state = _state;
+
+    return (state == CONNECTED) || (state == SUBSCRIBED);
+}
+
+void MqttClient::setDownlinkConfig(const DownlinkConfig &config)
+{
+    if (_isRunning) {
         return;
     }
 
-    rc = mosquitto_subscribe(mosq, NULL, mqtt->_topic.c_str(), 1);
-    if (rc != MOSQ_ERR_SUCCESS) {
-        cerr << "mosquitto: " << mosquitto_connack_string(rc) << endl;
-        mosquitto_disconnect(mosq);
-        return;
+    _downlinkConfig = config;
+    if (config.queue.capacity != _downlinkQueue->capacity()) {
+        _downlinkQueue.reset(
+            new MessageRing<DownlinkEntry>(config.queue.capacity));
     }
+    _downlinkConfig.queue.capacity = _downlinkQueue->capacity();
+    // Start out with a full bucket
+    _airtimeTokens = _downlinkConfig.burstMs;
+    _airtimeRefill = chrono::steady_clock::now();
 }
 
-void MqttClient::onDisconnect(struct mosquitto *mosq, void *obj, int rc)
+void MqttClient::setDownlink(Downlink downlink, shared_ptr<DedupCache> dedup)
 {
-    MqttClient *mqtt = (MqttClient *) obj;
+    if (!_isRunning) {
+        _downlink = downlink;
+        _downlinkDedup = dedup;
+    }
+}
 
-    (void)(mosq);
-    (void)(obj);
-    (void)(rc);
+void MqttClient::ignoreGateway(uint32_t node)
+{
+    lock_guard<mutex> lock(_gatewayMutex);
+    char id[16];
 
-    mqtt->_grantedQos = 0;
+    snprintf(id, sizeof(id), "!%08x", node);
+    if (find(_ignoreGateways.begin(), _ignoreGateways.end(), id) ==
+        _ignoreGateways.end()) {
+        _ignoreGateways.push_back(id);
+    }
 }
 
-void MqttClient::onPublish(struct mosquitto *mosq, void *obj, int mid)
+const MqttClient::DownlinkConfig &MqttClient::downlinkConfig(void) const
 {
-    MqttClient *mqtt = (MqttClient *) obj;
+    return _downlinkConfig;
+}
 
-    (void)(mosq);
-    (void)(obj);
-    (void)(mid);
+const MqttClient::QueueCounters &MqttClient::downlinkQueueCounters(void) const
+{
+    return _downlinkQueueCounters;
+}
 
-    mqtt->_publishConfirmed++;
+size_t MqttClient::downlinkQueueDepth(void) const
+{
+    return _downlinkQueue->size();
 }
 
-void MqttClient::onSubscribe(struct mosquitto *mosq, void *obj,
-                             int mid, int qos_count, const int *granted_qos)
+unsigned long MqttClient::downlinkFiltered(void) const
 {
-    MqttClient *mqtt = (MqttClient *) obj;
+    return _downlinkFiltered;
+}
 
-    (void)(mosq);
-    (void)(obj);
-    (void)(mid);
+bool MqttClient::downlinkEnabled(void) const
+{
+    return _downlink && !_downlinkConfig.channels.empty() &&
+        (_downlinkConfig.dutyCycle > 0.0);
+}
 
-    if (qos_count == 1) {
-        mqtt->_grantedQos = granted_qos[0];
+void MqttClient::setBatchConfig(const BatchConfig &config)
+{
+    if (_isRunning) {
+        return;
+    }
+
+    _batchConfig = config;
+    if (_batchConfig.maxMessages == 0) {
+        _batchConfig.maxMessages = 1;
+    }
+    // Room for at least one frame of the largest packet
+    if (_batchConfig.maxBytes < meshtastic_MeshPacket_size + 2) {
+        _batchConfig.maxBytes = meshtastic_MeshPacket_size + 2;
     }
 }
 
-void MqttClient::thread_function(MqttClient *mqtt)
+const MqttClient::BatchConfig &MqttClient::batchConfig(void) const
 {
-    mqtt->run();
+    return _batchConfig;
 }
 
-void MqttClient::run(void)
+unsigned long MqttClient::batches(void) const
 {
-    int ret;
+    return _batchesPublished;
+}
 
-    if (_mosq == NULL) {
-        _mosq = mosquitto_new("MqttClient", true, this);
-        if (_mosq == NULL) {
-            cerr << "mosquitto_new() failed!" << endl;
-            goto done;
-        }
+unsigned long MqttClient::batchedPackets(void) const
+{
+    return _batchedPackets;
+}
+
+void MqttClient::setQosConfig(const QosConfig &config)
+{
+    if (_isRunning) {
+        return;
     }
 
-    mosquitto_username_pw_set(_mosq, _user.c_str(), _password.c_str());
-    mosquitto_connect_callback_set(_mosq, onConnect);
-    mosquitto_disconnect_callback_set(_mosq, onDisconnect);
-    mosquitto_publish_callback_set(_mosq, onPublish);
-    mosquitto_subscribe_callback_set(_mosq, onSubscribe);
+    _qosConfig = config;
+    _qosConfig.proxyQos = max(-1, min(2, _qosConfig.proxyQos));
+    _qosConfig.packetQos = max(-1, min(2, _qosConfig.packetQos));
+    // Every message in flight needs an ack slot
+    _qosConfig.windowMax = max(1U, min((unsigned int) ACK_SLOTS,
+                                       _qosConfig.windowMax));
+    _qosConfig.windowMin = max(1U, min(_qosConfig.windowMax,
+                                       _qosConfig.windowMin));
+    _window = _qosConfig.windowMin;
+}
 
-    ret = mosquitto_loop_start(_mosq);
-    if (ret != MOSQ_ERR_SUCCESS) {
-        cerr << "mosquitto_loop_start: " << mosquitto_strerror(ret) << endl;
-        goto done;
+const MqttClient::QosConfig &MqttClient::qosConfig(void) const
+{
+    return _qosConfig;
+}
+
+unsigned int MqttClient::inflight(void) const
+{
+    return _inflight;
+}
+
+unsigned int MqttClient::inflightWindow(void) const
+{
+    return _window;
+}
+
+unsigned long MqttClient::ackRttUs(void) const
+{
+    return _srttUs;
+}
+
+unsigned long MqttClient::windowStalls(void) const
+{
+    return _windowStalls;
+}
+
+int MqttClient::qosFor(int configured) const
+{
+    return configured >= 0 ? configured : (int) _grantedQos;
+}
+
+bool MqttClient::windowOpen(int qos) const
+{
+    // Nothing comes back for QoS 0 to wait for
+    return (qos == 0) || (_inflight < _window);
+}
+
+bool MqttClient::openSpool(const SpoolConfig &config)
+{
+    shared_ptr<MqttSpool> spool;
+
+    if (_isRunning) {
+        return false;
     }
 
-    ret = mosquitto_connect(_mosq, _server.c_str(), _port, 60);
-    if (ret != MOSQ_ERR_SUCCESS) {
-        cerr << "mosquitto_connect: " << mosquitto_strerror(ret) << endl;
-        goto done;
+    if (config.dir.empty()) {
+        _spool = NULL;
+        return true;
     }
 
-    while (_isRunning) {
-        if (!_proxyQueue.empty()) {
-            _mutex.lock();
-            meshtastic_MqttClientProxyMessage m = _proxyQueue.front();
-            _proxyQueue.pop();
-            _mutex.unlock();
-
-            ret = mosquitto_publish(_mosq,
-                                    NULL,
-                                    m.topic,
-                                    m.payload_variant.data.size,
-                                    m.payload_variant.data.bytes,
-                                    _grantedQos,
-                                    m.retained);
-            if (ret != MOSQ_ERR_SUCCESS){
-                fprintf(stderr, "mosquitto_publish failed: %s\n",
-                        mosquitto_strerror(ret));
-            } else {
-                _published++;
-            }
-        }
+    spool = make_shared<MqttSpool>();
+    if (!spool->open(config.dir, config.maxBytes, config.segmentBytes)) {
+        return false;
+    }
+
+    _spool = spool;
+    _replayRate = config.replayRate;
+    _replayTokens = _replayRate;
+    _replayRefill = chrono::steady_clock::now();
+
+    return true;
+}
+
+const shared_ptr<MqttSpool> MqttClient::spool(void) const
+{
+    return _spool;
+}
 
-        if (!_packetQueue.empty()) {
-            _mutex.lock();
-            meshtastic_MeshPacket p = _packetQueue.front();
-            _packetQueue.pop();
-            _mutex.unlock();
+bool MqttClient::isConnected(void) const
+{
+    return _state == SUBSCRIBED;
+}
+
+bool MqttClient::isRunning(void) const
+{
+    return _isRunning;
+}
 
-            (void)(p);
+void MqttClient::start(void)
+{
+    if (!_isRunning) {
+        if (_thread == NULL) {
+            _isRunning = true;
+            _thread = make_shared<thread>(thread_function, this);
         }
+    }
+}
 
-        unique_lock<mutex> lock(_mutex);
-        _cv.wait_for(lock, std::chrono::seconds(1));
+void MqttClient::stop(void)
+{
+    if (_reactor) {
+        detach();
+        return;
     }
 
-done:
+    if (_isRunning) {
+        // Flip the flag under the lock so that run() cannot miss the
+        // wake-up between testing its predicate and going to sleep
+        _mutex.lock();
+        _isRunning = false;
+        _mutex.unlock();
+        _cv.notify_one();
+    }
+}
 
-    mosquitto_disconnect(_mosq);
-    _isRunning = false;
+void MqttClient::join(void)
+{
+    if (_thread != NULL) {
+        if (_thread->joinable()) {
+            _thread->join();
+        }
+    }
+}
 
-    return;
+void MqttClient::setSink(Sink sink)
+{
+    if (!_isRunning) {
+        _sink = sink;
+    }
+}
+
+void MqttClient::setMultiProducer(bool multiProducer)
+{
+    _multiProducer = multiProducer;
+}
+
+void MqttClient::reset(void)
+{
+    // Called from the producer side, like publish()
+    unique_lock<mutex> lock(_producerMutex, defer_lock);
+    bool live;
+
+    if (_multiProducer) {
+        lock.lock();
+    }
+
+    while (_proxyQueue->dropOldest(live)) {
+        if (live) {
+            _proxyQueueCounters.dropped++;
+        }
+    }
+
+    while (_packetQueue->dropOldest(live)) {
+        if (live) {
+            _packetQueueCounters.dropped++;
+        }
+    }
+}
+
+template <typename E> E *MqttClient::reserve(MessageRing<E> &ring,
+                                             const QueueConfig &config,
+                                             QueueCounters &counters,
+                                             uint64_t key)
+{
+    E *e;
+    bool live;
+
+    if ((config.policy == COALESCE) && (key != 0) && ring.cancel(key)) {
+        counters.coalesced++;
+    }
+
+    e = ring.alloc();
+    if ((e == NULL) && (config.policy != DROP_NEWEST) &&
+        ring.dropOldest(live)) {
+        if (live) {
+            counters.dropped++;
+        }
+        // Still NULL if run() is holding the slot at the tail
+        e = ring.alloc();
+    }
+
+    if (e == NULL) {
+        counters.dropped++;
+    }
+
+    return e;
+}
+
+void MqttClient::wake(void)
+{
+    uint64_t one = 1;
+
+    if (_wakefd != -1) {
+        // One eventfd write per burst; onWakeEvent() re-arms it
+        if (!_wakePending.exchange(true)) {
+            if (write(_wakefd, &one, sizeof(one)) != sizeof(one)) {
+                _wakePending = false;
+            }
+        }
+        return;
+    }
+
+    // Only take the lock if run() is (about to be) asleep; the ring's
+    // tail store and this load are both sequentially consistent, so
+    // either run() sees the new message or we see _waiting
+    if (_waiting) {
+        lock_guard<mutex> lock(_mutex);
+        _cv.notify_one();
+    }
+}
+
+bool MqttClient::publish(const meshtastic_MqttClientProxyMessage &m,
+                         uint64_t key)
+{
+    unique_lock<mutex> lock(_producerMutex, defer_lock);
+    ProxyEntry *e;
+
+    if (m.which_payload_variant !=
+        meshtastic_MqttClientProxyMessage_data_tag) {
+        return false;
+    }
+
+    if (!_isRunning && _spool) {
+        // Nobody to drain the queue; keep it for the next run
+        return _spool->append(m);
+    }
+
+    if (_multiProducer) {
+        lock.lock();
+    }
+
+    e = reserve(*_proxyQueue, _proxyQueueConfig, _proxyQueueCounters, key);
+    if (e == NULL) {
+        return false;
+    }
+
+    e->enqueued = chrono::steady_clock::now();
+    e->m = m;
+    _proxyQueue->push(key);
+    _proxyQueueCounters.enqueued++;
+    wake();
+
+    return true;
+}
+
+bool MqttClient::publish(const meshtastic_MeshPacket &p)
+{
+    unique_lock<mutex> lock(_producerMutex, defer_lock);
+    PacketEntry *e;
+    uint64_t key = 0;
+
+    if (p.which_payload_variant == meshtastic_MeshPacket_decoded_tag) {
+        key = coalesceKey(p.from, p.decoded.portnum);
+    }
+
+    if (!_isRunning && _spool) {
+        return _spool->append(p);
+    }
+
+    if (_multiProducer) {
+        lock.lock();
+    }
+
+    e = reserve(*_packetQueue, _packetQueueConfig, _packetQueueCounters, key);
+    if (e == NULL) {
+        return false;
+    }
+
+    e->enqueued = chrono::steady_clock::now();
+    e->p = p;
+    _packetQueue->push(key);
+    _packetQueueCounters.enqueued++;
+    wake();
+
+    return true;
+}
+
+void MqttClient::onConnect(struct mosquitto *mosq, void *obj, int rc)
+{
+    MqttClient *mqtt = (MqttClient *) obj;
+
+    if (rc != MOSQ_ERR_SUCCESS) {
+        // onDisconnect() takes it from here
+        LOGW(MQTT, "mosquitto: %s", mosquitto_connack_string(rc));
+        mosquitto_disconnect(mosq);
+        return;
+    }
+
+    mqtt->setState(CONNECTED);
+    // libmosquitto sends again what was in flight, under the same mids
+    mqtt->reseedInflight();
+
+    if (!mqtt->downlinkEnabled()) {
+        rc = mosquitto_subscribe(mosq, NULL, mqtt->_topic.c_str(), 1);
+    } else if (!mqtt->_downlinkConfig.topic.empty()) {
+        rc = mosquitto_subscribe(mosq, NULL,
+                                 mqtt->_downlinkConfig.topic.c_str(), 1);
+    } else {
+        // Where the radios publish encrypted packets, all channels
+        rc = mosquitto_subscribe(mosq, NULL,
+                                 (mqtt->_topic + "/2/e/#").c_str(), 1);
+    }
+    if (rc != MOSQ_ERR_SUCCESS) {
+        LOGW(MQTT, "mosquitto: %s", mosquitto_strerror(rc));
+        mosquitto_disconnect(mosq);
+        return;
+    }
+}
+
+void MqttClient::onDisconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+    MqttClient *mqtt = (MqttClient *) obj;
+
+    mqtt->_grantedQos = 0;
+
+    if (rc != 0) {
+        LOGW(MQTT, "mosquitto: %s", mosquitto_strerror(rc));
+    }
+
+    if (!mqtt->_isRunning) {
+        return;
+    }
+
+    // We do our own reconnects; keep the mosquitto loop thread from
+    // retrying behind our back
+    mosquitto_disconnect(mosq);
+    mqtt->scheduleBackoff();
+}
+
+void MqttClient::onPublish(struct mosquitto *mosq, void *obj, int mid)
+{
+    MqttClient *mqtt = (MqttClient *) obj;
+
+    (void)(mosq);
+
+    if (mqtt->trackAck(mid, true, 0, chrono::steady_clock::now())) {
+        mqtt->wake();
+    }
+    mqtt->_publishConfirmed++;
+}
+
+void MqttClient::onSubscribe(struct mosquitto *mosq, void *obj,
+                             int mid, int qos_count, const int *granted_qos)
+{
+    MqttClient *mqtt = (MqttClient *) obj;
+
+    (void)(mosq);
+    (void)(obj);
+    (void)(mid);
+
+    if (qos_count == 1) {
+        mqtt->_grantedQos = granted_qos[0];
+    }
+
+    mqtt->setState(SUBSCRIBED);
+}
+
+void MqttClient::onMessage(struct mosquitto *mosq, void *obj,
+                           const struct mosquitto_message *message)
+{
+    MqttClient *mqtt = (MqttClient *) obj;
+
+    (void)(mosq);
+
+    mqtt->gotMessage(message->topic, message->payload, message->payloadlen,
+                     message->retain);
+}
+
+void MqttClient::gotMessage(const char *topic, const void *payload,
+                            int payloadlen, bool retain)
+{
+    meshtastic_MqttClientProxyMessage *m;
+    ServiceEnvelope envelope;
+    const meshtastic_MeshPacket &packet = envelope.packet();
+    DownlinkEntry *e;
+    bool pass;
+
+    if (!downlinkEnabled()) {
+        return;
+    }
+
+    if ((payloadlen <= 0) ||
+        ((size_t) payloadlen > sizeof(e->m.payload_variant.data.bytes)) ||
+        (strlen(topic) >= sizeof(e->m.topic)) ||
+        !envelope.decode((const uint8_t *) payload, payloadlen)) {
+        goto filtered;
+    }
+
+    pass = find(_downlinkConfig.channels.begin(),
+                _downlinkConfig.channels.end(), envelope.channelId()) !=
+        _downlinkConfig.channels.end();
+    if (pass) {
+        lock_guard<mutex> lock(_gatewayMutex);
+
+        pass = find(_ignoreGateways.begin(), _ignoreGateways.end(),
+                    envelope.gatewayId()) == _ignoreGateways.end();
+    }
+    if (!pass) {
+        goto filtered;
+    }
+
+    if ((_downlinkDedup != NULL) && (packet.id != 0) &&
+        _downlinkDedup->check(packet.from, packet.id)) {
+        // Heard on the mesh already, by one of our radios or another
+        // gateway's copy came first
+        goto filtered;
+    }
+
+    // Only the mosquitto callback produces, so no _producerMutex
+    e = reserve(*_downlinkQueue, _downlinkConfig.queue,
+                _downlinkQueueCounters, 0);
+    if (e == NULL) {
+        return;
+    }
+
+    e->enqueued = chrono::steady_clock::now();
+    m = &e->m;
+    memset(m, 0x0, sizeof(*m));
+    strcpy(m->topic, topic);
+    m->which_payload_variant = meshtastic_MqttClientProxyMessage_data_tag;
+    m->payload_variant.data.size = payloadlen;
+    memcpy(m->payload_variant.data.bytes, payload, payloadlen);
+    m->retained = retain;
+    _downlinkQueue->push();
+    _downlinkQueueCounters.enqueued++;
+    wake();
+
+    return;
+
+filtered:
+
+    _downlinkFiltered++;
+}
+
+void MqttClient::downlink(void)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double burstMs = _downlinkConfig.burstMs;
+    DownlinkEntry *e;
+
+    if (!downlinkEnabled()) {
+        return;
+    }
+
+    _airtimeTokens += _downlinkConfig.dutyCycle *
+        chrono::duration<double, milli>(now - _airtimeRefill).count();
+    if (_airtimeTokens > burstMs) {
+        _airtimeTokens = burstMs;
+    }
+    _airtimeRefill = now;
+
+    while ((e = _downlinkQueue->front()) != NULL) {
+        double costMs = airtimeMs(e->m.payload_variant.data.size,
+                                  _downlinkConfig.bitrate);
+
+        // A packet longer than the burst goes out on a full bucket
+        if (_airtimeTokens < min(costMs, burstMs)) {
+            _downlinkAt = now + chrono::milliseconds(
+                (long) ((min(costMs, burstMs) - _airtimeTokens) /
+                        _downlinkConfig.dutyCycle) + 1);
+            break;
+        }
+
+        if (_downlink(e->m)) {
+            _airtimeTokens -= costMs;
+        } else {
+            // The radio is gone; don't hold the queue for it
+            _downlinkQueueCounters.dropped++;
+        }
+        _downlinkQueue->pop();
+        _downlinkQueueCounters.dequeued++;
+    }
+}
+
+void MqttClient::thread_function(MqttClient *mqtt)
+{
+    mqtt->run();
+}
+
+bool MqttClient::spoolable(int ret) const
+{
+    // Worth retrying later, as opposed to a message the broker rejects
+    return _spool && ((ret == MOSQ_ERR_NO_CONN) ||
+                      (ret == MOSQ_ERR_CONN_LOST));
+}
+
+bool MqttClient::trackAck(int mid, bool acked, int qos,
+                          chrono::steady_clock::time_point when)
+{
+    lock_guard<mutex> lock(_ackMutex);
+    AckSlot &slot = _ackSlots[mid % ACK_SLOTS];
+    chrono::steady_clock::time_point sent;
+    chrono::steady_clock::time_point ack;
+    bool full;
+
+    if ((slot.mid == mid) && (slot.acked != acked)) {
+        sent = acked ? slot.when : when;
+        ack = acked ? when : slot.when;
+        _ackLatency.record(sent, ack);
+        slot.mid = -1;
+
+        if (acked) {
+            // Only the publish side knows
+            qos = slot.qos;
+        }
+        if (qos == 0) {
+            return false;
+        }
+
+        full = _inflight >= _window;
+        if (acked) {
+            // Counted in flight by the publish side
+            _inflight--;
+        }
+        adaptWindow(chrono::duration_cast<chrono::microseconds>(
+                        ack - sent).count());
+
+        return full && (_inflight < _window);
+    }
+
+    if ((slot.mid != -1) && !slot.acked && (slot.qos > 0)) {
+        // Its ack never came; stop counting it
+        _inflight--;
+    }
+
+    // First of the pair, or a stale slot from an ack that never came
+    slot.mid = mid;
+    slot.acked = acked;
+    slot.qos = qos;
+    slot.when = when;
+    if (!acked && (qos > 0)) {
+        _inflight++;
+    }
+
+    return false;
+}
+
+void MqttClient::adaptWindow(unsigned long rttUs)
+{
+    // Called with _ackMutex held. The fastest round trip seen is the
+    // broker's unloaded latency; well beyond it and our messages are
+    // queueing up at the broker. Adjusted at most once per window's
+    // worth of acks, so that each change gets to show its effect.
+    if ((_minRttUs == 0) || (rttUs < _minRttUs)) {
+        _minRttUs = rttUs;
+    }
+    _srttUs = (_srttUs == 0) ? rttUs : (7 * _srttUs + rttUs) / 8;
+
+    if (++_windowAcks < _window) {
+        return;
+    }
+    _windowAcks = 0;
+
+    if (_srttUs > 2 * _minRttUs + RTT_SLACK_US) {
+        _window = max(_qosConfig.windowMin, _window * 3 / 4);
+    } else if (_window < _qosConfig.windowMax) {
+        _window++;
+    }
+}
+
+void MqttClient::reseedInflight(void)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    lock_guard<mutex> lock(_ackMutex);
+    unsigned int inflight = 0;
+
+    // The unacked slots are what gets resent; their round trips start
+    // over on the new connection
+    for (unsigned int i = 0; i < ACK_SLOTS; i++) {
+        if ((_ackSlots[i].mid != -1) && !_ackSlots[i].acked &&
+            (_ackSlots[i].qos > 0)) {
+            _ackSlots[i].when = now;
+            inflight++;
+        }
+    }
+    _inflight = inflight;
+    _window = _qosConfig.windowMin;
+    _windowAcks = 0;
+    _srttUs = 0;
+    _minRttUs = 0;
+}
+
+void MqttClient::expireInflight(void)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    lock_guard<mutex> lock(_ackMutex);
+    chrono::microseconds timeout(max((unsigned long) ACK_TIMEOUT_US,
+                                     8 * _srttUs.load()));
+    unsigned int expired = 0;
+
+    if (_inflight == 0) {
+        return;
+    }
+
+    // mosquitto keeps retrying them; they just stop holding up the rest
+    for (unsigned int i = 0; i < ACK_SLOTS; i++) {
+        AckSlot &slot = _ackSlots[i];
+
+        if ((slot.mid != -1) && !slot.acked && (slot.qos > 0) &&
+            (now - slot.when > timeout)) {
+            slot.mid = -1;
+            _inflight--;
+            expired++;
+        }
+    }
+
+    if (expired > 0) {
+        LOGW(MQTT, "%u messages not acked in %lums", expired,
+             (unsigned long) (timeout.count() / 1000));
+        _window = max(_qosConfig.windowMin, _window / 2);
+        _windowAcks = 0;
+    }
+}
+
+int MqttClient::publishTimed(const char *topic, int payloadlen,
+                             const void *payload, int qos, bool retain)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int mid = 0;
+    int ret;
+
+    if (_sink) {
+        ret = _sink(topic, payloadlen, payload, retain);
+        _publishLatency.record(start, chrono::steady_clock::now());
+        return ret;
+    }
+
+    ret = mosquitto_publish(_mosq, &mid, topic, payloadlen, payload,
+                            qos, retain);
+    _publishLatency.record(start, chrono::steady_clock::now());
+    if (ret == MOSQ_ERR_SUCCESS) {
+        trackAck(mid, false, qos, start);
+    }
+
+    return ret;
+}
+
+int MqttClient::publishProxy(const meshtastic_MqttClientProxyMessage &m)
+{
+    int ret;
+
+    ret = publishTimed(m.topic, m.payload_variant.data.size,
+                       m.payload_variant.data.bytes,
+                       qosFor(_qosConfig.proxyQos), m.retained);
+    if ((ret != MOSQ_ERR_SUCCESS) && !spoolable(ret)) {
+        LOGW(MQTT, "mosquitto_publish failed: %s", mosquitto_strerror(ret));
+    }
+
+    return ret;
+}
+
+size_t MqttClient::encodePacket(const meshtastic_MeshPacket &p)
+{
+    pb_ostream_t stream;
+
+    stream = pb_ostream_from_buffer(_encodeBuf, sizeof(_encodeBuf));
+    if (!pb_encode(&stream, meshtastic_MeshPacket_fields, &p)) {
+        LOGE(MQTT, "pb_encode failed: %s", PB_GET_ERROR(&stream));
+        return 0;
+    }
+
+    return stream.bytes_written;
+}
+
+int MqttClient::publishPacket(const meshtastic_MeshPacket &p)
+{
+    unsigned int portnum = 0;
+    size_t len;
+    int ret;
+
+    if (p.which_payload_variant == meshtastic_MeshPacket_decoded_tag) {
+        portnum = p.decoded.portnum;
+    }
+
+    // <topic>/!<node>/<portnum>, e.g. meshmon/!a1b2c3d4/67
+    snprintf(_encodeTopic, sizeof(_encodeTopic), "%s/!%08x/%u",
+             _topic.c_str(), p.from, portnum);
+
+    len = encodePacket(p);
+    if (len == 0) {
+        return MOSQ_ERR_INVAL;
+    }
+
+    ret = publishTimed(_encodeTopic, len, _encodeBuf,
+                       qosFor(_qosConfig.packetQos), false);
+    if ((ret != MOSQ_ERR_SUCCESS) && !spoolable(ret)) {
+        LOGW(MQTT, "mosquitto_publish failed: %s", mosquitto_strerror(ret));
+    }
+
+    return ret;
+}
+
+bool MqttClient::batching(void) const
+{
+    return _batchConfig.windowMs > 0;
+}
+
+bool MqttClient::batchDue(void) const
+{
+    return !_batches.empty() && (_spool || linkUp()) &&
+        (chrono::steady_clock::now() >= _batchAt) &&
+        (!linkUp() || windowOpen(qosFor(_qosConfig.packetQos)));
+}
+
+bool MqttClient::batchPacket(const meshtastic_MeshPacket &p, bool replayed)
+{
+    unordered_map<uint64_t, Batch>::iterator it;
+    unsigned int portnum = 0;
+    bool ret = true;
+    uint64_t key;
+    size_t len;
+
+    if (p.which_payload_variant == meshtastic_MeshPacket_decoded_tag) {
+        portnum = p.decoded.portnum;
+    }
+    key = coalesceKey(p.from, portnum);
+    if (replayed) {
+        // Kept apart from live packets; see replayBatchDone()
+        key |= 1ULL << 31;
+    }
+
+    len = encodePacket(p);
+    if (len == 0) {
+        return true;
+    }
+
+    it = _batches.find(key);
+    if ((it != _batches.end()) &&
+        (it->second.payload.size() + 2 + len > _batchConfig.maxBytes)) {
+        ret = flushBatch(it->second);
+        _batches.erase(it);
+        it = _batches.end();
+    }
+
+    if (it == _batches.end()) {
+        Batch batch;
+
+        // <topic>/batch/!<node>/<portnum>, e.g. meshmon/batch/!a1b2c3d4/67
+        snprintf(_encodeTopic, sizeof(_encodeTopic), "%s/batch/!%08x/%u",
+                 _topic.c_str(), p.from, portnum);
+        batch.topic = _encodeTopic;
+        batch.count = 0;
+        batch.replayed = replayed;
+        if (replayed) {
+            _replayBatches++;
+        }
+        batch.due = chrono::steady_clock::now() +
+            chrono::milliseconds(_batchConfig.windowMs);
+        if (batch.due < _batchAt) {
+            _batchAt = batch.due;
+        }
+        it = _batches.insert(make_pair(key, batch)).first;
+    }
+
+    it->second.payload += (char) (len >> 8);
+    it->second.payload += (char) (len & 0xff);
+    it->second.payload.append((const char *) _encodeBuf, len);
+    it->second.count++;
+
+    if (it->second.count >= _batchConfig.maxMessages) {
+        ret = flushBatch(it->second) && ret;
+        _batches.erase(it);
+    }
+
+    return ret;
+}
+
+void MqttClient::flushBatches(bool all)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    unordered_map<uint64_t, Batch>::iterator it;
+
+    _batchAt = chrono::steady_clock::time_point::max();
+    for (it = _batches.begin(); it != _batches.end(); ) {
+        if (!all && linkUp() &&
+            !windowOpen(qosFor(_qosConfig.packetQos))) {
+            // Stays open until an ack makes room
+            if (it->second.due < _batchAt) {
+                _batchAt = it->second.due;
+            }
+            it++;
+        } else if (all || (now >= it->second.due)) {
+            flushBatch(it->second);
+            it = _batches.erase(it);
+        } else {
+            if (it->second.due < _batchAt) {
+                _batchAt = it->second.due;
+            }
+            it++;
+        }
+    }
+}
+
+bool MqttClient::flushBatch(const Batch &batch)
+{
+    bool sent = false;          // or rejected for good
+    int ret;
+
+    if (linkUp() && windowOpen(qosFor(_qosConfig.packetQos)) &&
+        !(batch.replayed && _replayFailed)) {
+        ret = publishTimed(batch.topic.c_str(), batch.payload.size(),
+                           batch.payload.data(),
+                           qosFor(_qosConfig.packetQos), false);
+        if (ret == MOSQ_ERR_SUCCESS) {
+            _published++;
+            _batchesPublished++;
+            _batchedPackets += batch.count;
+            sent = true;
+        } else if (!spoolable(ret)) {
+            LOGW(MQTT, "mosquitto_publish failed: %s",
+                 mosquitto_strerror(ret));
+            sent = true;
+        }
+    }
+
+    if (batch.replayed) {
+        replayBatchDone(sent);
+    } else if (sent) {
+        // Done with
+    } else if (_spool) {
+        spoolBatch(batch);
+    } else {
+        _packetQueueCounters.dropped += batch.count;
+    }
+
+    return sent;
+}
+
+void MqttClient::replayBatchDone(bool sent)
+{
+    // Replayed packets stay in the spool, read ahead, until every batch
+    // holding them is out: only then are they popped, all together. If
+    // any of those batches fails they are all read again later, so a
+    // crash or an outage can repeat packets but never lose them.
+    if (!sent) {
+        _replayFailed = true;
+    }
+    if (--_replayBatches > 0) {
+        return;
+    }
+
+    if (_replayFailed) {
+        _spool->rewind();
+    } else {
+        _spool->popAhead();
+    }
+    _replayFailed = false;
+}
+
+void MqttClient::spoolBatch(const Batch &batch)
+{
+    const uint8_t *frame = (const uint8_t *) batch.payload.data();
+    const uint8_t *end = frame + batch.payload.size();
+    pb_istream_t stream;
+    size_t len;
+
+    // The spool keeps packets, not batches; they are batched again when
+    // replayed
+    while (frame + 2 <= end) {
+        len = (frame[0] << 8) | frame[1];
+        frame += 2;
+        if (frame + len > end) {
+            break;
+        }
+        stream = pb_istream_from_buffer(frame, len);
+        if (pb_decode(&stream, meshtastic_MeshPacket_fields, &_unbatched)) {
+            _spool->append(_unbatched);
+        }
+        frame += len;
+    }
+}
+
+void MqttClient::drain(void)
+{
+    chrono::steady_clock::time_point oldest =
+        chrono::steady_clock::time_point::max();
+    unsigned int batch = 0;
+    unsigned int latencyMs;
+    ProxyEntry *pe;
+    PacketEntry *ke;
+    int ret;
+    // While the broker is away everything goes to the spool. Once it is
+    // back, live traffic goes straight out and replay() works through the
+    // backlog alongside it, so a long backlog cannot hold live traffic
+    // down to the replay rate.
+    bool toSpool = _spool && !linkUp();
+    int proxyQos = qosFor(_qosConfig.proxyQos);
+    int packetQos = qosFor(_qosConfig.packetQos);
+
+    if (!_spool && !linkUp()) {
+        // Keep it queued until the broker is back
+        return;
+    }
+
+    if (toSpool && !_batches.empty()) {
+        // The broker just went away: open batches are older than anything
+        // spooled from here on, and replayed ones are read again later
+        flushBatches(true);
+    }
+
+    // With the window full, the rest stays queued until acks come back;
+    // checked before front(), which takes the slot from the producer
+    while ((toSpool || windowOpen(proxyQos)) &&
+           ((pe = _proxyQueue->front()) != NULL)) {
+        const meshtastic_MqttClientProxyMessage &m = pe->m;
+
+        if (pe->enqueued < oldest) {
+            oldest = pe->enqueued;
+        }
+        _queueLatency.record(pe->enqueued, chrono::steady_clock::now());
+
+        if (toSpool) {
+            _spool->append(m);
+        } else if ((ret = publishProxy(m)) == MOSQ_ERR_SUCCESS) {
+            _published++;
+        } else if (spoolable(ret)) {
+            _spool->append(m);
+            toSpool = true;
+        }
+
+        _proxyQueue->pop();
+        _proxyQueueCounters.dequeued++;
+        batch++;
+    }
+
+    while ((toSpool || windowOpen(packetQos)) &&
+           ((ke = _packetQueue->front()) != NULL)) {
+        if (ke->enqueued < oldest) {
+            oldest = ke->enqueued;
+        }
+        _queueLatency.record(ke->enqueued, chrono::steady_clock::now());
+
+        if (toSpool) {
+            _spool->append(ke->p);
+        } else if (batching()) {
+            if (!batchPacket(ke->p) && _spool) {
+                toSpool = true;
+            }
+        } else if ((ret = publishPacket(ke->p)) == MOSQ_ERR_SUCCESS) {
+            _published++;
+        } else if (spoolable(ret)) {
+            _spool->append(ke->p);
+            toSpool = true;
+        }
+
+        _packetQueue->pop();
+        _packetQueueCounters.dequeued++;
+        batch++;
+    }
+
+    if ((!_proxyQueue->empty() && !windowOpen(proxyQos)) ||
+        (!_packetQueue->empty() && !windowOpen(packetQos))) {
+        _windowStalls++;
+    }
+
+    if (!_batches.empty()) {
+        flushBatches(false);
+    }
+
+    if (batch == 0) {
+        return;
+    }
+
+    latencyMs = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - oldest).count();
+    _lastBatchSize = batch;
+    _lastDrainLatencyMs = latencyMs;
+    if (latencyMs > _maxDrainLatencyMs) {
+        _maxDrainLatencyMs = latencyMs;
+    }
+}
+
+void MqttClient::replay(void)
+{
+    chrono::steady_clock::time_point now;
+    MqttSpool::RecordType type;
+    int ret;
+
+    if (!_spool || !linkUp()) {
+        return;
+    }
+
+    // Token bucket; a backlog trickles out at _replayRate messages/s on
+    // top of the live traffic rather than hitting the broker all at once
+    now = chrono::steady_clock::now();
+    if (_replayRate > 0) {
+        _replayTokens += _replayRate *
+            chrono::duration<double>(now - _replayRefill).count();
+        if (_replayTokens > _replayRate) {
+            _replayTokens = _replayRate;
+        }
+    }
+    _replayRefill = now;
+
+    if (batching()) {
+        replayBatched();
+        return;
+    }
+
+    while (((_replayRate == 0) || (_replayTokens >= 1.0)) &&
+           _spool->peek(type, _replayProxy, _replayPacket)) {
+        if (!windowOpen(qosFor(type == MqttSpool::PROXY_MESSAGE ?
+                               _qosConfig.proxyQos : _qosConfig.packetQos))) {
+            break;
+        }
+        if (type == MqttSpool::PROXY_MESSAGE) {
+            ret = publishProxy(_replayProxy);
+        } else {
+            ret = publishPacket(_replayPacket);
+        }
+
+        if (spoolable(ret)) {
+            // Lost the connection again; keep it for the next attempt
+            break;
+        }
+
+        _spool->pop();
+        if (ret == MOSQ_ERR_SUCCESS) {
+            _published++;
+        }
+        _replayTokens -= 1.0;
+    }
+}
+
+void MqttClient::replayBatched(void)
+{
+    MqttSpool::RecordType type;
+    int ret;
+
+    // Packets go into batches of their own while the spool is read ahead
+    // past them, up to a packet queue's worth. A proxy message waits for
+    // the packets before it to be out, as it is popped in order.
+    while (((_replayRate == 0) || (_replayTokens >= 1.0)) &&
+           !_replayFailed &&
+           _spool->peekAhead(type, _replayProxy, _replayPacket)) {
+        if (type == MqttSpool::MESH_PACKET) {
+            if ((_spool->ahead() >= _packetQueueConfig.capacity) ||
+                !windowOpen(qosFor(_qosConfig.packetQos))) {
+                break;
+            }
+            _spool->next();
+            batchPacket(_replayPacket, true);
+            if (_replayBatches == 0) {
+                // Not batched after all
+                _spool->popAhead();
+            }
+        } else {
+            if ((_spool->ahead() > 0) ||
+                !windowOpen(qosFor(_qosConfig.proxyQos))) {
+                break;
+            }
+            ret = publishProxy(_replayProxy);
+            if (spoolable(ret)) {
+                break;
+            }
+            _spool->next();
+            _spool->popAhead();
+            if (ret == MOSQ_ERR_SUCCESS) {
+                _published++;
+            }
+        }
+        _replayTokens -= 1.0;
+    }
+}
+
+void MqttClient::spill(void)
+{
+    ProxyEntry *pe;
+    PacketEntry *ke;
+
+    // Whatever is still queued on the way out goes to disk
+    while ((pe = _proxyQueue->front()) != NULL) {
+        _spool->append(pe->m);
+        _proxyQueue->pop();
+        _proxyQueueCounters.dequeued++;
+    }
+
+    while ((ke = _packetQueue->front()) != NULL) {
+        _spool->append(ke->p);
+        _packetQueue->pop();
+        _packetQueueCounters.dequeued++;
+    }
+}
+
+bool MqttClient::setup(void)
+{
+    if (_mosq == NULL) {
+        // Let mosquitto pick a unique client id; several radios may
+        // connect to the same broker
+        _mosq = mosquitto_new(NULL, true, this);
+        if (_mosq == NULL) {
+            LOGE(MQTT, "mosquitto_new() failed!");
+            return false;
+        }
+    }
+
+    // An empty username is still sent as one; NULL sends none
+    mosquitto_username_pw_set(_mosq,
+                              _user.empty() ? NULL : _user.c_str(),
+                              _password.empty() ? NULL : _password.c_str());
+    mosquitto_connect_callback_set(_mosq, onConnect);
+    mosquitto_disconnect_callback_set(_mosq, onDisconnect);
+    mosquitto_publish_callback_set(_mosq, onPublish);
+    mosquitto_subscribe_callback_set(_mosq, onSubscribe);
+    mosquitto_message_callback_set(_mosq, onMessage);
+    // Our own window decides what is in flight
+    mosquitto_max_inflight_messages_set(_mosq, _qosConfig.windowMax);
+
+    return true;
+}
+
+void MqttClient::connect(void)
+{
+    int ret;
+
+    // Reap the loop thread of the previous connection, if any
+    mosquitto_loop_stop(_mosq, false);
+
+    if (_state != STOPPED) {
+        _reconnects++;
+    }
+    setState(CONNECTING);
+
+    ret = mosquitto_connect(_mosq, _server.c_str(), _port,
+                            _connectConfig.keepaliveSec);
+    if (ret != MOSQ_ERR_SUCCESS) {
+        LOGW(MQTT, "mosquitto_connect: %s", mosquitto_strerror(ret));
+        scheduleBackoff();
+        return;
+    }
+
+    ret = mosquitto_loop_start(_mosq);
+    if (ret != MOSQ_ERR_SUCCESS) {
+        LOGW(MQTT, "mosquitto_loop_start: %s", mosquitto_strerror(ret));
+        mosquitto_disconnect(_mosq);
+        scheduleBackoff();
+    }
+}
+
+void MqttClient::run(void)
+{
+    if (_sink) {
+        // Nothing to connect to; the sink is always there
+        setState(SUBSCRIBED);
+    } else if (!setup()) {
+        goto done;
+    } else {
+        connect();
+    }
+
+    while (_isRunning) {
+        {
+            // Sleep until there is work, the link changes state or we are
+            // told to stop; also wake up to retry a connection and to
+            // replay the spool
+            unique_lock<mutex> lock(_mutex);
+            chrono::steady_clock::time_point deadline =
+                chrono::steady_clock::now() + chrono::seconds(_spool ? 1 : 60);
+
+            if (_state == BACKOFF) {
+                lock_guard<mutex> stateLock(_stateMutex);
+                if (_retryAt < deadline) {
+                    deadline = _retryAt;
+                }
+            }
+            if (!_downlinkQueue->empty() && (_downlinkAt < deadline)) {
+                deadline = _downlinkAt;
+            }
+            if (!_batches.empty() && (_batchAt < deadline)) {
+                deadline = _batchAt;
+            }
+            if ((_inflight >= _window) &&
+                (chrono::steady_clock::now() + chrono::seconds(1) <
+                 deadline)) {
+                // Look for acks that are not coming
+                deadline = chrono::steady_clock::now() + chrono::seconds(1);
+            }
+
+            _waiting = true;
+            _cv.wait_until(lock, deadline, [this]() {
+                return !_isRunning || _kick ||
+                    ((_spool || linkUp()) &&
+                     ((!_proxyQueue->empty() &&
+                       windowOpen(qosFor(_qosConfig.proxyQos))) ||
+                      (!_packetQueue->empty() &&
+                       windowOpen(qosFor(_qosConfig.packetQos))))) ||
+                    (!_downlinkQueue->empty() &&
+                     (chrono::steady_clock::now() >= _downlinkAt)) ||
+                    batchDue();
+            });
+            _waiting = false;
+            _kick = false;
+        }
+
+        if (backoffExpired()) {
+            connect();
+        }
+
+        // Publish everything pending, in place
+        expireInflight();
+        drain();
+        replay();
+        downlink();
+    }
+
+done:
+
+    _isRunning = false;
+    flushBatches(true);
+    if (_spool) {
+        spill();
+    }
+    if (_mosq) {
+        mosquitto_disconnect(_mosq);
+        mosquitto_loop_stop(_mosq, false);
+    }
+    setState(STOPPED);
+
+    return;
+}
+
+bool MqttClient::attach(shared_ptr<Reactor> reactor)
+{
+    if (_isRunning || _reactor) {
+        return false;
+    }
+
+    if (!setup()) {
+        return false;
+    }
+
+    // Callbacks now come from whichever reactor worker is servicing us
+    mosquitto_threaded_set(_mosq, true);
+
+    _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wakefd == -1) {
+        LOGE(MQTT, "eventfd: %s", strerror(errno));
+        return false;
+    }
+
+    _reactor = reactor;
+    _isRunning = true;
+    {
+        // An unreachable broker is retried from onTimerEvent()
+        lock_guard<mutex> lock(_loopMutex);
+        reactorConnect();
+    }
+    _reactor->add(_wakefd, EPOLLIN,
+                  [this](uint32_t events) {
+                      (void)(events);
+                      onWakeEvent();
+                  });
+    // Keepalive pings and retries, and closing batches on time
+    _timerfd = _reactor->addTimer(
+        batching() ? min(1000U, max(10U, _batchConfig.windowMs / 2)) : 1000,
+        [this]() { onTimerEvent(); });
+
+    return true;
+}
+
+void MqttClient::detach(void)
+{
+    if (!_reactor) {
+        return;
+    }
+
+    _reactor->remove(_timerfd);
+    _reactor->remove(_wakefd);
+    _reactor->remove(_sockfd);
+
+    lock_guard<mutex> lock(_loopMutex);
+
+    if (_timerfd != -1) {
+        close(_timerfd);
+        _timerfd = -1;
+    }
+    if (_wakefd != -1) {
+        close(_wakefd);
+        _wakefd = -1;
+    }
+    _sockfd = -1;
+
+    _isRunning = false;
+    flushBatches(true);
+    if (_spool) {
+        spill();
+    }
+    mosquitto_disconnect(_mosq);
+    _reactor = NULL;
+    setState(STOPPED);
+}
+
+void MqttClient::reactorConnect(void)
+{
+    int ret;
+
+    // Called with _loopMutex held
+    if (_state != STOPPED) {
+        _reconnects++;
+    }
+    setState(CONNECTING);
+
+    ret = mosquitto_connect(_mosq, _server.c_str(), _port,
+                            _connectConfig.keepaliveSec);
+    if (ret != MOSQ_ERR_SUCCESS) {
+        LOGW(MQTT, "mosquitto_connect: %s", mosquitto_strerror(ret));
+        scheduleBackoff();
+        return;
+    }
+
+    _sockfd = mosquitto_socket(_mosq);
+    _reactor->add(_sockfd, EPOLLIN | EPOLLOUT,
+                  [this](uint32_t events) { onSocketEvent(events); });
+}
+
+void MqttClient::updateSocketEvents(void)
+{
+    int sockfd = mosquitto_socket(_mosq);
+    uint32_t events = EPOLLIN;
+
+    if (sockfd != _sockfd) {
+        // Connection lost; mosquitto has closed the old socket
+        _reactor->remove(_sockfd);
+        _sockfd = -1;
+        if ((_state != BACKOFF) && (_state != STOPPED)) {
+            scheduleBackoff();
+        }
+        return;
+    }
+
+    if (mosquitto_want_write(_mosq)) {
+        events |= EPOLLOUT;
+    }
+    _reactor->modify(_sockfd, events);
+}
+
+void MqttClient::onSocketEvent(uint32_t events)
+{
+    lock_guard<mutex> lock(_loopMutex);
+    int ret = MOSQ_ERR_SUCCESS;
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ret = mosquitto_loop_read(_mosq, 1);
+    }
+    if ((ret == MOSQ_ERR_SUCCESS) && (events & EPOLLOUT)) {
+        ret = mosquitto_loop_write(_mosq, 1);
+    }
+    if (ret != MOSQ_ERR_SUCCESS) {
+        LOGW(MQTT, "mosquitto_loop: %s", mosquitto_strerror(ret));
+    }
+
+    updateSocketEvents();
+}
+
+void MqttClient::onWakeEvent(void)
+{
+    lock_guard<mutex> lock(_loopMutex);
+    uint64_t count;
+
+    // Clear the flag first so that a publish() racing with drain() below
+    // schedules another pass
+    _wakePending = false;
+    if (read(_wakefd, &count, sizeof(count)) < 0) {
+        // Nothing pending; spurious wake-up
+    }
+
+    drain();
+    downlink();
+    if (_sockfd != -1) {
+        updateSocketEvents();
+    }
+}
+
+void MqttClient::onTimerEvent(void)
+{
+    lock_guard<mutex> lock(_loopMutex);
+
+    if (backoffExpired()) {
+        reactorConnect();
+    } else if (_sockfd != -1) {
+        // Keepalive pings, and noticing a dead broker
+        mosquitto_loop_misc(_mosq);
+    }
+    expireInflight();
+    drain();
+    replay();
+    downlink();
+    if (_sockfd != -1) {
+        updateSocketEvents();
+    }
 }
 
 /*
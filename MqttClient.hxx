@@ -7,8 +7,18 @@
 #ifndef MQTTCLIENT_HXX
 #define MQTTCLIENT_HXX
 
-#include <queue>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <vector>
 #include <LibMeshtastic.hxx>
+#include <DedupCache.hxx>
+#include <LatencyHistogram.hxx>
+#include <MessageRing.hxx>
+#include <MqttSpool.hxx>
+#include <Reactor.hxx>
 
 using namespace std;
 
@@ -18,6 +28,105 @@ class MqttClient {
 
 public:
 
+    // What publish() does when a queue is at capacity
+    enum OverflowPolicy {
+        DROP_OLDEST,
+        DROP_NEWEST,
+        COALESCE,       // replace queued message of same node/portnum
+    };
+
+    struct QueueConfig {
+        size_t capacity;
+        OverflowPolicy policy;
+    };
+
+    struct QueueCounters {
+        atomic<unsigned long> enqueued;
+        atomic<unsigned long> dequeued;
+        atomic<unsigned long> dropped;
+        atomic<unsigned long> coalesced;
+    };
+
+    enum ConnState {
+        STOPPED,
+        CONNECTING,     // TCP connect sent, waiting for CONNACK
+        CONNECTED,      // CONNACK received, waiting for SUBACK
+        SUBSCRIBED,
+        BACKOFF,        // waiting to retry after a failure or drop
+        NUM_CONN_STATES,
+    };
+
+    struct ConnectConfig {
+        unsigned int keepaliveSec;
+        unsigned int backoffMinMs;
+        unsigned int backoffMaxMs;
+    };
+
+    // Where undeliverable messages go while the broker is unreachable
+    struct SpoolConfig {
+        string dir;                 // empty: no spool
+        size_t maxBytes;
+        size_t segmentBytes;
+        unsigned int replayRate;    // backlog messages/s, 0: no limit
+    };
+
+    // Broker -> radio, for proxy-to-client mode. What the radio may send
+    // is bounded by a token bucket of LoRa airtime: it fills at
+    // dutyCycle milliseconds per millisecond, up to burstMs.
+    struct DownlinkConfig {
+        vector<string> channels;    // channel ids to pass; empty: off
+        string topic;               // subscription; empty: <topic>/2/e/#
+        unsigned int bitrate;       // bits/s of the modem preset
+        double dutyCycle;
+        unsigned int burstMs;
+        QueueConfig queue;
+    };
+
+    // Several packets to a publish, for the private broker. Packets of the
+    // same node/portnum are held for up to windowMs, or until maxMessages
+    // or maxBytes, and go out together on <topic>/batch/!<node>/<portnum>
+    // as a run of frames: a 2-byte big-endian length, then the encoded
+    // MeshPacket.
+    struct BatchConfig {
+        unsigned int windowMs;      // 0: off
+        unsigned int maxMessages;
+        size_t maxBytes;
+    };
+
+    // Delivery of the two uplink pipelines; -1 publishes at the QoS the
+    // subscription was granted. Messages sent at QoS 1 or 2 and not yet
+    // acknowledged are bounded by a window between windowMin and
+    // windowMax: it grows while the broker acks promptly and shrinks as
+    // the ack round trip stretches out. A full window leaves messages in
+    // their queue.
+    struct QosConfig {
+        int proxyQos;
+        int packetQos;
+        unsigned int windowMin;
+        unsigned int windowMax;
+    };
+
+    // Hands a message from the broker to the radio; called from the
+    // client's own thread
+    typedef function<bool(const meshtastic_MqttClientProxyMessage &m)>
+        Downlink;
+
+    // Stands in for mosquitto_publish(); returns a MOSQ_ERR_* code
+    typedef function<int(const char *topic, int payloadlen,
+                         const void *payload, bool retain)> Sink;
+
+    static const QueueConfig defaultQueueConfig;
+    static const ConnectConfig defaultConnectConfig;
+    static const DownlinkConfig defaultDownlinkConfig;
+    static const BatchConfig defaultBatchConfig;
+    static const QosConfig defaultQosConfig;
+    static const char *connStateString(ConnState state);
+    static bool parseOverflowPolicy(const string &s, OverflowPolicy &policy);
+    static const char *overflowPolicyString(OverflowPolicy policy);
+    static uint64_t coalesceKey(uint32_t node, unsigned int portnum);
+    // Rough time on air of a packet carrying bytes of payload
+    static unsigned int airtimeMs(size_t bytes, unsigned int bitrate);
+
     MqttClient();
  	MqttClient(const string &server, uint16_t port,
                const string &user, const string &password,
@@ -26,6 +135,72 @@ public:
 
     unsigned int published(void) const;
     unsigned int publishConfirmed(void) const;
+    size_t proxyQueueDepth(void) const;
+    size_t packetQueueDepth(void) const;
+    unsigned int lastBatchSize(void) const;
+    unsigned int lastDrainLatencyMs(void) const;
+    unsigned int maxDrainLatencyMs(void) const;
+
+    // Pipeline stages, in microseconds
+    inline LatencyHistogram &queueLatency(void) {
+        return _queueLatency;       // publish() -> mosquitto_publish()
+    }
+
+    inline LatencyHistogram &publishLatency(void) {
+        return _publishLatency;     // time spent in mosquitto_publish()
+    }
+
+    inline LatencyHistogram &ackLatency(void) {
+        return _ackLatency;         // mosquitto_publish() -> onPublish()
+    }
+
+    void setProxyQueueConfig(const QueueConfig &config);
+    void setPacketQueueConfig(const QueueConfig &config);
+    const QueueConfig &proxyQueueConfig(void) const;
+    const QueueConfig &packetQueueConfig(void) const;
+    const QueueCounters &proxyQueueCounters(void) const;
+    const QueueCounters &packetQueueCounters(void) const;
+
+    void setConnectConfig(const ConnectConfig &config);
+    const ConnectConfig &connectConfig(void) const;
+
+    ConnState connState(void) const;
+    // Total time spent in a state, including the current stint
+    unsigned long timeInStateMs(ConnState state) const;
+    unsigned int reconnects(void) const;
+
+    // Set before start() or attach(); dedup, if any, drops packets
+    // already heard on the mesh
+    void setDownlinkConfig(const DownlinkConfig &config);
+    void setDownlink(Downlink downlink, shared_ptr<DedupCache> dedup);
+    // Our own uplinks come back from the broker; drop what this gateway
+    // sent
+    void ignoreGateway(uint32_t node);
+    const DownlinkConfig &downlinkConfig(void) const;
+    const QueueCounters &downlinkQueueCounters(void) const;
+    size_t downlinkQueueDepth(void) const;
+    unsigned long downlinkFiltered(void) const;
+
+    // Set before start() or attach()
+    void setBatchConfig(const BatchConfig &config);
+    const BatchConfig &batchConfig(void) const;
+    // Publishes that carried a batch, and the packets in them; the
+    // difference is the publishes saved
+    unsigned long batches(void) const;
+    unsigned long batchedPackets(void) const;
+
+    // Set before start() or attach()
+    void setQosConfig(const QosConfig &config);
+    const QosConfig &qosConfig(void) const;
+    unsigned int inflight(void) const;
+    unsigned int inflightWindow(void) const;
+    // Smoothed round trip of QoS 1/2 acks
+    unsigned long ackRttUs(void) const;
+    // Drain passes cut short by a full window
+    unsigned long windowStalls(void) const;
+
+    bool openSpool(const SpoolConfig &config);
+    const shared_ptr<MqttSpool> spool(void) const;
 
     bool isConnected(void) const;
     bool isRunning(void) const;
@@ -33,20 +208,108 @@ public:
     void stop(void);
     void join(void);
 
+    // Let a Reactor service the socket and the queues instead of
+    // start()'ing a publisher thread and a mosquitto loop thread
+    bool attach(shared_ptr<Reactor> reactor);
+    void detach(void);
+
+    // Hand messages to sink instead of a broker (benchmarks); set before
+    // start()
+    void setSink(Sink sink);
+
+    // Set when publish() is called from more than one thread, i.e. the
+    // client is shared by several radios
+    void setMultiProducer(bool multiProducer);
+
     void reset(void);
-    bool publish(const meshtastic_MqttClientProxyMessage &m);
+    bool publish(const meshtastic_MqttClientProxyMessage &m,
+                 uint64_t key = 0);
     bool publish(const meshtastic_MeshPacket &p);
 
 private:
 
+    struct ProxyEntry {
+        chrono::steady_clock::time_point enqueued;
+        meshtastic_MqttClientProxyMessage m;
+    };
+
+    struct PacketEntry {
+        chrono::steady_clock::time_point enqueued;
+        meshtastic_MeshPacket p;
+    };
+
+    struct DownlinkEntry {
+        chrono::steady_clock::time_point enqueued;
+        meshtastic_MqttClientProxyMessage m;
+    };
+
+    struct Batch {
+        string topic;
+        string payload;             // frames
+        unsigned int count;
+        bool replayed;              // read ahead from the spool
+        chrono::steady_clock::time_point due;
+    };
+
+    template <typename E> E *reserve(MessageRing<E> &ring,
+                                     const QueueConfig &config,
+                                     QueueCounters &counters, uint64_t key);
+    void wake(void);
+    void setState(ConnState state);
+    void scheduleBackoff(void);
+    bool backoffExpired(void) const;
+    bool linkUp(void) const;
+    int qosFor(int configured) const;
+    bool windowOpen(int qos) const;
+
     static void onConnect(struct mosquitto *mosq, void *obj, int rc);
     static void onDisconnect(struct mosquitto *mosq, void *obj, int rc);
     static void onPublish(struct mosquitto *mosq, void *obj, int mid);
     static void onSubscribe(struct mosquitto *mosq, void *obj,
                             int mid, int qos_count, const int *granted_qos);
+    static void onMessage(struct mosquitto *mosq, void *obj,
+                          const struct mosquitto_message *message);
 
     static void thread_function(MqttClient *mqtt);
+    bool setup(void);
+    void connect(void);
     void run(void);
+    void reactorConnect(void);
+    void onSocketEvent(uint32_t events);
+    void onWakeEvent(void);
+    void onTimerEvent(void);
+    void updateSocketEvents(void);
+    void drain(void);
+    void replay(void);
+    void replayBatched(void);
+    void spill(void);
+    bool downlinkEnabled(void) const;
+    void gotMessage(const char *topic, const void *payload, int payloadlen,
+                    bool retain);
+    void downlink(void);
+    bool spoolable(int ret) const;
+    int publishProxy(const meshtastic_MqttClientProxyMessage &m);
+    int publishPacket(const meshtastic_MeshPacket &p);
+    // Into _encodeBuf; returns the length, 0 on failure
+    size_t encodePacket(const meshtastic_MeshPacket &p);
+    bool batching(void) const;
+    bool batchDue(void) const;
+    // These return false if a batch could not go out and was spooled
+    bool batchPacket(const meshtastic_MeshPacket &p, bool replayed = false);
+    // Publishes the batches whose window is over, or all of them
+    void flushBatches(bool all);
+    bool flushBatch(const Batch &batch);
+    void spoolBatch(const Batch &batch);
+    void replayBatchDone(bool sent);
+    int publishTimed(const char *topic, int payloadlen, const void *payload,
+                     int qos, bool retain);
+    // Returns true if an ack reopened a full window
+    bool trackAck(int mid, bool acked, int qos,
+                  chrono::steady_clock::time_point when);
+    void adaptWindow(unsigned long rttUs);
+    void reseedInflight(void);
+    // Gives up on acks that are long overdue
+    void expireInflight(void);
 
 private:
 
@@ -62,12 +325,109 @@ private:
     bool _isRunning;
 
     struct mosquitto *_mosq;
+    Sink _sink;
     unsigned int _grantedQos;
-    queue<meshtastic_MqttClientProxyMessage> _proxyQueue;
-    queue<meshtastic_MeshPacket> _packetQueue;
-    unsigned int _published;
-    unsigned int _publishConfirmed;
-    unsigned int _messaged;
+
+    ConnectConfig _connectConfig;
+    atomic<ConnState> _state;
+    mutable mutex _stateMutex;
+    chrono::steady_clock::time_point _stateSince;
+    unsigned long _stateTimeMs[NUM_CONN_STATES];
+    unsigned int _backoffAttempts;
+    chrono::steady_clock::time_point _retryAt;
+    minstd_rand _rng;
+    atomic<unsigned int> _reconnects;
+    bool _kick;
+    // Written in place by the publish() caller, read in place by run()
+    unique_ptr<MessageRing<ProxyEntry> > _proxyQueue;
+    unique_ptr<MessageRing<PacketEntry> > _packetQueue;
+    atomic<bool> _waiting;
+    bool _multiProducer;
+    mutex _producerMutex;
+
+    // Reactor mode
+    shared_ptr<Reactor> _reactor;
+    mutex _loopMutex;
+    int _sockfd;
+    int _wakefd;
+    int _timerfd;
+    atomic<bool> _wakePending;
+
+    shared_ptr<MqttSpool> _spool;
+    unsigned int _replayRate;
+    double _replayTokens;
+    chrono::steady_clock::time_point _replayRefill;
+    // Decode targets for MqttSpool::peek()
+    meshtastic_MqttClientProxyMessage _replayProxy;
+    meshtastic_MeshPacket _replayPacket;
+
+    // Written by onMessage(), read by downlink()
+    DownlinkConfig _downlinkConfig;
+    Downlink _downlink;
+    shared_ptr<DedupCache> _downlinkDedup;
+    unique_ptr<MessageRing<DownlinkEntry> > _downlinkQueue;
+    QueueCounters _downlinkQueueCounters;
+    atomic<unsigned long> _downlinkFiltered;
+    mutex _gatewayMutex;
+    vector<string> _ignoreGateways;
+    double _airtimeTokens;
+    chrono::steady_clock::time_point _airtimeRefill;
+    // When the bucket will have enough for the message at the front
+    chrono::steady_clock::time_point _downlinkAt;
+
+    // Open batches by coalesceKey(); touched only by drain() and replay()
+    BatchConfig _batchConfig;
+    unordered_map<uint64_t, Batch> _batches;
+    chrono::steady_clock::time_point _batchAt;  // earliest due
+    unsigned int _replayBatches;                // open, with replayed
+    bool _replayFailed;                         // packets from the spool
+    meshtastic_MeshPacket _unbatched;           // spoolBatch() decode target
+    atomic<unsigned long> _batchesPublished;
+    atomic<unsigned long> _batchedPackets;
+
+    // Reused by publishPacket() for every MeshPacket
+    uint8_t _encodeBuf[meshtastic_MeshPacket_size];
+    char _encodeTopic[128];
+    QueueConfig _proxyQueueConfig;
+    QueueConfig _packetQueueConfig;
+    QueueCounters _proxyQueueCounters;
+    QueueCounters _packetQueueCounters;
+    atomic<unsigned int> _published;
+    atomic<unsigned int> _publishConfirmed;
+    atomic<unsigned int> _messaged;
+
+    atomic<unsigned int> _lastBatchSize;
+    atomic<unsigned int> _lastDrainLatencyMs;
+    atomic<unsigned int> _maxDrainLatencyMs;
+
+    LatencyHistogram _queueLatency;
+    LatencyHistogram _publishLatency;
+    LatencyHistogram _ackLatency;
+
+    // Matches onPublish() with the mosquitto_publish() call of the same
+    // mid; either side may get there first
+    struct AckSlot {
+        int mid;
+        bool acked;
+        int qos;
+        chrono::steady_clock::time_point when;
+    };
+    static const unsigned int ACK_SLOTS = 256;
+    // Round trips this far over the fastest seen mean the broker is
+    // falling behind
+    static const unsigned long RTT_SLACK_US = 2000;
+    static const unsigned long ACK_TIMEOUT_US = 2000000;
+    mutex _ackMutex;
+    AckSlot _ackSlots[ACK_SLOTS];
+
+    // In-flight window; written under _ackMutex
+    QosConfig _qosConfig;
+    atomic<unsigned int> _inflight;
+    atomic<unsigned int> _window;
+    unsigned int _windowAcks;       // since the window last changed
+    atomic<unsigned long> _srttUs;
+    unsigned long _minRttUs;
+    atomic<unsigned long> _windowStalls;
 
 };
 
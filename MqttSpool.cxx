@@ -0,0 +1,565 @@
+/*
+ * MqttSpool.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <ctime>
+#include <vector>
+#include <Logger.hxx>
+#include <MqttSpool.hxx>
+
+#define SEGMENT_MAGIC   0x50534d4d  // "MMSP"
+#define SEGMENT_VERSION 2
+#define RECORD_MAGIC    0x43455221  // "!REC"
+#define DATA_START      64
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t readOffset;
+    uint32_t writeOffset;       // end of the last complete record
+};
+
+struct RecordHeader {
+    uint32_t magic;             // written last
+    uint16_t type;
+    uint16_t length;
+    uint64_t timestamp;
+};
+
+static inline size_t recordSize(size_t length)
+{
+    return (sizeof(RecordHeader) + length + 7) & ~((size_t) 7);
+}
+
+static bool mkdirs(const string &dir)
+{
+    size_t pos = 0;
+
+    while (pos != string::npos) {
+        pos = dir.find('/', pos + 1);
+        string path = dir.substr(0, pos);
+        if ((mkdir(path.c_str(), 0755) == -1) && (errno != EEXIST)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+MqttSpool::MqttSpool()
+    : _maxBytes(0),
+      _segmentBytes(0),
+      _aheadSeq(0),
+      _aheadOffset(0),
+      _ahead(0),
+      _aheadSkipped(0),
+      _appended(0),
+      _replayed(0),
+      _dropped(0)
+{
+
+}
+
+MqttSpool::~MqttSpool()
+{
+    close();
+}
+
+string MqttSpool::segmentPath(uint32_t seq) const
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "%08x.seg", seq);
+
+    return _dir + "/" + name;
+}
+
+bool MqttSpool::open(const string &dir, size_t maxBytes, size_t segmentBytes)
+{
+    vector<uint32_t> seqs;
+    DIR *d;
+    struct dirent *ent;
+    lock_guard<mutex> lock(_mutex);
+
+    _dir = dir;
+    _maxBytes = maxBytes;
+    _segmentBytes = max(segmentBytes, (size_t) DATA_START +
+                        recordSize(sizeof(_encodeBuf)));
+
+    if (!mkdirs(_dir)) {
+        LOGE(SPOOL, "mkdir %s: %s", _dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    d = opendir(_dir.c_str());
+    if (d == NULL) {
+        LOGE(SPOOL, "opendir %s: %s", _dir.c_str(), strerror(errno));
+        return false;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        unsigned int seq;
+        char suffix[8];
+        if ((sscanf(ent->d_name, "%8x.%3s", &seq, suffix) == 2) &&
+            (strcmp(suffix, "seg") == 0)) {
+            seqs.push_back(seq);
+        }
+    }
+    closedir(d);
+
+    sort(seqs.begin(), seqs.end());
+    for (vector<uint32_t>::const_iterator it = seqs.begin();
+         it != seqs.end(); it++) {
+        openSegment(*it, false);
+    }
+
+    if (_segments.empty() && !openSegment(1, true)) {
+        return false;
+    }
+
+    trim();
+
+    return true;
+}
+
+void MqttSpool::close(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    while (!_segments.empty()) {
+        closeSegment(_segments.front(), false);
+        _segments.pop_front();
+    }
+}
+
+bool MqttSpool::openSegment(uint32_t seq, bool create)
+{
+    string path = segmentPath(seq);
+    Segment segment;
+    SegmentHeader *header;
+    struct stat st;
+
+    segment.seq = seq;
+    segment.fd = ::open(path.c_str(),
+                        O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+                        0644);
+    if (segment.fd == -1) {
+        LOGE(SPOOL, "open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (create && (ftruncate(segment.fd, _segmentBytes) == -1)) {
+        LOGE(SPOOL, "ftruncate %s: %s", path.c_str(), strerror(errno));
+        ::close(segment.fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    if ((fstat(segment.fd, &st) == -1) || (st.st_size < DATA_START)) {
+        ::close(segment.fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    segment.size = st.st_size;
+    segment.base = (uint8_t *) mmap(NULL, segment.size,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    segment.fd, 0);
+    if (segment.base == MAP_FAILED) {
+        LOGE(SPOOL, "mmap %s: %s", path.c_str(), strerror(errno));
+        ::close(segment.fd);
+        return false;
+    }
+
+    header = (SegmentHeader *) segment.base;
+    if (create) {
+        header->version = SEGMENT_VERSION;
+        header->size = segment.size;
+        header->readOffset = DATA_START;
+        header->writeOffset = DATA_START;
+        header->magic = SEGMENT_MAGIC;
+    } else if ((header->magic != SEGMENT_MAGIC) ||
+               ((header->version != 1) &&
+                (header->version != SEGMENT_VERSION)) ||
+               (header->readOffset < DATA_START) ||
+               (header->readOffset > segment.size)) {
+        LOGE(SPOOL, "%s: not a spool segment, discarding", path.c_str());
+        closeSegment(segment, true);
+        return false;
+    } else if (header->version == 1) {
+        // No write offset; records end at the first one without its magic
+        header->writeOffset = scanRecords(segment, DATA_START, segment.size,
+                                          NULL);
+        header->version = SEGMENT_VERSION;
+    }
+
+    // Anything past the write offset is an append cut short by a crash,
+    // or a record left over from before a rewind
+    segment.writeOffset = scanRecords(segment, DATA_START,
+                                      min((size_t) header->writeOffset,
+                                          segment.size), NULL);
+    header->writeOffset = segment.writeOffset;
+    if (header->readOffset > segment.writeOffset) {
+        header->readOffset = segment.writeOffset;
+    }
+
+    _segments.push_back(segment);
+
+    return true;
+}
+
+void MqttSpool::closeSegment(Segment &segment, bool unlinkFile)
+{
+    if (segment.base != NULL) {
+        munmap(segment.base, segment.size);
+        segment.base = NULL;
+    }
+    if (segment.fd != -1) {
+        ::close(segment.fd);
+        segment.fd = -1;
+    }
+    if (unlinkFile) {
+        unlink(segmentPath(segment.seq).c_str());
+    }
+}
+
+size_t MqttSpool::scanRecords(const Segment &segment, size_t offset,
+                              size_t end, unsigned long *count) const
+{
+    while ((offset + sizeof(RecordHeader)) <= end) {
+        const RecordHeader *record =
+            (const RecordHeader *) (segment.base + offset);
+        if ((record->magic != RECORD_MAGIC) ||
+            ((offset + recordSize(record->length)) > end)) {
+            break;
+        }
+        offset += recordSize(record->length);
+        if (count != NULL) {
+            (*count)++;
+        }
+    }
+
+    return offset;
+}
+
+void MqttSpool::trim(void)
+{
+    while ((_segments.size() > 1) &&
+           ((_segments.size() * _segmentBytes) > _maxBytes)) {
+        Segment &oldest = _segments.front();
+        const SegmentHeader *header = (const SegmentHeader *) oldest.base;
+        unsigned long count = 0;
+
+        scanRecords(oldest, header->readOffset, oldest.writeOffset, &count);
+        _dropped += count;
+        closeSegment(oldest, true);
+        _segments.pop_front();
+    }
+}
+
+bool MqttSpool::appendRecord(RecordType type, const pb_msgdesc_t *fields,
+                             const void *src)
+{
+    pb_ostream_t stream;
+    RecordHeader *record;
+    size_t size;
+    lock_guard<mutex> lock(_mutex);
+
+    if (_segments.empty()) {
+        return false;
+    }
+
+    stream = pb_ostream_from_buffer(_encodeBuf, sizeof(_encodeBuf));
+    if (!pb_encode(&stream, fields, src)) {
+        LOGE(SPOOL, "pb_encode failed: %s", PB_GET_ERROR(&stream));
+        return false;
+    }
+
+    size = recordSize(stream.bytes_written);
+    if ((_segments.back().writeOffset + size) > _segments.back().size) {
+        if (!openSegment(_segments.back().seq + 1, true)) {
+            _dropped++;
+            return false;
+        }
+        trim();
+    }
+
+    Segment &segment = _segments.back();
+    record = (RecordHeader *) (segment.base + segment.writeOffset);
+    record->type = type;
+    record->length = stream.bytes_written;
+    record->timestamp = time(NULL);
+    memcpy(record + 1, _encodeBuf, stream.bytes_written);
+    __atomic_store_n(&record->magic, RECORD_MAGIC, __ATOMIC_RELEASE);
+    segment.writeOffset += size;
+    // Only now is the record part of the segment
+    __atomic_store_n(&((SegmentHeader *) segment.base)->writeOffset,
+                     (uint32_t) segment.writeOffset, __ATOMIC_RELEASE);
+    _appended++;
+
+    return true;
+}
+
+bool MqttSpool::append(const meshtastic_MqttClientProxyMessage &m)
+{
+    return appendRecord(PROXY_MESSAGE, meshtastic_MqttClientProxyMessage_fields,
+                        &m);
+}
+
+bool MqttSpool::append(const meshtastic_MeshPacket &p)
+{
+    return appendRecord(MESH_PACKET, meshtastic_MeshPacket_fields, &p);
+}
+
+bool MqttSpool::decode(const uint8_t *record, RecordType &type,
+                       meshtastic_MqttClientProxyMessage &m,
+                       meshtastic_MeshPacket &p)
+{
+    const RecordHeader *header = (const RecordHeader *) record;
+    pb_istream_t stream;
+
+    stream = pb_istream_from_buffer((const pb_byte_t *) (header + 1),
+                                    header->length);
+    switch (header->type) {
+    case PROXY_MESSAGE:
+        if (!pb_decode(&stream, meshtastic_MqttClientProxyMessage_fields,
+                       &m)) {
+            return false;
+        }
+        break;
+    case MESH_PACKET:
+        if (!pb_decode(&stream, meshtastic_MeshPacket_fields, &p)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    type = (RecordType) header->type;
+
+    return true;
+}
+
+bool MqttSpool::peek(RecordType &type, meshtastic_MqttClientProxyMessage &m,
+                     meshtastic_MeshPacket &p)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    while (!_segments.empty()) {
+        Segment &segment = _segments.front();
+        SegmentHeader *header = (SegmentHeader *) segment.base;
+        const RecordHeader *record;
+
+        if (header->readOffset >= segment.writeOffset) {
+            if (_segments.size() == 1) {
+                return false;
+            }
+            // Fully replayed and no longer written to
+            closeSegment(segment, true);
+            _segments.pop_front();
+            continue;
+        }
+
+        record = (const RecordHeader *) (segment.base + header->readOffset);
+        if (!decode((const uint8_t *) record, type, m, p)) {
+            // Skip what we cannot decode rather than wedge the spool
+            header->readOffset += recordSize(record->length);
+            _dropped++;
+            continue;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void MqttSpool::pop(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_segments.empty()) {
+        return;
+    }
+
+    Segment &segment = _segments.front();
+    SegmentHeader *header = (SegmentHeader *) segment.base;
+    const RecordHeader *record =
+        (const RecordHeader *) (segment.base + header->readOffset);
+
+    if (header->readOffset >= segment.writeOffset) {
+        return;
+    }
+
+    header->readOffset += recordSize(record->length);
+    _replayed++;
+    rewindIfDrained();
+}
+
+void MqttSpool::rewindIfDrained(void)
+{
+    Segment &segment = _segments.front();
+    SegmentHeader *header = (SegmentHeader *) segment.base;
+
+    if ((_segments.size() == 1) &&
+        (header->readOffset >= segment.writeOffset)) {
+        // Drained: rewind the only segment instead of growing it. The
+        // old records stay behind, but past the write offset.
+        header->writeOffset = DATA_START;
+        segment.writeOffset = DATA_START;
+        header->readOffset = DATA_START;
+        _ahead = 0;
+    }
+}
+
+MqttSpool::Segment *MqttSpool::aheadSegment(void)
+{
+    if (_segments.empty()) {
+        return NULL;
+    }
+
+    if ((_ahead == 0) || (_aheadSeq < _segments.front().seq)) {
+        // Nothing read ahead, or trim() took it away
+        _aheadSeq = _segments.front().seq;
+        _aheadOffset = ((SegmentHeader *) _segments.front().base)->readOffset;
+        _ahead = 0;
+        _aheadSkipped = 0;
+    }
+
+    for (deque<Segment>::iterator it = _segments.begin();
+         it != _segments.end(); it++) {
+        if (it->seq != _aheadSeq) {
+            continue;
+        }
+        if ((_aheadOffset >= it->writeOffset) &&
+            ((it + 1) != _segments.end())) {
+            // On to the next segment, read from its start
+            it++;
+            _aheadSeq = it->seq;
+            _aheadOffset = DATA_START;
+        }
+        return &*it;
+    }
+
+    return NULL;
+}
+
+bool MqttSpool::peekAhead(RecordType &type,
+                          meshtastic_MqttClientProxyMessage &m,
+                          meshtastic_MeshPacket &p)
+{
+    lock_guard<mutex> lock(_mutex);
+    Segment *segment;
+
+    while (((segment = aheadSegment()) != NULL) &&
+           (_aheadOffset < segment->writeOffset)) {
+        const RecordHeader *record =
+            (const RecordHeader *) (segment->base + _aheadOffset);
+
+        if (decode((const uint8_t *) record, type, m, p)) {
+            return true;
+        }
+
+        // Skipped, and consumed with the rest by popAhead()
+        _aheadOffset += recordSize(record->length);
+        _ahead++;
+        _aheadSkipped++;
+        _dropped++;
+    }
+
+    return false;
+}
+
+void MqttSpool::next(void)
+{
+    lock_guard<mutex> lock(_mutex);
+    Segment *segment = aheadSegment();
+    const RecordHeader *record;
+
+    if ((segment == NULL) || (_aheadOffset >= segment->writeOffset)) {
+        return;
+    }
+
+    record = (const RecordHeader *) (segment->base + _aheadOffset);
+    _aheadOffset += recordSize(record->length);
+    _ahead++;
+}
+
+void MqttSpool::popAhead(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if ((_ahead == 0) || _segments.empty() ||
+        (_aheadSeq < _segments.front().seq)) {
+        // Nothing to consume, or trim() already dropped it
+        _ahead = 0;
+        return;
+    }
+
+    // Segments read all the way through are done with
+    while ((_segments.size() > 1) && (_segments.front().seq < _aheadSeq)) {
+        closeSegment(_segments.front(), true);
+        _segments.pop_front();
+    }
+
+    ((SegmentHeader *) _segments.front().base)->readOffset = _aheadOffset;
+    _replayed += _ahead - _aheadSkipped;
+    _ahead = 0;
+    _aheadSkipped = 0;
+    rewindIfDrained();
+}
+
+void MqttSpool::rewind(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    _ahead = 0;
+    _aheadSkipped = 0;
+}
+
+unsigned int MqttSpool::ahead(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _ahead;
+}
+
+bool MqttSpool::empty(void)
+{
+    return bytes() == 0;
+}
+
+size_t MqttSpool::bytes(void)
+{
+    size_t bytes = 0;
+    lock_guard<mutex> lock(_mutex);
+
+    for (deque<Segment>::const_iterator it = _segments.begin();
+         it != _segments.end(); it++) {
+        const SegmentHeader *header = (const SegmentHeader *) it->base;
+        bytes += it->writeOffset - header->readOffset;
+    }
+
+    return bytes;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
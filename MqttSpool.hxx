@@ -0,0 +1,138 @@
+/*
+ * MqttSpool.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef MQTTSPOOL_HXX
+#define MQTTSPOOL_HXX
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Append-only, memory-mapped on-disk spool for messages that could not be
+ * delivered to the broker.
+ *
+ * The spool is a directory of fixed-size segment files (NNNNNNNN.seg).
+ * Messages are pb-encoded and appended as records to the newest segment
+ * and consumed in order from the oldest one; each segment header keeps
+ * its read and write offsets, so a restarted daemon resumes where it left
+ * off. When the spool exceeds its size cap the oldest segment is
+ * discarded.
+ */
+class MqttSpool {
+
+public:
+
+    enum RecordType {
+        PROXY_MESSAGE = 1,
+        MESH_PACKET = 2,
+    };
+
+    MqttSpool();
+    ~MqttSpool();
+
+    bool open(const string &dir, size_t maxBytes = 16 * 1024 * 1024,
+              size_t segmentBytes = 1024 * 1024);
+    void close(void);
+
+    bool append(const meshtastic_MqttClientProxyMessage &m);
+    bool append(const meshtastic_MeshPacket &p);
+
+    // Decodes the oldest record into m or p (per type) without consuming
+    bool peek(RecordType &type, meshtastic_MqttClientProxyMessage &m,
+              meshtastic_MeshPacket &p);
+    void pop(void);
+
+    // Reading ahead: records stay in the spool until popAhead() consumes
+    // all those next()ed past, or rewind() goes back to the oldest one
+    bool peekAhead(RecordType &type, meshtastic_MqttClientProxyMessage &m,
+                   meshtastic_MeshPacket &p);
+    void next(void);
+    void popAhead(void);
+    void rewind(void);
+    unsigned int ahead(void);
+
+    bool empty(void);
+    size_t bytes(void);
+
+    inline const string &dir(void) const {
+        return _dir;
+    }
+
+    inline unsigned long appended(void) const {
+        return _appended;
+    }
+
+    inline unsigned long replayed(void) const {
+        return _replayed;
+    }
+
+    inline unsigned long dropped(void) const {
+        return _dropped;
+    }
+
+private:
+
+    struct Segment {
+        uint32_t seq;
+        int fd;
+        uint8_t *base;
+        size_t size;
+        size_t writeOffset;
+    };
+
+    bool appendRecord(RecordType type, const pb_msgdesc_t *fields,
+                      const void *src);
+    bool openSegment(uint32_t seq, bool create);
+    void closeSegment(Segment &segment, bool unlinkFile);
+    size_t scanRecords(const Segment &segment, size_t offset, size_t end,
+                       unsigned long *count) const;
+    static bool decode(const uint8_t *record, RecordType &type,
+                       meshtastic_MqttClientProxyMessage &m,
+                       meshtastic_MeshPacket &p);
+    Segment *aheadSegment(void);
+    void rewindIfDrained(void);
+    string segmentPath(uint32_t seq) const;
+    void trim(void);
+
+private:
+
+    string _dir;
+    size_t _maxBytes;
+    size_t _segmentBytes;
+
+    mutex _mutex;
+    deque<Segment> _segments;
+    // Read-ahead cursor; _ahead records past the read offset
+    uint32_t _aheadSeq;
+    size_t _aheadOffset;
+    unsigned int _ahead;
+    unsigned int _aheadSkipped;
+    uint8_t _encodeBuf[meshtastic_MqttClientProxyMessage_size >
+                       meshtastic_MeshPacket_size ?
+                       meshtastic_MqttClientProxyMessage_size :
+                       meshtastic_MeshPacket_size];
+
+    atomic<unsigned long> _appended;
+    atomic<unsigned long> _replayed;
+    atomic<unsigned long> _dropped;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,638 @@
+/*
+ * NodeDb.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <Logger.hxx>
+#include <NodeDb.hxx>
+
+#define NODEDB_MAGIC    0x444e4d4d  // "MMND"
+#define NODEDB_VERSION  3
+#define WAL_MAGIC       0x4c574d4d  // "MMWL"
+// Record-aligned, so that no record straddles a page
+#define DATA_START      256
+
+static_assert(sizeof(NodeDb::NodeRecord) == 256,
+              "NodeRecord is part of the on-disk format");
+static_assert(DATA_START % sizeof(NodeDb::NodeRecord) == 0,
+              "NodeRecords must not cross pages");
+
+struct TableHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;
+};
+
+struct WalEntry {
+    uint32_t magic;
+    uint32_t offset;            // into the table file
+    uint32_t length;
+    uint32_t checksum;          // FNV-1a of offset, length and data
+};
+
+static uint32_t checksum(uint32_t offset, uint32_t length, const void *data)
+{
+    const uint8_t *p;
+    uint32_t h = 2166136261u;
+
+    p = (const uint8_t *) &offset;
+    for (size_t i = 0; i < sizeof(offset); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    p = (const uint8_t *) &length;
+    for (size_t i = 0; i < sizeof(length); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    p = (const uint8_t *) data;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+// Zero-padded so that an unchanged name compares equal byte for byte
+static void copyString(char *dst, size_t size, const char *src)
+{
+    size_t length = strnlen(src, size - 1);
+
+    memset(dst, 0x0, size);
+    memcpy(dst, src, length);
+}
+
+static inline unsigned int hashNum(uint32_t num)
+{
+    num ^= num >> 16;
+    num *= 0x45d9f3b;
+    num ^= num >> 16;
+
+    return num;
+}
+
+NodeDb::NodeDb()
+    : _fd(-1),
+      _walfd(-1),
+      _map(NULL),
+      _mapSize(0),
+      _records(NULL),
+      _heardDirty(false),
+      _capacity(0),
+      _count(0),
+      _walBytes(0),
+      _walMaxBytes(256 * 1024),
+      _compactSec(3600),
+      _compactedAt(0),
+      _compactions(0),
+      _dropped(0)
+{
+
+}
+
+NodeDb::~NodeDb()
+{
+    close();
+}
+
+bool NodeDb::open(const string &path, unsigned int capacity)
+{
+    TableHeader *header;
+    struct stat st;
+    bool init = false;
+    bool replayed = false;
+    lock_guard<mutex> lock(_mutex);
+
+    if (capacity == 0) {
+        return false;
+    }
+
+    _path = path;
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ((_fd == -1) || (fstat(_fd, &st) == -1)) {
+        LOGE(STORE, "%s: %s", path.c_str(), strerror(errno));
+        goto fail;
+    }
+
+    if (st.st_size >= DATA_START) {
+        TableHeader existing;
+
+        if ((pread(_fd, &existing, sizeof(existing), 0) !=
+             (ssize_t) sizeof(existing)) ||
+            (existing.magic != NODEDB_MAGIC) ||
+            (existing.version != NODEDB_VERSION) ||
+            (existing.recordSize != sizeof(NodeRecord))) {
+            LOGW(STORE, "%s: not a node database, recreating", path.c_str());
+            init = true;
+        } else {
+            // The file decides; a new capacity needs a new file
+            capacity = existing.capacity;
+        }
+    } else {
+        init = true;
+    }
+
+    _capacity = capacity;
+    _mapSize = DATA_START + ((size_t) capacity * sizeof(NodeRecord));
+    if (init && (ftruncate(_fd, 0) == -1)) {
+        LOGE(STORE, "%s: %s", path.c_str(), strerror(errno));
+        goto fail;
+    }
+    if (ftruncate(_fd, _mapSize) == -1) {
+        LOGE(STORE, "%s: %s", path.c_str(), strerror(errno));
+        goto fail;
+    }
+
+    _map = (uint8_t *) mmap(NULL, _mapSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED) {
+        _map = NULL;
+        LOGE(STORE, "%s: mmap: %s", path.c_str(), strerror(errno));
+        goto fail;
+    }
+    _records = (NodeRecord *) (_map + DATA_START);
+
+    if (init) {
+        header = (TableHeader *) _map;
+        header->magic = NODEDB_MAGIC;
+        header->version = NODEDB_VERSION;
+        header->recordSize = sizeof(NodeRecord);
+        header->capacity = capacity;
+        msync(_map, _mapSize, MS_SYNC);
+    }
+
+    _walfd = ::open((path + ".wal").c_str(),
+                    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_walfd == -1) {
+        LOGE(STORE, "%s.wal: %s", path.c_str(), strerror(errno));
+        goto fail;
+    }
+    if (init) {
+        // Its offsets are into the table that was just thrown away
+        if (ftruncate(_walfd, 0) == -1) {
+            LOGE(STORE, "%s.wal: %s", path.c_str(), strerror(errno));
+            goto fail;
+        }
+    } else {
+        replayed = replay();
+    }
+
+    _count = 0;
+    _heard.assign(_capacity, Heard());
+    for (unsigned int i = 0; i < _capacity; i++) {
+        if (_records[i].num != 0) {
+            _count++;
+        }
+        _heard[i].lastHeard = _records[i].lastHeard;
+        _heard[i].snr = _records[i].snr;
+        _heard[i].rssi = _records[i].rssi;
+    }
+    _heardDirty = false;
+
+    if (replayed) {
+        compactLocked();
+    }
+    _compactedAt = time(NULL);
+
+    return true;
+
+fail:
+
+    if (_map != NULL) {
+        munmap(_map, _mapSize);
+        _map = NULL;
+        _records = NULL;
+    }
+    if (_walfd != -1) {
+        ::close(_walfd);
+        _walfd = -1;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _capacity = 0;
+
+    return false;
+}
+
+void NodeDb::close(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_map != NULL) {
+        compactLocked();
+        munmap(_map, _mapSize);
+        _map = NULL;
+        _records = NULL;
+    }
+    _heard.clear();
+    _heardDirty = false;
+    if (_walfd != -1) {
+        ::close(_walfd);
+        _walfd = -1;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _capacity = 0;
+    _count = 0;
+}
+
+void NodeDb::setCompaction(size_t walMaxBytes, unsigned int compactSec)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    _walMaxBytes = walMaxBytes;
+    _compactSec = compactSec;
+}
+
+bool NodeDb::replay(void)
+{
+    WalEntry entry;
+    uint8_t data[sizeof(NodeRecord)];
+    off_t offset = 0;
+
+    for (;;) {
+        if (pread(_walfd, &entry, sizeof(entry), offset) !=
+            (ssize_t) sizeof(entry)) {
+            break;
+        }
+        if ((entry.magic != WAL_MAGIC) ||
+            (entry.length == 0) || (entry.length > sizeof(data)) ||
+            (entry.offset < DATA_START) ||
+            (entry.offset + entry.length > _mapSize)) {
+            break;
+        }
+        if ((pread(_walfd, data, entry.length, offset + sizeof(entry)) !=
+             (ssize_t) entry.length) ||
+            (checksum(entry.offset, entry.length, data) != entry.checksum)) {
+            break;      // torn tail
+        }
+
+        memcpy(_map + entry.offset, data, entry.length);
+        offset += sizeof(entry) + entry.length;
+    }
+
+    // Anything in the log, applied or torn, is settled by a compaction
+    return lseek(_walfd, 0, SEEK_END) > 0;
+}
+
+void NodeDb::compactLocked(void)
+{
+    if ((_map == NULL) || (_walfd == -1)) {
+        return;
+    }
+
+    if (_heardDirty) {
+        for (unsigned int i = 0; i < _capacity; i++) {
+            NodeRecord &record = _records[i];
+            const Heard &heard = _heard[i];
+
+            // Leave the pages of nodes not heard from alone
+            if ((record.num == 0) ||
+                ((record.lastHeard == heard.lastHeard) &&
+                 (record.snr == heard.snr) && (record.rssi == heard.rssi))) {
+                continue;
+            }
+            record.lastHeard = heard.lastHeard;
+            record.snr = heard.snr;
+            record.rssi = heard.rssi;
+        }
+        _heardDirty = false;
+    }
+
+    // Table first, then forget the log that led to it
+    if (msync(_map, _mapSize, MS_SYNC) == -1) {
+        LOGE(STORE, "%s: msync: %s", _path.c_str(), strerror(errno));
+        return;
+    }
+    if (ftruncate(_walfd, 0) == -1) {
+        LOGE(STORE, "%s.wal: %s", _path.c_str(), strerror(errno));
+        return;
+    }
+    _walBytes = 0;
+    _compactedAt = time(NULL);
+    _compactions++;
+}
+
+void NodeDb::compact(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    compactLocked();
+}
+
+void NodeDb::sync(void)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if ((_walfd == -1) || ((_walBytes == 0) && !_heardDirty)) {
+        return;
+    }
+
+    if ((_walBytes >= _walMaxBytes) ||
+        (time(NULL) - _compactedAt >= (time_t) _compactSec)) {
+        compactLocked();
+    } else if (_walBytes > 0) {
+        fdatasync(_walfd);
+    }
+}
+
+NodeDb::NodeRecord *NodeDb::find(uint32_t num, bool insert)
+{
+    unsigned int i;
+
+    if ((_records == NULL) || (num == 0)) {
+        return NULL;
+    }
+
+    i = hashNum(num) % _capacity;
+    for (unsigned int probe = 0; probe < _capacity; probe++) {
+        NodeRecord *record = &_records[(i + probe) % _capacity];
+
+        if (record->num == num) {
+            return record;
+        }
+        if (record->num == 0) {
+            // Records are never removed, so the probe chain ends here
+            return insert ? record : NULL;
+        }
+    }
+
+    if (insert) {
+        _dropped++;
+    }
+
+    return NULL;
+}
+
+void NodeDb::write(NodeRecord *record, const NodeRecord &updated)
+{
+    const uint8_t *from = (const uint8_t *) record;
+    const uint8_t *to = (const uint8_t *) &updated;
+    size_t first = 0;
+    size_t last = sizeof(NodeRecord);
+    WalEntry entry;
+    struct iovec iov[2];
+
+    // Log just the span of bytes that changed
+    while ((first < last) && (from[first] == to[first])) {
+        first++;
+    }
+    if (first == last) {
+        return;
+    }
+    while (from[last - 1] == to[last - 1]) {
+        last--;
+    }
+
+    if (record->num == 0) {
+        _count++;
+    }
+
+    entry.magic = WAL_MAGIC;
+    entry.offset = ((const uint8_t *) record - _map) + first;
+    entry.length = last - first;
+    entry.checksum = checksum(entry.offset, entry.length, to + first);
+    iov[0].iov_base = &entry;
+    iov[0].iov_len = sizeof(entry);
+    iov[1].iov_base = (void *) (to + first);
+    iov[1].iov_len = entry.length;
+    if (writev(_walfd, iov, 2) == (ssize_t) (sizeof(entry) + entry.length)) {
+        _walBytes += sizeof(entry) + entry.length;
+    } else {
+        // The mapped copy still gets the update; it is only less durable
+        LOGE(STORE, "%s.wal: %s", _path.c_str(), strerror(errno));
+    }
+
+    *record = updated;
+}
+
+void NodeDb::heard(const meshtastic_MeshPacket &packet, time_t t)
+{
+    lock_guard<mutex> lock(_mutex);
+    NodeRecord *record = find(packet.from, true);
+    NodeRecord updated;
+    Heard *heard;
+
+    if (record == NULL) {
+        return;
+    }
+
+    heard = &_heard[record - _records];
+    heard->lastHeard = t;
+    if (packet.rx_rssi != 0) {
+        heard->snr = packet.rx_snr;
+        heard->rssi = packet.rx_rssi;
+    }
+
+    if (record->num != 0) {
+        _heardDirty = true;
+        return;
+    }
+
+    // A new node is logged, so that it keeps its slot after a crash
+    updated = *record;
+    updated.num = packet.from;
+    updated.lastHeard = heard->lastHeard;
+    updated.snr = heard->snr;
+    updated.rssi = heard->rssi;
+    write(record, updated);
+}
+
+void NodeDb::updateUser(uint32_t num, const meshtastic_User &user)
+{
+    lock_guard<mutex> lock(_mutex);
+    NodeRecord *record = find(num, true);
+    NodeRecord updated;
+
+    if (record == NULL) {
+        return;
+    }
+
+    updated = *record;
+    updated.num = num;
+    copyString(updated.id, sizeof(updated.id), user.id);
+    copyString(updated.longName, sizeof(updated.longName), user.long_name);
+    copyString(updated.shortName, sizeof(updated.shortName),
+               user.short_name);
+    updated.hwModel = user.hw_model;
+    updated.role = user.role;
+    updated.isLicensed = user.is_licensed;
+    updated.publicKeySize = min((size_t) user.public_key.size,
+                                sizeof(updated.publicKey));
+    memset(updated.publicKey, 0x0, sizeof(updated.publicKey));
+    memcpy(updated.publicKey, user.public_key.bytes, updated.publicKeySize);
+    write(record, updated);
+}
+
+void NodeDb::updatePosition(uint32_t num, const meshtastic_Position &position)
+{
+    lock_guard<mutex> lock(_mutex);
+    NodeRecord *record = find(num, true);
+    NodeRecord updated;
+
+    if ((record == NULL) || !position.has_latitude_i ||
+        !position.has_longitude_i) {
+        return;
+    }
+
+    updated = *record;
+    updated.num = num;
+    updated.latitudeI = position.latitude_i;
+    updated.longitudeI = position.longitude_i;
+    if (position.has_altitude) {
+        updated.altitude = position.altitude;
+    }
+    updated.positionTime = position.time;
+    write(record, updated);
+}
+
+void NodeDb::updateDeviceMetrics(uint32_t num,
+                                 const meshtastic_DeviceMetrics &metrics)
+{
+    lock_guard<mutex> lock(_mutex);
+    NodeRecord *record = find(num, true);
+    NodeRecord updated;
+
+    if (record == NULL) {
+        return;
+    }
+
+    updated = *record;
+    updated.num = num;
+    if (metrics.has_battery_level) {
+        updated.batteryLevel = metrics.battery_level;
+    }
+    if (metrics.has_voltage) {
+        updated.voltage = metrics.voltage;
+    }
+    if (metrics.has_channel_utilization) {
+        updated.channelUtilization = metrics.channel_utilization;
+    }
+    if (metrics.has_air_util_tx) {
+        updated.airUtilTx = metrics.air_util_tx;
+    }
+    if (metrics.has_uptime_seconds) {
+        updated.uptimeSeconds = metrics.uptime_seconds;
+    }
+    write(record, updated);
+}
+
+bool NodeDb::get(uint32_t num, NodeRecord &record) const
+{
+    lock_guard<mutex> lock(_mutex);
+    const NodeRecord *found;
+
+    found = const_cast<NodeDb *>(this)->find(num, false);
+    if (found == NULL) {
+        return false;
+    }
+    current(found, record);
+
+    return true;
+}
+
+bool NodeDb::slot(unsigned int slot, NodeRecord &record) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if ((_records == NULL) || (slot >= _capacity) ||
+        (_records[slot].num == 0)) {
+        return false;
+    }
+    current(&_records[slot], record);
+
+    return true;
+}
+
+void NodeDb::current(const NodeRecord *record, NodeRecord &copy) const
+{
+    const Heard &heard = _heard[record - _records];
+
+    copy = *record;
+    copy.lastHeard = heard.lastHeard;
+    copy.snr = heard.snr;
+    copy.rssi = heard.rssi;
+}
+
+bool NodeDb::toUser(const NodeRecord &record, meshtastic_User &user)
+{
+    memset(&user, 0x0, sizeof(user));
+    if ((record.id[0] == '\0') && (record.longName[0] == '\0')) {
+        return false;
+    }
+
+    copyString(user.id, sizeof(user.id), record.id);
+    copyString(user.long_name, sizeof(user.long_name), record.longName);
+    copyString(user.short_name, sizeof(user.short_name), record.shortName);
+    user.hw_model = (meshtastic_HardwareModel) record.hwModel;
+    user.role = (meshtastic_Config_DeviceConfig_Role) record.role;
+    user.is_licensed = record.isLicensed != 0;
+    user.public_key.size = min((size_t) record.publicKeySize,
+                               sizeof(user.public_key.bytes));
+    memcpy(user.public_key.bytes, record.publicKey, user.public_key.size);
+
+    return true;
+}
+
+bool NodeDb::toPosition(const NodeRecord &record,
+                        meshtastic_Position &position)
+{
+    memset(&position, 0x0, sizeof(position));
+    if (record.positionTime == 0) {
+        return false;
+    }
+
+    position.has_latitude_i = true;
+    position.latitude_i = record.latitudeI;
+    position.has_longitude_i = true;
+    position.longitude_i = record.longitudeI;
+    position.has_altitude = true;
+    position.altitude = record.altitude;
+    position.time = record.positionTime;
+
+    return true;
+}
+
+bool NodeDb::toDeviceMetrics(const NodeRecord &record,
+                             meshtastic_DeviceMetrics &metrics)
+{
+    memset(&metrics, 0x0, sizeof(metrics));
+    if (record.uptimeSeconds == 0) {
+        return false;
+    }
+
+    metrics.has_battery_level = true;
+    metrics.battery_level = record.batteryLevel;
+    metrics.has_voltage = true;
+    metrics.voltage = record.voltage;
+    metrics.has_channel_utilization = true;
+    metrics.channel_utilization = record.channelUtilization;
+    metrics.has_air_util_tx = true;
+    metrics.air_util_tx = record.airUtilTx;
+    metrics.has_uptime_seconds = true;
+    metrics.uptime_seconds = record.uptimeSeconds;
+
+    return true;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,165 @@
+/*
+ * NodeDb.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef NODEDB_HXX
+#define NODEDB_HXX
+
+#include <stdint.h>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Persistent table of the nodes heard on the mesh.
+ *
+ * The table file is a header followed by fixed-size records, placed by
+ * open addressing on the node number, and is memory-mapped so that
+ * opening it costs a map and a replay of the log. An update patches the
+ * mapped record and appends only the bytes that changed to a write-ahead
+ * log next to it; the mapped pages reach the disk when the log is
+ * compacted (msync, then truncate), which happens when it grows past a
+ * limit or gets old. Log entries carry absolute offsets and a checksum,
+ * so replaying them after a crash is idempotent and a torn tail is
+ * ignored.
+ *
+ * Hearing a node changes only its lastHeard, snr and rssi. That happens
+ * on every packet, so those are kept in memory and folded into the
+ * table at compaction rather than logged.
+ */
+class NodeDb {
+
+public:
+
+    struct NodeRecord {
+        uint32_t num;               // 0: free slot
+        uint32_t lastHeard;
+        float snr;
+        int32_t rssi;
+        char id[16];
+        char longName[40];
+        char shortName[8];
+        int32_t latitudeI;
+        int32_t longitudeI;
+        int32_t altitude;
+        uint32_t positionTime;
+        uint32_t batteryLevel;
+        float voltage;
+        float channelUtilization;
+        float airUtilTx;
+        uint32_t uptimeSeconds;
+        uint32_t hwModel;
+        uint32_t role;
+        uint8_t isLicensed;
+        uint8_t publicKeySize;
+        uint8_t publicKey[32];
+        uint8_t reserved[98];
+    };
+
+    NodeDb();
+    ~NodeDb();
+
+    bool open(const string &path, unsigned int capacity = 4096);
+    void close(void);
+
+    void setCompaction(size_t walMaxBytes, unsigned int compactSec);
+
+    void heard(const meshtastic_MeshPacket &packet, time_t t);
+    void updateUser(uint32_t num, const meshtastic_User &user);
+    void updatePosition(uint32_t num, const meshtastic_Position &position);
+    void updateDeviceMetrics(uint32_t num,
+                             const meshtastic_DeviceMetrics &metrics);
+
+    bool get(uint32_t num, NodeRecord &record) const;
+    // Copies out the record in the given slot (0 .. capacity - 1), if any
+    bool slot(unsigned int slot, NodeRecord &record) const;
+
+    // What a record holds, as MeshClient takes it; false if it holds none
+    static bool toUser(const NodeRecord &record, meshtastic_User &user);
+    static bool toPosition(const NodeRecord &record,
+                           meshtastic_Position &position);
+    static bool toDeviceMetrics(const NodeRecord &record,
+                                meshtastic_DeviceMetrics &metrics);
+
+    // Makes logged updates durable; compacts if due
+    void sync(void);
+    void compact(void);
+
+    inline const string &path(void) const {
+        return _path;
+    }
+
+    inline unsigned int capacity(void) const {
+        return _capacity;
+    }
+
+    inline unsigned int count(void) const {
+        return _count;
+    }
+
+    inline size_t walBytes(void) const {
+        return _walBytes;
+    }
+
+    inline unsigned long compactions(void) const {
+        return _compactions;
+    }
+
+    inline unsigned long dropped(void) const {
+        return _dropped;
+    }
+
+private:
+
+    struct Heard {
+        uint32_t lastHeard;
+        float snr;
+        int32_t rssi;
+    };
+
+    NodeRecord *find(uint32_t num, bool insert);
+    void write(NodeRecord *record, const NodeRecord &updated);
+    // The record with what was heard since the last compaction
+    void current(const NodeRecord *record, NodeRecord &copy) const;
+    bool replay(void);
+    void compactLocked(void);
+
+private:
+
+    mutable mutex _mutex;
+    string _path;
+    int _fd;
+    int _walfd;
+    uint8_t *_map;
+    size_t _mapSize;
+    NodeRecord *_records;
+    vector<Heard> _heard;       // by slot
+    bool _heardDirty;
+    unsigned int _capacity;
+    unsigned int _count;
+    size_t _walBytes;
+    size_t _walMaxBytes;
+    unsigned int _compactSec;
+    time_t _compactedAt;
+    unsigned long _compactions;
+    unsigned long _dropped;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
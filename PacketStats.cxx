@@ -0,0 +1,100 @@
+/*
+ * PacketStats.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <ctime>
+#include <PacketStats.hxx>
+
+PacketStats::PacketStats()
+{
+    _packets = 0;
+    for (unsigned int i = 0; i < NUM_PORTNUMS; i++) {
+        _portnums[i] = 0;
+    }
+    for (unsigned int i = 0; i < NODE_SLOTS; i++) {
+        _nodes[i].num = 0;
+        _nodes[i].heard = 0;
+        _nodes[i].packets = 0;
+    }
+    _nodesDropped = 0;
+}
+
+PacketStats::~PacketStats()
+{
+
+}
+
+void PacketStats::record(const meshtastic_MeshPacket &packet)
+{
+    uint32_t lastHeard;
+    uint16_t rssi;
+    uint16_t snr;
+    unsigned int slot;
+
+    _packets++;
+    if ((packet.which_payload_variant == meshtastic_MeshPacket_decoded_tag) &&
+        (packet.decoded.portnum < NUM_PORTNUMS)) {
+        _portnums[packet.decoded.portnum]++;
+    }
+
+    if (packet.from == 0) {
+        return;
+    }
+
+    lastHeard = packet.rx_time != 0 ? packet.rx_time : time(NULL);
+    rssi = (uint16_t) (int16_t) packet.rx_rssi;
+    snr = (uint16_t) (int16_t) (packet.rx_snr * 4.0);
+
+    // Linear probing; a slot is claimed once and never given back
+    slot = (packet.from * 2654435761U) % NODE_SLOTS;
+    for (unsigned int i = 0; i < NODE_SLOTS; i++) {
+        Slot &s = _nodes[(slot + i) % NODE_SLOTS];
+        uint32_t num = s.num.load();
+
+        if ((num == 0) && s.num.compare_exchange_strong(num, packet.from)) {
+            num = packet.from;
+        }
+        if (num == packet.from) {
+            s.heard = (((uint64_t) lastHeard) << 32) |
+                (((uint64_t) rssi) << 16) | snr;
+            s.packets++;
+            return;
+        }
+    }
+
+    _nodesDropped++;
+}
+
+bool PacketStats::node(unsigned int slot, Node &node) const
+{
+    uint64_t heard;
+
+    if (slot >= NODE_SLOTS) {
+        return false;
+    }
+
+    node.num = _nodes[slot].num;
+    heard = _nodes[slot].heard;
+    if ((node.num == 0) || (heard == 0)) {
+        return false;
+    }
+
+    node.lastHeard = heard >> 32;
+    node.rssi = (int16_t) ((heard >> 16) & 0xffff);
+    node.snr = ((int16_t) (heard & 0xffff)) / 4.0;
+    node.packets = _nodes[slot].packets;
+
+    return true;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
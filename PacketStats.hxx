@@ -0,0 +1,86 @@
+/*
+ * PacketStats.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef PACKETSTATS_HXX
+#define PACKETSTATS_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Per-radio packet counters by portnum and a last-heard table of nodes.
+ *
+ * Updated from the radio receive path and read by exporters, so neither
+ * side takes a lock: counters are atomics and each node's last-heard
+ * time, RSSI and SNR are packed into a single 64-bit word. The node
+ * table is fixed in size; nodes that do not fit are counted, not stored.
+ */
+class PacketStats {
+
+public:
+
+    static const unsigned int NUM_PORTNUMS = meshtastic_PortNum_MAX + 1;
+    static const unsigned int NODE_SLOTS = 1024;
+
+    struct Node {
+        uint32_t num;
+        time_t lastHeard;
+        int rssi;
+        float snr;
+        unsigned long packets;
+    };
+
+    PacketStats();
+    ~PacketStats();
+
+    void record(const meshtastic_MeshPacket &packet);
+
+    inline unsigned long packets(void) const {
+        return _packets;
+    }
+
+    inline unsigned long portnum(unsigned int portnum) const {
+        return portnum < NUM_PORTNUMS ? _portnums[portnum].load() : 0;
+    }
+
+    // Copies out the node in the given slot (0 .. NODE_SLOTS - 1), if any
+    bool node(unsigned int slot, Node &node) const;
+
+    inline unsigned long nodesDropped(void) const {
+        return _nodesDropped;
+    }
+
+private:
+
+    struct Slot {
+        atomic<uint32_t> num;
+        atomic<uint64_t> heard;     // lastHeard:32 rssi:16 snr*4:16
+        atomic<unsigned long> packets;
+    };
+
+private:
+
+    atomic<unsigned long> _packets;
+    atomic<unsigned long> _portnums[NUM_PORTNUMS];
+    Slot _nodes[NODE_SLOTS];
+    atomic<unsigned long> _nodesDropped;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
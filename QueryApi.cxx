@@ -0,0 +1,735 @@
+/*
+ * QueryApi.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <Json.hxx>
+#include <RadioName.hxx>
+#include <QueryApi.hxx>
+
+static void appendError(string &s, const string &id, const char *error)
+{
+    s += "{\"id\":";
+    s += id.empty() ? "null" : id;
+    s += ",\"ok\":false,\"error\":";
+    Json::appendString(s, error, strlen(error));
+    s += "}\n";
+}
+
+static inline const char *skipSpace(const char *p, const char *end)
+{
+    while ((p < end) &&
+           ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))) {
+        p++;
+    }
+
+    return p;
+}
+
+static bool parseHex(const char *p, unsigned int &code)
+{
+    code = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        char c = p[i] | 0x20;
+
+        code <<= 4;
+        if ((c >= '0') && (c <= '9')) {
+            code |= c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            code |= c - 'a' + 10;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void appendUtf8(string &s, unsigned int code)
+{
+    if (code < 0x80) {
+        s += (char) code;
+    } else if (code < 0x800) {
+        s += (char) (0xc0 | (code >> 6));
+        s += (char) (0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        s += (char) (0xe0 | (code >> 12));
+        s += (char) (0x80 | ((code >> 6) & 0x3f));
+        s += (char) (0x80 | (code & 0x3f));
+    } else {
+        s += (char) (0xf0 | (code >> 18));
+        s += (char) (0x80 | ((code >> 12) & 0x3f));
+        s += (char) (0x80 | ((code >> 6) & 0x3f));
+        s += (char) (0x80 | (code & 0x3f));
+    }
+}
+
+static bool parseString(const char *&p, const char *end, string &value)
+{
+    unsigned int code;
+    unsigned int low;
+
+    value.clear();
+    if ((p == end) || (*p != '"')) {
+        return false;
+    }
+
+    for (p++; p < end; p++) {
+        if (*p == '"') {
+            p++;
+            return true;
+        }
+        if (*p != '\\') {
+            value += *p;
+            continue;
+        }
+
+        if (++p == end) {
+            break;
+        }
+        switch (*p) {
+        case 'b': value += '\b'; break;
+        case 'f': value += '\f'; break;
+        case 'n': value += '\n'; break;
+        case 'r': value += '\r'; break;
+        case 't': value += '\t'; break;
+        case '"':
+        case '\\':
+        case '/':
+            value += *p;
+            break;
+        case 'u':
+            if ((end - p < 5) || !parseHex(p + 1, code)) {
+                return false;
+            }
+            p += 4;
+            if ((code >= 0xd800) && (code < 0xdc00) && (end - p >= 7) &&
+                (p[1] == '\\') && (p[2] == 'u') && parseHex(p + 3, low) &&
+                (low >= 0xdc00) && (low < 0xe000)) {
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                p += 6;
+            } else if ((code >= 0xd800) && (code < 0xe000)) {
+                // Unpaired surrogate
+                code = 0xfffd;
+            }
+            appendUtf8(value, code);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return false;
+}
+
+// Numbers, true, false and null
+static bool parseToken(const char *&p, const char *end, string &value)
+{
+    const char *start = p;
+
+    while ((p < end) &&
+           (((*p >= '0') && (*p <= '9')) || ((*p >= 'a') && (*p <= 'z')) ||
+            (*p == '-') || (*p == '+') || (*p == '.') || (*p == 'E'))) {
+        p++;
+    }
+    value.assign(start, p - start);
+
+    return p > start;
+}
+
+// A JSON number, true, false or null
+static bool validToken(const string &token)
+{
+    const char *p = token.c_str();
+
+    if ((token == "true") || (token == "false") || (token == "null")) {
+        return true;
+    }
+
+    if (*p == '-') {
+        p++;
+    }
+    if (*p == '0') {
+        p++;
+    } else if ((*p >= '1') && (*p <= '9')) {
+        while ((*p >= '0') && (*p <= '9')) {
+            p++;
+        }
+    } else {
+        return false;
+    }
+    if (*p == '.') {
+        if ((*++p < '0') || (*p > '9')) {
+            return false;
+        }
+        while ((*p >= '0') && (*p <= '9')) {
+            p++;
+        }
+    }
+    if ((*p == 'e') || (*p == 'E')) {
+        p++;
+        if ((*p == '+') || (*p == '-')) {
+            p++;
+        }
+        if ((*p < '0') || (*p > '9')) {
+            return false;
+        }
+        while ((*p >= '0') && (*p <= '9')) {
+            p++;
+        }
+    }
+
+    return *p == '\0';
+}
+
+QueryApi::QueryApi()
+{
+
+}
+
+QueryApi::~QueryApi()
+{
+
+}
+
+void QueryApi::addDevice(const string &name, shared_ptr<MeshMon> mon)
+{
+    Device device;
+
+    device.name = RadioName::shorten(name);
+    device.mon = mon;
+    _devices.push_back(device);
+}
+
+bool QueryApi::parse(const char *line, size_t len, Request &request)
+{
+    const char *end = line + len;
+    const char *p = skipSpace(line, end);
+    string name;
+    string value;
+
+    request.id.clear();
+    request.q.clear();
+    request.radio.clear();
+    request.since = 0;
+
+    if ((p == end) || (*p++ != '{')) {
+        return false;
+    }
+    p = skipSpace(p, end);
+    if ((p < end) && (*p == '}')) {
+        p++;
+        goto done;
+    }
+
+    for (;;) {
+        bool quoted;
+
+        if (!parseString(p, end, name)) {
+            return false;
+        }
+        p = skipSpace(p, end);
+        if ((p == end) || (*p++ != ':')) {
+            return false;
+        }
+        p = skipSpace(p, end);
+        quoted = (p < end) && (*p == '"');
+        if (quoted) {
+            if (!parseString(p, end, value)) {
+                return false;
+            }
+        } else if (!parseToken(p, end, value)) {
+            // No nested objects or arrays
+            return false;
+        }
+
+        if (name == "id") {
+            // Echoed back, so it has to be JSON that is safe to echo
+            request.id.clear();
+            if (quoted) {
+                Json::appendString(request.id, value);
+            } else if (validToken(value)) {
+                request.id = value;
+            } else {
+                return false;
+            }
+        } else if (name == "q") {
+            request.q = value;
+        } else if (name == "radio") {
+            request.radio = value;
+        } else if (name == "since") {
+            request.since = strtoll(value.c_str(), NULL, 10);
+        }
+
+        p = skipSpace(p, end);
+        if (p == end) {
+            return false;
+        }
+        if (*p == '}') {
+            p++;
+            break;
+        }
+        if (*p++ != ',') {
+            return false;
+        }
+        p = skipSpace(p, end);
+    }
+
+done:
+
+    return skipSpace(p, end) == end;
+}
+
+int QueryApi::device(const Request &request) const
+{
+    if (!request.radio.empty()) {
+        return RadioName::find(_devices, request.radio);
+    }
+
+    return _devices.empty() ? -1 : 0;
+}
+
+void QueryApi::handle(const char *line, size_t len, string &reply,
+                      size_t maxBytes) const
+{
+    const char *end = line + len;
+    size_t start = reply.size();
+    const char *error = NULL;
+    Request request;
+
+    if (skipSpace(line, end) == end) {
+        // Blank lines keep the connection alive
+        return;
+    }
+
+    if (!parse(line, len, request)) {
+        appendError(reply, request.id, "bad request");
+        return;
+    }
+
+    reply += "{\"id\":";
+    reply += request.id.empty() ? "null" : request.id;
+    reply += ",\"ok\":true,\"result\":";
+
+    if (request.q == "radios") {
+        error = radios(reply);
+    } else if (request.q == "nodes") {
+        error = nodes(request, reply);
+    } else if (request.q == "packets") {
+        error = packets(request, reply);
+    } else if (request.q == "mqtt") {
+        error = mqtt(request, reply);
+    } else if (request.q == "cputemp") {
+        error = cputemp(request, reply);
+    } else if (request.q == "dedup") {
+        error = dedup(request, reply);
+    } else if (request.q == "topology") {
+        error = topology(request, reply);
+    } else {
+        error = "unknown query";
+    }
+
+    if ((error == NULL) && (maxBytes > 0) &&
+        (reply.size() - start + 2 > maxBytes)) {
+        error = "reply too large";
+    }
+    if (error != NULL) {
+        reply.resize(start);
+        appendError(reply, request.id, error);
+        return;
+    }
+
+    reply += "}\n";
+}
+
+const char *QueryApi::radios(string &reply) const
+{
+    reply += '[';
+    for (unsigned int i = 0; i < _devices.size(); i++) {
+        uint32_t node = _devices[i].mon->whoami();
+
+        reply += i == 0 ? "{" : ",{";
+        Json::key(reply, "radio", true);
+        Json::appendString(reply, _devices[i].name);
+        Json::key(reply, "index");
+        Json::appendUnsigned(reply, i);
+        Json::key(reply, "node");
+        Json::appendNodeId(reply, node);
+        Json::key(reply, "name");
+        Json::appendString(reply, _devices[i].mon->getDisplayName(node));
+        reply += '}';
+    }
+    reply += ']';
+
+    return NULL;
+}
+
+const char *QueryApi::nodes(const Request &request, string &reply) const
+{
+    shared_ptr<NodeDb> nodeDb;
+    int index = device(request);
+    bool first = true;
+
+    if (index < 0) {
+        return "no such radio";
+    }
+
+    nodeDb = _devices[index].mon->nodeDb();
+    reply += '[';
+    if (nodeDb) {
+        NodeDb::NodeRecord record;
+
+        for (unsigned int i = 0; i < nodeDb->capacity(); i++) {
+            if (!nodeDb->slot(i, record) ||
+                ((int64_t) record.lastHeard < request.since)) {
+                continue;
+            }
+
+            reply += first ? "{" : ",{";
+            first = false;
+            Json::key(reply, "num", true);
+            Json::appendUnsigned(reply, record.num);
+            Json::key(reply, "id");
+            Json::appendNodeId(reply, record.num);
+            Json::key(reply, "longName");
+            Json::appendString(reply, record.longName,
+                               strnlen(record.longName,
+                                       sizeof(record.longName)));
+            Json::key(reply, "shortName");
+            Json::appendString(reply, record.shortName,
+                               strnlen(record.shortName,
+                                       sizeof(record.shortName)));
+            Json::key(reply, "lastHeard");
+            Json::appendUnsigned(reply, record.lastHeard);
+            Json::key(reply, "snr");
+            Json::appendFloat(reply, record.snr, 2);
+            Json::key(reply, "rssi");
+            Json::appendInt(reply, record.rssi);
+            if (record.positionTime != 0) {
+                Json::key(reply, "latitude");
+                Json::appendFixed(reply, record.latitudeI, 7);
+                Json::key(reply, "longitude");
+                Json::appendFixed(reply, record.longitudeI, 7);
+                Json::key(reply, "altitude");
+                Json::appendInt(reply, record.altitude);
+                Json::key(reply, "positionTime");
+                Json::appendUnsigned(reply, record.positionTime);
+            }
+            if (record.uptimeSeconds != 0) {
+                Json::key(reply, "batteryLevel");
+                Json::appendUnsigned(reply, record.batteryLevel);
+                Json::key(reply, "voltage");
+                Json::appendFloat(reply, record.voltage, 3);
+                Json::key(reply, "channelUtilization");
+                Json::appendFloat(reply, record.channelUtilization, 2);
+                Json::key(reply, "airUtilTx");
+                Json::appendFloat(reply, record.airUtilTx, 2);
+                Json::key(reply, "uptime");
+                Json::appendUnsigned(reply, record.uptimeSeconds);
+            }
+            reply += '}';
+        }
+    } else {
+        // No node database: what this radio has heard itself
+        const PacketStats &stats = _devices[index].mon->packetStats();
+        PacketStats::Node node;
+
+        for (unsigned int i = 0; i < PacketStats::NODE_SLOTS; i++) {
+            if (!stats.node(i, node) || (node.lastHeard < request.since)) {
+                continue;
+            }
+
+            reply += first ? "{" : ",{";
+            first = false;
+            Json::key(reply, "num", true);
+            Json::appendUnsigned(reply, node.num);
+            Json::key(reply, "id");
+            Json::appendNodeId(reply, node.num);
+            Json::key(reply, "lastHeard");
+            Json::appendInt(reply, node.lastHeard);
+            Json::key(reply, "snr");
+            Json::appendFloat(reply, node.snr, 2);
+            Json::key(reply, "rssi");
+            Json::appendInt(reply, node.rssi);
+            Json::key(reply, "packets");
+            Json::appendUnsigned(reply, node.packets);
+            reply += '}';
+        }
+    }
+    reply += ']';
+
+    return NULL;
+}
+
+const char *QueryApi::packets(const Request &request, string &reply) const
+{
+    int index = -1;
+    bool first = true;
+
+    if (!request.radio.empty()) {
+        index = RadioName::find(_devices, request.radio);
+        if (index < 0) {
+            return "no such radio";
+        }
+    }
+
+    reply += '[';
+    for (unsigned int i = 0; i < _devices.size(); i++) {
+        const PacketStats &stats = _devices[i].mon->packetStats();
+        bool firstPortnum = true;
+
+        if ((index >= 0) && ((unsigned int) index != i)) {
+            continue;
+        }
+
+        reply += first ? "{" : ",{";
+        first = false;
+        Json::key(reply, "radio", true);
+        Json::appendString(reply, _devices[i].name);
+        Json::key(reply, "packets");
+        Json::appendUnsigned(reply, stats.packets());
+        Json::key(reply, "portnums");
+        reply += '{';
+        for (unsigned int p = 0; p < PacketStats::NUM_PORTNUMS; p++) {
+            if (stats.portnum(p) == 0) {
+                continue;
+            }
+            reply += firstPortnum ? "\"" : ",\"";
+            firstPortnum = false;
+            Json::appendUnsigned(reply, p);
+            reply += "\":";
+            Json::appendUnsigned(reply, stats.portnum(p));
+        }
+        reply += '}';
+        Json::key(reply, "nodesDropped");
+        Json::appendUnsigned(reply, stats.nodesDropped());
+        reply += '}';
+    }
+    reply += ']';
+
+    return NULL;
+}
+
+const char *QueryApi::mqtt(const Request &request, string &reply) const
+{
+    vector<shared_ptr<MqttClient> > seen;
+    int index = -1;
+    bool first = true;
+
+    if (!request.radio.empty()) {
+        index = RadioName::find(_devices, request.radio);
+        if (index < 0) {
+            return "no such radio";
+        }
+    }
+
+    reply += '[';
+    for (unsigned int i = 0; i < _devices.size(); i++) {
+        shared_ptr<MqttClient> mqtts[2] = {
+            _devices[i].mon->meshtasticMqtt(), _devices[i].mon->myownMqtt(),
+        };
+        const char *names[2] = { "meshtastic", "myown", };
+
+        if ((index >= 0) && ((unsigned int) index != i)) {
+            continue;
+        }
+
+        for (unsigned int j = 0; j < 2; j++) {
+            const shared_ptr<MqttClient> &mqtt = mqtts[j];
+            bool shared = false;
+
+            if (mqtt == NULL) {
+                continue;
+            }
+            // A client shared by all radios in reactor mode is listed once
+            for (vector<shared_ptr<MqttClient> >::const_iterator it =
+                     seen.begin(); it != seen.end(); it++) {
+                shared = shared || (*it == mqtt);
+            }
+            if (shared) {
+                continue;
+            }
+            seen.push_back(mqtt);
+
+            reply += first ? "{" : ",{";
+            first = false;
+            Json::key(reply, "radio", true);
+            Json::appendString(reply, _devices[i].name);
+            Json::key(reply, "client");
+            Json::appendString(reply, names[j], strlen(names[j]));
+            mqttClient(*mqtt, reply);
+            reply += '}';
+        }
+    }
+    reply += ']';
+
+    return NULL;
+}
+
+void QueryApi::mqttClient(const MqttClient &mqtt, string &reply)
+{
+    const char *state = MqttClient::connStateString(mqtt.connState());
+    const MqttClient::QueueCounters &proxy = mqtt.proxyQueueCounters();
+    const MqttClient::QueueCounters &packet = mqtt.packetQueueCounters();
+    const MqttClient::QueueCounters &downlink =
+        mqtt.downlinkQueueCounters();
+
+    Json::key(reply, "state");
+    Json::appendString(reply, state, strlen(state));
+    Json::key(reply, "connected");
+    Json::appendBool(reply, mqtt.isConnected());
+    Json::key(reply, "reconnects");
+    Json::appendUnsigned(reply, mqtt.reconnects());
+    Json::key(reply, "published");
+    Json::appendUnsigned(reply, mqtt.published());
+    Json::key(reply, "confirmed");
+    Json::appendUnsigned(reply, mqtt.publishConfirmed());
+    Json::key(reply, "proxyQueue");
+    Json::appendUnsigned(reply, mqtt.proxyQueueDepth());
+    Json::key(reply, "packetQueue");
+    Json::appendUnsigned(reply, mqtt.packetQueueDepth());
+    Json::key(reply, "dropped");
+    Json::appendUnsigned(reply, proxy.dropped + packet.dropped);
+    Json::key(reply, "coalesced");
+    Json::appendUnsigned(reply, proxy.coalesced + packet.coalesced);
+    Json::key(reply, "inflight");
+    Json::appendUnsigned(reply, mqtt.inflight());
+    Json::key(reply, "inflightWindow");
+    Json::appendUnsigned(reply, mqtt.inflightWindow());
+    Json::key(reply, "ackRttUs");
+    Json::appendUnsigned(reply, mqtt.ackRttUs());
+    Json::key(reply, "windowStalls");
+    Json::appendUnsigned(reply, mqtt.windowStalls());
+    Json::key(reply, "lastBatch");
+    Json::appendUnsigned(reply, mqtt.lastBatchSize());
+    Json::key(reply, "drainLatencyMs");
+    Json::appendUnsigned(reply, mqtt.lastDrainLatencyMs());
+    Json::key(reply, "maxDrainLatencyMs");
+    Json::appendUnsigned(reply, mqtt.maxDrainLatencyMs());
+    Json::key(reply, "batches");
+    Json::appendUnsigned(reply, mqtt.batches());
+    Json::key(reply, "batchedPackets");
+    Json::appendUnsigned(reply, mqtt.batchedPackets());
+    Json::key(reply, "downlinkQueue");
+    Json::appendUnsigned(reply, mqtt.downlinkQueueDepth());
+    Json::key(reply, "downlinkDropped");
+    Json::appendUnsigned(reply, downlink.dropped);
+    Json::key(reply, "downlinkFiltered");
+    Json::appendUnsigned(reply, mqtt.downlinkFiltered());
+    Json::key(reply, "spoolBytes");
+    Json::appendUnsigned(reply, mqtt.spool() ? mqtt.spool()->bytes() : 0);
+}
+
+const char *QueryApi::cputemp(const Request &request, string &reply) const
+{
+    shared_ptr<CpuTemp> cpuTemp;
+    int index = device(request);
+    float tempC;
+    time_t sampledAt;
+
+    if (index < 0) {
+        return "no such radio";
+    }
+
+    cpuTemp = _devices[index].mon->cpuTemp();
+    if (!cpuTemp || !cpuTemp->sample(tempC, sampledAt)) {
+        return "no CPU temperature";
+    }
+
+    reply += '{';
+    Json::key(reply, "tempC", true);
+    Json::appendFloat(reply, tempC, 1);
+    Json::key(reply, "sampledAt");
+    Json::appendInt(reply, sampledAt);
+    Json::key(reply, "source");
+    Json::appendString(reply, cpuTemp->sourceName(),
+                       strlen(cpuTemp->sourceName()));
+    reply += '}';
+
+    return NULL;
+}
+
+const char *QueryApi::dedup(const Request &request, string &reply) const
+{
+    shared_ptr<DedupCache> dedup;
+    int index = device(request);
+
+    if (index < 0) {
+        return "no such radio";
+    }
+
+    dedup = _devices[index].mon->dedupCache();
+    if (!dedup) {
+        return "no dedup cache";
+    }
+
+    reply += '{';
+    Json::key(reply, "hits", true);
+    Json::appendUnsigned(reply, dedup->hits());
+    Json::key(reply, "misses");
+    Json::appendUnsigned(reply, dedup->misses());
+    Json::key(reply, "evictions");
+    Json::appendUnsigned(reply, dedup->evictions());
+    Json::key(reply, "slots");
+    Json::appendUnsigned(reply, dedup->slots());
+    reply += '}';
+
+    return NULL;
+}
+
+const char *QueryApi::topology(const Request &request,
+                               string &reply) const
+{
+    shared_ptr<Topology> topology;
+    int index = device(request);
+    vector<Topology::Link> links;
+
+    if (index < 0) {
+        return "no such radio";
+    }
+
+    topology = _devices[index].mon->topology();
+    if (!topology) {
+        return "no topology";
+    }
+
+    topology->links(time(NULL), links);
+    reply += '{';
+    Json::key(reply, "nodes", true);
+    Json::appendUnsigned(reply, topology->nodes());
+    Json::key(reply, "traceroutes");
+    Json::appendUnsigned(reply, topology->traceroutes());
+    Json::key(reply, "links");
+    reply += '[';
+    for (vector<Topology::Link>::const_iterator it = links.begin();
+         it != links.end(); it++) {
+        reply += it == links.begin() ? "{" : ",{";
+        Json::key(reply, "from", true);
+        Json::appendNodeId(reply, it->from);
+        Json::key(reply, "to");
+        Json::appendNodeId(reply, it->to);
+        Json::key(reply, "snr");
+        Json::appendFloat(reply, it->snr, 2);
+        Json::key(reply, "lastSeen");
+        Json::appendInt(reply, it->lastSeen);
+        Json::key(reply, "samples");
+        Json::appendUnsigned(reply, it->samples);
+        reply += '}';
+    }
+    reply += "]}";
+
+    return NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
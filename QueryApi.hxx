@@ -0,0 +1,88 @@
+/*
+ * QueryApi.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef QUERYAPI_HXX
+#define QUERYAPI_HXX
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <MeshMon.hxx>
+
+using namespace std;
+
+/*
+ * Machine-readable queries, one JSON object per line each way:
+ *
+ *   {"id":1,"q":"nodes","since":1735689600}
+ *   {"id":1,"ok":true,"result":[{"num":...},...]}
+ *
+ * Queries: radios, nodes [since], packets, mqtt, cputemp, dedup and
+ * topology, each for the given "radio" or, where it takes one, the first.
+ * "id" (a number, string, true, false or null) is echoed back so that
+ * pipelined requests can be matched to their replies. Replies are
+ * appended straight from the in-memory state, without going through
+ * printf.
+ */
+class QueryApi {
+
+public:
+
+    QueryApi();
+    ~QueryApi();
+
+    void addDevice(const string &name, shared_ptr<MeshMon> mon);
+
+    // Appends the reply to one request line, newline included; a reply
+    // over maxBytes (0: no limit) is replaced by an error
+    void handle(const char *line, size_t len, string &reply,
+                size_t maxBytes = 0) const;
+
+private:
+
+    struct Device {
+        string name;
+        shared_ptr<MeshMon> mon;
+    };
+
+    struct Request {
+        string id;              // raw JSON
+        string q;
+        string radio;
+        int64_t since;
+    };
+
+    static bool parse(const char *line, size_t len, Request &request);
+    // The requested radio, the first one by default; -1 if there is none
+    int device(const Request &request) const;
+
+    // Each appends its result, or returns an error
+    const char *radios(string &reply) const;
+    const char *nodes(const Request &request, string &reply) const;
+    const char *packets(const Request &request, string &reply) const;
+    const char *mqtt(const Request &request, string &reply) const;
+    static void mqttClient(const MqttClient &mqtt, string &reply);
+    const char *cputemp(const Request &request, string &reply) const;
+    const char *dedup(const Request &request, string &reply) const;
+    const char *topology(const Request &request, string &reply) const;
+
+private:
+
+    vector<Device> _devices;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,54 @@
+/*
+ * RadioName.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cstdlib>
+#include <RadioName.hxx>
+
+string RadioName::shorten(const string &device)
+{
+    size_t slash = device.find_last_of('/');
+
+    return slash == string::npos ? device : device.substr(slash + 1);
+}
+
+int RadioName::find(const vector<string> &names, const string &radio)
+{
+    for (unsigned int i = 0; i < names.size(); i++) {
+        if (matches(names[i], radio)) {
+            return i;
+        }
+    }
+
+    return index(radio, names.size());
+}
+
+bool RadioName::matches(const string &name, const string &radio)
+{
+    return (name == radio) || (("/dev/" + name) == radio);
+}
+
+int RadioName::index(const string &radio, size_t count)
+{
+    char *end = NULL;
+    unsigned long index;
+
+    index = strtoul(radio.c_str(), &end, 10);
+    if (!radio.empty() && (*end == '\0') && (index < count)) {
+        return index;
+    }
+
+    return -1;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
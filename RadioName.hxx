@@ -0,0 +1,58 @@
+/*
+ * RadioName.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef RADIONAME_HXX
+#define RADIONAME_HXX
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * How radios are named to users: by the last part of their device path
+ * (ttyACM0 for /dev/ttyACM0), and looked up by that name, by the full
+ * path or by their index.
+ */
+class RadioName {
+
+public:
+
+    static string shorten(const string &device);
+
+    // Index of the radio in names, -1 if there is none
+    static int find(const vector<string> &names, const string &radio);
+
+    // Same, for a list of anything with a shortened name member
+    template <typename Radio>
+    static int find(const vector<Radio> &radios, const string &radio) {
+        for (unsigned int i = 0; i < radios.size(); i++) {
+            if (matches(radios[i].name, radio)) {
+                return i;
+            }
+        }
+
+        return index(radio, radios.size());
+    }
+
+private:
+
+    static bool matches(const string &name, const string &radio);
+    static int index(const string &radio, size_t count);
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,261 @@
+/*
+ * Reactor.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <Logger.hxx>
+#include <Reactor.hxx>
+
+Reactor::Reactor(unsigned int workers)
+    : _workers(workers > 0 ? workers : 1),
+      _isRunning(false)
+{
+    struct epoll_event ev;
+
+    _epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epfd == -1) {
+        LOGE(REACTOR, "epoll_create1: %s!", strerror(errno));
+    }
+
+    // Level-triggered and never drained: wakes every worker on stop()
+    _stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((_epfd != -1) && (_stopfd != -1)) {
+        memset(&ev, 0x0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = _stopfd;
+        epoll_ctl(_epfd, EPOLL_CTL_ADD, _stopfd, &ev);
+    }
+}
+
+Reactor::~Reactor()
+{
+    stop();
+    join();
+
+    if (_stopfd != -1) {
+        close(_stopfd);
+    }
+    if (_epfd != -1) {
+        close(_epfd);
+    }
+}
+
+unsigned int Reactor::workers(void) const
+{
+    return _workers;
+}
+
+bool Reactor::add(int fd, uint32_t events, Handler handler)
+{
+    shared_ptr<Registration> reg = make_shared<Registration>();
+    struct epoll_event ev;
+    lock_guard<mutex> lock(_mutex);
+
+    reg->fd = fd;
+    reg->events = events;
+    reg->handler = handler;
+    reg->busy = false;
+    reg->removed = false;
+
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events = events | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        LOGE(REACTOR, "epoll_ctl: %s!", strerror(errno));
+        return false;
+    }
+
+    _registrations[fd] = reg;
+
+    return true;
+}
+
+bool Reactor::modify(int fd, uint32_t events)
+{
+    map<int, shared_ptr<Registration> >::iterator it;
+    struct epoll_event ev;
+    lock_guard<mutex> lock(_mutex);
+
+    it = _registrations.find(fd);
+    if (it == _registrations.end()) {
+        return false;
+    }
+
+    it->second->events = events;
+    if (it->second->busy) {
+        // Applied by dispatch() once the handler returns
+        return true;
+    }
+
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events = events | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Reactor::remove(int fd)
+{
+    map<int, shared_ptr<Registration> >::iterator it;
+    shared_ptr<Registration> reg;
+    unique_lock<mutex> lock(_mutex);
+
+    it = _registrations.find(fd);
+    if (it == _registrations.end()) {
+        return;
+    }
+
+    reg = it->second;
+    _registrations.erase(it);
+    reg->removed = true;
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    if (reg->worker != this_thread::get_id()) {
+        _cv.wait(lock, [reg]() { return !reg->busy; });
+    }
+}
+
+int Reactor::addTimer(unsigned int intervalMs, function<void(void)> handler)
+{
+    struct itimerspec its;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        LOGE(REACTOR, "timerfd_create: %s!", strerror(errno));
+        return -1;
+    }
+
+    its.it_interval.tv_sec = intervalMs / 1000;
+    its.it_interval.tv_nsec = (intervalMs % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(fd, 0, &its, NULL);
+
+    if (!add(fd, EPOLLIN, [fd, handler](uint32_t events) {
+                uint64_t expirations;
+
+                (void)(events);
+                if (read(fd, &expirations, sizeof(expirations)) > 0) {
+                    handler();
+                }
+            })) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void Reactor::start(void)
+{
+    if (!_isRunning && (_epfd != -1)) {
+        _isRunning = true;
+        for (unsigned int i = 0; i < _workers; i++) {
+            _threads.push_back(make_shared<thread>(thread_function, this));
+        }
+    }
+}
+
+void Reactor::stop(void)
+{
+    uint64_t one = 1;
+
+    if (_isRunning) {
+        _isRunning = false;
+        if (write(_stopfd, &one, sizeof(one)) != sizeof(one)) {
+            LOGE(REACTOR, "eventfd write: %s!", strerror(errno));
+        }
+    }
+}
+
+void Reactor::join(void)
+{
+    for (vector<shared_ptr<thread> >::iterator it = _threads.begin();
+         it != _threads.end(); it++) {
+        if ((*it)->joinable()) {
+            (*it)->join();
+        }
+    }
+    _threads.clear();
+}
+
+void Reactor::thread_function(Reactor *reactor)
+{
+    reactor->run();
+}
+
+void Reactor::dispatch(int fd, uint32_t events)
+{
+    map<int, shared_ptr<Registration> >::iterator it;
+    shared_ptr<Registration> reg;
+    struct epoll_event ev;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        it = _registrations.find(fd);
+        if (it == _registrations.end()) {
+            return;
+        }
+        reg = it->second;
+        reg->busy = true;
+        reg->worker = this_thread::get_id();
+    }
+
+    reg->handler(events);
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        reg->busy = false;
+        reg->worker = thread::id();
+        if (!reg->removed) {
+            memset(&ev, 0x0, sizeof(ev));
+            ev.events = reg->events | EPOLLONESHOT;
+            ev.data.fd = fd;
+            epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+    _cv.notify_all();
+}
+
+void Reactor::run(void)
+{
+    struct epoll_event events[16];
+    int n;
+
+    for (;;) {
+        n = epoll_wait(_epfd, events, sizeof(events) / sizeof(events[0]),
+                       -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE(REACTOR, "epoll_wait: %s!", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == _stopfd) {
+                return;
+            }
+            dispatch(events[i].data.fd, events[i].events);
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
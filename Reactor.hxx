@@ -0,0 +1,91 @@
+/*
+ * Reactor.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef REACTOR_HXX
+#define REACTOR_HXX
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+ * epoll-based event loop serviced by a small fixed pool of worker threads.
+ *
+ * Every fd is registered EPOLLONESHOT, so a handler never runs on two
+ * workers at once; the fd is re-armed with its current interest set when
+ * the handler returns. Handlers for different fds may run concurrently.
+ */
+class Reactor {
+
+public:
+
+    typedef function<void(uint32_t events)> Handler;
+
+    Reactor(unsigned int workers = 2);
+    ~Reactor();
+
+    unsigned int workers(void) const;
+
+    bool add(int fd, uint32_t events, Handler handler);
+    bool modify(int fd, uint32_t events);
+    // Waits for a running handler of fd to finish (unless called from it)
+    void remove(int fd);
+
+    // Periodic callback on a timerfd; returns the fd, which the caller
+    // must remove() and close()
+    int addTimer(unsigned int intervalMs, function<void(void)> handler);
+
+    void start(void);
+    void stop(void);
+    void join(void);
+
+private:
+
+    struct Registration {
+        int fd;
+        uint32_t events;
+        Handler handler;
+        bool busy;
+        bool removed;
+        thread::id worker;
+    };
+
+    static void thread_function(Reactor *reactor);
+    void run(void);
+    void dispatch(int fd, uint32_t events);
+
+private:
+
+    unsigned int _workers;
+    int _epfd;
+    int _stopfd;
+
+    mutex _mutex;
+    condition_variable _cv;
+    map<int, shared_ptr<Registration> > _registrations;
+    vector<shared_ptr<thread> > _threads;
+    bool _isRunning;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
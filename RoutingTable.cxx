@@ -0,0 +1,204 @@
+/*
+ * RoutingTable.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <RoutingTable.hxx>
+
+static const struct {
+    const char *name;
+    int portnum;
+} portnums[] = {
+    { "TEXT_MESSAGE_APP", meshtastic_PortNum_TEXT_MESSAGE_APP, },
+    { "REMOTE_HARDWARE_APP", meshtastic_PortNum_REMOTE_HARDWARE_APP, },
+    { "POSITION_APP", meshtastic_PortNum_POSITION_APP, },
+    { "NODEINFO_APP", meshtastic_PortNum_NODEINFO_APP, },
+    { "ROUTING_APP", meshtastic_PortNum_ROUTING_APP, },
+    { "ADMIN_APP", meshtastic_PortNum_ADMIN_APP, },
+    { "WAYPOINT_APP", meshtastic_PortNum_WAYPOINT_APP, },
+    { "DETECTION_SENSOR_APP", meshtastic_PortNum_DETECTION_SENSOR_APP, },
+    { "PAXCOUNTER_APP", meshtastic_PortNum_PAXCOUNTER_APP, },
+    { "STORE_FORWARD_APP", meshtastic_PortNum_STORE_FORWARD_APP, },
+    { "RANGE_TEST_APP", meshtastic_PortNum_RANGE_TEST_APP, },
+    { "TELEMETRY_APP", meshtastic_PortNum_TELEMETRY_APP, },
+    { "TRACEROUTE_APP", meshtastic_PortNum_TRACEROUTE_APP, },
+    { "NEIGHBORINFO_APP", meshtastic_PortNum_NEIGHBORINFO_APP, },
+    { "MAP_REPORT_APP", meshtastic_PortNum_MAP_REPORT_APP, },
+};
+
+static const struct {
+    const char *name;
+    uint8_t sink;
+} sinks[] = {
+    { "meshtastic", RoutingTable::SINK_MESHTASTIC, },
+    { "myown", RoutingTable::SINK_MYOWN, },
+    { "metrics", RoutingTable::SINK_METRICS, },
+    { "log", RoutingTable::SINK_LOG, },
+    { "events", RoutingTable::SINK_EVENTS, },
+};
+
+bool RoutingTable::parsePortnum(const string &s, int &portnum)
+{
+    char *end = NULL;
+    long value;
+
+    for (unsigned int i = 0; i < sizeof(portnums) / sizeof(portnums[0]);
+         i++) {
+        if (strcasecmp(s.c_str(), portnums[i].name) == 0) {
+            portnum = portnums[i].portnum;
+            return true;
+        }
+    }
+
+    value = strtol(s.c_str(), &end, 0);
+    if (s.empty() || (*end != '\0') || (value < 0) ||
+        (value >= (long) NUM_PORTNUMS)) {
+        return false;
+    }
+    portnum = (int) value;
+
+    return true;
+}
+
+bool RoutingTable::parseSink(const string &s, uint8_t &sink)
+{
+    for (unsigned int i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (s == sinks[i].name) {
+            sink = sinks[i].sink;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool RoutingTable::parseNode(const string &s, int64_t &node)
+{
+    char *end = NULL;
+    unsigned long long value;
+
+    // "!a1b2c3d4" as the apps show it, or a plain number
+    if (!s.empty() && (s[0] == '!')) {
+        value = strtoull(s.c_str() + 1, &end, 16);
+    } else {
+        value = strtoull(s.c_str(), &end, 0);
+    }
+    if (s.empty() || (*end != '\0') || (value > 0xffffffffULL)) {
+        return false;
+    }
+    node = (int64_t) value;
+
+    return true;
+}
+
+string RoutingTable::sinksString(uint8_t mask)
+{
+    string s;
+
+    for (unsigned int i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (mask & sinks[i].sink) {
+            if (!s.empty()) {
+                s += ",";
+            }
+            s += sinks[i].name;
+        }
+    }
+
+    return s.empty() ? string("none") : s;
+}
+
+RoutingTable::RoutingTable()
+{
+    Rule rule;
+
+    memset(_table, 0x0, sizeof(_table));
+
+    // Count and stream everything
+    rule.portnum = ANY;
+    rule.channel = ANY;
+    rule.node = ANY;
+    rule.sinks = SINK_METRICS | SINK_EVENTS;
+    add(rule);
+
+    // These are sanctioned for upload for the benefit of meshmap.net;
+    // conversations never go to the public MQTT server
+    rule.sinks = SINK_MESHTASTIC | SINK_MYOWN | SINK_METRICS | SINK_EVENTS;
+    rule.portnum = meshtastic_PortNum_POSITION_APP;
+    add(rule);
+    rule.portnum = meshtastic_PortNum_TELEMETRY_APP;
+    add(rule);
+    // Node info never went to the private broker
+    rule.sinks = SINK_MESHTASTIC | SINK_METRICS | SINK_EVENTS;
+    rule.portnum = meshtastic_PortNum_NODEINFO_APP;
+    add(rule);
+
+    rule.sinks = SINK_MYOWN | SINK_METRICS | SINK_EVENTS;
+    rule.portnum = meshtastic_PortNum_TRACEROUTE_APP;
+    add(rule);
+}
+
+RoutingTable::~RoutingTable()
+{
+
+}
+
+bool RoutingTable::add(const Rule &rule)
+{
+    unsigned int portnumFirst, portnumLast;
+    unsigned int channelFirst, channelLast;
+    uint8_t *table = NULL;
+    int16_t *row = NULL;
+
+    if ((rule.portnum < ANY) || (rule.portnum >= (int) NUM_PORTNUMS) ||
+        (rule.channel < ANY) || (rule.channel >= (int) NUM_CHANNELS) ||
+        (rule.node < ANY) || (rule.node > 0xffffffffLL)) {
+        return false;
+    }
+
+    portnumFirst = rule.portnum == ANY ? 0 : rule.portnum;
+    portnumLast = rule.portnum == ANY ? NUM_PORTNUMS - 1 : rule.portnum;
+    channelFirst = rule.channel == ANY ? 0 : rule.channel;
+    channelLast = rule.channel == ANY ? NUM_CHANNELS - 1 : rule.channel;
+
+    if (rule.node == ANY) {
+        table = _table;
+    } else {
+        vector<int16_t> &nodeRow = _nodes[(uint32_t) rule.node];
+        if (nodeRow.empty()) {
+            nodeRow.assign(NUM_CHANNELS * NUM_PORTNUMS, -1);
+        }
+        row = nodeRow.data();
+    }
+
+    for (unsigned int channel = channelFirst; channel <= channelLast;
+         channel++) {
+        for (unsigned int portnum = portnumFirst; portnum <= portnumLast;
+             portnum++) {
+            unsigned int index = (channel * NUM_PORTNUMS) + portnum;
+
+            if (table != NULL) {
+                table[index] = rule.sinks;
+            } else {
+                row[index] = rule.sinks;
+            }
+        }
+    }
+
+    _rules.push_back(rule);
+
+    return true;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
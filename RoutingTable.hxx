@@ -0,0 +1,113 @@
+/*
+ * RoutingTable.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef ROUTINGTABLE_HXX
+#define ROUTINGTABLE_HXX
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Decides where a packet heard on the mesh goes, by portnum, channel and
+ * sending node.
+ *
+ * Rules are compiled at startup into a flat channel x portnum array of
+ * sink masks, plus a row of the same shape for each node that has rules
+ * of its own, so that lookup() is an array index (and a hash probe when
+ * node rules exist). A rule overwrites the cells it matches; later rules
+ * win. The table is not modified after it has been handed to the radios.
+ */
+class RoutingTable {
+
+public:
+
+    enum Sink {
+        SINK_MESHTASTIC = 0x1,  // upstream MQTT via the radio's proxy
+        SINK_MYOWN = 0x2,       // private MQTT broker
+        SINK_METRICS = 0x4,     // PacketStats / OpenMetrics
+        SINK_LOG = 0x8,         // one line on stdout
+        SINK_EVENTS = 0x10,     // EventBus subscribers
+    };
+
+    static const unsigned int NUM_PORTNUMS = meshtastic_PortNum_MAX + 1;
+    static const unsigned int NUM_CHANNELS = 8;
+    static const int ANY = -1;
+
+    struct Rule {
+        int portnum;            // or ANY
+        int channel;            // or ANY
+        int64_t node;           // or ANY
+        uint8_t sinks;
+    };
+
+    static bool parsePortnum(const string &s, int &portnum);
+    static bool parseSink(const string &s, uint8_t &sink);
+    static bool parseNode(const string &s, int64_t &node);
+    static string sinksString(uint8_t sinks);
+
+    // Starts out with the built-in forwarding policy
+    RoutingTable();
+    ~RoutingTable();
+
+    bool add(const Rule &rule);
+
+    inline const vector<Rule> &rules(void) const {
+        return _rules;
+    }
+
+    inline uint8_t lookup(const meshtastic_MeshPacket &packet) const {
+        unsigned int portnum;
+        unsigned int channel;
+        unsigned int index;
+
+        if (packet.which_payload_variant !=
+            meshtastic_MeshPacket_decoded_tag) {
+            return 0;
+        }
+
+        portnum = packet.decoded.portnum;
+        if (portnum >= NUM_PORTNUMS) {
+            return 0;
+        }
+        channel = packet.channel < NUM_CHANNELS ? packet.channel : 0;
+        index = (channel * NUM_PORTNUMS) + portnum;
+
+        if (!_nodes.empty()) {
+            unordered_map<uint32_t, vector<int16_t> >::const_iterator it =
+                _nodes.find(packet.from);
+            if ((it != _nodes.end()) && (it->second[index] >= 0)) {
+                return (uint8_t) it->second[index];
+            }
+        }
+
+        return _table[index];
+    }
+
+private:
+
+    uint8_t _table[NUM_CHANNELS * NUM_PORTNUMS];
+    // -1: fall back to _table
+    unordered_map<uint32_t, vector<int16_t> > _nodes;
+    vector<Rule> _rules;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
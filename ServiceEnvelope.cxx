@@ -0,0 +1,142 @@
+/*
+ * ServiceEnvelope.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <ServiceEnvelope.hxx>
+
+// Field numbers from meshtastic/mqtt.proto
+#define SERVICE_ENVELOPE_PACKET     1
+#define SERVICE_ENVELOPE_CHANNEL_ID 2
+#define SERVICE_ENVELOPE_GATEWAY_ID 3
+
+ServiceEnvelope::ServiceEnvelope()
+{
+    memset(&_packet, 0x0, sizeof(_packet));
+    _channelId[0] = '\0';
+    _gatewayId[0] = '\0';
+}
+
+ServiceEnvelope::~ServiceEnvelope()
+{
+
+}
+
+bool ServiceEnvelope::decodeString(pb_istream_t *stream, char *buf,
+                                   size_t len)
+{
+    pb_istream_t substream;
+    size_t n;
+
+    if (!pb_make_string_substream(stream, &substream)) {
+        return false;
+    }
+
+    n = substream.bytes_left;
+    if (n > (len - 1)) {
+        n = len - 1;
+    }
+
+    if (!pb_read(&substream, (pb_byte_t *) buf, n)) {
+        pb_close_string_substream(stream, &substream);
+        return false;
+    }
+    buf[n] = '\0';
+
+    // Skips whatever did not fit into buf
+    return pb_close_string_substream(stream, &substream);
+}
+
+bool ServiceEnvelope::decode(const uint8_t *bytes, size_t size)
+{
+    pb_istream_t stream;
+    pb_istream_t substream;
+    pb_wire_type_t wireType;
+    uint32_t tag;
+    bool eof;
+    bool hasPacket = false;
+    bool result;
+
+    _channelId[0] = '\0';
+    _gatewayId[0] = '\0';
+
+    stream = pb_istream_from_buffer(bytes, size);
+    while (stream.bytes_left > 0) {
+        if (!pb_decode_tag(&stream, &wireType, &tag, &eof)) {
+            if (eof) {
+                break;
+            }
+            return false;
+        }
+
+        switch (tag) {
+        case SERVICE_ENVELOPE_PACKET:
+            if (wireType != PB_WT_STRING) {
+                return false;
+            }
+            if (!pb_make_string_substream(&stream, &substream)) {
+                return false;
+            }
+            result = pb_decode(&substream, meshtastic_MeshPacket_fields,
+                               &_packet);
+            if (!pb_close_string_substream(&stream, &substream) ||
+                !result) {
+                return false;
+            }
+            hasPacket = true;
+            break;
+        case SERVICE_ENVELOPE_CHANNEL_ID:
+            if ((wireType != PB_WT_STRING) ||
+                !decodeString(&stream, _channelId, sizeof(_channelId))) {
+                return false;
+            }
+            break;
+        case SERVICE_ENVELOPE_GATEWAY_ID:
+            if ((wireType != PB_WT_STRING) ||
+                !decodeString(&stream, _gatewayId, sizeof(_gatewayId))) {
+                return false;
+            }
+            break;
+        default:
+            if (!pb_skip_field(&stream, wireType)) {
+                return false;
+            }
+            break;
+        }
+    }
+
+    return hasPacket;
+}
+
+size_t ServiceEnvelope::encode(const meshtastic_MeshPacket &packet,
+                               const char *channelId, const char *gatewayId,
+                               uint8_t *buf, size_t size)
+{
+    pb_ostream_t stream;
+
+    stream = pb_ostream_from_buffer(buf, size);
+    if (!pb_encode_tag(&stream, PB_WT_STRING, SERVICE_ENVELOPE_PACKET) ||
+        !pb_encode_submessage(&stream, meshtastic_MeshPacket_fields,
+                              &packet) ||
+        !pb_encode_tag(&stream, PB_WT_STRING, SERVICE_ENVELOPE_CHANNEL_ID) ||
+        !pb_encode_string(&stream, (const pb_byte_t *) channelId,
+                          strlen(channelId)) ||
+        !pb_encode_tag(&stream, PB_WT_STRING, SERVICE_ENVELOPE_GATEWAY_ID) ||
+        !pb_encode_string(&stream, (const pb_byte_t *) gatewayId,
+                          strlen(gatewayId))) {
+        return 0;
+    }
+
+    return stream.bytes_written;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,72 @@
+/*
+ * ServiceEnvelope.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef SERVICEENVELOPE_HXX
+#define SERVICEENVELOPE_HXX
+
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Decoder for meshtastic_ServiceEnvelope as carried in the payload of an
+ * MqttClientProxyMessage.
+ *
+ * The generated descriptor declares packet/channel_id/gateway_id as
+ * FT_POINTER fields, which pb_decode() can only fill in with malloc().
+ * Instead, the envelope is walked by hand in a single pass: the packet
+ * sub-message is decoded in place and the two strings are copied into
+ * bounded buffers (truncated if oversized).
+ */
+class ServiceEnvelope {
+
+public:
+
+    ServiceEnvelope();
+    ~ServiceEnvelope();
+
+    bool decode(const uint8_t *bytes, size_t size);
+
+    // The inverse of decode(); returns the encoded size, 0 on error
+    static size_t encode(const meshtastic_MeshPacket &packet,
+                         const char *channelId, const char *gatewayId,
+                         uint8_t *buf, size_t size);
+
+    inline const meshtastic_MeshPacket &packet(void) const {
+        return _packet;
+    }
+
+    inline const char *channelId(void) const {
+        return _channelId;
+    }
+
+    inline const char *gatewayId(void) const {
+        return _gatewayId;
+    }
+
+private:
+
+    static bool decodeString(pb_istream_t *stream, char *buf, size_t len);
+
+private:
+
+    meshtastic_MeshPacket _packet;
+    char _channelId[32];
+    char _gatewayId[32];
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
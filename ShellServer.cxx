@@ -0,0 +1,513 @@
+/*
+ * ShellServer.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <Logger.hxx>
+#include <RadioName.hxx>
+#include <ShellServer.hxx>
+
+#define MAX_ARGS 16
+#define MAX_LINE 1024
+// Replies to pipelined requests collected before sending
+#define QUERY_BATCH (64 * 1024)
+
+ShellServer::Session::Session(int fd, size_t maxOutputBytes, bool query)
+    : fd(fd),
+      maxOutputBytes(maxOutputBytes),
+      truncated(false),
+      closing(false),
+      eof(false),
+      query(query),
+      device(0)
+{
+
+}
+
+void ShellServer::Session::write(const char *text, size_t len)
+{
+    if (truncated) {
+        return;
+    }
+
+    if (output.size() + len > maxOutputBytes) {
+        // Cut at the last whole line that fits
+        size_t room = maxOutputBytes - output.size();
+        const char *nl = (const char *) memrchr(text, '\n', room);
+
+        if (nl != NULL) {
+            output.append(text, nl - text + 1);
+        }
+        truncated = true;
+        return;
+    }
+
+    output.append(text, len);
+}
+
+ShellServer::ShellServer(shared_ptr<Reactor> reactor)
+    : _reactor(reactor),
+      _ownReactor(false),
+      _isRunning(false),
+      _listenfd(-1),
+      _queryfd(-1),
+      _maxSessions(32),
+      _maxOutputBytes(1024 * 1024),
+      _accepted(0),
+      _refused(0),
+      _queries(0)
+{
+    if (_reactor == NULL) {
+        _reactor = make_shared<Reactor>(1);
+        _ownReactor = true;
+    }
+}
+
+ShellServer::~ShellServer()
+{
+    stop();
+
+    if (_listenfd != -1) {
+        close(_listenfd);
+    }
+    if (_queryfd != -1) {
+        close(_queryfd);
+    }
+}
+
+void ShellServer::addDevice(const string &name, shared_ptr<MeshMon> mon)
+{
+    Device device;
+
+    device.name = RadioName::shorten(name);
+    device.mon = mon;
+    _devices.push_back(device);
+    _query.addDevice(name, mon);
+}
+
+void ShellServer::setLimits(unsigned int maxSessions, size_t maxOutputBytes)
+{
+    if (maxSessions > 0) {
+        _maxSessions = maxSessions;
+    }
+    if (maxOutputBytes >= 4096) {
+        _maxOutputBytes = maxOutputBytes;
+    }
+}
+
+int ShellServer::listenOn(const string &address, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+    int fd;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        LOGE(MAIN, "shell: bad address '%s'", address.c_str());
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        LOGE(MAIN, "shell: socket: %s!", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((::bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) ||
+        (listen(fd, 16) == -1)) {
+        LOGE(MAIN, "shell: %s:%u: %s!", address.c_str(), port,
+             strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool ShellServer::bind(const string &address, uint16_t port)
+{
+    _listenfd = listenOn(address, port);
+
+    return _listenfd != -1;
+}
+
+bool ShellServer::bindQuery(const string &address, uint16_t port)
+{
+    _queryfd = listenOn(address, port);
+
+    return _queryfd != -1;
+}
+
+bool ShellServer::start(void)
+{
+    if (_isRunning || ((_listenfd == -1) && (_queryfd == -1))) {
+        return false;
+    }
+
+    if (_ownReactor) {
+        _reactor->start();
+    }
+    _isRunning = true;
+    if (_listenfd != -1) {
+        _isRunning = _reactor->add(_listenfd, EPOLLIN,
+                                   [this](uint32_t events) {
+                                       (void)(events);
+                                       onAccept(_listenfd, false);
+                                   });
+    }
+    if (_isRunning && (_queryfd != -1)) {
+        _isRunning = _reactor->add(_queryfd, EPOLLIN,
+                                   [this](uint32_t events) {
+                                       (void)(events);
+                                       onAccept(_queryfd, true);
+                                   });
+        if (!_isRunning && (_listenfd != -1)) {
+            _reactor->remove(_listenfd);
+        }
+    }
+
+    return _isRunning;
+}
+
+void ShellServer::stop(void)
+{
+    map<int, shared_ptr<Session> > sessions;
+
+    if (!_isRunning) {
+        return;
+    }
+    _isRunning = false;
+
+    if (_listenfd != -1) {
+        _reactor->remove(_listenfd);
+    }
+    if (_queryfd != -1) {
+        _reactor->remove(_queryfd);
+    }
+    {
+        // From here on closeSession() leaves them to us
+        lock_guard<mutex> lock(_mutex);
+        sessions.swap(_sessions);
+    }
+    for (map<int, shared_ptr<Session> >::iterator it = sessions.begin();
+         it != sessions.end(); it++) {
+        // Let a running handler finish before the fd goes away
+        _reactor->remove(it->first);
+        shutdown(it->first, SHUT_RDWR);
+        close(it->first);
+    }
+
+    if (_ownReactor) {
+        _reactor->stop();
+        _reactor->join();
+    }
+}
+
+size_t ShellServer::sessions(void) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _sessions.size();
+}
+
+void ShellServer::onAccept(int listenfd, bool query)
+{
+    shared_ptr<Session> session;
+    size_t count;
+    int fd;
+
+    for (;;) {
+        fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR)) {
+                LOGW(MAIN, "shell: accept: %s", strerror(errno));
+            }
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(_mutex);
+            count = _sessions.size();
+        }
+        if (count >= _maxSessions) {
+            static const char busy[] = "Too many sessions\n";
+
+            if (send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL) < 0) {
+                // Closing anyway
+            }
+            close(fd);
+            _refused++;
+            continue;
+        }
+
+        session = make_shared<Session>(fd, _maxOutputBytes, query);
+        if (!query) {
+            if (!_banner.empty()) {
+                session->printf("%s\n", _banner.c_str());
+            }
+            prompt(*session);
+        }
+        {
+            lock_guard<mutex> lock(_mutex);
+            _sessions[fd] = session;
+        }
+        _accepted++;
+
+        // Send the prompt when the socket is ready for it
+        if (!_reactor->add(fd, query ? EPOLLIN : EPOLLOUT,
+                           [this, session](uint32_t events) {
+                               onSession(session, events);
+                           })) {
+            lock_guard<mutex> lock(_mutex);
+            _sessions.erase(fd);
+            close(fd);
+        }
+    }
+}
+
+void ShellServer::onSession(shared_ptr<Session> session, uint32_t events)
+{
+    char buf[1024];
+    ssize_t n;
+    size_t nl;
+
+    if ((events & EPOLLIN) && !session->eof) {
+        for (;;) {
+            n = recv(session->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0) {
+                session->input.append(buf, n);
+                continue;
+            }
+            if (n == 0) {
+                // Half-closed after pipelining; what came in still gets
+                // its replies
+                session->eof = true;
+                break;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR)) {
+                closeSession(session);
+                return;
+            }
+            if (errno != EINTR) {
+                break;
+            }
+        }
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        closeSession(session);
+        return;
+    }
+
+    // Run commands while the client keeps up with their output; the rest
+    // stays in input until it does
+    for (;;) {
+        if (!flush(*session)) {
+            closeSession(session);
+            return;
+        }
+        if (!session->output.empty()) {
+            break;
+        }
+        if (session->closing) {
+            closeSession(session);
+            return;
+        }
+
+        nl = session->input.find('\n');
+        if (nl == string::npos) {
+            if (session->eof || (session->input.size() > MAX_LINE)) {
+                closeSession(session);
+                return;
+            }
+            break;
+        }
+        if (session->query) {
+            answer(*session);
+        } else {
+            execute(*session, session->input.substr(0, nl));
+            session->input.erase(0, nl + 1);
+        }
+    }
+
+    _reactor->modify(session->fd, session->output.empty() ?
+                     EPOLLIN : EPOLLOUT);
+}
+
+bool ShellServer::flush(Session &session)
+{
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < session.output.size()) {
+        n = send(session.fd, session.output.data() + sent,
+                 session.output.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    session.output.erase(0, sent);
+
+    return true;
+}
+
+void ShellServer::closeSession(shared_ptr<Session> session)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_sessions.erase(session->fd) == 0) {
+            // stop() got here first
+            return;
+        }
+    }
+
+    _reactor->remove(session->fd);
+    close(session->fd);
+}
+
+void ShellServer::answer(Session &session)
+{
+    size_t start = 0;
+    size_t nl;
+
+    // Pipelined requests are answered together, in one send
+    while ((session.output.size() < QUERY_BATCH) &&
+           ((nl = session.input.find('\n', start)) != string::npos)) {
+        _query.handle(session.input.data() + start, nl - start,
+                      session.output, session.maxOutputBytes);
+        start = nl + 1;
+        _queries++;
+    }
+    session.input.erase(0, start);
+}
+
+void ShellServer::prompt(Session &session)
+{
+    if (_devices.empty()) {
+        session.printf("meshmon> ");
+    } else {
+        session.printf("%s> ", _devices[session.device].name.c_str());
+    }
+}
+
+void ShellServer::radios(Session &session)
+{
+    for (unsigned int i = 0; i < _devices.size(); i++) {
+        uint32_t node = _devices[i].mon->whoami();
+
+        session.printf("%c %u  %-12s !%08x  %s\n",
+                       i == session.device ? '*' : ' ', i,
+                       _devices[i].name.c_str(), node,
+                       _devices[i].mon->getDisplayName(node).c_str());
+    }
+}
+
+bool ShellServer::use(Session &session, const string &name)
+{
+    int index = RadioName::find(_devices, name);
+
+    if (index < 0) {
+        return false;
+    }
+    session.device = index;
+
+    return true;
+}
+
+void ShellServer::execute(Session &session, const string &line)
+{
+    istringstream iss(line);
+    vector<string> words;
+    char *argv[MAX_ARGS];
+    int argc = 0;
+    string word;
+    shared_ptr<MeshMon> mon;
+    int ret = 0;
+
+    session.truncated = false;
+    while ((iss >> word) && (words.size() < MAX_ARGS)) {
+        words.push_back(word);
+    }
+    for (vector<string>::iterator it = words.begin(); it != words.end();
+         it++) {
+        argv[argc++] = &(*it)[0];
+    }
+    if (!_devices.empty()) {
+        mon = _devices[session.device].mon;
+    }
+
+    if (argc == 0) {
+        // Just the prompt
+    } else if ((strcmp(argv[0], "quit") == 0) ||
+               (strcmp(argv[0], "exit") == 0)) {
+        session.closing = true;
+        return;
+    } else if ((strcmp(argv[0], "help") == 0) ||
+               (strcmp(argv[0], "?") == 0)) {
+        session.printf("radios                      list the radios\n"
+                       "use <name|index>            talk to another radio\n"
+                       "system                      MQTT, dedup and node "
+                       "DB status\n"
+                       "stats [reset]               MQTT latencies\n"
+                       "routes                      packet routing rules\n"
+                       "telemetry [!node [metric [hours]]]\n"
+                       "topology [neighbors !node | path !from !to | "
+                       "weak [dB] | dot | json]\n"
+                       "quit\n");
+    } else if (strcmp(argv[0], "radios") == 0) {
+        radios(session);
+    } else if (strcmp(argv[0], "use") == 0) {
+        if ((argc != 2) || !use(session, argv[1])) {
+            session.printf("Usage: use <name|index>; see 'radios'\n");
+        }
+    } else if (mon == NULL) {
+        session.printf("No radio\n");
+    } else if ((strcmp(argv[0], "system") == 0) ||
+               (strcmp(argv[0], "status") == 0)) {
+        session.printf("Radio: %s !%08x %s\n",
+                       _devices[session.device].name.c_str(),
+                       mon->whoami(),
+                       mon->getDisplayName(mon->whoami()).c_str());
+        MeshMonCommands::status(mon, session, argc, argv);
+    } else if (!MeshMonCommands::run(mon, session, argc, argv, ret)) {
+        session.printf("Unknown command '%s'; try 'help'\n", argv[0]);
+    }
+
+    if (session.truncated) {
+        session.truncated = false;
+        session.printf("[output truncated]\n");
+    }
+    prompt(session);
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
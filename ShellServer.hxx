@@ -0,0 +1,143 @@
+/*
+ * ShellServer.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef SHELLSERVER_HXX
+#define SHELLSERVER_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <MeshMon.hxx>
+#include <MeshMonCommands.hxx>
+#include <QueryApi.hxx>
+#include <Reactor.hxx>
+
+using namespace std;
+
+/*
+ * One TCP listener for the meshmon commands of every radio.
+ *
+ * Sessions are non-blocking sockets on a Reactor; a session picks the
+ * radio it talks to with "use". A command's output is collected in the
+ * session's own buffer (bounded; the excess is cut) and sent as the
+ * socket takes it. A session does not read its next command until its
+ * output has gone out, so a slow client only holds up itself.
+ *
+ * A second, optional listener speaks the QueryApi instead: no banner or
+ * prompt, one JSON request per line. Requests that arrive together are
+ * answered together, in one send.
+ */
+class ShellServer {
+
+public:
+
+    // Shares the reactor if given one, otherwise runs its own
+    ShellServer(shared_ptr<Reactor> reactor = NULL);
+    ~ShellServer();
+
+    void addDevice(const string &name, shared_ptr<MeshMon> mon);
+
+    inline void setBanner(const string &banner) {
+        _banner = banner;
+    }
+
+    void setLimits(unsigned int maxSessions, size_t maxOutputBytes);
+
+    bool bind(const string &address, uint16_t port);
+    bool bindQuery(const string &address, uint16_t port);
+    bool start(void);
+    void stop(void);
+
+    size_t sessions(void) const;
+
+    inline unsigned long accepted(void) const {
+        return _accepted;
+    }
+
+    inline unsigned long refused(void) const {
+        return _refused;
+    }
+
+    inline unsigned long queries(void) const {
+        return _queries;
+    }
+
+private:
+
+    struct Device {
+        string name;
+        shared_ptr<MeshMon> mon;
+    };
+
+    class Session : public MeshMonCommands::Output {
+
+    public:
+
+        Session(int fd, size_t maxOutputBytes, bool query);
+
+        virtual void write(const char *text, size_t len);
+
+    public:
+
+        int fd;
+        string input;
+        string output;
+        size_t maxOutputBytes;
+        bool truncated;
+        bool closing;
+        bool eof;               // input is all in
+        bool query;
+        unsigned int device;
+
+    };
+
+    static int listenOn(const string &address, uint16_t port);
+    void onAccept(int listenfd, bool query);
+    void onSession(shared_ptr<Session> session, uint32_t events);
+    void execute(Session &session, const string &line);
+    void answer(Session &session);
+    void prompt(Session &session);
+    void radios(Session &session);
+    bool use(Session &session, const string &name);
+    bool flush(Session &session);
+    void closeSession(shared_ptr<Session> session);
+
+private:
+
+    shared_ptr<Reactor> _reactor;
+    bool _ownReactor;
+    bool _isRunning;
+    int _listenfd;
+    int _queryfd;
+    string _banner;
+    vector<Device> _devices;
+    QueryApi _query;
+    unsigned int _maxSessions;
+    size_t _maxOutputBytes;
+
+    mutable mutex _mutex;
+    map<int, shared_ptr<Session> > _sessions;
+    atomic<unsigned long> _accepted;
+    atomic<unsigned long> _refused;
+    atomic<unsigned long> _queries;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
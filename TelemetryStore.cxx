@@ -0,0 +1,465 @@
+/*
+ * TelemetryStore.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <cstring>
+#include <TelemetryStore.hxx>
+
+const TelemetryStore::Rollup TelemetryStore::rollups[NUM_ROLLUPS] = {
+    { 60, 60, 0, },             // 1 minute, 1 hour deep
+    { 900, 96, 60, },           // 15 minutes, 1 day deep
+    { 3600, 168, 60 + 96, },    // 1 hour, 1 week deep
+};
+
+static const char *metricNames[TelemetryStore::NUM_METRICS] = {
+    "battery_level",
+    "voltage",
+    "channel_utilization",
+    "air_util_tx",
+    "temperature",
+    "relative_humidity",
+    "barometric_pressure",
+    "gas_resistance",
+    "iaq",
+    "lux",
+    "pm10",
+    "pm25",
+    "pm100",
+    "co2",
+    "ch1_voltage",
+    "ch1_current",
+    "ch2_voltage",
+    "ch2_current",
+    "ch3_voltage",
+    "ch3_current",
+    "heart_bpm",
+    "spo2",
+    "body_temperature",
+    "host_load1",
+    "host_freemem",
+};
+
+const char *TelemetryStore::metricName(Metric metric)
+{
+    return metric < NUM_METRICS ? metricNames[metric] : "unknown";
+}
+
+bool TelemetryStore::parseMetric(const string &s, Metric &metric)
+{
+    for (unsigned int i = 0; i < NUM_METRICS; i++) {
+        if (s == metricNames[i]) {
+            metric = (Metric) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TelemetryStore::TelemetryStore(size_t maxSeries)
+    : _maxSeries(maxSeries > 0 ? maxSeries : 1),
+      _recycled(0)
+{
+
+}
+
+TelemetryStore::~TelemetryStore()
+{
+    for (vector<Series *>::iterator it = _series.begin();
+         it != _series.end(); it++) {
+        delete *it;
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_DeviceMetrics &metrics)
+{
+    if (metrics.has_battery_level) {
+        add(node, BATTERY_LEVEL, t, metrics.battery_level);
+    }
+    if (metrics.has_voltage) {
+        add(node, VOLTAGE, t, metrics.voltage);
+    }
+    if (metrics.has_channel_utilization) {
+        add(node, CHANNEL_UTILIZATION, t, metrics.channel_utilization);
+    }
+    if (metrics.has_air_util_tx) {
+        add(node, AIR_UTIL_TX, t, metrics.air_util_tx);
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_EnvironmentMetrics &metrics)
+{
+    if (metrics.has_temperature) {
+        add(node, TEMPERATURE, t, metrics.temperature);
+    }
+    if (metrics.has_relative_humidity) {
+        add(node, RELATIVE_HUMIDITY, t, metrics.relative_humidity);
+    }
+    if (metrics.has_barometric_pressure) {
+        add(node, BAROMETRIC_PRESSURE, t, metrics.barometric_pressure);
+    }
+    if (metrics.has_gas_resistance) {
+        add(node, GAS_RESISTANCE, t, metrics.gas_resistance);
+    }
+    if (metrics.has_iaq) {
+        add(node, IAQ, t, metrics.iaq);
+    }
+    if (metrics.has_lux) {
+        add(node, LUX, t, metrics.lux);
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_AirQualityMetrics &metrics)
+{
+    if (metrics.has_pm10_standard) {
+        add(node, PM10, t, metrics.pm10_standard);
+    }
+    if (metrics.has_pm25_standard) {
+        add(node, PM25, t, metrics.pm25_standard);
+    }
+    if (metrics.has_pm100_standard) {
+        add(node, PM100, t, metrics.pm100_standard);
+    }
+    if (metrics.has_co2) {
+        add(node, CO2, t, metrics.co2);
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_PowerMetrics &metrics)
+{
+    if (metrics.has_ch1_voltage) {
+        add(node, CH1_VOLTAGE, t, metrics.ch1_voltage);
+    }
+    if (metrics.has_ch1_current) {
+        add(node, CH1_CURRENT, t, metrics.ch1_current);
+    }
+    if (metrics.has_ch2_voltage) {
+        add(node, CH2_VOLTAGE, t, metrics.ch2_voltage);
+    }
+    if (metrics.has_ch2_current) {
+        add(node, CH2_CURRENT, t, metrics.ch2_current);
+    }
+    if (metrics.has_ch3_voltage) {
+        add(node, CH3_VOLTAGE, t, metrics.ch3_voltage);
+    }
+    if (metrics.has_ch3_current) {
+        add(node, CH3_CURRENT, t, metrics.ch3_current);
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_HealthMetrics &metrics)
+{
+    if (metrics.has_heart_bpm) {
+        add(node, HEART_BPM, t, metrics.heart_bpm);
+    }
+    if (metrics.has_spO2) {
+        add(node, SPO2, t, metrics.spO2);
+    }
+    if (metrics.has_temperature) {
+        add(node, BODY_TEMPERATURE, t, metrics.temperature);
+    }
+}
+
+void TelemetryStore::record(uint32_t node, time_t t,
+                            const meshtastic_HostMetrics &metrics)
+{
+    // load is reported x100
+    add(node, HOST_LOAD1, t, metrics.load1 / 100.0);
+    add(node, HOST_FREEMEM, t, metrics.freemem_bytes);
+}
+
+TelemetryStore::Series *TelemetryStore::find(uint32_t node,
+                                             Metric metric) const
+{
+    unordered_map<uint64_t, Series *>::const_iterator it;
+
+    it = _index.find(key(node, metric));
+
+    return it != _index.end() ? it->second : NULL;
+}
+
+TelemetryStore::Series *TelemetryStore::allocate(uint32_t node,
+                                                 Metric metric)
+{
+    Series *series = NULL;
+
+    if (_series.size() < _maxSeries) {
+        series = new Series;
+        _series.push_back(series);
+    } else {
+        // Recycle the series that has gone quiet the longest
+        for (vector<Series *>::iterator it = _series.begin();
+             it != _series.end(); it++) {
+            if ((series == NULL) ||
+                ((*it)->newestTime < series->newestTime)) {
+                series = *it;
+            }
+        }
+        _index.erase(key(series->node, series->metric));
+        _recycled++;
+    }
+
+    memset(series, 0x0, sizeof(*series));
+    series->node = node;
+    series->metric = metric;
+    _index[key(node, metric)] = series;
+
+    return series;
+}
+
+void TelemetryStore::rollup(Series *series, unsigned int r, time_t t,
+                            float value)
+{
+    const Rollup &rollup = rollups[r];
+    uint32_t bucket = t / rollup.periodSec;
+    uint32_t newest = series->newestBucket[r];
+    unsigned int i;
+
+    if (bucket > newest) {
+        // Clear the buckets being rotated in
+        uint32_t gap = bucket - newest;
+        if (gap > rollup.buckets) {
+            gap = rollup.buckets;
+        }
+        for (uint32_t b = bucket - gap + 1; b <= bucket; b++) {
+            series->bucketCount[rollup.offset + (b % rollup.buckets)] = 0;
+        }
+        series->newestBucket[r] = bucket;
+    } else if ((newest - bucket) >= rollup.buckets) {
+        return;     // older than this rollup reaches
+    }
+
+    i = rollup.offset + (bucket % rollup.buckets);
+    if (series->bucketCount[i] == 0) {
+        series->bucketMin[i] = value;
+        series->bucketMax[i] = value;
+        series->bucketSum[i] = value;
+        series->bucketCount[i] = 1;
+    } else if (series->bucketCount[i] < UINT16_MAX) {
+        if (value < series->bucketMin[i]) {
+            series->bucketMin[i] = value;
+        }
+        if (value > series->bucketMax[i]) {
+            series->bucketMax[i] = value;
+        }
+        series->bucketSum[i] += value;
+        series->bucketCount[i]++;
+    }
+}
+
+void TelemetryStore::add(uint32_t node, Metric metric, time_t t, float value)
+{
+    lock_guard<mutex> lock(_mutex);
+    Series *series;
+
+    if ((metric >= NUM_METRICS) || (t <= 0)) {
+        return;
+    }
+
+    series = find(node, metric);
+    if (series == NULL) {
+        series = allocate(node, metric);
+    }
+
+    if (series->rawCount > 0) {
+        unsigned int last = (series->rawHead + RAW_SAMPLES - 1) % RAW_SAMPLES;
+
+        if (((uint32_t) t == series->newestTime) &&
+            (series->rawValue[last] == value)) {
+            return;     // the same report heard by another radio
+        }
+    }
+
+    if ((series->rawCount == 0) || ((uint32_t) t >= series->newestTime)) {
+        uint32_t delta = series->rawCount > 0 ? t - series->newestTime : 0;
+
+        if (delta > UINT16_MAX) {
+            // Too far apart to delta-encode; the rollups still cover the
+            // older samples
+            series->rawCount = 0;
+            delta = 0;
+        }
+        series->rawValue[series->rawHead] = value;
+        series->rawDelta[series->rawHead] = delta;
+        series->rawHead = (series->rawHead + 1) % RAW_SAMPLES;
+        if (series->rawCount < RAW_SAMPLES) {
+            series->rawCount++;
+        }
+        series->newestTime = t;
+    }
+
+    for (unsigned int r = 0; r < NUM_ROLLUPS; r++) {
+        rollup(series, r, t, value);
+    }
+}
+
+bool TelemetryStore::latest(uint32_t node, Metric metric, float &value,
+                            time_t &t) const
+{
+    lock_guard<mutex> lock(_mutex);
+    Series *series = find(node, metric);
+
+    if ((series == NULL) || (series->rawCount == 0)) {
+        return false;
+    }
+
+    value = series->rawValue[(series->rawHead + RAW_SAMPLES - 1) %
+                             RAW_SAMPLES];
+    t = series->newestTime;
+
+    return true;
+}
+
+bool TelemetryStore::samples(uint32_t node, Metric metric,
+                             vector<Point> &points) const
+{
+    lock_guard<mutex> lock(_mutex);
+    Series *series = find(node, metric);
+    unsigned int i;
+    time_t t;
+
+    points.clear();
+    if (series == NULL) {
+        return false;
+    }
+
+    // Walk back from the newest sample, then put oldest first
+    points.resize(series->rawCount);
+    i = series->rawHead;
+    t = series->newestTime;
+    for (unsigned int n = series->rawCount; n > 0; n--) {
+        Point &point = points[n - 1];
+
+        i = (i + RAW_SAMPLES - 1) % RAW_SAMPLES;
+        point.time = t;
+        point.min = series->rawValue[i];
+        point.max = series->rawValue[i];
+        point.mean = series->rawValue[i];
+        point.count = 1;
+        t -= series->rawDelta[i];
+    }
+
+    return true;
+}
+
+bool TelemetryStore::history(uint32_t node, Metric metric, time_t since,
+                             time_t now, vector<Point> &points) const
+{
+    lock_guard<mutex> lock(_mutex);
+    Series *series = find(node, metric);
+    unsigned int r;
+    uint32_t first, last, oldest;
+
+    points.clear();
+    if ((series == NULL) || (since > now)) {
+        return false;
+    }
+
+    for (r = 0; r < NUM_ROLLUPS - 1; r++) {
+        if ((time_t) (rollups[r].periodSec * rollups[r].buckets) >=
+            now - since) {
+            break;
+        }
+    }
+
+    const Rollup &rollup = rollups[r];
+    first = since / rollup.periodSec;
+    last = now / rollup.periodSec;
+    if (last > series->newestBucket[r]) {
+        last = series->newestBucket[r];
+    }
+    oldest = series->newestBucket[r] >= rollup.buckets ?
+        series->newestBucket[r] - rollup.buckets + 1 : 0;
+    if (first < oldest) {
+        first = oldest;
+    }
+
+    for (uint32_t b = first; b <= last; b++) {
+        unsigned int i = rollup.offset + (b % rollup.buckets);
+        Point point;
+
+        if (series->bucketCount[i] == 0) {
+            continue;
+        }
+        point.time = (time_t) b * rollup.periodSec;
+        point.min = series->bucketMin[i];
+        point.max = series->bucketMax[i];
+        point.mean = series->bucketSum[i] / series->bucketCount[i];
+        point.count = series->bucketCount[i];
+        points.push_back(point);
+    }
+
+    return true;
+}
+
+bool TelemetryStore::summary(uint32_t node, Metric metric, time_t since,
+                             time_t now, Point &point) const
+{
+    vector<Point> points;
+    double sum = 0.0;
+
+    if (!history(node, metric, since, now, points) || points.empty()) {
+        return false;
+    }
+
+    point = points[0];
+    point.count = 0;
+    for (vector<Point>::const_iterator it = points.begin();
+         it != points.end(); it++) {
+        if (it->min < point.min) {
+            point.min = it->min;
+        }
+        if (it->max > point.max) {
+            point.max = it->max;
+        }
+        sum += (double) it->mean * it->count;
+        point.count += it->count;
+    }
+    point.mean = sum / point.count;
+
+    return true;
+}
+
+void TelemetryStore::metrics(uint32_t node, vector<Metric> &metrics) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    metrics.clear();
+    for (unsigned int i = 0; i < NUM_METRICS; i++) {
+        if (find(node, (Metric) i) != NULL) {
+            metrics.push_back((Metric) i);
+        }
+    }
+}
+
+size_t TelemetryStore::series(void) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _series.size();
+}
+
+size_t TelemetryStore::memoryBytes(void) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _series.size() * sizeof(Series) +
+        _index.size() * (sizeof(uint64_t) + 2 * sizeof(void *));
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
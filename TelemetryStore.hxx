@@ -0,0 +1,176 @@
+/*
+ * TelemetryStore.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef TELEMETRYSTORE_HXX
+#define TELEMETRYSTORE_HXX
+
+#include <stdint.h>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Recent telemetry history of every node heard, kept in memory.
+ *
+ * Each (node, metric) series is a fixed-size record holding the last
+ * RAW_SAMPLES samples as columns of float32 values and 16-bit timestamp
+ * deltas, plus min/max/sum/count rollups at 1 minute (1 hour deep),
+ * 15 minutes (1 day) and 1 hour (1 week). Series are allocated on first
+ * sample up to a configured limit; past that the least recently updated
+ * series is recycled, so memory is bounded no matter how many nodes are
+ * heard.
+ */
+class TelemetryStore {
+
+public:
+
+    enum Metric {
+        BATTERY_LEVEL,
+        VOLTAGE,
+        CHANNEL_UTILIZATION,
+        AIR_UTIL_TX,
+        TEMPERATURE,
+        RELATIVE_HUMIDITY,
+        BAROMETRIC_PRESSURE,
+        GAS_RESISTANCE,
+        IAQ,
+        LUX,
+        PM10,
+        PM25,
+        PM100,
+        CO2,
+        CH1_VOLTAGE,
+        CH1_CURRENT,
+        CH2_VOLTAGE,
+        CH2_CURRENT,
+        CH3_VOLTAGE,
+        CH3_CURRENT,
+        HEART_BPM,
+        SPO2,
+        BODY_TEMPERATURE,
+        HOST_LOAD1,
+        HOST_FREEMEM,
+        NUM_METRICS,
+    };
+
+    struct Point {
+        time_t time;            // start of the bucket, or sample time
+        float min;
+        float max;
+        float mean;
+        unsigned int count;
+    };
+
+    static const unsigned int RAW_SAMPLES = 64;
+    static const unsigned int NUM_ROLLUPS = 3;
+
+    static const char *metricName(Metric metric);
+    static bool parseMetric(const string &s, Metric &metric);
+
+    TelemetryStore(size_t maxSeries = 4096);
+    ~TelemetryStore();
+
+    void record(uint32_t node, time_t t,
+                const meshtastic_DeviceMetrics &metrics);
+    void record(uint32_t node, time_t t,
+                const meshtastic_EnvironmentMetrics &metrics);
+    void record(uint32_t node, time_t t,
+                const meshtastic_AirQualityMetrics &metrics);
+    void record(uint32_t node, time_t t,
+                const meshtastic_PowerMetrics &metrics);
+    void record(uint32_t node, time_t t,
+                const meshtastic_HealthMetrics &metrics);
+    void record(uint32_t node, time_t t,
+                const meshtastic_HostMetrics &metrics);
+    void add(uint32_t node, Metric metric, time_t t, float value);
+
+    bool latest(uint32_t node, Metric metric, float &value,
+                time_t &t) const;
+    // Raw samples, oldest first
+    bool samples(uint32_t node, Metric metric, vector<Point> &points) const;
+    // Rollup buckets covering [since, now], oldest first, from the finest
+    // rollup that reaches back far enough
+    bool history(uint32_t node, Metric metric, time_t since, time_t now,
+                 vector<Point> &points) const;
+    // The same window folded into one point
+    bool summary(uint32_t node, Metric metric, time_t since, time_t now,
+                 Point &point) const;
+    // Metrics on record for a node
+    void metrics(uint32_t node, vector<Metric> &metrics) const;
+
+    inline size_t maxSeries(void) const {
+        return _maxSeries;
+    }
+
+    size_t series(void) const;
+    size_t memoryBytes(void) const;
+
+    inline unsigned long recycled(void) const {
+        return _recycled;
+    }
+
+private:
+
+    struct Rollup {
+        unsigned int periodSec;
+        unsigned int buckets;
+        unsigned int offset;    // into the Series bucket columns
+    };
+
+    static const Rollup rollups[NUM_ROLLUPS];
+    static const unsigned int NUM_BUCKETS = 60 + 96 + 168;
+
+    struct Series {
+        uint32_t node;
+        Metric metric;
+
+        uint32_t newestTime;
+        uint16_t rawHead;
+        uint16_t rawCount;
+        uint16_t rawDelta[RAW_SAMPLES];     // seconds since previous
+        float rawValue[RAW_SAMPLES];
+
+        uint32_t newestBucket[NUM_ROLLUPS];
+        float bucketMin[NUM_BUCKETS];
+        float bucketMax[NUM_BUCKETS];
+        float bucketSum[NUM_BUCKETS];
+        uint16_t bucketCount[NUM_BUCKETS];
+    };
+
+    static inline uint64_t key(uint32_t node, Metric metric) {
+        return ((uint64_t) node << 8) | metric;
+    }
+
+    Series *find(uint32_t node, Metric metric) const;
+    Series *allocate(uint32_t node, Metric metric);
+    void rollup(Series *series, unsigned int r, time_t t, float value);
+
+private:
+
+    mutable mutex _mutex;
+    size_t _maxSeries;
+    vector<Series *> _series;
+    unordered_map<uint64_t, Series *> _index;
+    unsigned long _recycled;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
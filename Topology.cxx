@@ -0,0 +1,360 @@
+/*
+ * Topology.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <climits>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <Topology.hxx>
+
+#define BROADCAST_NUM 0xffffffffU
+
+// bestPath() cost of a hop: 1 at GOOD_SNR or better, plus one for every
+// SNR_STEP below it
+static const float GOOD_SNR = 5.0;
+static const float SNR_STEP = 5.0;
+
+static inline string nodeId(uint32_t num)
+{
+    char id[16];
+
+    snprintf(id, sizeof(id), "!%08x", num);
+
+    return id;
+}
+
+static bool weaker(const Topology::Link &a, const Topology::Link &b)
+{
+    return a.snr < b.snr;
+}
+
+Topology::Topology(float alpha, unsigned int maxAgeSec)
+    : _alpha(alpha),
+      _maxAgeSec(maxAgeSec),
+      _recentNext(0),
+      _traceroutes(0)
+{
+    if ((_alpha <= 0.0) || (_alpha > 1.0)) {
+        _alpha = 0.25;
+    }
+    for (unsigned int i = 0; i < RECENT; i++) {
+        _recent[i] = 0;
+    }
+}
+
+Topology::~Topology()
+{
+
+}
+
+void Topology::traceroute(const meshtastic_MeshPacket &packet,
+                          const meshtastic_RouteDiscovery &route, time_t t)
+{
+    lock_guard<mutex> lock(_mutex);
+    uint64_t key = ((uint64_t) packet.from << 32) | packet.id;
+    bool reply;
+    uint32_t origin;
+    uint32_t dest;
+    vector<uint32_t> nodes;
+
+    if (packet.id != 0) {
+        for (unsigned int i = 0; i < RECENT; i++) {
+            if (_recent[i] == key) {
+                return;
+            }
+        }
+        _recent[_recentNext] = key;
+        _recentNext = (_recentNext + 1) % RECENT;
+    }
+    _traceroutes++;
+
+    // The reply travels back from the destination; its route fields
+    // still describe the request's way out and the reply's way back
+    reply = (packet.which_payload_variant ==
+             meshtastic_MeshPacket_decoded_tag) &&
+        (packet.decoded.request_id != 0);
+    origin = reply ? packet.to : packet.from;
+    dest = reply ? packet.from : packet.to;
+
+    nodes.reserve(route.route_count + 2);
+    nodes.push_back(origin);
+    nodes.insert(nodes.end(), route.route, route.route + route.route_count);
+    nodes.push_back(dest);
+    path(nodes, route.snr_towards, route.snr_towards_count, t);
+
+    if (reply) {
+        nodes.clear();
+        nodes.push_back(dest);
+        nodes.insert(nodes.end(), route.route_back,
+                     route.route_back + route.route_back_count);
+        nodes.push_back(origin);
+        path(nodes, route.snr_back, route.snr_back_count, t);
+    }
+}
+
+void Topology::path(const vector<uint32_t> &nodes, const int8_t *snr,
+                    unsigned int snrCount, time_t t)
+{
+    // snr[i] is what nodes[i + 1] heard nodes[i] at, in quarter dB; a
+    // request still on its way out has fewer entries than hops
+    for (unsigned int i = 0; (i + 1 < nodes.size()) && (i < snrCount); i++) {
+        if ((nodes[i] == BROADCAST_NUM) || (nodes[i + 1] == BROADCAST_NUM) ||
+            (nodes[i] == nodes[i + 1]) || (snr[i] == INT8_MIN)) {
+            // Hop of unknown identity or SNR
+            continue;
+        }
+        updateLocked(nodes[i], nodes[i + 1], snr[i] / 4.0, t);
+    }
+}
+
+void Topology::update(uint32_t from, uint32_t to, float snr, time_t t)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    updateLocked(from, to, snr, t);
+}
+
+void Topology::updateLocked(uint32_t from, uint32_t to, float snr, time_t t)
+{
+    Node &dst = _nodes[to];
+    Node &src = _nodes[from];
+    vector<Edge>::iterator it;
+
+    for (it = src.out.begin(); it != src.out.end(); it++) {
+        if (it->to == to) {
+            break;
+        }
+    }
+
+    if (it == src.out.end()) {
+        Edge edge;
+
+        edge.to = to;
+        edge.snr = snr;
+        edge.lastSeen = t;
+        edge.samples = 1;
+        src.out.push_back(edge);
+        dst.in.push_back(from);
+    } else {
+        it->snr += _alpha * (snr - it->snr);
+        it->lastSeen = max(it->lastSeen, t);
+        it->samples++;
+    }
+}
+
+const Topology::Edge *Topology::edge(uint32_t from, uint32_t to,
+                                     time_t now) const
+{
+    unordered_map<uint32_t, Node>::const_iterator it = _nodes.find(from);
+
+    if (it == _nodes.end()) {
+        return NULL;
+    }
+
+    for (vector<Edge>::const_iterator e = it->second.out.begin();
+         e != it->second.out.end(); e++) {
+        if (e->to == to) {
+            if ((_maxAgeSec > 0) &&
+                (now - e->lastSeen > (time_t) _maxAgeSec)) {
+                return NULL;
+            }
+            return &(*e);
+        }
+    }
+
+    return NULL;
+}
+
+Topology::Link Topology::link(uint32_t from, const Edge &edge)
+{
+    Link link;
+
+    link.from = from;
+    link.to = edge.to;
+    link.snr = edge.snr;
+    link.lastSeen = edge.lastSeen;
+    link.samples = edge.samples;
+
+    return link;
+}
+
+void Topology::neighbors(uint32_t node, time_t now, vector<Link> &links) const
+{
+    lock_guard<mutex> lock(_mutex);
+    unordered_map<uint32_t, Node>::const_iterator it = _nodes.find(node);
+
+    links.clear();
+    if (it == _nodes.end()) {
+        return;
+    }
+
+    for (vector<Edge>::const_iterator e = it->second.out.begin();
+         e != it->second.out.end(); e++) {
+        if (edge(node, e->to, now) != NULL) {
+            links.push_back(link(node, *e));
+        }
+    }
+    for (vector<uint32_t>::const_iterator from = it->second.in.begin();
+         from != it->second.in.end(); from++) {
+        const Edge *e = edge(*from, node, now);
+
+        if (e != NULL) {
+            links.push_back(link(*from, *e));
+        }
+    }
+}
+
+void Topology::weakLinks(float snr, time_t now, vector<Link> &links) const
+{
+    vector<Link> all;
+
+    this->links(now, all);
+    links.clear();
+    for (vector<Link>::const_iterator it = all.begin(); it != all.end();
+         it++) {
+        if (it->snr < snr) {
+            links.push_back(*it);
+        }
+    }
+    sort(links.begin(), links.end(), weaker);
+}
+
+void Topology::links(time_t now, vector<Link> &links) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    links.clear();
+    for (unordered_map<uint32_t, Node>::const_iterator it = _nodes.begin();
+         it != _nodes.end(); it++) {
+        for (vector<Edge>::const_iterator e = it->second.out.begin();
+             e != it->second.out.end(); e++) {
+            if ((_maxAgeSec == 0) ||
+                (now - e->lastSeen <= (time_t) _maxAgeSec)) {
+                links.push_back(link(it->first, *e));
+            }
+        }
+    }
+}
+
+bool Topology::bestPath(uint32_t from, uint32_t to, time_t now,
+                        vector<Link> &path) const
+{
+    lock_guard<mutex> lock(_mutex);
+    typedef pair<float, uint32_t> Entry;
+    priority_queue<Entry, vector<Entry>, greater<Entry> > pending;
+    unordered_map<uint32_t, float> cost;
+    unordered_map<uint32_t, uint32_t> prev;
+
+    path.clear();
+    if (from == to) {
+        return true;
+    }
+
+    // Dijkstra
+    cost[from] = 0.0;
+    pending.push(Entry(0.0, from));
+    while (!pending.empty()) {
+        Entry top = pending.top();
+        unordered_map<uint32_t, Node>::const_iterator it;
+
+        pending.pop();
+        if (top.second == to) {
+            break;
+        }
+        if (top.first > cost[top.second]) {
+            continue;
+        }
+
+        it = _nodes.find(top.second);
+        if (it == _nodes.end()) {
+            continue;
+        }
+        for (vector<Edge>::const_iterator e = it->second.out.begin();
+             e != it->second.out.end(); e++) {
+            unordered_map<uint32_t, float>::iterator c;
+            float next;
+
+            if ((_maxAgeSec > 0) &&
+                (now - e->lastSeen > (time_t) _maxAgeSec)) {
+                continue;
+            }
+
+            next = top.first + 1.0 +
+                (max((float) 0.0, GOOD_SNR - e->snr) / SNR_STEP);
+            c = cost.find(e->to);
+            if ((c == cost.end()) || (next < c->second)) {
+                cost[e->to] = next;
+                prev[e->to] = top.second;
+                pending.push(Entry(next, e->to));
+            }
+        }
+    }
+
+    if (prev.find(to) == prev.end()) {
+        return false;
+    }
+
+    for (uint32_t node = to; node != from; node = prev[node]) {
+        path.push_back(link(prev[node], *edge(prev[node], node, now)));
+    }
+    reverse(path.begin(), path.end());
+
+    return true;
+}
+
+void Topology::writeDot(ostream &os, time_t now) const
+{
+    vector<Link> all;
+    char label[32];
+
+    links(now, all);
+    os << "digraph mesh {" << endl;
+    for (vector<Link>::const_iterator it = all.begin(); it != all.end();
+         it++) {
+        snprintf(label, sizeof(label), "%.1f dB", it->snr);
+        os << "    \"" << nodeId(it->from) << "\" -> \""
+           << nodeId(it->to) << "\" [label=\"" << label << "\"];" << endl;
+    }
+    os << "}" << endl;
+}
+
+void Topology::writeJson(ostream &os, time_t now) const
+{
+    vector<Link> all;
+    char snr[16];
+
+    links(now, all);
+    os << "{\"links\":[";
+    for (vector<Link>::const_iterator it = all.begin(); it != all.end();
+         it++) {
+        snprintf(snr, sizeof(snr), "%.2f", it->snr);
+        os << (it == all.begin() ? "" : ",")
+           << "{\"from\":\"" << nodeId(it->from)
+           << "\",\"to\":\"" << nodeId(it->to)
+           << "\",\"snr\":" << snr
+           << ",\"lastSeen\":" << (long long) it->lastSeen
+           << ",\"samples\":" << it->samples << "}";
+    }
+    os << "]}" << endl;
+}
+
+size_t Topology::nodes(void) const
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _nodes.size();
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,119 @@
+/*
+ * Topology.hxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#ifndef TOPOLOGY_HXX
+#define TOPOLOGY_HXX
+
+#include <stdint.h>
+#include <ctime>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <unordered_map>
+#include <LibMeshtastic.hxx>
+
+using namespace std;
+
+/*
+ * Mesh topology learned from traceroutes.
+ *
+ * Every traceroute carries the hops it took and the SNR each hop heard
+ * the previous one at, in both directions. Each hop updates one directed
+ * edge in the adjacency list of the transmitting node: an exponentially
+ * weighted moving average of the SNR and the time it was last seen. A
+ * traceroute costs O(hops) to fold in; queries skip edges not seen within
+ * maxAgeSec.
+ */
+class Topology {
+
+public:
+
+    struct Link {
+        uint32_t from;
+        uint32_t to;
+        float snr;              // dB, EWMA
+        time_t lastSeen;
+        unsigned int samples;
+    };
+
+    // alpha: weight of a new SNR sample
+    Topology(float alpha = 0.25, unsigned int maxAgeSec = 86400);
+    ~Topology();
+
+    // A RouteDiscovery as received in a traceroute or routing packet
+    void traceroute(const meshtastic_MeshPacket &packet,
+                    const meshtastic_RouteDiscovery &route, time_t t);
+    // One hop; snr in dB
+    void update(uint32_t from, uint32_t to, float snr, time_t t);
+
+    // Links from and to the node
+    void neighbors(uint32_t node, time_t now, vector<Link> &links) const;
+    // Links with an average SNR below the threshold
+    void weakLinks(float snr, time_t now, vector<Link> &links) const;
+    void links(time_t now, vector<Link> &links) const;
+    // Cheapest path by hops, penalizing poor links; false if none
+    bool bestPath(uint32_t from, uint32_t to, time_t now,
+                  vector<Link> &path) const;
+
+    void writeDot(ostream &os, time_t now) const;
+    void writeJson(ostream &os, time_t now) const;
+
+    inline unsigned int maxAgeSec(void) const {
+        return _maxAgeSec;
+    }
+
+    size_t nodes(void) const;
+
+    inline unsigned long traceroutes(void) const {
+        return _traceroutes;
+    }
+
+private:
+
+    struct Edge {
+        uint32_t to;
+        float snr;
+        time_t lastSeen;
+        unsigned int samples;
+    };
+
+    struct Node {
+        vector<Edge> out;
+        vector<uint32_t> in;    // nodes with an edge to this one
+    };
+
+    static const unsigned int RECENT = 64;
+
+    void path(const vector<uint32_t> &nodes, const int8_t *snr,
+              unsigned int snrCount, time_t t);
+    void updateLocked(uint32_t from, uint32_t to, float snr, time_t t);
+    const Edge *edge(uint32_t from, uint32_t to, time_t now) const;
+    static Link link(uint32_t from, const Edge &edge);
+
+private:
+
+    mutable mutex _mutex;
+    float _alpha;
+    unsigned int _maxAgeSec;
+    unordered_map<uint32_t, Node> _nodes;
+    // The same reply heard by several radios is folded in once
+    uint64_t _recent[RECENT];
+    unsigned int _recentNext;
+    unsigned long _traceroutes;
+
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,189 @@
+/*
+ * envelope_bench.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <getopt.h>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <ServiceEnvelope.hxx>
+
+/*
+ * Micro-benchmark of ServiceEnvelope::decode() against the brute-force
+ * search that MeshMon::gotMqttClientProxyMessage() used to do.
+ *
+ * Usage: envelope_bench [-n iterations] [envelope.bin ...]
+ *
+ * Each file argument holds one raw ServiceEnvelope as recorded from the
+ * payload of an MqttClientProxyMessage. Without files, a few synthetic
+ * envelopes are generated.
+ */
+
+typedef vector<uint8_t> Envelope;
+
+static bool bruteForceDecode(const uint8_t *bytes, size_t size,
+                             meshtastic_MeshPacket &packet)
+{
+    pb_istream_t stream;
+    bool found = false;
+
+    while ((size > 0) && isprint(bytes[size - 1])) {
+        size--;
+    }
+
+    for (size_t i = 7; i < 10 && !found; i++) {
+        for (size_t l = size; l > i; l--) {
+            stream = pb_istream_from_buffer(bytes + i, l);
+            found = pb_decode(&stream, meshtastic_MeshPacket_fields,
+                              &packet);
+            if (found) {
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+static bool makeEnvelope(Envelope &envelope, meshtastic_PortNum portnum,
+                         size_t payloadSize)
+{
+    meshtastic_MeshPacket packet;
+    uint8_t buf[meshtastic_MqttClientProxyMessage_size];
+    size_t size;
+    static const char *channelId = "LongFast";
+    static const char *gatewayId = "!deadbeef";
+
+    memset(&packet, 0x0, sizeof(packet));
+    packet.from = 0x12345678;
+    packet.to = 0xffffffff;
+    packet.id = 0x0badcafe;
+    packet.rx_time = 1750000000;
+    packet.rx_snr = 6.25;
+    packet.rx_rssi = -97;
+    packet.hop_limit = 3;
+    packet.hop_start = 3;
+    packet.which_payload_variant = meshtastic_MeshPacket_decoded_tag;
+    packet.decoded.portnum = portnum;
+    packet.decoded.payload.size = payloadSize;
+    for (size_t i = 0; i < payloadSize; i++) {
+        packet.decoded.payload.bytes[i] = (uint8_t) (i * 7);
+    }
+
+    size = ServiceEnvelope::encode(packet, channelId, gatewayId,
+                                   buf, sizeof(buf));
+    if (size == 0) {
+        return false;
+    }
+
+    envelope.assign(buf, buf + size);
+
+    return true;
+}
+
+static double nsPerDecode(chrono::steady_clock::time_point t0,
+                          chrono::steady_clock::time_point t1,
+                          unsigned long count)
+{
+    return (double) chrono::duration_cast<chrono::nanoseconds>(
+        t1 - t0).count() / count;
+}
+
+int main(int argc, char **argv)
+{
+    vector<Envelope> envelopes;
+    unsigned long iterations = 100000;
+    unsigned long decoded;
+    chrono::steady_clock::time_point t0, t1;
+    meshtastic_MeshPacket packet;
+    ServiceEnvelope envelope;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            cerr << "Usage: " << argv[0]
+                 << " [-n iterations] [envelope.bin ...]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        ifstream f(argv[i], ios::binary);
+        if (!f) {
+            cerr << "Unable to open " << argv[i] << endl;
+            return EXIT_FAILURE;
+        }
+        envelopes.push_back(Envelope(istreambuf_iterator<char>(f),
+                                     istreambuf_iterator<char>()));
+    }
+
+    if (envelopes.empty()) {
+        static const struct {
+            meshtastic_PortNum portnum;
+            size_t payloadSize;
+        } synthetic[] = {
+            { meshtastic_PortNum_POSITION_APP, 32, },
+            { meshtastic_PortNum_NODEINFO_APP, 72, },
+            { meshtastic_PortNum_TELEMETRY_APP, 24, },
+            { meshtastic_PortNum_TELEMETRY_APP, 200, },
+        };
+
+        for (size_t i = 0; i < sizeof(synthetic) / sizeof(synthetic[0]);
+             i++) {
+            Envelope e;
+            if (!makeEnvelope(e, synthetic[i].portnum,
+                              synthetic[i].payloadSize)) {
+                cerr << "Unable to encode synthetic envelope" << endl;
+                return EXIT_FAILURE;
+            }
+            envelopes.push_back(e);
+        }
+    }
+
+    for (size_t i = 0; i < envelopes.size(); i++) {
+        const Envelope &e = envelopes[i];
+
+        decoded = 0;
+        t0 = chrono::steady_clock::now();
+        for (unsigned long n = 0; n < iterations; n++) {
+            decoded += envelope.decode(e.data(), e.size()) ? 1 : 0;
+        }
+        t1 = chrono::steady_clock::now();
+        cout << "envelope[" << i << "] " << e.size() << " bytes" << endl;
+        cout << "  ServiceEnvelope::decode: "
+             << nsPerDecode(t0, t1, iterations) << " ns/decode ("
+             << decoded << "/" << iterations << " ok)" << endl;
+
+        decoded = 0;
+        t0 = chrono::steady_clock::now();
+        for (unsigned long n = 0; n < iterations; n++) {
+            decoded += bruteForceDecode(e.data(), e.size(), packet) ? 1 : 0;
+        }
+        t1 = chrono::steady_clock::now();
+        cout << "  brute-force search:      "
+             << nsPerDecode(t0, t1, iterations) << " ns/decode ("
+             << decoded << "/" << iterations << " ok)" << endl;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
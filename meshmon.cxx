@@ -14,6 +14,18 @@
 #include <vector>
 #include <algorithm>
 #include <MeshMonShell.hxx>
+#include <ShellServer.hxx>
+#include <EventBus.hxx>
+#include <MqttClient.hxx>
+#include <MetricsServer.hxx>
+#include <Capture.hxx>
+#include <RoutingTable.hxx>
+#include <TelemetryStore.hxx>
+#include <NodeDb.hxx>
+#include <RadioName.hxx>
+#include <Logger.hxx>
+#include <Topology.hxx>
+#include <Reactor.hxx>
 #include "MeshMon.hxx"
 #include "version.h"
 
@@ -24,11 +36,19 @@ using namespace libconfig;
 static vector<shared_ptr<MeshMon>> mons;
 static shared_ptr<MeshMonShell> stdioShell;
 static vector<shared_ptr<MeshMonShell>> netShells;
+static shared_ptr<ShellServer> shellServer;
+static shared_ptr<EventBus> events;
+static shared_ptr<CpuTemp> cpuTemp;
+static shared_ptr<MetricsServer> metrics;
+static shared_ptr<CaptureWriter> capture;
+static atomic<bool> replayStop(false);
 
 void sighandler(int signum)
 {
     (void)(signum);
 
+    replayStop = true;
+
     for (vector< shared_ptr<MeshMon>>::iterator it = mons.begin();
          it != mons.end(); it++) {
         (*it)->detach();
@@ -44,7 +64,30 @@ void sighandler(int signum)
 
 void cleanup(void)
 {
+    if (shellServer) {
+        shellServer->stop();
+        shellServer = NULL;
+    }
+    if (events) {
+        events->stop();
+        events = NULL;
+    }
+    if (metrics) {
+        metrics->stop();
+        metrics->join();
+        metrics = NULL;
+    }
+    if (capture) {
+        capture->close();
+        capture = NULL;
+    }
+    if (cpuTemp) {
+        cpuTemp->stop();
+        cpuTemp->join();
+        cpuTemp = NULL;
+    }
     mosquitto_lib_cleanup();
+    Logger::stop();
 }
 
 static void loadLibConfig(Config &cfg, string &path)
@@ -84,6 +127,572 @@ done:
     return;
 }
 
+static void loadQueueConfig(Config &cfg, const char *name,
+                            MqttClient::QueueConfig &config)
+{
+    try {
+        int capacity = 0;
+        string policy;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root[name];
+        if (setting.lookupValue("capacity", capacity) && (capacity > 0)) {
+            config.capacity = capacity;
+        }
+        if (setting.lookupValue("policy", policy) &&
+            !MqttClient::parseOverflowPolicy(policy, config.policy)) {
+            cerr << name << ": unknown policy '" << policy << "'" << endl;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+static void loadMyownMqttConfig(Config &cfg, string &server, uint16_t &port,
+                                string &user, string &password,
+                                string &topic)
+{
+    try {
+        int cfgPort = 0;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["myownMqtt"];
+        setting.lookupValue("server", server);
+        if (setting.lookupValue("port", cfgPort) && (cfgPort > 0)) {
+            port = cfgPort;
+        }
+        setting.lookupValue("user", user);
+        setting.lookupValue("password", password);
+        setting.lookupValue("topic", topic);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+static void loadConnectConfig(Config &cfg, MqttClient::ConnectConfig &config)
+{
+    try {
+        int keepaliveSec = 0;
+        int backoffMinMs = 0;
+        int backoffMaxMs = 0;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["mqttConnect"];
+        if (setting.lookupValue("keepaliveSec", keepaliveSec) &&
+            (keepaliveSec > 0)) {
+            config.keepaliveSec = keepaliveSec;
+        }
+        if (setting.lookupValue("backoffMinMs", backoffMinMs) &&
+            (backoffMinMs > 0)) {
+            config.backoffMinMs = backoffMinMs;
+        }
+        if (setting.lookupValue("backoffMaxMs", backoffMaxMs) &&
+            (backoffMaxMs > 0)) {
+            config.backoffMaxMs = backoffMaxMs;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+static void loadSpoolConfig(Config &cfg, MqttClient::SpoolConfig &config)
+{
+    try {
+        int maxBytes = 0;
+        int segmentBytes = 0;
+        int replayRate = 0;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["mqttSpool"];
+        setting.lookupValue("dir", config.dir);
+        if (setting.lookupValue("maxBytes", maxBytes) && (maxBytes > 0)) {
+            config.maxBytes = maxBytes;
+        }
+        if (setting.lookupValue("segmentBytes", segmentBytes) &&
+            (segmentBytes > 0)) {
+            config.segmentBytes = segmentBytes;
+        }
+        if (setting.lookupValue("replayRate", replayRate) &&
+            (replayRate >= 0)) {
+            config.replayRate = replayRate;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+// mqttDownlink = { channels = [ "LongFast" ]; bitrate = 1067;
+//                 dutyCycle = 0.1; burstMs = 5000; capacity = 16;
+//                 policy = "drop-oldest"; };
+static void loadDownlinkConfig(Config &cfg,
+                               MqttClient::DownlinkConfig &config)
+{
+    try {
+        int bitrate = 0;
+        double dutyCycle = 0.0;
+        int burstMs = 0;
+        int capacity = 0;
+        string policy;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["mqttDownlink"];
+        if (setting.exists("channels")) {
+            Setting &channels = setting["channels"];
+            for (int i = 0; i < channels.getLength(); i++) {
+                config.channels.push_back((const char *) channels[i]);
+            }
+        }
+        setting.lookupValue("topic", config.topic);
+        if (setting.lookupValue("bitrate", bitrate) && (bitrate > 0)) {
+            config.bitrate = bitrate;
+        }
+        if (setting.lookupValue("dutyCycle", dutyCycle) &&
+            (dutyCycle > 0.0) && (dutyCycle <= 1.0)) {
+            config.dutyCycle = dutyCycle;
+        }
+        if (setting.lookupValue("burstMs", burstMs) && (burstMs > 0)) {
+            config.burstMs = burstMs;
+        }
+        if (setting.lookupValue("capacity", capacity) && (capacity > 0)) {
+            config.queue.capacity = capacity;
+        }
+        if (setting.lookupValue("policy", policy) &&
+            !MqttClient::parseOverflowPolicy(policy, config.queue.policy)) {
+            cerr << "mqttDownlink: unknown policy '" << policy << "'"
+                 << endl;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+// mqttBatch = { windowMs = 250; maxMessages = 32; maxBytes = 8192; };
+static void loadBatchConfig(Config &cfg, MqttClient::BatchConfig &config)
+{
+    try {
+        int windowMs = 0;
+        int maxMessages = 0;
+        int maxBytes = 0;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["mqttBatch"];
+        if (setting.lookupValue("windowMs", windowMs) && (windowMs >= 0)) {
+            config.windowMs = windowMs;
+        }
+        if (setting.lookupValue("maxMessages", maxMessages) &&
+            (maxMessages > 0)) {
+            config.maxMessages = maxMessages;
+        }
+        if (setting.lookupValue("maxBytes", maxBytes) && (maxBytes > 0)) {
+            config.maxBytes = maxBytes;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+// mqttQos = { proxy = 1; packet = 0; windowMin = 4; windowMax = 64; };
+static void loadQosConfig(Config &cfg, MqttClient::QosConfig &config)
+{
+    try {
+        int windowMin = 0;
+        int windowMax = 0;
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["mqttQos"];
+        setting.lookupValue("proxy", config.proxyQos);
+        setting.lookupValue("packet", config.packetQos);
+        if (setting.lookupValue("windowMin", windowMin) && (windowMin > 0)) {
+            config.windowMin = windowMin;
+        }
+        if (setting.lookupValue("windowMax", windowMax) && (windowMax > 0)) {
+            config.windowMax = windowMax;
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+}
+
+static MqttClient::SpoolConfig spoolConfigFor(
+    const MqttClient::SpoolConfig &config, const string &name)
+{
+    MqttClient::SpoolConfig result = config;
+
+    // e.g. /var/spool/meshmon/ttyACM0 for /dev/ttyACM0
+    if (!result.dir.empty()) {
+        result.dir += "/";
+        result.dir += RadioName::shorten(name);
+    }
+
+    return result;
+}
+
+static shared_ptr<CpuTemp> loadCpuTemp(Config &cfg)
+{
+    string type = "auto";
+    int intervalMs = 5000;
+    float fakeTempC = 0.0;
+    shared_ptr<CpuTempSource> source;
+    shared_ptr<FakeCpuTempSource> fake;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["cpuTemp"];
+        setting.lookupValue("source", type);
+        setting.lookupValue("intervalMs", intervalMs);
+        setting.lookupValue("fakeTempC", fakeTempC);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    source = CpuTemp::createSource(type);
+    if ((source == NULL) && (type == "auto")) {
+        // No sensor here
+        return NULL;
+    } else if (source == NULL) {
+        cerr << "cpuTemp: unknown source '" << type << "'" << endl;
+        return NULL;
+    }
+
+    fake = dynamic_pointer_cast<FakeCpuTempSource>(source);
+    if (fake) {
+        fake->set(fakeTempC);
+    }
+
+    return make_shared<CpuTemp>(source,
+                                intervalMs > 0 ? intervalMs : 5000);
+}
+
+static shared_ptr<DedupCache> loadDedupCache(Config &cfg)
+{
+    int slots = 4096;
+    int ttlSec = 600;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["dedup"];
+        setting.lookupValue("slots", slots);
+        setting.lookupValue("ttlSec", ttlSec);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if ((slots <= 0) || (ttlSec <= 0)) {
+        return NULL;
+    }
+
+    return make_shared<DedupCache>(slots, ttlSec);
+}
+
+// logging = { file = "/var/log/meshmon.log"; maxBytes = 1048576; keep = 3;
+//             level = "info"; levels = { mqtt = "debug"; mesh = "warn"; }; };
+static void loadLogging(Config &cfg, bool daemon)
+{
+    string file;
+    int maxBytes = 1024 * 1024;
+    int keep = 3;
+    string level;
+    Logger::Level parsed;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["logging"];
+        setting.lookupValue("file", file);
+        setting.lookupValue("maxBytes", maxBytes);
+        setting.lookupValue("keep", keep);
+        if (setting.lookupValue("level", level)) {
+            if (Logger::parseLevel(level, parsed)) {
+                Logger::setLevel(parsed);
+            } else {
+                cerr << "logging: unknown level '" << level << "'" << endl;
+            }
+        }
+        if (setting.exists("levels")) {
+            Setting &levels = setting["levels"];
+            for (int i = 0; i < levels.getLength(); i++) {
+                Logger::Subsystem subsys;
+                string name = levels[i].getName();
+
+                level = (const char *) levels[i];
+                if (!Logger::parseSubsystem(name, subsys) ||
+                    !Logger::parseLevel(level, parsed)) {
+                    cerr << "logging: bad level " << name << " = '" << level
+                         << "'" << endl;
+                    continue;
+                }
+                Logger::setLevel(subsys, parsed);
+            }
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if (!file.empty()) {
+        Logger::setFile(file, maxBytes > 0 ? maxBytes : 0,
+                        keep > 0 ? keep : 0);
+    } else if (daemon) {
+        // stdout is /dev/null; don't even format
+        Logger::setLevel(Logger::LEVEL_OFF);
+    }
+}
+
+static shared_ptr<TelemetryStore> loadTelemetryStore(Config &cfg)
+{
+    int maxSeries = 4096;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["telemetry"];
+        setting.lookupValue("maxSeries", maxSeries);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if (maxSeries <= 0) {
+        return NULL;
+    }
+
+    return make_shared<TelemetryStore>(maxSeries);
+}
+
+static shared_ptr<Topology> loadTopology(Config &cfg)
+{
+    bool enabled = true;
+    double alpha = 0.25;
+    int maxAgeSec = 86400;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["topology"];
+        setting.lookupValue("enabled", enabled);
+        setting.lookupValue("alpha", alpha);
+        setting.lookupValue("maxAgeSec", maxAgeSec);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if (!enabled) {
+        return NULL;
+    }
+
+    return make_shared<Topology>(alpha, maxAgeSec > 0 ? maxAgeSec : 0);
+}
+
+static shared_ptr<NodeDb> loadNodeDb(Config &cfg)
+{
+    string path;
+    int capacity = 4096;
+    int walMaxBytes = 256 * 1024;
+    int compactSec = 3600;
+    shared_ptr<NodeDb> nodeDb;
+
+    if (getenv("HOME") != NULL) {
+        path = string(getenv("HOME")) + "/.meshmon.nodes";
+    }
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["nodeDb"];
+        setting.lookupValue("path", path);
+        setting.lookupValue("capacity", capacity);
+        setting.lookupValue("walMaxBytes", walMaxBytes);
+        setting.lookupValue("compactSec", compactSec);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    // path = ""; turns it off
+    if (path.empty() || (capacity <= 0)) {
+        return NULL;
+    }
+
+    nodeDb = make_shared<NodeDb>();
+    if (!nodeDb->open(path, capacity)) {
+        cerr << "Unable to open node database " << path << endl;
+        return NULL;
+    }
+    nodeDb->setCompaction(walMaxBytes > 0 ? walMaxBytes : 256 * 1024,
+                          compactSec > 0 ? compactSec : 3600);
+
+    return nodeDb;
+}
+
+// routes = ( { portnum = "TEXT_MESSAGE_APP"; channel = 0;
+//              node = "!a1b2c3d4"; sinks = [ "myown", "log" ]; }, ... );
+// Omitted fields match anything; rules are applied on top of the
+// built-in policy, later ones winning.
+static shared_ptr<RoutingTable> loadRoutingTable(Config &cfg)
+{
+    shared_ptr<RoutingTable> routes = make_shared<RoutingTable>();
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["routes"];
+
+        for (int i = 0; i < setting.getLength(); i++) {
+            Setting &cfgRule = setting[i];
+            RoutingTable::Rule rule;
+            string s;
+            int value;
+            bool valid = true;
+
+            rule.portnum = RoutingTable::ANY;
+            rule.channel = RoutingTable::ANY;
+            rule.node = RoutingTable::ANY;
+            rule.sinks = 0;
+
+            if (cfgRule.lookupValue("portnum", s)) {
+                valid = valid && RoutingTable::parsePortnum(s, rule.portnum);
+            } else if (cfgRule.lookupValue("portnum", value)) {
+                rule.portnum = value;
+            }
+            if (cfgRule.lookupValue("channel", value)) {
+                rule.channel = value;
+            }
+            if (cfgRule.lookupValue("node", s)) {
+                valid = valid && RoutingTable::parseNode(s, rule.node);
+            }
+
+            if (!cfgRule.exists("sinks")) {
+                cerr << "routes: rule " << i << " has no sinks" << endl;
+                continue;
+            }
+            Setting &cfgSinks = cfgRule["sinks"];
+            for (int j = 0; j < cfgSinks.getLength(); j++) {
+                uint8_t sink = 0;
+                string name = cfgSinks[j];
+
+                if (!RoutingTable::parseSink(name, sink)) {
+                    cerr << "routes: unknown sink '" << name << "'" << endl;
+                    valid = false;
+                }
+                rule.sinks |= sink;
+            }
+
+            if (!valid || !routes->add(rule)) {
+                cerr << "routes: ignoring rule " << i << endl;
+            }
+        }
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    return routes;
+}
+
+static shared_ptr<MetricsServer> loadMetricsServer(Config &cfg)
+{
+    int port = 0;
+    int bufferBytes = 256 * 1024;
+    string address = "127.0.0.1";
+    shared_ptr<MetricsServer> server;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["metrics"];
+        setting.lookupValue("port", port);
+        setting.lookupValue("bind", address);
+        setting.lookupValue("bufferBytes", bufferBytes);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if ((port <= 0) || (port > 65535)) {
+        return NULL;
+    }
+
+    server = make_shared<MetricsServer>(bufferBytes > 0 ? bufferBytes : 0);
+    if (!server->bind(address, port)) {
+        return NULL;
+    }
+
+    return server;
+}
+
+// shell = { bind = "0.0.0.0"; maxSessions = 32; maxOutputBytes = 1048576;
+//           legacyPort = <port + 1>; queryPort = 0; };
+// legacyPort: where the full per-radio shells are served, one port per
+// radio from there on; 0 turns them off
+// queryPort: newline-delimited JSON queries (see QueryApi.hxx)
+static shared_ptr<ShellServer> loadShellServer(Config &cfg, uint16_t port,
+                                               shared_ptr<Reactor> reactor,
+                                               uint16_t &legacyPort)
+{
+    string address = "0.0.0.0";
+    int maxSessions = 32;
+    int maxOutputBytes = 1024 * 1024;
+    int cfgLegacyPort = (port != 0) ? port + 1 : 0;
+    int queryPort = 0;
+    shared_ptr<ShellServer> server;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["shell"];
+        setting.lookupValue("bind", address);
+        setting.lookupValue("maxSessions", maxSessions);
+        setting.lookupValue("maxOutputBytes", maxOutputBytes);
+        setting.lookupValue("legacyPort", cfgLegacyPort);
+        setting.lookupValue("queryPort", queryPort);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    legacyPort = (cfgLegacyPort > 0) && (cfgLegacyPort <= 65535) ?
+        cfgLegacyPort : 0;
+    if ((queryPort <= 0) || (queryPort > 65535)) {
+        queryPort = 0;
+    }
+    if ((port == 0) && (queryPort == 0)) {
+        return NULL;
+    }
+
+    server = make_shared<ShellServer>(reactor);
+    server->setLimits(maxSessions > 0 ? maxSessions : 0,
+                      maxOutputBytes > 0 ? maxOutputBytes : 0);
+    if ((port != 0) && !server->bind(address, port)) {
+        cerr << "Unable to listen on port " << port << endl;
+        return NULL;
+    }
+    if ((queryPort != 0) && !server->bindQuery(address, queryPort)) {
+        cerr << "Unable to listen on port " << queryPort << endl;
+        return NULL;
+    }
+
+    return server;
+}
+
+// events = { socket = "/run/meshmon/events.sock"; maxSubscribers = 16;
+//            queue = 256; dropSlow = false; };
+// queue: events held per subscriber per radio; dropSlow: disconnect a
+// subscriber that falls behind instead of dropping its oldest events
+static shared_ptr<EventBus> loadEventBus(Config &cfg,
+                                         shared_ptr<Reactor> reactor)
+{
+    string path;
+    int maxSubscribers = 16;
+    int queue = 256;
+    bool dropSlow = false;
+    shared_ptr<EventBus> bus;
+
+    try {
+        Setting &root = cfg.getRoot();
+        Setting &setting = root["events"];
+        setting.lookupValue("socket", path);
+        setting.lookupValue("maxSubscribers", maxSubscribers);
+        setting.lookupValue("queue", queue);
+        setting.lookupValue("dropSlow", dropSlow);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    if (path.empty()) {
+        return NULL;
+    }
+
+    bus = make_shared<EventBus>(reactor);
+    bus->setLimits(maxSubscribers > 0 ? maxSubscribers : 0,
+                   queue > 0 ? queue : 0, dropSlow);
+    if (!bus->bind(path)) {
+        cerr << "Unable to listen on " << path << endl;
+        return NULL;
+    }
+
+    return bus;
+}
+
 static const struct option long_options[] = {
     { "device", required_argument, NULL, 'd', },
     { "stdio", no_argument, NULL, 's', },
@@ -91,6 +700,11 @@ static const struct option long_options[] = {
     { "daemon", no_argument, NULL, 'b', },
     { "verbose", no_argument, NULL, 'v', },
     { "log", no_argument, NULL, 'l', },
+    { "reactor", required_argument, NULL, 'r', },
+    { "record", required_argument, NULL, 'R', },
+    { "replay", required_argument, NULL, 'P', },
+    { "speed", required_argument, NULL, 'S', },
+    { NULL, 0, NULL, 0, },
 };
 
 int main(int argc, char **argv)
@@ -99,8 +713,13 @@ int main(int argc, char **argv)
     Config cfg;
     string cfgfile;
     vector<string> devices;
+    vector<string> attached;
+    string recordPath;
+    string replayPath;
+    double replaySpeed = 1.0;
     bool useStdioShell = false;
     uint16_t port = 0;
+    uint16_t legacyPort = 0;
     bool daemon = false;
     bool verbose = false;
     bool log = false;
@@ -108,6 +727,31 @@ int main(int argc, char **argv)
     string version;
     string built;
     string copyright;
+    MqttClient::QueueConfig proxyQueueConfig = MqttClient::defaultQueueConfig;
+    MqttClient::QueueConfig packetQueueConfig = MqttClient::defaultQueueConfig;
+    string myownServer;
+    uint16_t myownPort = 1883;
+    string myownUser;
+    string myownPassword;
+    string myownTopic = "meshmon";
+    MqttClient::ConnectConfig connectConfig =
+        MqttClient::defaultConnectConfig;
+    MqttClient::SpoolConfig spoolConfig = {
+        "", 16 * 1024 * 1024, 1024 * 1024, 10,
+    };
+    MqttClient::DownlinkConfig downlinkConfig =
+        MqttClient::defaultDownlinkConfig;
+    MqttClient::BatchConfig batchConfig = MqttClient::defaultBatchConfig;
+    MqttClient::QosConfig qosConfig = MqttClient::defaultQosConfig;
+    int reactorWorkers = 0;
+    shared_ptr<Reactor> reactor;
+    shared_ptr<MqttClient> upstreamMqtt;
+    shared_ptr<MqttClient> myownMqtt;
+    shared_ptr<DedupCache> dedup;
+    shared_ptr<RoutingTable> routes;
+    shared_ptr<TelemetryStore> telemetry;
+    shared_ptr<Topology> topology;
+    shared_ptr<NodeDb> nodeDb;
 
     banner = "The MeshMon Application";
     version = string("Version: ") + string(MYPROJECT_VERSION_STRING);
@@ -167,9 +811,26 @@ int main(int argc, char **argv)
     } catch (SettingTypeException &e) {
     }
 
+    try {
+        Setting &root = cfg.getRoot();
+        root.lookupValue("reactorWorkers", reactorWorkers);
+    } catch (SettingNotFoundException &e) {
+    } catch (SettingTypeException &e) {
+    }
+
+    loadQueueConfig(cfg, "mqttProxyQueue", proxyQueueConfig);
+    loadQueueConfig(cfg, "mqttPacketQueue", packetQueueConfig);
+    loadMyownMqttConfig(cfg, myownServer, myownPort, myownUser,
+                        myownPassword, myownTopic);
+    loadConnectConfig(cfg, connectConfig);
+    loadSpoolConfig(cfg, spoolConfig);
+    loadDownlinkConfig(cfg, downlinkConfig);
+    loadBatchConfig(cfg, batchConfig);
+    loadQosConfig(cfg, qosConfig);
+
     for (;;) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "d:sp:bvl",
+        int c = getopt_long(argc, argv, "d:sp:bvlr:R:P:S:",
                             long_options, &option_index);
         if (c == -1) {
             break;
@@ -194,6 +855,27 @@ int main(int argc, char **argv)
         case 'l':
             log = true;
             break;
+        case 'r':
+            reactorWorkers = atoi(optarg);
+            break;
+        case 'R':
+            recordPath = optarg;
+            break;
+        case 'P':
+            replayPath = optarg;
+            break;
+        case 'S':
+            // "max" or 0 replays as fast as the handlers go
+            if (strcmp(optarg, "max") == 0) {
+                replaySpeed = 0.0;
+            } else {
+                replaySpeed = atof(optarg);
+                if (replaySpeed < 0.0) {
+                    fprintf(stderr, "Invalid replay speed %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
         default:
             fprintf(stderr, "Unrecognized argument specified!\n");
             exit(EXIT_FAILURE);
@@ -201,7 +883,11 @@ int main(int argc, char **argv)
         }
     }
 
-    if (devices.empty()) {
+    if (!replayPath.empty()) {
+        // A capture stands in for the radios
+        devices.clear();
+        devices.push_back(string("replay"));
+    } else if (devices.empty()) {
         devices.push_back(string(DEFAULT_DEVICE));
     }
 
@@ -241,7 +927,68 @@ int main(int argc, char **argv)
         }
     }
 
+    // After the fork: the writer thread would not survive it
+    loadLogging(cfg, daemon);
+    Logger::start();
     atexit(cleanup);
+
+    cpuTemp = loadCpuTemp(cfg);
+    if (cpuTemp) {
+        cpuTemp->start();
+    }
+
+    if (reactorWorkers > 0) {
+        reactor = make_shared<Reactor>(reactorWorkers);
+        reactor->start();
+
+        upstreamMqtt = make_shared<MqttClient>();
+        upstreamMqtt->setProxyQueueConfig(proxyQueueConfig);
+        upstreamMqtt->setPacketQueueConfig(packetQueueConfig);
+        upstreamMqtt->setMultiProducer(true);
+        upstreamMqtt->setConnectConfig(connectConfig);
+        upstreamMqtt->setDownlinkConfig(downlinkConfig);
+        upstreamMqtt->setQosConfig(qosConfig);
+        if (!upstreamMqtt->openSpool(
+                spoolConfigFor(spoolConfig, "meshtastic"))) {
+            cerr << "Unable to open MQTT spool in " << spoolConfig.dir << endl;
+        }
+
+        if (!myownServer.empty()) {
+            myownMqtt = make_shared<MqttClient>(myownServer, myownPort,
+                                                myownUser, myownPassword,
+                                                myownTopic);
+            myownMqtt->setProxyQueueConfig(proxyQueueConfig);
+            myownMqtt->setPacketQueueConfig(packetQueueConfig);
+            myownMqtt->setMultiProducer(true);
+            myownMqtt->setConnectConfig(connectConfig);
+            myownMqtt->setBatchConfig(batchConfig);
+            myownMqtt->setQosConfig(qosConfig);
+            if (!myownMqtt->openSpool(spoolConfigFor(spoolConfig, "myown"))) {
+                cerr << "Unable to open MQTT spool in " << spoolConfig.dir
+                     << endl;
+            }
+            if (!myownMqtt->attach(reactor)) {
+                cerr << "Unable to connect to " << myownServer << endl;
+            }
+        }
+    }
+
+    dedup = loadDedupCache(cfg);
+    routes = loadRoutingTable(cfg);
+    telemetry = loadTelemetryStore(cfg);
+    topology = loadTopology(cfg);
+    nodeDb = loadNodeDb(cfg);
+    shellServer = loadShellServer(cfg, port, reactor, legacyPort);
+    events = loadEventBus(cfg, reactor);
+
+    if (!recordPath.empty()) {
+        capture = make_shared<CaptureWriter>();
+        if (!capture->open(recordPath)) {
+            cerr << "Unable to record to " << recordPath << endl;
+            capture = NULL;
+        }
+    }
+
     signal(SIGINT, sighandler);
     signal(SIGTERM, sighandler);
     signal(SIGPIPE, SIG_IGN);
@@ -250,17 +997,40 @@ int main(int argc, char **argv)
          it != devices.cend(); it++) {
         shared_ptr<MeshMon> mon = make_shared<MeshMon>();
 
-        if (mon->attachSerial(*it) == false) {
+        if (replayPath.empty() && (mon->attachSerial(*it) == false)) {
             cerr << "Unable to attch to " << *it << endl;
             continue;
         } else {
             shared_ptr<MeshMonShell> shell;
 
             mon->setClient(mon);
+            mon->setNodeDb(nodeDb);
             mon->setNvm(mon);
             mon->setVerbose(verbose);
             mon->enableLogStderr(log);
+            mon->setCpuTemp(cpuTemp);
+            mon->setDedupCache(dedup);
+            mon->setCapture(capture);
+            mon->setRoutingTable(routes);
+            mon->setTelemetryStore(telemetry);
+            mon->setTopology(topology);
+            if (events) {
+                mon->setEventBus(events, events->addSource(*it));
+            }
+            mon->setMqttQueueConfig(proxyQueueConfig, packetQueueConfig);
+            mon->setMqttConnectConfig(connectConfig);
+            mon->setMqttDownlinkConfig(downlinkConfig);
+            mon->setMqttSpoolConfig(spoolConfigFor(spoolConfig, *it));
+            mon->setMqttBatchConfig(batchConfig);
+            mon->setMqttQosConfig(qosConfig);
+            if (reactor) {
+                mon->shareMqtt(reactor, upstreamMqtt, myownMqtt);
+            } else if (!myownServer.empty()) {
+                mon->startMyownMqtt(myownServer, myownPort, myownUser,
+                                    myownPassword, myownTopic);
+            }
             mons.push_back(mon);
+            attached.push_back(*it);
 
             if (useStdioShell && (stdioShell == NULL)) {
                 stdioShell = make_shared<MeshMonShell>();
@@ -272,21 +1042,48 @@ int main(int argc, char **argv)
                 stdioShell->setNvm(mon);
             }
 
-            if (port != 0) {
+            if (shellServer) {
+                shellServer->addDevice(*it, mon);
+            }
+
+            if (legacyPort != 0) {
                 shell = make_shared<MeshMonShell>();
                 shell->setClient(mon);
                 shell->setBanner(banner);
                 shell->setVersion(version);
                 shell->setBuilt(built);
                 shell->setCopyright(copyright);
-                shell->bindPort(port);
+                shell->bindPort(legacyPort);
                 shell->setNvm(mon);
                 netShells.push_back(shell);
-                port++;
+                legacyPort++;
             }
         }
     }
 
+    metrics = loadMetricsServer(cfg);
+    if (metrics) {
+        for (size_t i = 0; i < mons.size(); i++) {
+            metrics->addDevice(attached[i], mons[i]);
+        }
+        metrics->setCpuTemp(cpuTemp);
+        metrics->setDedupCache(dedup);
+        metrics->start();
+    }
+
+    if (shellServer) {
+        shellServer->setBanner(banner + "\n" + version);
+        if (!shellServer->start()) {
+            cerr << "Unable to start the shell server" << endl;
+            shellServer = NULL;
+        }
+    }
+
+    if (events && !events->start()) {
+        cerr << "Unable to start the event bus" << endl;
+        events = NULL;
+    }
+
     if (stdioShell) {
         // Attach last to let net shells print to stdout before we output
         // the prompt on stdio
@@ -295,6 +1092,11 @@ int main(int argc, char **argv)
 
     /* ------- */
 
+    if (!replayPath.empty() && !mons.empty()) {
+        mons[0]->replay(replayPath, replaySpeed, replayStop);
+        mons[0]->detach();
+    }
+
     for (vector< shared_ptr<MeshMon>>::iterator it = mons.begin();
          it != mons.end(); it++) {
         (*it)->join();
@@ -306,6 +1108,26 @@ int main(int argc, char **argv)
          it != netShells.end(); it++) {
         (*it)->join();
     }
+    if (shellServer) {
+        // Before the reactor it may share goes away
+        shellServer->stop();
+        shellServer = NULL;
+    }
+    if (events) {
+        events->stop();
+        events = NULL;
+    }
+    if (reactor) {
+        upstreamMqtt->stop();
+        if (myownMqtt) {
+            myownMqtt->stop();
+        }
+        reactor->stop();
+        reactor->join();
+    }
+    if (nodeDb) {
+        nodeDb->close();
+    }
 
     cout << "Good-bye!" << endl;
 
@@ -0,0 +1,422 @@
+/*
+ * meshmon_bench.cxx
+ *
+ * Copyright (C) 2025, Charles Chiou
+ */
+
+#include <getopt.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <thread>
+#include <vector>
+#include <LatencyHistogram.hxx>
+#include <MeshMon.hxx>
+#include <MqttClient.hxx>
+#include <ServiceEnvelope.hxx>
+
+/*
+ * Throughput benchmark of the MeshMon packet pipeline, without radios.
+ *
+ * Usage: meshmon_bench [-n packets] [-q capacity] [-b host[:port]]
+ *                      [envelope.bin ...]
+ *
+ * Feeds MqttClientProxyMessages and MeshPackets straight into the
+ * MeshMon::got*() handlers and reports handler throughput, heap
+ * allocations and handler latency, followed by the per-stage latencies of
+ * the MQTT clients behind them. By default the clients publish into an
+ * in-process sink; -b publishes to a (local) broker instead.
+ *
+ * Each file argument holds one raw ServiceEnvelope, as for envelope_bench,
+ * and is replayed as a proxied message. Without files, a synthetic mix of
+ * proxied messages, positions, node infos and device metrics is used.
+ */
+
+static atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+    void *p;
+
+    allocations.fetch_add(1, memory_order_relaxed);
+    p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// Makes the protected handlers callable from here
+class BenchMon : public MeshMon {
+
+public:
+
+    using MeshMon::gotMqttClientProxyMessage;
+    using MeshMon::gotPosition;
+    using MeshMon::gotUser;
+    using MeshMon::gotDeviceMetrics;
+
+};
+
+struct Item {
+    enum Kind {
+        PROXY,
+        POSITION,
+        USER,
+        DEVICE_METRICS,
+    } kind;
+    meshtastic_MqttClientProxyMessage proxy;
+    meshtastic_MeshPacket packet;
+    // Of the envelope around packet; empty if it could not be decoded
+    string channelId;
+    string gatewayId;
+    union {
+        meshtastic_Position position;
+        meshtastic_User user;
+        meshtastic_DeviceMetrics metrics;
+    };
+};
+
+static void makePacket(meshtastic_MeshPacket &packet,
+                       meshtastic_PortNum portnum, size_t payloadSize)
+{
+    memset(&packet, 0x0, sizeof(packet));
+    packet.from = 0x12345678;
+    packet.to = 0xffffffff;
+    packet.id = 0x0badcafe;
+    packet.rx_time = 1750000000;
+    packet.rx_snr = 6.25;
+    packet.rx_rssi = -97;
+    packet.hop_limit = 3;
+    packet.hop_start = 3;
+    packet.which_payload_variant = meshtastic_MeshPacket_decoded_tag;
+    packet.decoded.portnum = portnum;
+    packet.decoded.payload.size = payloadSize;
+    for (size_t i = 0; i < payloadSize; i++) {
+        packet.decoded.payload.bytes[i] = (uint8_t) (i * 7);
+    }
+}
+
+static bool makeProxy(meshtastic_MqttClientProxyMessage &proxy,
+                      const uint8_t *envelope, size_t size)
+{
+    memset(&proxy, 0x0, sizeof(proxy));
+    if (size > sizeof(proxy.payload_variant.data.bytes)) {
+        return false;
+    }
+
+    snprintf(proxy.topic, sizeof(proxy.topic),
+             "msh/TW/2/e/LongFast/!deadbeef");
+    proxy.which_payload_variant = meshtastic_MqttClientProxyMessage_data_tag;
+    proxy.payload_variant.data.size = size;
+    memcpy(proxy.payload_variant.data.bytes, envelope, size);
+
+    return true;
+}
+
+static bool makeSynthetic(vector<Item> &items)
+{
+    static const struct {
+        meshtastic_PortNum portnum;
+        size_t payloadSize;
+    } proxied[] = {
+        { meshtastic_PortNum_POSITION_APP, 32, },
+        { meshtastic_PortNum_NODEINFO_APP, 72, },
+        { meshtastic_PortNum_TELEMETRY_APP, 24, },
+    };
+    uint8_t buf[meshtastic_MqttClientProxyMessage_size];
+    size_t size;
+    Item item;
+
+    for (size_t i = 0; i < sizeof(proxied) / sizeof(proxied[0]); i++) {
+        item.kind = Item::PROXY;
+        makePacket(item.packet, proxied[i].portnum, proxied[i].payloadSize);
+        item.channelId = "LongFast";
+        item.gatewayId = "!deadbeef";
+        size = ServiceEnvelope::encode(item.packet, item.channelId.c_str(),
+                                       item.gatewayId.c_str(),
+                                       buf, sizeof(buf));
+        if ((size == 0) || !makeProxy(item.proxy, buf, size)) {
+            return false;
+        }
+        items.push_back(item);
+    }
+    item.channelId.clear();
+    item.gatewayId.clear();
+
+    item.kind = Item::POSITION;
+    makePacket(item.packet, meshtastic_PortNum_POSITION_APP, 0);
+    memset(&item.position, 0x0, sizeof(item.position));
+    item.position.has_latitude_i = true;
+    item.position.latitude_i = 250330000;
+    item.position.has_longitude_i = true;
+    item.position.longitude_i = 1215650000;
+    items.push_back(item);
+
+    item.kind = Item::USER;
+    makePacket(item.packet, meshtastic_PortNum_NODEINFO_APP, 0);
+    memset(&item.user, 0x0, sizeof(item.user));
+    snprintf(item.user.id, sizeof(item.user.id), "!12345678");
+    snprintf(item.user.long_name, sizeof(item.user.long_name), "Bench");
+    snprintf(item.user.short_name, sizeof(item.user.short_name), "BNCH");
+    items.push_back(item);
+
+    item.kind = Item::DEVICE_METRICS;
+    makePacket(item.packet, meshtastic_PortNum_TELEMETRY_APP, 0);
+    memset(&item.metrics, 0x0, sizeof(item.metrics));
+    item.metrics.has_battery_level = true;
+    item.metrics.battery_level = 87;
+    item.metrics.has_voltage = true;
+    item.metrics.voltage = 4.05;
+    items.push_back(item);
+
+    return true;
+}
+
+// Distinct ids and a handful of senders, as on a busy mesh; a proxied
+// envelope is encoded again around them
+static bool prepare(Item &item, uint32_t seq)
+{
+    uint8_t buf[meshtastic_MqttClientProxyMessage_size];
+    size_t size;
+
+    item.packet.id = seq;
+    item.packet.from = 0x12345600 + (seq % 64);
+
+    if ((item.kind != Item::PROXY) || item.channelId.empty()) {
+        return true;
+    }
+
+    size = ServiceEnvelope::encode(item.packet, item.channelId.c_str(),
+                                   item.gatewayId.c_str(), buf, sizeof(buf));
+
+    return (size > 0) && makeProxy(item.proxy, buf, size);
+}
+
+static void dispatch(BenchMon &mon, Item &item)
+{
+    switch (item.kind) {
+    case Item::PROXY:
+        mon.gotMqttClientProxyMessage(item.proxy);
+        break;
+    case Item::POSITION:
+        mon.gotPosition(item.packet, item.position);
+        break;
+    case Item::USER:
+        mon.gotUser(item.packet, item.user);
+        break;
+    case Item::DEVICE_METRICS:
+        mon.gotDeviceMetrics(item.packet, item.metrics);
+        break;
+    }
+}
+
+static void printLatency(const char *stage, const LatencyHistogram &h,
+                         const char *unit)
+{
+    cout << "  " << stage << ": count " << h.count()
+         << ", p50 " << h.percentile(50.0) << unit
+         << ", p99 " << h.percentile(99.0) << unit
+         << ", max " << h.max() << unit << endl;
+}
+
+static void printClient(const char *label, MqttClient &mqtt)
+{
+    const MqttClient::QueueCounters &proxy = mqtt.proxyQueueCounters();
+    const MqttClient::QueueCounters &packet = mqtt.packetQueueCounters();
+
+    cout << label << ": published " << mqtt.published()
+         << ", dropped " << (proxy.dropped + packet.dropped)
+         << ", coalesced " << (proxy.coalesced + packet.coalesced) << endl;
+    printLatency("queue", mqtt.queueLatency(), "us");
+    printLatency("publish", mqtt.publishLatency(), "us");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long packets = 100000;
+    MqttClient::QueueConfig queueConfig = MqttClient::defaultQueueConfig;
+    string broker;
+    uint16_t port = 1883;
+    vector<Item> items;
+    shared_ptr<BenchMon> mon;
+    shared_ptr<MqttClient> meshtasticMqtt;
+    shared_ptr<MqttClient> myownMqtt;
+    atomic<unsigned long> sunk(0);
+    LatencyHistogram handlerLatency;
+    chrono::steady_clock::time_point t0, t1, start;
+    unsigned long allocs;
+    double secs;
+    size_t colon;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:q:b:")) != -1) {
+        switch (c) {
+        case 'n':
+            packets = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            queueConfig.capacity = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            broker = optarg;
+            colon = broker.find(':');
+            if (colon != string::npos) {
+                port = atoi(broker.c_str() + colon + 1);
+                broker.erase(colon);
+            }
+            break;
+        default:
+            cerr << "Usage: " << argv[0]
+                 << " [-n packets] [-q capacity] [-b host[:port]]"
+                 << " [envelope.bin ...]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        ifstream f(argv[i], ios::binary);
+        vector<uint8_t> envelope;
+        ServiceEnvelope decoded;
+        Item item;
+
+        if (!f) {
+            cerr << "Unable to open " << argv[i] << endl;
+            return EXIT_FAILURE;
+        }
+        envelope.assign(istreambuf_iterator<char>(f),
+                        istreambuf_iterator<char>());
+        item.kind = Item::PROXY;
+        memset(&item.packet, 0x0, sizeof(item.packet));
+        if (!makeProxy(item.proxy, envelope.data(), envelope.size())) {
+            cerr << argv[i] << ": envelope too large" << endl;
+            return EXIT_FAILURE;
+        }
+        if (decoded.decode(envelope.data(), envelope.size())) {
+            item.packet = decoded.packet();
+            item.channelId = decoded.channelId();
+            item.gatewayId = decoded.gatewayId();
+        } else {
+            cerr << argv[i] << ": not decodable, replayed as is" << endl;
+        }
+        items.push_back(item);
+    }
+
+    if (items.empty() && !makeSynthetic(items)) {
+        cerr << "Unable to encode synthetic packets" << endl;
+        return EXIT_FAILURE;
+    }
+
+    mosquitto_lib_init();
+
+    if (broker.empty()) {
+        MqttClient::Sink sink =
+            [&sunk](const char *topic, int payloadlen, const void *payload,
+                    bool retain) {
+            (void)(topic);
+            (void)(payloadlen);
+            (void)(payload);
+            (void)(retain);
+            sunk++;
+            return (int) MOSQ_ERR_SUCCESS;
+        };
+
+        meshtasticMqtt = make_shared<MqttClient>();
+        meshtasticMqtt->setSink(sink);
+        myownMqtt = make_shared<MqttClient>();
+        myownMqtt->setSink(sink);
+    } else {
+        meshtasticMqtt = make_shared<MqttClient>(broker, port, "", "",
+                                                 "meshmon/bench/proxy");
+        myownMqtt = make_shared<MqttClient>(broker, port, "", "",
+                                            "meshmon/bench");
+    }
+
+    meshtasticMqtt->setProxyQueueConfig(queueConfig);
+    myownMqtt->setPacketQueueConfig(queueConfig);
+    meshtasticMqtt->start();
+    myownMqtt->start();
+
+    // Give a real broker a moment to accept us
+    start = chrono::steady_clock::now();
+    while (!broker.empty() &&
+           (!meshtasticMqtt->isConnected() || !myownMqtt->isConnected()) &&
+           ((chrono::steady_clock::now() - start) < chrono::seconds(5))) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    mon = make_shared<BenchMon>();
+    mon->useMqtt(meshtasticMqtt, myownMqtt);
+
+    allocs = allocations;
+    secs = 0.0;
+    for (unsigned long n = 0; n < packets; n++) {
+        Item &item = items[n % items.size()];
+
+        // Not timed; only the handlers are
+        if (!prepare(item, n + 1)) {
+            cerr << "Unable to encode packet " << n + 1 << endl;
+            return EXIT_FAILURE;
+        }
+        t0 = chrono::steady_clock::now();
+        dispatch(*mon, item);
+        t1 = chrono::steady_clock::now();
+        handlerLatency.record(
+            chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+        secs += chrono::duration<double>(t1 - t0).count();
+    }
+    allocs = allocations - allocs;
+
+    // Let the publisher threads catch up before reading their stats
+    start = chrono::steady_clock::now();
+    while (((meshtasticMqtt->proxyQueueDepth() > 0) ||
+            (myownMqtt->packetQueueDepth() > 0)) &&
+           ((chrono::steady_clock::now() - start) < chrono::seconds(10))) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    cout << packets << " packets (from " << items.size() << " templates) in "
+         << secs << "s: " << (unsigned long) (packets / secs)
+         << " packets/s" << endl;
+    cout << "allocations: " << allocs << " ("
+         << ((double) allocs / packets) << "/packet)" << endl;
+    cout << "handler latency:" << endl;
+    printLatency("all", handlerLatency, "ns");
+    printLatency("proxy", mon->handlerLatency(), "us");
+    printClient("meshtastic mqtt", *meshtasticMqtt);
+    printClient("myown mqtt", *myownMqtt);
+    if (broker.empty()) {
+        cout << "sink: " << sunk << " messages" << endl;
+    }
+
+    mon->useMqtt(NULL, NULL);
+    meshtasticMqtt->stop();
+    meshtasticMqtt->join();
+    myownMqtt->stop();
+    myownMqtt->join();
+    mosquitto_lib_cleanup();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C++
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */